@@ -4,6 +4,10 @@ if [[ "$1" == "release" ]]; then
   cmake -DCMAKE_BUILD_TYPE=Release -Wno-dev -G Ninja . && ninja -v release
 elif [[ "$1" == "debug" ]]; then
   cmake -DCMAKE_BUILD_TYPE=Debug -Wno-dev -G Ninja . && ninja -v debug
+elif [[ "$1" == "tsan" ]]; then
+  cmake -DCMAKE_BUILD_TYPE=Debug -DKBOT_TSAN=ON -Wno-dev -G Ninja . && ninja -v debug
+elif [[ "$1" == "fuzz" ]]; then
+  CXX=clang++ cmake -DCMAKE_BUILD_TYPE=Debug -DKBOT_FUZZ=ON -Wno-dev -G Ninja . && ninja -v fuzz
 elif [[ "$1" == "dirty" ]]; then
   git clean -dfxn -e 'compile_commands.json'
 elif [[ "$1" == "clean" ]]; then
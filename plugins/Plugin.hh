@@ -2,8 +2,12 @@
 #include <absl/container/flat_hash_map.h>
 
 #include <Manager.hh>
+#include <PluginABI.hh>
 #include <Server.hh>
 #include <UserCommand.hh>
+#include <array>
+#include <chrono>
+#include <span>
 #include <string_view>
 
 #define COMMAND_VECTOR(...)                                                                    \
@@ -14,6 +18,14 @@
 #define PLUGIN_COMMAND(command_str, name, min, max) \
   STATIC_REGISTER_USER_COMMAND(command_str, Plugin_##name, min, max)
 
+// Arguments are parsed into the callback's typed parameters, see CommandArgs.hh
+#define PLUGIN_TYPED_COMMAND(command_str, name) \
+  STATIC_REGISTER_TYPED_COMMAND(command_str, Plugin_##name)
+
+// Coroutine commands keep their plugin mapped until they finish, even across ,unload and ,reload
+#define PLUGIN_COROUTINE(command_str, name, min, max) \
+  STATIC_REGISTER_USER_COROUTINE(command_str, Plugin_##name, min, max)
+
 #define COMMAND_HELP_VECTOR(...)                                                           \
   namespace {                                                                              \
   const absl::flat_hash_map<std::string, const char *> __command_help_map = {__VA_ARGS__}; \
@@ -22,9 +34,70 @@
 #define HELP(name, help_string) \
   { #name, help_string }
 
+// Optional, subscribes to other IRC commands and numerics, e.g.
+//   EVENT_CALLBACK(on_join, m, msg) { ... }
+//   EVENT_VECTOR(PLUGIN_EVENT("JOIN", on_join), PLUGIN_EVENT("332", on_join));
+#define EVENT_VECTOR(...)                                                              \
+  namespace {                                                                          \
+  const kbot::plugin::EventEntry __event_map[] = {__VA_ARGS__};                        \
+  [[maybe_unused]] std::span<const kbot::plugin::EventEntry> __PluginEvents(int) {     \
+    return __event_map;                                                                \
+  }                                                                                    \
+  }
+
+#define PLUGIN_EVENT(command_str, name) \
+  { command_str, &PluginEvent_##name }
+
+// Optional, looks for keywords or regexes (RE2) in the channel messages that aren't commands, in
+// every channel or only the one given, e.g.
+//   PATTERN_CALLBACK(url, m, msg, match) { ... }
+//   PATTERN_VECTOR(PLUGIN_REGEX("https?://\\S+", "", url), PLUGIN_KEYWORD("kbot", "#kbot", ping));
+#define PATTERN_VECTOR(...)                                                              \
+  namespace {                                                                            \
+  const kbot::plugin::PatternEntry __pattern_map[] = {__VA_ARGS__};                      \
+  [[maybe_unused]] std::span<const kbot::plugin::PatternEntry> __PluginPatterns(int) {   \
+    return __pattern_map;                                                                \
+  }                                                                                      \
+  }
+
+#define PLUGIN_KEYWORD(keyword, channel, name) \
+  { kbot::plugin::PatternEntry::kKeyword, keyword, channel, &PluginPattern_##name }
+
+#define PLUGIN_REGEX(regex, channel, name) \
+  { kbot::plugin::PatternEntry::kRegex, regex, channel, &PluginPattern_##name }
+
+// Optional, runs callbacks periodically on the server thread while the plugin is loaded
+#define TIMER_VECTOR(...)                                                              \
+  namespace {                                                                          \
+  const kbot::plugin::TimerEntry __timer_map[] = {__VA_ARGS__};                        \
+  [[maybe_unused]] std::span<const kbot::plugin::TimerEntry> __PluginTimers(int) {     \
+    return __timer_map;                                                                \
+  }                                                                                    \
+  }
+
+#define PLUGIN_TIMER(interval_ms, name) \
+  { std::chrono::milliseconds(interval_ms), &PluginTimer_##name }
+
 #define COMMAND_CALLBACK(name, manager, msg) \
   void Plugin_##name(kbot::Manager &manager, const kbot::IRCMessagePrivMsg &msg)
 
+#define TYPED_COMMAND_CALLBACK(name, manager, msg, ...) \
+  void Plugin_##name(kbot::Manager &manager, const kbot::IRCMessagePrivMsg &msg, __VA_ARGS__)
+
+#define COROUTINE_CALLBACK(name, manager, msg) \
+  kbot::Task<> Plugin_##name(kbot::Manager &manager, kbot::IRCMessagePrivMsg msg)
+
+#define EVENT_CALLBACK(name, manager, msg) \
+  void PluginEvent_##name([[maybe_unused]] kbot::Manager &manager, const kbot::IRCMessage &msg)
+
+#define PATTERN_CALLBACK(name, manager, msg, match)                                     \
+  void PluginPattern_##name([[maybe_unused]] kbot::Manager &manager,                     \
+                            [[maybe_unused]] const kbot::IRCMessagePrivMsg &msg,         \
+                            [[maybe_unused]] std::string_view match)
+
+#define TIMER_CALLBACK(name, manager) \
+  void PluginTimer_##name([[maybe_unused]] kbot::Manager &manager)
+
 #define __INIT_CALLBACK(name) void RegisterPluginCommands_##name(void *p)
 #define __DELETE_CALLBACK(name) void DeletePluginCommands_##name(void *p)
 #define __HELP_CALLBACK(name) void HelpPluginCommands_##name(void *p)
@@ -38,13 +111,49 @@
   __HELP_CALLBACK(name) { HelpCallbackImpl(p, __command_help_map); } \
   }
 
+// ABI v2, see src/PluginABI.hh
+#define DESCRIPTOR(name)                                                                           \
+  namespace {                                                                                      \
+  const auto __command_entries = MakeCommandEntries(__command_map, __command_help_map);            \
+  }                                                                                                \
+  extern "C" const kbot::plugin::Descriptor KbotPluginDescriptor = {                               \
+      kbot::plugin::kAbiVersion, #name, __command_entries, __PluginEvents(0), __PluginTimers(0),   \
+      __PluginPatterns(0)};
+
+// Emits both the ABI v2 descriptor and the v1 entry points
 #define DECLARE_PLUGIN(name) \
+  DESCRIPTOR(name);          \
   INIT_CALLBACK(name);       \
   DELETE_CALLBACK(name);     \
   HELP_CALLBACK(name);
 
 namespace {
 
+// Overridden by EVENT_VECTOR, TIMER_VECTOR and PATTERN_VECTOR, which declare better matches
+[[maybe_unused]] inline std::span<const kbot::plugin::EventEntry> __PluginEvents(...) {
+  return {};
+}
+[[maybe_unused]] inline std::span<const kbot::plugin::TimerEntry> __PluginTimers(...) {
+  return {};
+}
+[[maybe_unused]] inline std::span<const kbot::plugin::PatternEntry> __PluginPatterns(...) {
+  return {};
+}
+
+template <size_t N>
+std::array<kbot::plugin::CommandEntry, N> MakeCommandEntries(
+    const std::pair<std::string, kbot::UserCommand::callback_t> (&command_map)[N],
+    const absl::flat_hash_map<std::string, const char *> &command_help_map) {
+  constexpr std::string_view prefix = ":" COMMAND_PREFIX;
+  std::array<kbot::plugin::CommandEntry, N> entries;
+  for (size_t i = 0; i < N; i++) {
+    auto &[command, cb] = command_map[i];
+    auto it = command_help_map.find(std::string_view(command).substr(prefix.size()));
+    entries[i] = {command, cb, it != command_help_map.end() ? it->second : ""};
+  }
+  return entries;
+}
+
 template <size_t N>
 void RegisterCallbackImpl(
     void *p, const std::pair<std::string, kbot::UserCommand::callback_t> (&command_map)[N]) {
@@ -0,0 +1,95 @@
+#include <fmt/format.h>
+
+#include <ISupport.hh>
+#include <Plugin.hh>
+#include <UserCommand.hh>
+#include <chrono>
+#include <mutex>
+#include <string>
+
+namespace {
+
+struct LastSeen {
+  std::string what;
+  std::chrono::steady_clock::time_point when;
+};
+
+constexpr auto kForgetAfter = std::chrono::hours(24);
+
+// Sightings of one network, with nicknames folded the way its server does
+struct Network {
+  kbot::CaseMapping mapping = kbot::CaseMapping::kRfc1459;
+  kbot::CaseFoldMap<LastSeen> seen_map = kbot::MakeCaseFoldMap<LastSeen>(mapping);
+};
+
+// The plugin is shared by all servers it is loaded on, each keeps to its own network's nicknames
+std::mutex seen_mtx;
+absl::flat_hash_map<std::string, Network> network_map;
+
+// Called with seen_mtx held
+kbot::CaseFoldMap<LastSeen> &GetSeenMap(kbot::Manager &m) {
+  auto &n = network_map[fmt::format("{}:{}", m.server.GetAddress(), m.server.GetPort())];
+  if (auto mapping = m.server.GetCaseMapping(); mapping != n.mapping) {
+    kbot::RebuildCaseFoldMap(n.seen_map, mapping);
+    n.mapping = mapping;
+  }
+  return n.seen_map;
+}
+
+void Record(kbot::Manager &m, const kbot::IRCMessage &msg, std::string what) try {
+  auto nickname = kbot::Message::ParseSourceUser(msg.GetSource()).nickname;
+  std::unique_lock lock(seen_mtx);
+  GetSeenMap(m).insert_or_assign(std::string(nickname),
+                                 LastSeen{std::move(what), std::chrono::steady_clock::now()});
+} catch (std::runtime_error &) {
+  // Server message
+}
+
+}  // namespace
+
+EVENT_CALLBACK(join, m, msg) {
+  if (msg.GetParameters().size()) Record(m, msg, fmt::format("joining {}", msg.GetParameters()[0]));
+}
+
+EVENT_CALLBACK(part, m, msg) {
+  if (msg.GetParameters().size()) Record(m, msg, fmt::format("leaving {}", msg.GetParameters()[0]));
+}
+
+EVENT_CALLBACK(privmsg, m, msg) {
+  if (msg.GetParameters().size()) {
+    Record(m, msg, fmt::format("talking in {}", msg.GetParameters()[0]));
+  }
+}
+
+TIMER_CALLBACK(forget, m) {
+  auto now = std::chrono::steady_clock::now();
+  std::unique_lock lock(seen_mtx);
+  auto &seen_map = GetSeenMap(m);
+  absl::erase_if(seen_map, [&](const auto &p) { return now - p.second.when > kForgetAfter; });
+}
+
+TYPED_COMMAND_CALLBACK(seen, m, msg, kbot::UserCommand::Nick nick) {
+  std::string_view nickname = nick.value;
+  std::string reply;
+  {
+    std::unique_lock lock(seen_mtx);
+    auto &seen_map = GetSeenMap(m);
+    auto it = seen_map.find(nickname);
+    if (it == seen_map.end()) {
+      reply = fmt::format("I haven't seen {}.", nickname);
+    } else {
+      auto ago = std::chrono::duration_cast<std::chrono::minutes>(std::chrono::steady_clock::now() -
+                                                                   it->second.when);
+      reply = fmt::format("{} was last seen {}, {} minutes ago.", nickname, it->second.what,
+                          ago.count());
+    }
+  }
+  kbot::UserCommand::SendInvokerReply(m, msg, reply);
+}
+
+COMMAND_HELP_VECTOR(HELP(seen, "Usage: ,seen <nickname>"));
+COMMAND_VECTOR(PLUGIN_TYPED_COMMAND("seen", seen));
+EVENT_VECTOR(PLUGIN_EVENT("JOIN", join), PLUGIN_EVENT("PART", part),
+             PLUGIN_EVENT("PRIVMSG", privmsg));
+TIMER_VECTOR(PLUGIN_TIMER(60 * 60 * 1000, forget));
+DECLARE_PLUGIN(seen);
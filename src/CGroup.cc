@@ -0,0 +1,222 @@
+#include <fcntl.h>
+#include <fmt/format.h>
+#include <glog/logging.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <CGroup.hh>
+#include <Log.hh>
+#include <cerrno>
+#include <charconv>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace kbot {
+namespace cgroup {
+
+namespace {
+
+constexpr uint64_t kCpuPeriodUsec = 100000;
+
+// Interface files always exist in a cgroup, so never create them
+bool WriteFile(const std::string &path, std::string_view value) {
+  int fd = open(path.c_str(), O_WRONLY | O_TRUNC | O_CLOEXEC);
+  if (fd < 0) {
+    PLOG(ERROR) << "Failed to open " << path;
+    return false;
+  }
+  bool ok = write(fd, value.data(), value.size()) == static_cast<ssize_t>(value.size());
+  if (!ok) PLOG(ERROR) << "Failed to write '" << value << "' to " << path;
+  close(fd);
+  return ok;
+}
+
+std::optional<std::string> ReadFile(const std::string &path) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return std::nullopt;
+  std::string s;
+  char buf[512];
+  ssize_t r;
+  while ((r = read(fd, buf, sizeof(buf))) > 0) s.append(buf, static_cast<size_t>(r));
+  close(fd);
+  if (r < 0) return std::nullopt;
+  return s;
+}
+
+std::optional<uint64_t> ParseU64(std::string_view s) {
+  while (!s.empty() && (s.back() == '\n' || s.back() == ' ')) s.remove_suffix(1);
+  uint64_t v;
+  auto [p, ec] = std::from_chars(s.data(), s.data() + s.size(), v);
+  if (ec != std::errc() || p != s.data() + s.size()) return std::nullopt;
+  return v;
+}
+
+// Looks up key in a flat keyed file such as cpu.stat ("key value" per line)
+uint64_t KeyedValue(std::string_view file, std::string_view key) {
+  while (!file.empty()) {
+    auto nl = file.find('\n');
+    auto line = file.substr(0, nl);
+    file.remove_prefix(nl == file.npos ? file.size() : nl + 1);
+    if (line.size() > key.size() && line.starts_with(key) && line[key.size()] == ' ') {
+      return ParseU64(line.substr(key.size() + 1)).value_or(0);
+    }
+  }
+  return 0;
+}
+
+}  // namespace
+
+// Limits
+
+std::optional<Limits> Limits::Parse(std::string_view spec) {
+  Limits l;
+  while (!spec.empty()) {
+    auto comma = spec.find(',');
+    auto kv = spec.substr(0, comma);
+    spec.remove_prefix(comma == spec.npos ? spec.size() : comma + 1);
+    auto eq = kv.find('=');
+    if (eq == kv.npos) return std::nullopt;
+    auto key = kv.substr(0, eq);
+    auto value = kv.substr(eq + 1);
+    uint64_t shift = 0;
+    if (key == "memory" && !value.empty()) {
+      switch (value.back()) {
+        case 'K':
+          shift = 10;
+          break;
+        case 'M':
+          shift = 20;
+          break;
+        case 'G':
+          shift = 30;
+          break;
+      }
+      if (shift) value.remove_suffix(1);
+    }
+    auto v = ParseU64(value);
+    if (!v) return std::nullopt;
+    if (key == "cpu") {
+      l.cpu_percent = static_cast<unsigned>(*v);
+    } else if (key == "memory") {
+      l.memory_max = *v << shift;
+    } else if (key == "pids") {
+      l.pids_max = *v;
+    } else {
+      return std::nullopt;
+    }
+  }
+  return l;
+}
+
+bool OverBudget(const Usage &prev, const Usage &cur) {
+  uint64_t periods = cur.nr_periods - prev.nr_periods;
+  uint64_t throttled = cur.nr_throttled - prev.nr_throttled;
+  return (periods && throttled * 2 > periods) || cur.memory_max_events > prev.memory_max_events ||
+         cur.oom_kill > prev.oom_kill || cur.pids_max_events > prev.pids_max_events;
+}
+
+// CGroup
+
+std::optional<CGroup> CGroup::CreateNew(std::string_view parent, std::string_view name) {
+  std::string path = fmt::format("{}/{}", parent, name);
+  if (mkdir(path.c_str(), 0755) < 0 && errno != EEXIST) {
+    PLOG(ERROR) << "Failed to create cgroup " << path;
+    return std::nullopt;
+  }
+  return CGroup(std::move(path));
+}
+
+bool CGroup::SetLimits(const Limits &limits) const {
+  uint64_t quota = limits.cpu_percent * kCpuPeriodUsec / 100;
+  std::string cpu = limits.cpu_percent ? fmt::format("{} {}", quota, kCpuPeriodUsec)
+                                       : fmt::format("max {}", kCpuPeriodUsec);
+  bool ok = WriteFile(path + "/cpu.max", cpu);
+  ok = WriteFile(path + "/memory.max", std::to_string(limits.memory_max)) && ok;
+  ok = WriteFile(path + "/pids.max", std::to_string(limits.pids_max)) && ok;
+  // Don't let the plugin dodge memory.max by swapping, if swap is accounted at all
+  if (access((path + "/memory.swap.max").c_str(), W_OK) == 0) {
+    WriteFile(path + "/memory.swap.max", "0");
+  }
+  return ok;
+}
+
+std::optional<Usage> CGroup::ReadUsage() const {
+  auto cpu = ReadFile(path + "/cpu.stat");
+  auto mem = ReadFile(path + "/memory.current");
+  if (!cpu || !mem) return std::nullopt;
+  Usage u;
+  u.cpu_usage_usec = KeyedValue(*cpu, "usage_usec");
+  u.nr_periods = KeyedValue(*cpu, "nr_periods");
+  u.nr_throttled = KeyedValue(*cpu, "nr_throttled");
+  u.throttled_usec = KeyedValue(*cpu, "throttled_usec");
+  u.memory_current = ParseU64(*mem).value_or(0);
+  if (auto ev = ReadFile(path + "/memory.events")) {
+    u.memory_max_events = KeyedValue(*ev, "max");
+    u.oom_kill = KeyedValue(*ev, "oom_kill");
+  }
+  if (auto cur = ReadFile(path + "/pids.current")) u.pids_current = ParseU64(*cur).value_or(0);
+  if (auto ev = ReadFile(path + "/pids.events")) u.pids_max_events = KeyedValue(*ev, "max");
+  return u;
+}
+
+bool CGroup::Remove() const {
+  if (rmdir(path.c_str()) < 0 && errno != ENOENT) {
+    PLOG(WARNING) << "Failed to remove cgroup " << path;
+    return false;
+  }
+  return true;
+}
+
+// Governor
+
+std::unique_ptr<Governor> Governor::CreateNew(std::string root, Limits limits,
+                                              unsigned max_strikes) {
+  // Fails if root itself has processes in it (or isn't delegated), the limits can't be applied
+  // then, but plugins are still isolated
+  if (!WriteFile(root + "/cgroup.subtree_control", "+cpu +memory +pids")) {
+    LOG(WARNING) << "Failed to enable controllers under " << root << ", limits may not apply";
+  }
+  return std::unique_ptr<Governor>(new Governor(std::move(root), limits, max_strikes));
+}
+
+std::optional<std::string> Governor::Admit(std::string_view plugin) {
+  auto g = CGroup::CreateNew(root, fmt::format("kbot-{}", plugin));
+  if (!g) return std::nullopt;
+  if (!g->SetLimits(limits)) LOG(WARNING) << "Some limits could not be set for " << plugin;
+  auto procs = g->GetProcsPath();
+  auto usage = g->ReadUsage().value_or(Usage{});
+  entry_map.insert_or_assign(std::string(plugin), Entry{std::move(*g), usage, 0});
+  return procs;
+}
+
+void Governor::Release(std::string_view plugin) {
+  if (auto it = entry_map.find(plugin); it != entry_map.end()) {
+    it->second.group.Remove();
+    entry_map.erase(it);
+  }
+}
+
+std::vector<Governor::Sample> Governor::SampleAll() {
+  std::vector<Sample> v;
+  v.reserve(entry_map.size());
+  for (auto &[name, e] : entry_map) {
+    auto u = e.group.ReadUsage();
+    if (!u) continue;
+    if (OverBudget(e.last, *u)) {
+      e.strikes++;
+      KLOG(Warning, "Plugin {} exceeded its budget ({} of {} strikes)", name, e.strikes,
+           max_strikes);
+    } else if (e.strikes) {
+      e.strikes--;
+    }
+    e.last = *u;
+    v.push_back({name, *u, e.strikes, e.strikes >= max_strikes});
+  }
+  return v;
+}
+
+}  // namespace cgroup
+}  // namespace kbot
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <absl/container/flat_hash_map.h>
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace kbot {
+namespace cgroup {
+
+// cgroup v2 resource governor
+// Plugin hosts (see PluginHost) are placed in a sub-group each of a cgroup directory delegated to
+// us, with cpu.max, memory.max and pids.max applied. The governor periodically samples every
+// group and counts a strike against a plugin for each interval in which it ran into one of its
+// limits; a plugin reaching max_strikes is unloaded, a clean interval forgives one strike.
+//
+// Only whole processes are governed. The memory and pids controllers are not threaded, so
+// plugins loaded into the bot itself cannot be limited without also limiting the network threads
+// running them.
+
+struct Limits {
+  // Percentage of a single CPU, 0 for no limit
+  unsigned cpu_percent = 50;
+  uint64_t memory_max = 256ULL << 20;
+  uint64_t pids_max = 64;
+
+  // Parses "cpu=<percent>,memory=<bytes>[KMG],pids=<n>", any subset, in any order
+  static std::optional<Limits> Parse(std::string_view spec);
+};
+
+// Raw counters read from a group, all cumulative except memory_current and pids_current
+struct Usage {
+  uint64_t cpu_usage_usec = 0;
+  uint64_t nr_periods = 0;
+  uint64_t nr_throttled = 0;
+  uint64_t throttled_usec = 0;
+  uint64_t memory_current = 0;
+  uint64_t memory_max_events = 0;
+  uint64_t oom_kill = 0;
+  uint64_t pids_current = 0;
+  uint64_t pids_max_events = 0;
+};
+
+// Whether the group ran into one of its limits between the two samples: it was throttled in most
+// CPU periods, or hit memory.max or pids.max
+bool OverBudget(const Usage &prev, const Usage &cur);
+
+class CGroup {
+  std::string path;
+
+  explicit CGroup(std::string path) : path(std::move(path)) {}
+
+ public:
+  CGroup(const CGroup &) = delete;
+  CGroup &operator=(const CGroup &) = delete;
+  CGroup(CGroup &&) = default;
+  CGroup &operator=(CGroup &&) = default;
+  // Groups are removed explicitly with Remove, as that fails while processes remain
+  ~CGroup() = default;
+
+  // Creates the group under parent, or reuses an existing one
+  static std::optional<CGroup> CreateNew(std::string_view parent, std::string_view name);
+  const std::string &GetPath() const { return path; }
+  std::string GetProcsPath() const { return path + "/cgroup.procs"; }
+  bool SetLimits(const Limits &limits) const;
+  std::optional<Usage> ReadUsage() const;
+  bool Remove() const;
+};
+
+class Governor {
+  struct Entry {
+    CGroup group;
+    Usage last;
+    unsigned strikes = 0;
+  };
+
+  std::string root;
+  Limits limits;
+  unsigned max_strikes;
+  absl::flat_hash_map<std::string, Entry> entry_map;
+
+  Governor(std::string root, Limits limits, unsigned max_strikes)
+      : root(std::move(root)), limits(limits), max_strikes(max_strikes) {}
+
+ public:
+  static constexpr unsigned kDefaultMaxStrikes = 3;
+  static constexpr std::chrono::seconds kSampleInterval = std::chrono::seconds(5);
+
+  struct Sample {
+    std::string plugin;
+    Usage usage;
+    unsigned strikes;
+    bool evict;
+  };
+
+  // Enables the cpu, memory and pids controllers for the children of root
+  static std::unique_ptr<Governor> CreateNew(std::string root, Limits limits,
+                                             unsigned max_strikes = kDefaultMaxStrikes);
+  // Creates the group for a plugin and returns its cgroup.procs path
+  std::optional<std::string> Admit(std::string_view plugin);
+  // Removes the group once the plugin's process is gone
+  void Release(std::string_view plugin);
+  // Reads every group and updates its strikes
+  std::vector<Sample> SampleAll();
+  bool Empty() const { return entry_map.empty(); }
+};
+
+}  // namespace cgroup
+}  // namespace kbot
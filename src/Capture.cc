@@ -0,0 +1,135 @@
+#include <fcntl.h>
+#include <glog/logging.h>
+#include <unistd.h>
+
+#include <Capture.hh>
+#include <algorithm>
+#include <cerrno>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <string_view>
+
+namespace kbot {
+namespace capture {
+
+void AppendVarint(std::string &out, uint64_t v) {
+  while (v >= 0x80) {
+    out.push_back(static_cast<char>(v | 0x80));
+    v >>= 7;
+  }
+  out.push_back(static_cast<char>(v));
+}
+
+std::optional<uint64_t> ParseVarint(std::string_view in, size_t &off) {
+  uint64_t v = 0;
+  for (int shift = 0; shift < 64 && off < in.size(); shift += 7) {
+    auto b = static_cast<uint8_t>(in[off++]);
+    v |= uint64_t(b & 0x7f) << shift;
+    if (!(b & 0x80)) return v;
+  }
+  return std::nullopt;
+}
+
+// Writer
+
+Writer::Writer(int fd, Clock::time_point now) : fd(fd), last_record(now), last_flush(now) {
+  buf.reserve(kFlushSize * 2);
+  buf.append(kMagic);
+}
+
+Writer::~Writer() {
+  Flush();
+  if (fd >= 0) close(fd);
+}
+
+std::unique_ptr<Writer> Writer::CreateNew(const std::string &path, Clock::time_point now) {
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    PLOG(ERROR) << "Failed to open capture file " << path;
+    return nullptr;
+  }
+  return std::unique_ptr<Writer>(new Writer(fd, now));
+}
+
+void Writer::Record(std::string_view line, Clock::time_point at) {
+  if (fd < 0) return;
+  // Lines of one read share its time, which never goes backwards
+  auto delta = std::max(at - last_record, Clock::duration::zero());
+  last_record = std::max(at, last_record);
+  AppendVarint(buf, static_cast<uint64_t>(std::chrono::nanoseconds(delta).count()));
+  AppendVarint(buf, line.size());
+  buf.append(line);
+  if (buf.size() >= kFlushSize) {
+    last_flush = at;
+    Flush();
+    return;
+  }
+  Tick(at);
+}
+
+void Writer::Tick(Clock::time_point now) {
+  if (!buf.empty() && now - last_flush >= kFlushInterval) {
+    last_flush = now;
+    Flush();
+  }
+}
+
+bool Writer::Flush() {
+  if (fd < 0) return false;
+  std::string_view v = buf;
+  while (!v.empty()) {
+    ssize_t r = write(fd, v.data(), v.size());
+    if (r < 0) {
+      if (errno == EINTR) continue;
+      // What was written may end in the middle of a record, anything after it would be misread,
+      // so the capture ends here. The reader drops a torn record at the end.
+      PLOG(ERROR) << "Failed to write capture, capture stopped";
+      buf.clear();
+      close(fd);
+      fd = -1;
+      return false;
+    }
+    v.remove_prefix(static_cast<size_t>(r));
+  }
+  buf.clear();
+  return true;
+}
+
+// Reader
+
+std::optional<Reader> Reader::Open(const std::string &path) {
+  std::ifstream f(path, std::ios::binary);
+  if (!f) {
+    LOG(ERROR) << "Failed to open capture file " << path;
+    return std::nullopt;
+  }
+  std::ostringstream ss;
+  ss << f.rdbuf();
+  auto r = FromBuffer(std::move(ss).str());
+  if (!r) LOG(ERROR) << "Not a capture file: " << path;
+  return r;
+}
+
+std::optional<Reader> Reader::FromBuffer(std::string data) {
+  if (!std::string_view(data).starts_with(kMagic)) return std::nullopt;
+  return Reader(std::move(data));
+}
+
+std::optional<Reader::Entry> Reader::Next() {
+  if (off == data.size()) return std::nullopt;
+  auto delta = ParseVarint(data, off);
+  auto len = delta ? ParseVarint(data, off) : std::nullopt;
+  if (!len || *len > data.size() - off) {
+    torn = true;
+    off = data.size();
+    return std::nullopt;
+  }
+  at += std::chrono::nanoseconds(*delta);
+  Entry e{at, std::string_view(data).substr(off, *len)};
+  off += *len;
+  return e;
+}
+
+}  // namespace capture
+}  // namespace kbot
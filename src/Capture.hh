@@ -0,0 +1,86 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+
+namespace kbot {
+namespace capture {
+
+// Capture
+// Raw inbound lines of a server with the monotonic time they arrived, so that production traffic
+// can be replayed offline by kbot-loadgen. The file starts with kMagic, followed by one record
+// per line:
+//   varint nanoseconds since the previous record (the first since the capture started)
+//   varint length of the line
+//   the line, without its CRLF
+// Varints are LEB128, a chat line costs two or three bytes on top of its text. A record torn by a
+// crash at the end of the file is dropped by the reader.
+
+using Clock = std::chrono::steady_clock;
+
+inline constexpr std::string_view kMagic = "KBOTCAP1";
+
+// Appends to an in-memory buffer written out every kFlushSize bytes, once kFlushInterval has
+// passed since the last write (checked when a line is recorded and by Tick), and on destruction.
+// Capturing stops for good at the first failed write.
+class Writer {
+  int fd = -1;
+  std::string buf;
+  Clock::time_point last_record;
+  Clock::time_point last_flush;
+
+  Writer(int fd, Clock::time_point now);
+
+ public:
+  static constexpr size_t kFlushSize = 64 * 1024;
+  static constexpr std::chrono::seconds kFlushInterval{1};
+
+  Writer(const Writer &) = delete;
+  Writer &operator=(const Writer &) = delete;
+  ~Writer();
+
+  // Truncates path, the capture starts now
+  static std::unique_ptr<Writer> CreateNew(const std::string &path,
+                                           Clock::time_point now = Clock::now());
+  void Record(std::string_view line, Clock::time_point at);
+  // Writes out lines that have waited kFlushInterval, called from a timer so that those of a
+  // quiet connection don't stay buffered until the next one arrives
+  void Tick(Clock::time_point now);
+  bool Flush();
+};
+
+class Reader {
+  std::string data;
+  size_t off = 0;
+  std::chrono::nanoseconds at{0};
+  bool torn = false;
+
+  explicit Reader(std::string data) : data(std::move(data)), off(kMagic.size()) {}
+
+ public:
+  struct Entry {
+    // Since the capture started
+    std::chrono::nanoseconds at;
+    // Valid as long as the reader, while it isn't moved
+    std::string_view line;
+  };
+
+  static std::optional<Reader> Open(const std::string &path);
+  // Contents of a capture file, std::nullopt without the magic
+  static std::optional<Reader> FromBuffer(std::string data);
+  // std::nullopt at the end
+  std::optional<Entry> Next();
+  // Whether the last record was cut short
+  bool Torn() const { return torn; }
+};
+
+// Exposed for tests
+void AppendVarint(std::string &out, uint64_t v);
+std::optional<uint64_t> ParseVarint(std::string_view in, size_t &off);
+
+}  // namespace capture
+}  // namespace kbot
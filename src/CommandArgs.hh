@@ -0,0 +1,222 @@
+#pragma once
+
+#include <array>
+#include <charconv>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+namespace kbot {
+namespace UserCommand {
+
+// Typed command arguments
+// A command declares its arguments as extra parameters of its callback, e.g.
+//   void Kick(Manager &m, const IRCMessagePrivMsg &msg, Channel chan, Nick nick,
+//             std::optional<Rest> reason);
+// and is registered with STATIC_REGISTER_TYPED_COMMAND. The words after the command are parsed
+// into a tuple of these on the stack before the callback runs, a malformed command gets a reply
+// with the usage instead. Parsing works on views into the line, and neither allocates nor throws.
+//
+// Argument types:
+//   std::string_view       any word
+//   integral types         a decimal number in range of the type
+//   Nick                   a nickname as of RFC 2812
+//   Channel                a channel name
+//   Rest                   the remaining words as they appear in the line, must come last
+//   std::optional<T>       T if present, optional arguments must come last
+
+struct Nick {
+  std::string_view value;
+};
+
+struct Channel {
+  std::string_view value;
+};
+
+struct Rest {
+  std::string_view value;
+};
+
+template <class T>
+struct ArgParser;
+
+template <>
+struct ArgParser<std::string_view> {
+  static constexpr std::string_view kLabel = "word";
+  static bool Parse(std::string_view s, std::string_view &out) {
+    out = s;
+    return true;
+  }
+};
+
+template <std::integral T>
+  requires(!std::is_same_v<T, bool>)
+struct ArgParser<T> {
+  static constexpr std::string_view kLabel = "number";
+  static bool Parse(std::string_view s, T &out) {
+    auto [p, ec] = std::from_chars(s.data(), s.data() + s.size(), out);
+    return ec == std::errc() && p == s.data() + s.size();
+  }
+};
+
+template <>
+struct ArgParser<Nick> {
+  static constexpr std::string_view kLabel = "nick";
+  static constexpr bool IsSpecial(char c) {
+    return c == '[' || c == ']' || c == '\\' || c == '`' || c == '_' || c == '^' || c == '{' ||
+           c == '|' || c == '}';
+  }
+  static constexpr bool IsLetter(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+  }
+  static bool Parse(std::string_view s, Nick &out) {
+    if (s.empty() || !(IsLetter(s[0]) || IsSpecial(s[0]))) return false;
+    for (char c : s.substr(1)) {
+      if (!(IsLetter(c) || IsSpecial(c) || (c >= '0' && c <= '9') || c == '-')) return false;
+    }
+    out.value = s;
+    return true;
+  }
+};
+
+template <>
+struct ArgParser<Channel> {
+  static constexpr std::string_view kLabel = "channel";
+  static bool Parse(std::string_view s, Channel &out) {
+    if (s.size() < 2 || std::string_view("#&+!").find(s[0]) == std::string_view::npos) {
+      return false;
+    }
+    // Words never contain spaces, CR or LF
+    if (s.find_first_of(std::string_view(",\x07:\0", 4)) != s.npos) return false;
+    out.value = s;
+    return true;
+  }
+};
+
+template <>
+struct ArgParser<Rest> {
+  static constexpr std::string_view kLabel = "text...";
+};
+
+template <class T>
+struct IsOptionalArg : std::false_type {};
+
+template <class T>
+struct IsOptionalArg<std::optional<T>> : std::true_type {
+  using type = T;
+};
+
+template <class T>
+using UnwrapArg = typename std::conditional_t<IsOptionalArg<T>::value, IsOptionalArg<T>,
+                                              std::type_identity<T>>::type;
+
+struct ArgError {
+  enum Kind {
+    kNone,
+    kTooFew,
+    kTooMany,
+    // The argument at index doesn't parse as its type
+    kInvalid,
+  } kind = kNone;
+  size_t index = 0;
+};
+
+template <class... Args>
+struct ArgSpec {
+  static constexpr std::array<bool, sizeof...(Args)> kOptional = {IsOptionalArg<Args>::value...};
+  static constexpr std::array<bool, sizeof...(Args)> kRest = {
+      std::is_same_v<UnwrapArg<Args>, Rest>...};
+  static constexpr size_t kRequired = ((IsOptionalArg<Args>::value ? 0 : 1) + ... + 0);
+  static constexpr bool kHasRest = (std::is_same_v<UnwrapArg<Args>, Rest> || ...);
+  static constexpr std::array<std::string_view, sizeof...(Args)> kLabels = {
+      ArgParser<UnwrapArg<Args>>::kLabel...};
+
+  static constexpr bool Valid() {
+    for (size_t i = 0; i < sizeof...(Args); i++) {
+      if (i + 1 < sizeof...(Args) && kRest[i]) return false;
+      if (i > 0 && kOptional[i - 1] && !kOptional[i]) return false;
+    }
+    return true;
+  }
+  static_assert(Valid(), "Rest must be the last argument, and optional arguments trailing");
+
+  // " <nick> <number> [word]"
+  static constexpr auto MakeUsage() {
+    constexpr size_t n = ((ArgParser<UnwrapArg<Args>>::kLabel.size() + 3) + ... + 0);
+    std::array<char, n> a{};
+    size_t i = 0;
+    [[maybe_unused]] auto append = [&](std::string_view label, bool optional) {
+      a[i++] = ' ';
+      a[i++] = optional ? '[' : '<';
+      for (char c : label) a[i++] = c;
+      a[i++] = optional ? ']' : '>';
+    };
+    (append(ArgParser<UnwrapArg<Args>>::kLabel, IsOptionalArg<Args>::value), ...);
+    return a;
+  }
+  static constexpr auto kUsageArray = MakeUsage();
+  static constexpr std::string_view kUsage{kUsageArray.data(), kUsageArray.size()};
+};
+
+namespace detail {
+
+template <size_t I, class T>
+bool ParseArg(std::span<const std::string_view> params, T &out, ArgError &err) {
+  if constexpr (IsOptionalArg<T>::value) {
+    if (I >= params.size()) return true;
+    out.emplace();
+    return ParseArg<I>(params, *out, err);
+  } else if constexpr (std::is_same_v<T, Rest>) {
+    // Words are views into the same line, so this keeps the spacing between them
+    std::string_view first = params[I], last = params.back();
+    out.value = std::string_view(first.data(), last.data() + last.size() - first.data());
+    return true;
+  } else {
+    if (!ArgParser<T>::Parse(params[I], out)) {
+      err = ArgError{ArgError::kInvalid, I};
+      return false;
+    }
+    return true;
+  }
+}
+
+template <class... Args, size_t... I>
+void ParseArgs([[maybe_unused]] std::span<const std::string_view> params,
+               [[maybe_unused]] std::tuple<Args...> &out, [[maybe_unused]] ArgError &err,
+               std::index_sequence<I...>) {
+  // Stops at the first argument that fails
+  (void)(ParseArg<I>(params, std::get<I>(out), err) && ...);
+}
+
+}  // namespace detail
+
+// params are the words following the command
+template <class... Args>
+ArgError ParseArgs(std::span<const std::string_view> params, std::tuple<Args...> &out) {
+  using Spec = ArgSpec<Args...>;
+  if (params.size() < Spec::kRequired) return ArgError{ArgError::kTooFew, params.size()};
+  if (!Spec::kHasRest && params.size() > sizeof...(Args)) {
+    return ArgError{ArgError::kTooMany, sizeof...(Args)};
+  }
+  ArgError err;
+  detail::ParseArgs(params, out, err, std::index_sequence_for<Args...>());
+  return err;
+}
+
+template <class F>
+struct CommandSignature;
+
+template <class M, class Msg, class... Args>
+struct CommandSignature<void (*)(M &, const Msg &, Args...)> {
+  using args_tuple = std::tuple<std::remove_cvref_t<Args>...>;
+  using spec = ArgSpec<std::remove_cvref_t<Args>...>;
+};
+
+}  // namespace UserCommand
+}  // namespace kbot
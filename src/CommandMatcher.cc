@@ -0,0 +1,228 @@
+#include <CommandMatcher.hh>
+#include <algorithm>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace kbot {
+
+namespace {
+
+// Same order as std::string_view's comparison
+bool LabelLess(char a, char b) {
+  return static_cast<unsigned char>(a) < static_cast<unsigned char>(b);
+}
+
+char AsciiLower(char c) { return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c; }
+
+}  // namespace
+
+size_t CommandMatcher::ChannelHash::operator()(std::string_view s) const {
+  // FNV-1a
+  uint64_t h = 14695981039346656037ULL;
+  for (char c : s) {
+    h ^= static_cast<unsigned char>(AsciiLower(c));
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+bool CommandMatcher::ChannelEq::operator()(std::string_view a, std::string_view b) const {
+  return std::equal(a.begin(), a.end(), b.begin(), b.end(),
+                    [](char x, char y) { return AsciiLower(x) == AsciiLower(y); });
+}
+
+CommandMatcher::CommandMatcher(std::string_view key_prefix)
+    : key_prefix(key_prefix), prefix_vec{std::string(key_prefix.substr(1))} {
+  Rebuild();
+  RebuildFirstBytes();
+}
+
+void CommandMatcher::SetCommands(std::span<const std::string_view> keys, uint64_t generation) {
+  key_vec.clear();
+  for (auto k : keys) {
+    if (k.starts_with(key_prefix) && k.size() > key_prefix.size()) key_vec.emplace_back(k);
+  }
+  this->generation = generation;
+  Rebuild();
+}
+
+void CommandMatcher::Rebuild() {
+  std::vector<std::pair<std::string_view, int32_t>> names;
+  absl::flat_hash_map<std::string_view, int32_t> index_map;
+  for (size_t i = 0; i < key_vec.size(); i++) {
+    auto name = GetName(static_cast<int32_t>(i));
+    if (index_map.emplace(name, static_cast<int32_t>(i)).second) names.emplace_back(name, i);
+  }
+  for (auto &[alias, command] : alias_map) {
+    // A command of the same name takes precedence
+    if (index_map.contains(alias)) continue;
+    if (auto it = index_map.find(command); it != index_map.end()) {
+      names.emplace_back(alias, it->second);
+    }
+  }
+  std::sort(names.begin(), names.end());
+
+  node_vec.assign(1, Node{});
+  // Children of a node are allocated together before any of theirs, so they stay contiguous
+  auto build = [&](auto &self, uint32_t node, size_t lo, size_t hi, size_t depth) -> void {
+    // The name ending here sorts first
+    if (lo < hi && names[lo].first.size() == depth) {
+      node_vec[node].command = names[lo].second;
+      node_vec[node].unique = names[lo].second;
+      lo++;
+    }
+    std::vector<std::pair<size_t, size_t>> groups;
+    for (size_t i = lo; i < hi;) {
+      size_t j = i + 1;
+      while (j < hi && names[j].first[depth] == names[i].first[depth]) j++;
+      groups.emplace_back(i, j);
+      i = j;
+    }
+    auto begin = static_cast<uint32_t>(node_vec.size());
+    node_vec[node].child_begin = begin;
+    node_vec[node].child_count = static_cast<uint16_t>(groups.size());
+    for (auto &[i, j] : groups) {
+      node_vec.push_back(Node{.label = names[i].first[depth]});
+    }
+    for (size_t g = 0; g < groups.size(); g++) {
+      self(self, begin + g, groups[g].first, groups[g].second, depth + 1);
+      int32_t &unique = node_vec[node].unique;
+      int32_t child = node_vec[begin + g].unique;
+      if (unique == kNone) {
+        unique = child;
+      } else if (child != kNone && child != unique) {
+        unique = kAmbiguousIndex;
+      }
+    }
+  };
+  build(build, 0, 0, names.size(), 0);
+}
+
+void CommandMatcher::RebuildFirstBytes() {
+  first_byte_set.reset();
+  for (auto &p : prefix_vec) first_byte_set.set(static_cast<unsigned char>(p[0]));
+  for (auto &[_, config] : channel_map) {
+    for (auto &p : config.prefix_vec) first_byte_set.set(static_cast<unsigned char>(p[0]));
+  }
+}
+
+std::string_view CommandMatcher::GetName(int32_t index) const {
+  return std::string_view(key_vec[index]).substr(key_prefix.size());
+}
+
+const std::vector<std::string> &CommandMatcher::GetPrefixes(std::string_view channel) const {
+  if (auto it = channel_map.find(channel); it != channel_map.end()) {
+    if (!it->second.prefix_vec.empty()) return it->second.prefix_vec;
+  }
+  return prefix_vec;
+}
+
+CommandMatcher::WalkResult CommandMatcher::Walk(std::string_view channel,
+                                                std::string_view word) const {
+  if (!MayBeCommand(word)) return {};
+  if (word.starts_with(':')) word.remove_prefix(1);
+  size_t prefix_size = 0;
+  for (auto &p : GetPrefixes(channel)) {
+    if (p.size() > prefix_size && word.starts_with(p)) prefix_size = p.size();
+  }
+  // A prefix alone isn't a command either
+  if (prefix_size == 0 || prefix_size == word.size()) return {};
+  word.remove_prefix(prefix_size);
+  const Node *n = &node_vec[0];
+  for (char c : word) {
+    auto begin = node_vec.begin() + n->child_begin;
+    auto end = begin + n->child_count;
+    auto it = std::lower_bound(begin, end, c,
+                               [](const Node &x, char label) { return LabelLess(x.label, label); });
+    if (it == end || it->label != c) return {true, nullptr};
+    n = &*it;
+  }
+  return {true, n};
+}
+
+CommandMatcher::Match CommandMatcher::Resolve(std::string_view channel,
+                                              std::string_view word) const {
+  auto [command, node] = Walk(channel, word);
+  if (!command) return {Result::kNotCommand, {}};
+  if (!node) return {Result::kUnknown, {}};
+  int32_t index = node->command != kNone ? node->command : node->unique;
+  if (index == kAmbiguousIndex) return {Result::kAmbiguous, {}};
+  if (index == kNone) return {Result::kUnknown, {}};
+  std::string_view key = key_vec[index];
+  if (auto it = channel_map.find(channel);
+      it != channel_map.end() && it->second.disabled_set.contains(GetName(index))) {
+    return {Result::kDisabled, key};
+  }
+  return {Result::kMatched, key};
+}
+
+std::vector<std::string_view> CommandMatcher::GetCandidates(std::string_view channel,
+                                                            std::string_view word,
+                                                            size_t max) const {
+  std::vector<std::string_view> v;
+  auto [command, node] = Walk(channel, word);
+  if (!node) return v;
+  std::vector<int32_t> seen;
+  auto collect = [&](auto &self, const Node &n) -> void {
+    if (n.command != kNone && std::find(seen.begin(), seen.end(), n.command) == seen.end()) {
+      seen.push_back(n.command);
+    }
+    for (uint32_t i = 0; i < n.child_count && seen.size() < max; i++) {
+      self(self, node_vec[n.child_begin + i]);
+    }
+  };
+  collect(collect, *node);
+  for (auto i : seen) v.push_back(key_vec[i]);
+  return v;
+}
+
+bool CommandMatcher::SetPrefixes(std::string_view channel, std::vector<std::string> prefixes) {
+  for (auto &p : prefixes) {
+    if (p.empty() || p.find_first_of(" \r\n") != p.npos) return false;
+  }
+  if (channel.empty()) {
+    if (prefixes.empty()) return false;
+    prefix_vec = std::move(prefixes);
+  } else if (prefixes.empty()) {
+    if (auto it = channel_map.find(channel); it != channel_map.end()) {
+      it->second.prefix_vec.clear();
+      if (it->second.disabled_set.empty()) channel_map.erase(it);
+    }
+  } else {
+    channel_map[channel].prefix_vec = std::move(prefixes);
+  }
+  RebuildFirstBytes();
+  return true;
+}
+
+bool CommandMatcher::AddAlias(std::string_view alias, std::string_view command) {
+  if (alias.empty() || alias.find(' ') != alias.npos) return false;
+  for (size_t i = 0; i < key_vec.size(); i++) {
+    if (GetName(static_cast<int32_t>(i)) == alias) return false;
+  }
+  alias_map.insert_or_assign(std::string(alias), std::string(command));
+  Rebuild();
+  return true;
+}
+
+bool CommandMatcher::RemoveAlias(std::string_view alias) {
+  if (!alias_map.erase(alias)) return false;
+  Rebuild();
+  return true;
+}
+
+void CommandMatcher::SetEnabled(std::string_view channel, std::string_view command,
+                                bool enabled) {
+  if (enabled) {
+    auto it = channel_map.find(channel);
+    if (it == channel_map.end()) return;
+    it->second.disabled_set.erase(command);
+    if (it->second.disabled_set.empty() && it->second.prefix_vec.empty()) channel_map.erase(it);
+  } else {
+    channel_map[channel].disabled_set.emplace(command);
+  }
+}
+
+}  // namespace kbot
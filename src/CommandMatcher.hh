@@ -0,0 +1,126 @@
+#pragma once
+
+#include <absl/container/flat_hash_map.h>
+#include <absl/container/flat_hash_set.h>
+
+#include <bitset>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace kbot {
+
+// CommandMatcher
+// Resolves the first word of a PRIVMSG to the key of the command it invokes, the command maps
+// themselves stay keyed by the canonical ":" COMMAND_PREFIX "<name>". On top of the exact name it
+// accepts, per network (one matcher per server) or overridden per channel:
+//   - other prefixes, and more than one
+//   - aliases for a command
+//   - any unambiguous abbreviation of a name or alias
+//   - commands disabled in a channel, which then don't resolve there
+//
+// The names and aliases are kept in a trie flattened into one array, where every node knows which
+// command, if any single one, lies below it. Resolving a word walks the prefix and then the trie
+// once, and a set of the first bytes of all prefixes turns away a line that can't be a command
+// after looking at a single byte. One instance belongs to one server thread.
+
+class CommandMatcher {
+ public:
+  enum class Result {
+    kNotCommand,
+    kUnknown,
+    kAmbiguous,
+    kDisabled,
+    kMatched,
+  };
+  struct Match {
+    Result result;
+    // Canonical key for kMatched and kDisabled
+    std::string_view key;
+  };
+
+ private:
+  static constexpr int32_t kNone = -1;
+  static constexpr int32_t kAmbiguousIndex = -2;
+
+  struct Node {
+    // Children are contiguous and sorted by label
+    uint32_t child_begin = 0;
+    uint16_t child_count = 0;
+    char label = 0;
+    // Index into key_vec if a name ends here
+    int32_t command = kNone;
+    // The command all names in this subtree resolve to, kAmbiguousIndex if they differ
+    int32_t unique = kNone;
+  };
+
+  struct WalkResult {
+    // Starts with one of the prefixes
+    bool command = false;
+    // Where the name ends in the trie, nullptr if it left it
+    const Node *node = nullptr;
+  };
+
+  // Channel names compare ignoring ASCII case
+  struct ChannelHash {
+    using is_transparent = void;
+    size_t operator()(std::string_view s) const;
+  };
+  struct ChannelEq {
+    using is_transparent = void;
+    bool operator()(std::string_view a, std::string_view b) const;
+  };
+
+  struct ChannelConfig {
+    // Empty to use the network's
+    std::vector<std::string> prefix_vec;
+    absl::flat_hash_set<std::string> disabled_set;
+  };
+
+  std::string key_prefix;
+  std::vector<std::string> prefix_vec;
+  absl::flat_hash_map<std::string, std::string> alias_map;
+  absl::flat_hash_map<std::string, ChannelConfig, ChannelHash, ChannelEq> channel_map;
+  std::bitset<256> first_byte_set;
+  std::vector<std::string> key_vec;
+  std::vector<Node> node_vec;
+  uint64_t generation = UINT64_MAX;
+
+  void Rebuild();
+  void RebuildFirstBytes();
+  const std::vector<std::string> &GetPrefixes(std::string_view channel) const;
+  WalkResult Walk(std::string_view channel, std::string_view word) const;
+  std::string_view GetName(int32_t index) const;
+
+ public:
+  // key_prefix is what precedes the name in command keys, which is also the default prefix once
+  // the leading ':' is dropped
+  explicit CommandMatcher(std::string_view key_prefix);
+
+  // Takes the keys of all commands available, the generation identifies the set
+  void SetCommands(std::span<const std::string_view> keys, uint64_t generation);
+  uint64_t GetGeneration() const { return generation; }
+
+  // word is the first word of the message, with or without the leading ':'
+  // Only looks at the first byte, false means Resolve would return kNotCommand
+  bool MayBeCommand(std::string_view word) const {
+    if (word.starts_with(':')) word.remove_prefix(1);
+    return !word.empty() && first_byte_set[static_cast<unsigned char>(word[0])];
+  }
+  Match Resolve(std::string_view channel, std::string_view word) const;
+  // Keys of the commands an ambiguous word could mean, at most max of them
+  std::vector<std::string_view> GetCandidates(std::string_view channel, std::string_view word,
+                                              size_t max) const;
+
+  // An empty channel sets the network's prefixes, empty prefixes reset a channel to them
+  bool SetPrefixes(std::string_view channel, std::vector<std::string> prefixes);
+  // Fails if alias already names a command
+  bool AddAlias(std::string_view alias, std::string_view command);
+  bool RemoveAlias(std::string_view alias);
+  void SetEnabled(std::string_view channel, std::string_view command, bool enabled);
+};
+
+}  // namespace kbot
@@ -1,9 +1,12 @@
 #include <errno.h>
 #include <sys/epoll.h>
+#include <sys/timerfd.h>
 #include <unistd.h>
 
 #include <Epoll.hh>
+#include <algorithm>
 #include <cassert>
+#include <chrono>
 #include <functional>
 #include <map>
 #include <optional>
@@ -18,7 +21,11 @@ EpollManager::EpollManager(EpollManager &&m) {
   fd = m.fd;
   m.fd = -1;
   fd_map = std::move(m.fd_map);
+  timer_fd = std::exchange(m.timer_fd, -1);
+  timer_seq = m.timer_seq;
+  timer_map = std::move(m.timer_map);
   static_events = std::move(m.static_events);
+  if (timer_fd >= 0) RegisterTimerFd();
 }
 
 EpollManager &EpollManager::operator=(EpollManager &&m) {
@@ -27,7 +34,12 @@ EpollManager &EpollManager::operator=(EpollManager &&m) {
   m.fd = -1;
 
   fd_map = std::move(m.fd_map);
+  if (timer_fd >= 0) close(timer_fd);
+  timer_fd = std::exchange(m.timer_fd, -1);
+  timer_seq = m.timer_seq;
+  timer_map = std::move(m.timer_map);
   static_events = std::move(m.static_events);
+  if (timer_fd >= 0) RegisterTimerFd();
   return *this;
 }
 
@@ -35,6 +47,9 @@ EpollManager::~EpollManager() {
   for (auto &ctx : static_events.exit) {
     ctx.cb(*this);
   }
+  if (timer_fd >= 0) {
+    close(timer_fd);
+  }
   if (fd >= 0) {
     close(fd);
   }
@@ -160,6 +175,73 @@ bool EpollManager::DeleteFd(int fd) {
   return true;
 }
 
+// Timers
+
+void EpollManager::RegisterTimerFd() {
+  // The callback captures this, so it is (re)bound whenever the instance moves
+  auto cb = [this](struct epoll_event) { OnTimerFd(); };
+  if (fd_map.contains(timer_fd)) {
+    ModifyFdCallback(timer_fd, std::move(cb));
+  } else {
+    RegisterFd(timer_fd, EpollIn, std::move(cb), EpollConfigDefault);
+  }
+}
+
+void EpollManager::ArmTimerFd() {
+  struct itimerspec its = {};
+  if (!timer_map.empty()) {
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                  timer_map.begin()->first.deadline.time_since_epoch())
+                  .count();
+    // An all zero it_value disarms the timer, so never pass that for a due deadline
+    its.it_value.tv_sec = ns / 1000000000;
+    its.it_value.tv_nsec = std::max<long>(ns % 1000000000, its.it_value.tv_sec ? 0 : 1);
+  }
+  timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, nullptr);
+}
+
+void EpollManager::OnTimerFd() {
+  uint64_t expirations;
+  (void)read(timer_fd, &expirations, sizeof(expirations));
+  auto now = std::chrono::steady_clock::now();
+  // One at a time, so that a callback cancelling another due timer keeps it from running. Timers
+  // added by the callbacks wait for the next expiration even if already due.
+  uint64_t added = timer_seq;
+  auto it = timer_map.begin();
+  while (it != timer_map.end() && it->first.deadline <= now) {
+    if (it->first.seq >= added) {
+      ++it;
+      continue;
+    }
+    auto id = it->first;
+    auto cb = std::move(it->second);
+    timer_map.erase(it);
+    cb();
+    it = timer_map.upper_bound(id);
+  }
+  ArmTimerFd();
+}
+
+std::optional<TimerId> EpollManager::AddTimer(std::chrono::nanoseconds after,
+                                              std::function<void()> cb) {
+  if (timer_fd < 0) {
+    // steady_clock is CLOCK_MONOTONIC on Linux
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd < 0) return std::nullopt;
+    RegisterTimerFd();
+  }
+  TimerId id{std::chrono::steady_clock::now() + after, timer_seq++};
+  bool first = timer_map.empty() || id < timer_map.begin()->first;
+  timer_map.emplace(id, std::move(cb));
+  if (first) ArmTimerFd();
+  return id;
+}
+
+bool EpollManager::CancelTimer(TimerId id) {
+  // The timerfd may fire early afterwards, which is harmless
+  return timer_map.erase(id) != 0;
+}
+
 int EpollManager::RunEventLoop(int timeout = 0) {
   for (auto &ctx : static_events.pre) {
     ctx.cb(*this);
@@ -181,10 +263,15 @@ int EpollManager::RunEventLoop(int timeout = 0) {
     assert(r);
     for (size_t i = 0; i < (size_t)r; i++) {
       auto it = fd_map.find(events_vec[i].data.fd);
-      assert(it != fd_map.end());
-      if (it->second.enabled) {
-        it->second.cb(events_vec[i]);
-      }
+      // An earlier callback in this round may have deleted the fd
+      if (it == fd_map.end() || !it->second.enabled) continue;
+      // The callback runs from a local, so that it may delete or replace itself (or register
+      // other fds, which may rehash the map), and is put back only if it is still wanted
+      int efd = events_vec[i].data.fd;
+      auto cb = std::move(it->second.cb);
+      cb(events_vec[i]);
+      it = fd_map.find(efd);
+      if (it != fd_map.end() && !it->second.cb) it->second.cb = std::move(cb);
     }
 
     break;
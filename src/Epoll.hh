@@ -1,7 +1,10 @@
+#pragma once
+
 #include <absl/container/flat_hash_map.h>
 #include <errno.h>
 #include <sys/epoll.h>
 
+#include <chrono>
 #include <concepts>
 #include <functional>
 #include <map>
@@ -37,15 +40,29 @@ struct EpollContext {
   uint32_t GetEventMask() { return ev.events & (EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLPRI); }
 };
 
+struct TimerId {
+  std::chrono::steady_clock::time_point deadline;
+  uint64_t seq = 0;
+  auto operator<=>(const TimerId &) const = default;
+};
+
 class EpollManager {
   int fd = -1;
   absl::flat_hash_map<int, EpollContext> fd_map;
+  // Timers are multiplexed on a single timerfd, created on first use
+  int timer_fd = -1;
+  uint64_t timer_seq = 0;
+  std::map<TimerId, std::function<void()>> timer_map;
   struct {
     std::vector<EpollStaticEvent<StaticEventType::Pre>> pre;
     std::vector<EpollStaticEvent<StaticEventType::Post>> post;
     std::vector<EpollStaticEvent<StaticEventType::Exit>> exit;
   } static_events;
 
+  void RegisterTimerFd();
+  void ArmTimerFd();
+  void OnTimerFd();
+
  protected:
   explicit EpollManager(int fd) : fd(fd) {}
   ~EpollManager();
@@ -86,6 +103,9 @@ class EpollManager {
   bool ModifyFdConfig(int fd, ConfigFlags configs);
   bool ModifyFdCallback(int fd, std::function<void(struct epoll_event)> callback);
   bool DeleteFd(int fd);
+  // Timer callbacks run from the event loop and may add or cancel timers themselves
+  std::optional<TimerId> AddTimer(std::chrono::nanoseconds after, std::function<void()> cb);
+  bool CancelTimer(TimerId id);
   int RunEventLoop(int timeout);
 };
 
@@ -0,0 +1,226 @@
+#include <curl/curl.h>
+#include <fmt/format.h>
+#include <glog/logging.h>
+#include <sys/epoll.h>
+
+#include <Epoll.hh>
+#include <Http.hh>
+#include <Log.hh>
+#include <cerrno>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace kbot {
+namespace http {
+
+// Engine
+
+Engine::Transfer::~Transfer() {
+  if (easy) curl_easy_cleanup(easy);
+  if (header_list) curl_slist_free_all(header_list);
+}
+
+std::unique_ptr<Engine> Engine::CreateNew(io::EpollManager &m, size_t owner_limit,
+                                          owner_func_t owner_func) {
+  std::unique_ptr<Engine> e(new Engine(m, owner_limit, std::move(owner_func)));
+  e->multi = curl_multi_init();
+  if (e->multi == nullptr) {
+    LOG(ERROR) << "Failed to create curl multi handle";
+    return nullptr;
+  }
+  curl_multi_setopt(e->multi, CURLMOPT_SOCKETFUNCTION, SocketCallback);
+  curl_multi_setopt(e->multi, CURLMOPT_SOCKETDATA, e.get());
+  curl_multi_setopt(e->multi, CURLMOPT_TIMERFUNCTION, TimerCallback);
+  curl_multi_setopt(e->multi, CURLMOPT_TIMERDATA, e.get());
+  // Keep a few idle connections around for reuse, but don't let a single host hog them
+  curl_multi_setopt(e->multi, CURLMOPT_MAXCONNECTS, 16L);
+  curl_multi_setopt(e->multi, CURLMOPT_MAX_HOST_CONNECTIONS, 4L);
+  return e;
+}
+
+Engine::~Engine() {
+  for (auto &[easy, t] : transfer_map) curl_multi_remove_handle(multi, easy);
+  transfer_map.clear();
+  // Cleanup closes the cached connections, which reports them through SocketCallback
+  curl_multi_cleanup(multi);
+  for (auto s : socket_set) m.DeleteFd(s);
+  if (timer) m.CancelTimer(*timer);
+}
+
+size_t Engine::GetInflight(const std::string &owner) const {
+  auto it = owner_count_map.find(owner);
+  return it == owner_count_map.end() ? 0 : it->second;
+}
+
+bool Engine::Fetch(Request req, std::function<void(Response)> cb) {
+  auto owner = owner_func ? owner_func() : std::string();
+  if (auto count = GetInflight(owner); count >= owner_limit) {
+    KLOG(Warning, "HTTP request to {} by '{}' rejected, {} transfers in flight", req.url, owner,
+         count);
+    errno = EBUSY;
+    return false;
+  }
+  auto t = std::make_unique<Transfer>();
+  t->easy = curl_easy_init();
+  if (t->easy == nullptr) {
+    LOG(ERROR) << "Failed to create curl easy handle";
+    return false;
+  }
+  t->req = std::move(req);
+  t->owner = std::move(owner);
+  t->cb = std::move(cb);
+  for (auto &h : t->req.headers) t->header_list = curl_slist_append(t->header_list, h.c_str());
+
+  CURL *easy = t->easy;
+  curl_easy_setopt(easy, CURLOPT_URL, t->req.url.c_str());
+  curl_easy_setopt(easy, CURLOPT_PRIVATE, t.get());
+  curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, WriteCallback);
+  curl_easy_setopt(easy, CURLOPT_WRITEDATA, t.get());
+  curl_easy_setopt(easy, CURLOPT_ERRORBUFFER, t->errbuf);
+  curl_easy_setopt(easy, CURLOPT_NOSIGNAL, 1L);
+  curl_easy_setopt(easy, CURLOPT_TIMEOUT_MS, static_cast<long>(t->req.timeout.count()));
+  curl_easy_setopt(easy, CURLOPT_PROTOCOLS_STR, "http,https");
+  curl_easy_setopt(easy, CURLOPT_REDIR_PROTOCOLS_STR, "http,https");
+  curl_easy_setopt(easy, CURLOPT_FOLLOWLOCATION, 1L);
+  curl_easy_setopt(easy, CURLOPT_MAXREDIRS, 5L);
+  curl_easy_setopt(easy, CURLOPT_USERAGENT, "kbot");
+  curl_easy_setopt(easy, CURLOPT_ACCEPT_ENCODING, "");
+  if (t->req.max_size) {
+    curl_easy_setopt(easy, CURLOPT_MAXFILESIZE_LARGE, static_cast<curl_off_t>(t->req.max_size));
+  }
+  if (t->header_list) curl_easy_setopt(easy, CURLOPT_HTTPHEADER, t->header_list);
+  if (!t->req.body.empty()) {
+    curl_easy_setopt(easy, CURLOPT_POSTFIELDSIZE_LARGE,
+                     static_cast<curl_off_t>(t->req.body.size()));
+    curl_easy_setopt(easy, CURLOPT_POSTFIELDS, t->req.body.c_str());
+  }
+
+  if (auto r = curl_multi_add_handle(multi, easy); r != CURLM_OK) {
+    LOG(ERROR) << "Failed to add curl transfer: " << curl_multi_strerror(r);
+    return false;
+  }
+  // Only now, an entry for a request that never started would stay behind
+  owner_count_map[t->owner]++;
+  transfer_map.emplace(easy, std::move(t));
+  return true;
+}
+
+FetchAwaiter Engine::FetchAsync(Request req) { return FetchAwaiter(*this, std::move(req)); }
+
+int Engine::SocketCallback(CURL *, curl_socket_t s, int what, void *userp, void *) {
+  auto e = static_cast<Engine *>(userp);
+  if (what == CURL_POLL_REMOVE) {
+    if (e->socket_set.erase(s)) e->m.DeleteFd(s);
+    return 0;
+  }
+  uint32_t events = 0;
+  if (what & CURL_POLL_IN) events |= io::EpollManager::EpollIn;
+  if (what & CURL_POLL_OUT) events |= io::EpollManager::EpollOut;
+  auto flags = static_cast<io::EpollManager::EventFlags>(events);
+  if (e->socket_set.contains(s)) {
+    if (!e->m.ModifyFdEvents(s, flags)) PLOG(ERROR) << "Failed to modify curl socket " << s;
+    return 0;
+  }
+  if (!e->m.RegisterFd(
+          s, flags,
+          [e, s](struct epoll_event ev) {
+            int mask = 0;
+            if (ev.events & EPOLLIN) mask |= CURL_CSELECT_IN;
+            if (ev.events & EPOLLOUT) mask |= CURL_CSELECT_OUT;
+            if (ev.events & (EPOLLERR | EPOLLHUP)) mask |= CURL_CSELECT_ERR;
+            e->SocketAction(s, mask);
+          },
+          io::EpollManager::EpollConfigDefault)) {
+    PLOG(ERROR) << "Failed to register curl socket " << s;
+    return -1;
+  }
+  e->socket_set.insert(s);
+  return 0;
+}
+
+int Engine::TimerCallback(CURLM *, long timeout_ms, void *userp) {
+  auto e = static_cast<Engine *>(userp);
+  if (e->timer) {
+    e->m.CancelTimer(*e->timer);
+    e->timer.reset();
+  }
+  if (timeout_ms < 0) return 0;
+  // curl must not be re-entered from here, so even a zero timeout goes through the event loop
+  e->timer = e->m.AddTimer(std::chrono::milliseconds(timeout_ms), [e] {
+    e->timer.reset();
+    e->SocketAction(CURL_SOCKET_TIMEOUT, 0);
+  });
+  return e->timer ? 0 : -1;
+}
+
+size_t Engine::WriteCallback(char *ptr, size_t size, size_t nmemb, void *userdata) {
+  auto t = static_cast<Transfer *>(userdata);
+  size_t n = size * nmemb;
+  if (t->req.max_size && t->res.body.size() + n > t->req.max_size) {
+    t->oversized = true;
+    // Anything other than n aborts the transfer
+    return 0;
+  }
+  t->res.body.append(ptr, n);
+  return n;
+}
+
+void Engine::SocketAction(curl_socket_t s, int ev_bitmask) {
+  int running;
+  auto r = curl_multi_socket_action(multi, s, ev_bitmask, &running);
+  if (r != CURLM_OK) LOG(ERROR) << "curl_multi_socket_action failed: " << curl_multi_strerror(r);
+  ProcessDone();
+}
+
+void Engine::ProcessDone() {
+  std::vector<std::unique_ptr<Transfer>> done;
+  int left;
+  while (CURLMsg *msg = curl_multi_info_read(multi, &left)) {
+    if (msg->msg != CURLMSG_DONE) continue;
+    auto it = transfer_map.find(msg->easy_handle);
+    assert(it != transfer_map.end());
+    auto t = std::move(it->second);
+    transfer_map.erase(it);
+    curl_multi_remove_handle(multi, t->easy);
+    if (auto c = owner_count_map.find(t->owner); c != owner_count_map.end() && !--c->second) {
+      owner_count_map.erase(c);
+    }
+
+    CURLcode code = msg->data.result;
+    curl_easy_getinfo(t->easy, CURLINFO_RESPONSE_CODE, &t->res.status);
+    char *ct = nullptr;
+    if (curl_easy_getinfo(t->easy, CURLINFO_CONTENT_TYPE, &ct) == CURLE_OK && ct) {
+      t->res.content_type = ct;
+    }
+    if (t->oversized || code == CURLE_FILESIZE_EXCEEDED) {
+      t->res.error = fmt::format("response exceeds {} bytes", t->req.max_size);
+      t->res.body.clear();
+    } else if (code != CURLE_OK) {
+      t->res.error = t->errbuf[0] ? t->errbuf : curl_easy_strerror(code);
+    }
+    KLOG(Debug, "HTTP {} -> {} ({} bytes){}{}", t->req.url, t->res.status, t->res.body.size(),
+         t->res.error.empty() ? "" : ": ", t->res.error);
+    done.push_back(std::move(t));
+  }
+  // Callbacks may start new transfers, so only invoke them once curl is done reporting
+  for (auto &t : done) t->cb(std::move(t->res));
+}
+
+// FetchAwaiter
+
+bool FetchAwaiter::await_suspend(std::coroutine_handle<> h) {
+  bool r = e.Fetch(std::move(req), [this, h](Response r) {
+    res = std::move(r);
+    h.resume();
+  });
+  if (!r) {
+    res.emplace();
+    res->error = "request rejected";
+  }
+  return r;
+}
+
+}  // namespace http
+}  // namespace kbot
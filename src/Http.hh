@@ -0,0 +1,124 @@
+#pragma once
+
+#include <absl/container/flat_hash_map.h>
+#include <absl/container/flat_hash_set.h>
+#include <curl/curl.h>
+
+#include <Epoll.hh>
+#include <chrono>
+#include <coroutine>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace kbot {
+namespace http {
+
+// HTTP client
+// A curl multi handle driven by the EpollManager of the owning thread: curl tells us which sockets
+// to watch and when to wake it up, and we call back into it from the event loop, so transfers
+// never block the server thread. Connections are cached by the multi handle and reused across
+// requests to the same host. Nothing here is thread safe.
+
+struct Request {
+  std::string url;
+  std::vector<std::string> headers;
+  // A non-empty body turns the request into a POST
+  std::string body;
+  // Transfers whose response body grows beyond this are aborted
+  size_t max_size = 1 << 20;
+  std::chrono::milliseconds timeout = std::chrono::seconds(30);
+};
+
+struct Response {
+  long status = 0;
+  std::string body;
+  std::string content_type;
+  // Empty on success, which only means the transfer completed; check status as well
+  std::string error;
+
+  bool Ok() const { return error.empty() && status >= 200 && status < 300; }
+};
+
+class FetchAwaiter;
+
+class Engine {
+ public:
+  // Names who is calling Fetch (usually the plugin running), requests are accounted per owner for
+  // concurrency limits. Decided by the engine rather than the request, so a caller can't pick
+  // another owner to get around its limit.
+  using owner_func_t = std::function<std::string()>;
+
+ private:
+  struct Transfer {
+    CURL *easy = nullptr;
+    curl_slist *header_list = nullptr;
+    Request req;
+    std::string owner;
+    Response res;
+    std::function<void(Response)> cb;
+    bool oversized = false;
+    char errbuf[CURL_ERROR_SIZE] = {};
+
+    ~Transfer();
+  };
+
+  io::EpollManager &m;
+  CURLM *multi = nullptr;
+  size_t owner_limit;
+  owner_func_t owner_func;
+  std::optional<io::TimerId> timer;
+  absl::flat_hash_set<curl_socket_t> socket_set;
+  absl::flat_hash_map<CURL *, std::unique_ptr<Transfer>> transfer_map;
+  absl::flat_hash_map<std::string, size_t> owner_count_map;
+
+  Engine(io::EpollManager &m, size_t owner_limit, owner_func_t owner_func)
+      : m(m), owner_limit(owner_limit), owner_func(std::move(owner_func)) {}
+  static int SocketCallback(CURL *easy, curl_socket_t s, int what, void *userp, void *socketp);
+  static int TimerCallback(CURLM *multi, long timeout_ms, void *userp);
+  static size_t WriteCallback(char *ptr, size_t size, size_t nmemb, void *userdata);
+  void SocketAction(curl_socket_t s, int ev_bitmask);
+  void ProcessDone();
+
+ public:
+  static constexpr size_t kDefaultOwnerLimit = 4;
+
+  Engine(const Engine &) = delete;
+  Engine &operator=(const Engine &) = delete;
+  Engine(Engine &&) = delete;
+  Engine &operator=(Engine &&) = delete;
+  // Pending transfers are dropped without invoking their callbacks
+  ~Engine();
+
+  // The EpollManager must have reached its final address, i.e. call this from the thread running
+  // its event loop.
+  static std::unique_ptr<Engine> CreateNew(io::EpollManager &m,
+                                           size_t owner_limit = kDefaultOwnerLimit,
+                                           owner_func_t owner_func = {});
+  // Starts the transfer and returns immediately, cb is invoked from the event loop once it is
+  // done. Returns false if the request could not be started, e.g. because its owner already has
+  // owner_limit transfers in flight; cb is not invoked in that case.
+  bool Fetch(Request req, std::function<void(Response)> cb);
+  FetchAwaiter FetchAsync(Request req);
+  size_t GetInflight() const { return transfer_map.size(); }
+  size_t GetInflight(const std::string &owner) const;
+};
+
+class FetchAwaiter {
+  Engine &e;
+  Request req;
+  std::optional<Response> res;
+
+ public:
+  FetchAwaiter(Engine &e, Request req) : e(e), req(std::move(req)) {}
+  bool await_ready() const noexcept { return false; }
+  bool await_suspend(std::coroutine_handle<> h);
+  Response await_resume() { return std::move(*res); }
+};
+
+}  // namespace http
+}  // namespace kbot
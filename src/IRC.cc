@@ -7,10 +7,15 @@
 #include <unistd.h>
 
 #include <IRC.hh>
-#include <cassert>
+#include <Trace.hh>
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
 #include <cstring>
 #include <iostream>
 #include <memory>
+#include <optional>
 #include <string>
 #include <string_view>
 #include <type_traits>
@@ -30,8 +35,10 @@ constexpr const char *IRC::StateToString(enum IRCService s) {
   return IRCServiceStringTable[static_cast<int>(s)];
 }
 
+// Servers supporting capabilities hold registration until CAP END, see BuiltinCap
 ssize_t IRC::Login(std::string_view nickname, std::string_view password) const {
   ssize_t fail = 0;
+  if (auto r = Cap("LS 302"); r < 0) fail = r;
   std::string buf = fmt::format("\rUSER {} 0 * :{}\r\n", nickname, nickname);
   auto r = SendMsg(buf);
   if (r < 0) {
@@ -58,6 +65,41 @@ ssize_t IRC::Nick(std::string_view nickname) const {
   return r;
 }
 
+ssize_t IRC::Whois(std::string_view nickname) const {
+  std::string buf = fmt::format("\rWHOIS {}\r\n", nickname);
+  auto r = SendMsg(buf);
+  if (r < 0) PLOG(ERROR) << "Failed to send WHOIS message";
+  return r;
+}
+
+ssize_t IRC::Ping(std::string_view token) const {
+  std::string buf = fmt::format("\rPING :{}\r\n", token);
+  auto r = SendMsg(buf);
+  if (r < 0) PLOG(ERROR) << "Failed to send PING message";
+  return r;
+}
+
+ssize_t IRC::Pong(std::string_view token) const {
+  std::string buf = fmt::format("\rPONG :{}\r\n", token);
+  auto r = SendMsg(buf);
+  if (r < 0) PLOG(ERROR) << "Failed to send PONG message";
+  return r;
+}
+
+ssize_t IRC::Cap(std::string_view params) const {
+  std::string buf = fmt::format("\rCAP {}\r\n", params);
+  auto r = SendMsg(buf);
+  if (r < 0) PLOG(ERROR) << "Failed to send CAP message";
+  return r;
+}
+
+ssize_t IRC::Authenticate(std::string_view param) const {
+  std::string buf = fmt::format("\rAUTHENTICATE {}\r\n", param);
+  auto r = SendMsg(buf);
+  if (r < 0) PLOG(ERROR) << "Failed to send AUTHENTICATE message";
+  return r;
+}
+
 ssize_t IRC::Join(std::string_view channel) const {
   std::string buf = fmt::format("\rJOIN {}\r\n", channel);
   auto r = SendMsg(buf);
@@ -98,16 +140,23 @@ ssize_t IRC::Quit(std::string_view msg) const {
 }
 
 ssize_t IRC::SendMsg(std::string_view msg) const {
-  auto r = send(fd, msg.data(), msg.size(), MSG_NOSIGNAL);
+  auto r = send_sink ? send_sink(msg) : send(fd, msg.data(), msg.size(), MSG_NOSIGNAL);
   if (r < 0) {
     PLOG(ERROR) << "Failed to send data";
+  } else {
+    KBOT_TRACE_POINT(send_msg, r);
+    sent_msgs.fetch_add(1, std::memory_order_relaxed);
+    sent_bytes.fetch_add(static_cast<uint64_t>(r), std::memory_order_relaxed);
   }
   return r;
 }
 
-std::string IRC::RecvMsg() const {
-  std::string buf;
-  size_t r = 0;
+std::optional<std::string> IRC::RecvMsg() const {
+  // Lines may arrive in any number of pieces, start with what the last call kept of one
+  std::string buf = std::move(recv_partial);
+  recv_partial.clear();
+  size_t r = buf.size();
+  size_t received = 0;
   int tries = 5;
   do {
     buf.resize(r + 4096);
@@ -115,23 +164,28 @@ std::string IRC::RecvMsg() const {
     if (p < 0) {
       if (errno != EAGAIN) {
         PLOG(ERROR) << "Failed to receive data";
-        return "";
+        return std::nullopt;
       }
-      if (r)
-        break;
-      else
-        return "";
+      break;
     } else if (p == 0) {
-      return "";
+      // Closed, the next call tells once what came before is processed. A line cut short by
+      // the close is dropped.
+      if (received) break;
+      return std::nullopt;
     }
     r += static_cast<size_t>(p);
+    received += static_cast<size_t>(p);
   } while (buf[r - 1] != '\n' && tries--);
-  // Discard remaining buffer if all tries failed
-  if (buf[r - 1] != '\n') {
-    while (--r && buf[r - 1] != '\n')
-      ;
-  }
   buf.resize(r);
+  // Keep an incomplete last line for the next call, unless it's longer than any server sends
+  auto end = buf.rfind('\n') + 1;
+  if (r - end <= kMaxPartialLine) {
+    recv_partial.assign(buf, end);
+  } else {
+    LOG(WARNING) << "Discarding " << r - end << " bytes without a line ending";
+  }
+  buf.resize(end);
+  KBOT_TRACE_POINT(recv_msg, end);
   return buf;
 }
 
@@ -150,6 +204,8 @@ constexpr uint64_t GetCommandMaskAsUint(std::string_view command) {
   uint64_t mask = 0;
   if (command.size() <= 8) {
     for (size_t i = 0; i < command.size(); i++) {
+      // A NUL would make "PING\0" look like "PING", no command has one
+      if (!*p) return 0;
       mask |= static_cast<uint64_t>(static_cast<unsigned char>(*p++) & 0xff) << (i * 8);
     }
   }
@@ -172,12 +228,27 @@ IRCMessageType GetSetIRCMessageType(IRCMessage &m) {
       return m.message_type = IRCMessageType::PART;
     case GetCommandMaskAsUint("PRIVMSG"):
       return m.message_type = IRCMessageType::PRIVMSG;
+    case GetCommandMaskAsUint("CAP"):
+      return m.message_type = IRCMessageType::CAP;
+    case GetCommandMaskAsUint("BATCH"):
+      return m.message_type = IRCMessageType::BATCH;
+    case GetCommandMaskAsUint("PONG"):
+      return m.message_type = IRCMessageType::PONG;
     case GetCommandMaskAsUint("KILL"):
     case GetCommandMaskAsUint("QUIT"):
       return m.message_type = IRCMessageType::QUIT;
-    default:
-      return m.message_type = IRCMessageType::_DEFAULT;
+    default: {
+      // Too long for a mask
+      auto c = m.GetCommand();
+      if (c == "AUTHENTICATE") return m.message_type = IRCMessageType::AUTHENTICATE;
+      auto digit = [](char d) { return d >= '0' && d <= '9'; };
+      if (c.size() == 3 && std::all_of(c.begin(), c.end(), digit)) {
+        return m.message_type = IRCMessageType::NUMERIC;
+      }
+      break;
+    }
   }
+  return m.message_type = IRCMessageType::_DEFAULT;
 }
 
 IRCMessageVariant GetIRCMessageVariantFrom(IRCMessage &&m) {
@@ -188,7 +259,8 @@ IRCMessageVariant GetIRCMessageVariantFrom(IRCMessage &&m) {
       return mv;
       // case IRCMessageType::LOGIN:
     case IRCMessageType::NICK:
-      assert(Message::IsUserMessage(m.GetSource()));
+      // Only users change nicknames, anything else is left to plugins as it is
+      if (!Message::IsUserMessage(m.GetSource())) break;
       mv.emplace<IRCMessageNick>(std::move(m));
       return mv;
     case IRCMessageType::JOIN:
@@ -198,7 +270,8 @@ IRCMessageVariant GetIRCMessageVariantFrom(IRCMessage &&m) {
       mv.emplace<IRCMessagePart>(std::move(m));
       return mv;
     case IRCMessageType::PRIVMSG:
-      assert(!Message::IsServerMessage(m.GetSource()));
+      // From the server itself (e.g. announcements), or without a source
+      if (Message::IsServerMessage(m.GetSource())) break;
       if (!Message::IsQuitMessage(m)) {
         mv.emplace<IRCMessagePrivMsg>(std::move(m));
         return mv;
@@ -207,10 +280,279 @@ IRCMessageVariant GetIRCMessageVariantFrom(IRCMessage &&m) {
     case IRCMessageType::QUIT:
       mv.emplace<IRCMessageQuit>();
       return mv;
-    default:
-      mv.emplace<IRCMessage>(std::move(m));
+    case IRCMessageType::CAP:
+      if (m.GetParameters().size() < 2) break;
+      mv.emplace<IRCMessageCap>(std::move(m));
+      return mv;
+    case IRCMessageType::BATCH:
+      if (m.GetParameters()[0].size() < 2) break;
+      mv.emplace<IRCMessageBatch>(std::move(m));
+      return mv;
+    case IRCMessageType::AUTHENTICATE:
+      mv.emplace<IRCMessageAuthenticate>(std::move(m));
       return mv;
+    case IRCMessageType::NUMERIC:
+      mv.emplace<IRCMessageNumeric>(std::move(m));
+      return mv;
+    case IRCMessageType::PONG:
+      if (m.GetParameters().empty()) break;
+      mv.emplace<IRCMessagePong>(std::move(m));
+      return mv;
+    default:
+      break;
+  }
+  mv.emplace<IRCMessage>(std::move(m));
+  return mv;
+}
+
+std::optional<std::string_view> IRCMessage::GetTag(std::string_view key, std::string &buf) const {
+  // The last one wins
+  for (auto it = tag_kv.rbegin(); it != tag_kv.rend(); ++it) {
+    if (it->first == key) return Message::UnescapeTagValue(it->second, buf);
+  }
+  return std::nullopt;
+}
+
+std::optional<std::chrono::system_clock::time_point> IRCMessage::GetServerTime() const {
+  std::string buf;
+  auto tag = GetTag("time", buf);
+  if (!tag) return std::nullopt;
+  // YYYY-MM-DDThh:mm:ss[.sss]Z
+  std::string_view t = *tag;
+  if (t.size() < 20 || t.back() != 'Z') return std::nullopt;
+  auto field = [t](size_t pos, size_t len, int &out) {
+    auto end = t.data() + pos + len;
+    auto [p, ec] = std::from_chars(t.data() + pos, end, out);
+    return ec == std::errc() && p == end && out >= 0;
+  };
+  int y, mo, d, h, mi, s, ms = 0;
+  if (!field(0, 4, y) || t[4] != '-' || !field(5, 2, mo) || t[7] != '-' || !field(8, 2, d) ||
+      t[10] != 'T' || !field(11, 2, h) || t[13] != ':' || !field(14, 2, mi) || t[16] != ':' ||
+      !field(17, 2, s)) {
+    return std::nullopt;
   }
+  if (t.size() > 20) {
+    // Fraction of a second, to millisecond precision
+    auto fraction = t.substr(20, t.size() - 21);
+    auto digit = [](char c) { return c >= '0' && c <= '9'; };
+    if (t[19] != '.' || fraction.empty() ||
+        !std::all_of(fraction.begin(), fraction.end(), digit)) {
+      return std::nullopt;
+    }
+    field(20, std::min<size_t>(fraction.size(), 3), ms);
+    for (size_t i = fraction.size(); i < 3; i++) ms *= 10;
+  }
+  std::chrono::year_month_day ymd{std::chrono::year(y), std::chrono::month(mo),
+                                  std::chrono::day(d)};
+  if (!ymd.ok() || h > 23 || mi > 59 || s > 60) return std::nullopt;
+  // system_clock counts nanoseconds, which run out in 2262
+  if (y < 1970 || y > 2261) return std::nullopt;
+  return std::chrono::sys_days(ymd) + std::chrono::hours(h) + std::chrono::minutes(mi) +
+         std::chrono::seconds(s) + std::chrono::milliseconds(ms);
+}
+
+namespace Message {
+
+std::optional<PrivMsgView> PeekPrivMsg(std::string_view line) {
+  if (line.starts_with('@')) {
+    auto i = line.find(' ');
+    if (i == line.npos || i == 1) return std::nullopt;
+    line.remove_prefix(i + 1);
+  }
+  if (!line.starts_with(':')) return std::nullopt;
+  auto i = line.find(' ');
+  auto bang = line.substr(0, i).find('!');
+  if (i == line.npos || bang == line.npos) return std::nullopt;
+  std::string_view nickname = line.substr(1, bang - 1);
+  line.remove_prefix(i + 1);
+  if (!line.starts_with("PRIVMSG ")) return std::nullopt;
+  line.remove_prefix(sizeof("PRIVMSG ") - 1);
+  i = line.find(' ');
+  if (i == 0 || i == line.npos) return std::nullopt;
+  std::string_view target = line.substr(0, i);
+  i = line.find_first_not_of(' ', i);
+  if (i == line.npos) return std::nullopt;
+  line.remove_prefix(i);
+  std::string_view word = line.substr(0, line.find(' '));
+  if (line.starts_with(':')) line.remove_prefix(1);
+  return PrivMsgView{nickname, target, word, line};
+}
+
+std::string_view PeekCommand(std::string_view line) {
+  for (char c : {'@', ':'}) {
+    if (!line.starts_with(c)) continue;
+    auto i = line.find(' ');
+    if (i == line.npos) return {};
+    line.remove_prefix(i + 1);
+  }
+  return line.substr(0, line.find(' '));
+}
+
+std::optional<std::string_view> PeekTag(std::string_view line, std::string_view key) {
+  if (!line.starts_with('@')) return std::nullopt;
+  std::string_view tags = line.substr(1, line.find(' ') - 1);
+  std::optional<std::string_view> value;
+  while (!tags.empty()) {
+    auto item = tags.substr(0, tags.find(';'));
+    tags.remove_prefix(std::min(item.size() + 1, tags.size()));
+    if (!item.starts_with(key)) continue;
+    if (item.size() == key.size()) {
+      value = std::string_view();
+    } else if (item[key.size()] == '=') {
+      value = item.substr(key.size() + 1);
+    }
+  }
+  return value;
+}
+
+std::string_view UnescapeTagValue(std::string_view value, std::string &buf) {
+  if (value.find('\\') == value.npos) return value;
+  buf.clear();
+  for (size_t i = 0; i < value.size(); i++) {
+    if (value[i] != '\\') {
+      buf.push_back(value[i]);
+      continue;
+    }
+    // A trailing backslash is dropped, unknown escapes stand for the character itself
+    if (++i == value.size()) break;
+    switch (value[i]) {
+      case ':':
+        buf.push_back(';');
+        break;
+      case 's':
+        buf.push_back(' ');
+        break;
+      case 'r':
+        buf.push_back('\r');
+        break;
+      case 'n':
+        buf.push_back('\n');
+        break;
+      default:
+        buf.push_back(value[i]);
+    }
+  }
+  return buf;
+}
+
+std::vector<std::string> PackJoins(std::span<const std::pair<std::string, std::string>> channels,
+                                   size_t line_limit, size_t max_targets) {
+  std::vector<const std::pair<std::string, std::string> *> order;
+  for (auto &c : channels) order.push_back(&c);
+  std::stable_partition(order.begin(), order.end(), [](auto *c) { return !c->second.empty(); });
+
+  std::vector<std::string> v;
+  std::string chans, keys;
+  size_t count = 0;
+  auto flush = [&] {
+    if (chans.empty()) return;
+    v.push_back(keys.empty() ? std::move(chans) : fmt::format("{} {}", chans, keys));
+    chans.clear();
+    keys.clear();
+    count = 0;
+  };
+  constexpr size_t kOverhead = sizeof("JOIN ") - 1 + sizeof("\r\n") - 1;
+  for (auto *c : order) {
+    auto &[name, key] = *c;
+    size_t size = kOverhead + chans.size() + !chans.empty() + name.size();
+    if (!keys.empty() || !key.empty()) size += 1 + keys.size() + !keys.empty() + key.size();
+    // One that doesn't fit even alone gets a line of its own, for the server to refuse
+    if ((size > line_limit || (max_targets && count == max_targets)) && count) flush();
+    if (!chans.empty()) chans.push_back(',');
+    chans += name;
+    if (!key.empty()) {
+      if (!keys.empty()) keys.push_back(',');
+      keys += key;
+    }
+    count++;
+  }
+  flush();
+  return v;
+}
+
+std::vector<std::string_view> SplitUtf8(std::string_view text, size_t max_size) {
+  std::vector<std::string_view> v;
+  max_size = std::max<size_t>(max_size, 4);
+  while (text.size() > max_size) {
+    size_t end = max_size;
+    // Back to the start of the sequence the cut falls in, unless it isn't valid UTF-8
+    for (int i = 0; i < 3 && (static_cast<unsigned char>(text[end]) & 0xc0) == 0x80; i++) end--;
+    if ((static_cast<unsigned char>(text[end]) & 0xc0) == 0x80) end = max_size;
+    // Words stay whole if that doesn't waste more than a quarter of the line
+    if (auto space = text.rfind(' ', end - 1); space != text.npos && space >= end - end / 4) {
+      end = space + 1;
+    }
+    v.push_back(text.substr(0, end));
+    text.remove_prefix(end);
+  }
+  v.push_back(text);
+  return v;
 }
 
+std::vector<std::string> PackPrivMsgs(std::span<const std::string_view> targets,
+                                      std::string_view text, size_t line_limit,
+                                      size_t max_targets) {
+  constexpr size_t kOverhead = sizeof("PRIVMSG ") - 1 + sizeof(" :") - 1 + sizeof("\r\n") - 1;
+  size_t avail = line_limit > kOverhead ? line_limit - kOverhead : 0;
+  // An empty name can't go in a target list, and without any there is nothing to send
+  std::vector<std::string_view> names;
+  size_t longest = 0, list_size = 0;
+  for (auto t : targets) {
+    if (t.empty()) continue;
+    names.push_back(t);
+    longest = std::max(longest, t.size());
+    list_size += t.size() + 1;
+  }
+  if (names.empty()) return {};
+  // Text that doesn't fit along with any one target is split, in as many pieces as makes for the
+  // fewest lines: shorter pieces leave room for more targets per line
+  size_t piece_size = text.size();
+  if (text.size() + longest > avail) {
+    piece_size = avail / 2;
+    size_t fewest = SIZE_MAX;
+    for (size_t n = 2; n <= text.size(); n++) {
+      size_t size = (text.size() + n - 1) / n;
+      // Leave room for at least one byte of targets
+      if (size + longest >= avail) continue;
+      size_t groups = (list_size + avail - size - 1) / (avail - size);
+      if (max_targets) groups = std::max(groups, (names.size() + max_targets - 1) / max_targets);
+      if (n * groups < fewest) {
+        fewest = n * groups;
+        piece_size = size;
+      }
+      // More pieces can't take fewer lines from here on
+      if (groups == 1) break;
+    }
+  }
+  auto pieces = SplitUtf8(text, piece_size);
+  size_t longest_piece = 0;
+  for (auto p : pieces) longest_piece = std::max(longest_piece, p.size());
+  size_t target_budget = avail > longest_piece ? avail - longest_piece : 0;
+
+  std::vector<std::string> v;
+  std::string list;
+  size_t count = 0;
+  auto flush = [&] {
+    if (list.empty()) return;
+    for (auto p : pieces) v.push_back(fmt::format("{} :{}", list, p));
+    list.clear();
+    count = 0;
+  };
+  for (auto t : names) {
+    // One that doesn't fit even alone gets a line of its own
+    if ((list.size() + !list.empty() + t.size() > target_budget ||
+         (max_targets && count == max_targets)) &&
+        count) {
+      flush();
+    }
+    if (!list.empty()) list.push_back(',');
+    list += t;
+    count++;
+  }
+  flush();
+  return v;
+}
+
+}  // namespace Message
+
 }  // namespace kbot
@@ -3,12 +3,19 @@
 #include <glog/logging.h>
 #include <sys/types.h>
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <chrono>
 #include <cstring>
+#include <functional>
 #include <iostream>
+#include <optional>
+#include <span>
 #include <stdexcept>
 #include <string>
 #include <string_view>
+#include <utility>
 #include <variant>
 #include <vector>
 
@@ -19,6 +26,7 @@ enum IRCUserCapability : uint64_t {
   kPart = (1ULL << 1),
   kJoin = (1ULL << 2),
   kNickModify = (1ULL << 3),
+  kConfigure = (1ULL << 4),
   kMax = UINT64_MAX,
 };
 
@@ -33,20 +41,53 @@ inline constexpr const char *const IRCServiceStringTable[IRCServiceMax] = {
     "Atheme IRC Services",
 };
 
+// IRCv3 capabilities we make use of, requested during registration when the server offers them
+enum IRCCapability : uint32_t {
+  kCapMessageTags = (1U << 0),
+  kCapServerTime = (1U << 1),
+  kCapBatch = (1U << 2),
+  kCapMultiPrefix = (1U << 3),
+  kCapEchoMessage = (1U << 4),
+  kCapAccountTag = (1U << 5),
+  kCapSasl = (1U << 6),
+};
+
+inline constexpr std::pair<std::string_view, IRCCapability> IRCCapabilityTable[] = {
+    {"message-tags", kCapMessageTags}, {"server-time", kCapServerTime},
+    {"batch", kCapBatch},              {"multi-prefix", kCapMultiPrefix},
+    {"echo-message", kCapEchoMessage}, {"account-tag", kCapAccountTag},
+    {"sasl", kCapSasl},
+};
+
 // Low-level API to interact with the IRC server
 
 class IRC {
   const enum IRCService service_type = IRCService::kAtheme;
 
+ protected:
+  // Received past the last line ending, see RecvMsg
+  mutable std::string recv_partial;
+  // Message tags may take 8191 bytes, and the rest of the line 512
+  static constexpr size_t kMaxPartialLine = 8192 + 512;
+
  public:
   int fd = -1;
+  // Outbound accounting, read by the metrics listener from another thread
+  mutable std::atomic<uint64_t> sent_msgs = 0;
+  mutable std::atomic<uint64_t> sent_bytes = 0;
+  // When set, outbound messages are handed to the sink instead of the socket (see PluginHost)
+  std::function<ssize_t(std::string_view)> send_sink;
   explicit IRC(int sockfd);
   IRC(const IRC &) = delete;
   IRC &operator=(IRC &) = delete;
-  IRC(IRC &&i) { fd = std::exchange(i.fd, -1); }
+  IRC(IRC &&i) { *this = std::move(i); }
   IRC &operator=(IRC &&i) {
     if (this != &i) {
       fd = std::exchange(i.fd, -1);
+      send_sink = std::move(i.send_sink);
+      recv_partial = std::move(i.recv_partial);
+      sent_msgs.store(i.sent_msgs.load(std::memory_order_relaxed), std::memory_order_relaxed);
+      sent_bytes.store(i.sent_bytes.load(std::memory_order_relaxed), std::memory_order_relaxed);
     }
     return *this;
   }
@@ -59,9 +100,17 @@ class IRC {
   ssize_t Part(std::string_view channel) const;
   ssize_t PrivMsg(std::string_view recipient, std::string_view msg) const;
   ssize_t Quit(std::string_view msg = "") const;
+  ssize_t Whois(std::string_view nickname) const;
+  ssize_t Ping(std::string_view token) const;
+  ssize_t Pong(std::string_view token) const;
+  // params as they follow CAP, e.g. "REQ :batch server-time"
+  ssize_t Cap(std::string_view params) const;
+  ssize_t Authenticate(std::string_view param) const;
   // Low-level API
   ssize_t SendMsg(std::string_view msg) const;
-  std::string RecvMsg() const;
+  // Complete lines received, empty when there is nothing to read (or only part of a line),
+  // std::nullopt once the connection is closed or broken
+  std::optional<std::string> RecvMsg() const;
   // Friends/Misc
   friend std::ostream &operator<<(std::ostream &o, const IRC &i);
 
@@ -75,6 +124,9 @@ struct IRCUser {
   std::string_view nickname;
   std::string_view hostname;
   std::string_view username;
+  // Services account, empty when unknown or not logged in. Only Server::GetInvoker fills it in,
+  // from the account tag, and only when account-tag is enabled on the connection.
+  std::string_view account;
 };
 
 // Destructured raw IRC message
@@ -88,9 +140,19 @@ enum class IRCMessageType : uint8_t {
   PART,
   PRIVMSG,
   QUIT,
+  CAP,
+  BATCH,
+  AUTHENTICATE,
+  NUMERIC,
+  PONG,
 };
 
 class IRCMessage {
+  [[noreturn]] void Fail(const char *why) const {
+    DLOG(ERROR) << "Failure: " << why << " (" << line << ')';
+    throw std::runtime_error(std::string("IRCMessage parsing error: ") + why);
+  }
+
  protected:
   std::string line;
   std::string_view tags;
@@ -102,50 +164,43 @@ class IRCMessage {
  public:
   IRCMessageType message_type = IRCMessageType::_DEFAULT;
 
-  explicit IRCMessage(std::string_view l, IRCMessageType t = IRCMessageType::_DEFAULT) try
+  // Throws std::runtime_error for malformed lines. Lines are taken as they are, bytes like NUL
+  // included, everything past a position is checked against the size of the line.
+  explicit IRCMessage(std::string_view l, IRCMessageType t = IRCMessageType::_DEFAULT)
       : line(l), message_type(t) {
     size_t i = 0, prev = 0;
-    if (line[i] == '@') {
+    if (line.starts_with('@')) {
       prev = i + 1;
       i = line.find(' ', prev);
-      if (i == line.npos) {
-        throw "No command present";
-      }
+      if (i == line.npos) Fail("No command present");
       tags = std::string_view(&line[prev], &line[i++]);
-      size_t i, prev = 0;
-      while ((i = tags.find('=', prev)) != tags.npos) {
-        std::string_view key(&tags[prev], &tags[i]), val;
-        prev = i + 1;
-        i = tags.find(';', prev);
-        val = std::string_view(&tags[prev], &tags[i == tags.npos ? tags.size() : i]);
-        tag_kv.push_back({key, val});
-        if (i == tags.npos)
-          break;
-        else
-          prev = i + 1;
+      if (tags.empty()) Fail("Malformed tag");
+      // key[=value] separated by ';', values stay escaped until GetTag
+      for (std::string_view rest = tags; !rest.empty();) {
+        auto item = rest.substr(0, rest.find(';'));
+        rest.remove_prefix(std::min(item.size() + 1, rest.size()));
+        if (item.empty()) continue;
+        auto eq = item.find('=');
+        tag_kv.push_back({item.substr(0, eq),
+                          eq == item.npos ? std::string_view() : item.substr(eq + 1)});
       }
-      if (!prev) throw "Malformed tag";
     }
-    if (line[i] == ':') {
+    if (i < line.size() && line[i] == ':') {
       prev = i + 1;
       i = line.find(' ', prev);
-      if (i == line.npos) {
-        throw "No command present";
-      }
+      if (i == line.npos) Fail("No command present");
       source = std::string_view(&line[prev], &line[i++]);
     }
     if (source != "" && source.find('!') == source.npos &&
         message_type == IRCMessageType::PRIVMSG) {
-      throw std::runtime_error("Bad source: Server message");
+      Fail("Bad source: Server message");
     }
-    if (line[i] != '\0') {
+    if (i < line.size()) {
       prev = i;
       i = line.find(' ', prev);
-      if (i == line.npos) {
-        throw "No parameter present";
-      }
+      if (i == line.npos) Fail("No parameter present");
       command = std::string_view(&line[prev], &line[i++]);
-      if (command == "") throw "No command present";
+      if (command == "") Fail("No command present");
     }
     prev = i;
     while (prev != line.npos) {
@@ -155,26 +210,44 @@ class IRCMessage {
       if (i == line.npos) break;
       prev = line.find_first_not_of(' ', i + 1);
     }
-    if (param_vec.size() == 0 || param_vec[0] == "") throw "Bad parameter present";
+    if (param_vec.size() == 0 || param_vec[0] == "") Fail("Bad parameter present");
     line.shrink_to_fit();
     param_vec.shrink_to_fit();
     tag_kv.shrink_to_fit();
-  } catch (const char *e) {
-    DLOG(ERROR) << "Failure: " << e << " (" << l << ')';
-    throw std::runtime_error("IRCMessage parsing error");
   }
 
   IRCMessage(const IRCMessage &) = delete;
   IRCMessage &operator=(IRCMessage &) = delete;
-  IRCMessage(IRCMessage &&) = default;
+  // The views point into line, which may live in the SSO buffer, so rebase them onto the new one
+  IRCMessage(IRCMessage &&m) noexcept : message_type(m.message_type) {
+    const char *old = m.line.data();
+    line = std::move(m.line);
+    auto rebase = [old, this](std::string_view v) {
+      return v.data() ? std::string_view(line.data() + (v.data() - old), v.size()) : v;
+    };
+    tags = rebase(m.tags);
+    source = rebase(m.source);
+    command = rebase(m.command);
+    tag_kv = std::move(m.tag_kv);
+    for (auto &kv : tag_kv) kv = {rebase(kv.first), rebase(kv.second)};
+    param_vec = std::move(m.param_vec);
+    for (auto &sv : param_vec) sv = rebase(sv);
+  }
   IRCMessage &operator=(IRCMessage &&) = delete;
   ~IRCMessage() = default;
 
+  std::string_view GetLine() const { return line; }
+
   std::string_view GetTags() const { return tags; }
 
   const std::vector<std::pair<std::string_view, std::string_view>> &GetTagKV() const {
     return tag_kv;
   }
+  // Value of the tag, empty for one without a value and std::nullopt if absent. Escapes are only
+  // undone when present, into buf, so the result is usually a view into the line.
+  std::optional<std::string_view> GetTag(std::string_view key, std::string &buf) const;
+  // When the server received the message, from the server-time tag
+  std::optional<std::chrono::system_clock::time_point> GetServerTime() const;
 
   std::string_view GetSource() const { return source; }
 
@@ -215,13 +288,20 @@ class IRCMessageNick : public IRCMessage {
 class IRCMessageJoin : public IRCMessage {
  public:
   IRCMessageJoin(IRCMessage &&m) : IRCMessage(std::move(m)) {}
-  std::string_view GetChannel() const { return param_vec.at(0); }
+  // Some servers send it as a trailing parameter
+  std::string_view GetChannel() const {
+    auto c = param_vec.at(0);
+    return c.starts_with(':') ? c.substr(1) : c;
+  }
 };
 
 class IRCMessagePart : public IRCMessage {
  public:
   IRCMessagePart(IRCMessage &&m) : IRCMessage(std::move(m)) {}
-  std::string_view GetChannel() const { return param_vec.at(0); }
+  std::string_view GetChannel() const {
+    auto c = param_vec.at(0);
+    return c.starts_with(':') ? c.substr(1) : c;
+  }
 };
 
 class IRCMessagePrivMsg : public IRCMessage {
@@ -231,6 +311,14 @@ class IRCMessagePrivMsg : public IRCMessage {
     assert(param_vec.size() >= 1);
   }
   IRCUser GetUser() const { return Message::ParseSourceUser(source); }
+  // Whoever sent the line may have made it up if the server didn't enable account-tag
+  std::string_view GetAccountTag() const {
+    for (auto &[k, v] : tag_kv) {
+      // Account names can't contain anything that would be escaped
+      if (k == "account") return v;
+    }
+    return {};
+  }
   std::string_view GetChannel() const { return param_vec.at(0); }
   std::string_view GetUserCommand() const { return param_vec.at(1); }
   std::vector<std::string_view> GetUserCommandParameters() const {
@@ -242,16 +330,74 @@ class IRCMessagePrivMsg : public IRCMessage {
   }
 };
 
+class IRCMessageCap : public IRCMessage {
+ public:
+  IRCMessageCap(IRCMessage &&m) : IRCMessage(std::move(m)) {}
+  // LS, LIST, ACK, NAK, NEW or DEL
+  std::string_view GetSubcommand() const { return param_vec.at(1); }
+  // More lines of an LS or LIST reply follow
+  bool IsContinued() const { return param_vec.size() > 3 && param_vec[2] == "*"; }
+  // As sent, i.e. with values (name=value) in LS and modifiers ('-' to disable) in ACK
+  std::vector<std::string_view> GetCapabilities() const {
+    std::vector<std::string_view> v;
+    for (size_t i = IsContinued() ? 3 : 2; i < param_vec.size(); i++) {
+      auto c = param_vec[i];
+      if (c.starts_with(':')) c.remove_prefix(1);
+      if (!c.empty()) v.push_back(c);
+    }
+    return v;
+  }
+};
+
+class IRCMessageBatch : public IRCMessage {
+ public:
+  IRCMessageBatch(IRCMessage &&m) : IRCMessage(std::move(m)) {}
+  // BATCH +<reference> <type> [params...] opens a batch, BATCH -<reference> closes it
+  bool IsStart() const { return param_vec.at(0).starts_with('+'); }
+  std::string_view GetReference() const { return param_vec.at(0).substr(1); }
+  std::string_view GetType() const { return param_vec.size() > 1 ? param_vec[1] : ""; }
+};
+
+class IRCMessageAuthenticate : public IRCMessage {
+ public:
+  IRCMessageAuthenticate(IRCMessage &&m) : IRCMessage(std::move(m)) {}
+  // Base64 chunk of the server's challenge, "+" when empty
+  std::string_view GetPayload() const { return param_vec.at(0); }
+};
+
+// Three digit replies, the first parameter is our nickname (or '*' before registration)
+class IRCMessageNumeric : public IRCMessage {
+ public:
+  IRCMessageNumeric(IRCMessage &&m) : IRCMessage(std::move(m)) {}
+  int GetNumeric() const {
+    return (command[0] - '0') * 100 + (command[1] - '0') * 10 + (command[2] - '0');
+  }
+};
+
+// Answer to a PING of ours, "PONG <server> :<token>" (or just the token)
+class IRCMessagePong : public IRCMessage {
+ public:
+  IRCMessagePong(IRCMessage &&m) : IRCMessage(std::move(m)) {}
+  std::string_view GetToken() const {
+    auto t = param_vec.back();
+    return t.starts_with(':') ? t.substr(1) : t;
+  }
+};
+
 struct IRCMessageQuit {};
 
 // Predicate functions
 
 namespace Message {
 
-inline bool IsUserCapable(const IRCUser &u, const uint64_t cap_mask) {
+// admin_account is the services account of the admin on this network, if any
+inline bool IsUserCapable(const IRCUser &u, const uint64_t cap_mask,
+                          std::string_view admin_account = {}) {
   // TODO: store admins to a persistent DB
   static uint64_t kkd_cap_mask = UINT64_MAX;
-  if (u.nickname == "kkd" && u.username == "~memxor" && u.hostname == "unaffiliated/kartikeya") {
+  // The account is known without asking services when the server sends account tags
+  if ((!admin_account.empty() && u.account == admin_account) ||
+      (u.nickname == "kkd" && u.username == "~memxor" && u.hostname == "unaffiliated/kartikeya")) {
     if ((kkd_cap_mask & cap_mask) != 0) return true;
   }
   return false;
@@ -284,6 +430,40 @@ inline bool IsPrivMsgMessage(const IRCMessage &m) {
   return true;
 }
 
+// The parts of a PRIVMSG from a user that decide whether it is a command, as views into the line
+struct PrivMsgView {
+  std::string_view nickname;
+  std::string_view target;
+  // First word of the text, with the leading ':' like the parameter IRCMessage produces
+  std::string_view word;
+  // All of it, without the ':'
+  std::string_view text;
+};
+
+// Recognizes a PRIVMSG from a user on the raw line, without allocating. Returns std::nullopt for
+// other lines and for anything the full parse may reject, so those keep taking that path.
+std::optional<PrivMsgView> PeekPrivMsg(std::string_view line);
+// The command, or the value of a tag (still escaped), again on the raw line
+std::string_view PeekCommand(std::string_view line);
+std::optional<std::string_view> PeekTag(std::string_view line, std::string_view key);
+// Undoes the escapes of IRCv3 message-tags, returns value itself if there are none
+std::string_view UnescapeTagValue(std::string_view value, std::string &buf);
+// Packs (channel, key) pairs into the parameters of as few JOIN lines as fit line_limit bytes
+// (with "JOIN " and CRLF) and max_targets channels each (0 for any number), e.g. "#a,#b key".
+// Channels with keys go first in each line, so that the keys line up with them.
+std::vector<std::string> PackJoins(std::span<const std::pair<std::string, std::string>> channels,
+                                   size_t line_limit, size_t max_targets);
+// Splits text into pieces of at most max_size bytes, never inside a UTF-8 sequence and after a
+// space where one is near the end. Empty text is one empty piece.
+std::vector<std::string_view> SplitUtf8(std::string_view text, size_t max_size);
+// Packs the same message to many targets into the parameters of as few PRIVMSG lines as fit
+// line_limit bytes (with "PRIVMSG " and CRLF) and max_targets targets each, e.g. "#a,#b :text".
+// Text too long for one line is split with SplitUtf8, each group of targets gets all pieces in
+// turn.
+std::vector<std::string> PackPrivMsgs(std::span<const std::string_view> targets,
+                                      std::string_view text, size_t line_limit,
+                                      size_t max_targets);
+
 inline IRCUser ParseSourceUser(std::string_view source) {
   if (!Message::IsUserMessage(source)) {
     throw std::runtime_error("Source parameter is not a valid IRCUser specification");
@@ -311,7 +491,8 @@ inline IRCUser ParseSourceUser(std::string_view source) {
 
 using IRCMessageVariant =
     std::variant<std::monostate, IRCMessage, IRCMessagePing, IRCMessageNick, IRCMessageJoin,
-                 IRCMessagePart, IRCMessagePrivMsg, IRCMessageQuit>;
+                 IRCMessagePart, IRCMessagePrivMsg, IRCMessageCap, IRCMessageBatch,
+                 IRCMessageAuthenticate, IRCMessageNumeric, IRCMessagePong, IRCMessageQuit>;
 
 IRCMessageType GetSetIRCMessageType(IRCMessage &m);
 IRCMessageVariant GetIRCMessageVariantFrom(IRCMessage &&m);
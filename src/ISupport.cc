@@ -0,0 +1,144 @@
+#include <ISupport.hh>
+#include <algorithm>
+#include <charconv>
+#include <string>
+#include <string_view>
+
+namespace kbot {
+
+namespace casefold {
+
+std::optional<CaseMapping> ParseMapping(std::string_view name) {
+  if (name == "ascii") return CaseMapping::kAscii;
+  if (name == "rfc1459") return CaseMapping::kRfc1459;
+  if (name == "strict-rfc1459") return CaseMapping::kStrictRfc1459;
+  return std::nullopt;
+}
+
+std::string_view MappingName(CaseMapping mapping) {
+  switch (mapping) {
+    case CaseMapping::kAscii:
+      return "ascii";
+    case CaseMapping::kRfc1459:
+      return "rfc1459";
+    case CaseMapping::kStrictRfc1459:
+      return "strict-rfc1459";
+  }
+  return "";
+}
+
+std::string Fold(CaseMapping mapping, std::string_view s) {
+  auto &table = GetTable(mapping);
+  std::string out(s);
+  for (auto &c : out) c = static_cast<char>(table[static_cast<unsigned char>(c)]);
+  return out;
+}
+
+}  // namespace casefold
+
+size_t CaseFoldHash::operator()(std::string_view s) const {
+  // FNV-1a over the folded bytes
+  uint64_t h = 14695981039346656037ULL;
+  for (char c : s) {
+    h ^= (*table)[static_cast<unsigned char>(c)];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+std::string UnescapeISupportValue(std::string_view value) {
+  std::string out;
+  out.reserve(value.size());
+  for (size_t i = 0; i < value.size(); i++) {
+    unsigned char c = 0;
+    if (value[i] == '\\' && i + 3 < value.size() && value[i + 1] == 'x') {
+      auto [p, ec] = std::from_chars(value.data() + i + 2, value.data() + i + 4, c, 16);
+      if (ec == std::errc() && p == value.data() + i + 4) {
+        out.push_back(static_cast<char>(c));
+        i += 3;
+        continue;
+      }
+    }
+    out.push_back(value[i]);
+  }
+  return out;
+}
+
+bool ISupport::Apply(std::span<const std::string_view> tokens) {
+  auto before = casemapping;
+  for (auto t : tokens) {
+    if (t.starts_with('-')) {
+      t.remove_prefix(1);
+      token_map.erase(t);
+      Reparse(t);
+      continue;
+    }
+    auto eq = t.find('=');
+    auto key = t.substr(0, eq);
+    token_map.insert_or_assign(std::string(key),
+                               eq == t.npos ? "" : UnescapeISupportValue(t.substr(eq + 1)));
+    Reparse(key);
+  }
+  return casemapping != before;
+}
+
+void ISupport::Reparse(std::string_view key) {
+  auto it = token_map.find(key);
+  std::optional<std::string_view> value;
+  if (it != token_map.end()) value = it->second;
+  auto number = [](std::string_view v, size_t otherwise) {
+    size_t n = 0;
+    auto [p, ec] = std::from_chars(v.data(), v.data() + v.size(), n);
+    return ec == std::errc() && p == v.data() + v.size() ? n : otherwise;
+  };
+
+  if (key == "CASEMAPPING") {
+    // Others (e.g. rfc7613) fold at least ASCII
+    casemapping = value ? casefold::ParseMapping(*value).value_or(CaseMapping::kAscii)
+                        : CaseMapping::kRfc1459;
+  } else if (key == "CHANTYPES") {
+    chantypes = value.value_or("#&");
+  } else if (key == "PREFIX") {
+    prefix_modes = "ov";
+    prefix_symbols = "@+";
+    if (!value) return;
+    // (modes)symbols, empty for none
+    auto v = *value;
+    auto close = v.find(')');
+    if (v.starts_with('(') && close != v.npos && v.size() - close - 1 == close - 1) {
+      prefix_modes = v.substr(1, close - 1);
+      prefix_symbols = v.substr(close + 1);
+    } else if (v.empty()) {
+      prefix_modes.clear();
+      prefix_symbols.clear();
+    }
+  } else if (key == "LINELEN") {
+    linelen = value ? std::max<size_t>(number(*value, 512), 512) : 512;
+  } else if (key == "MAXTARGETS") {
+    maxtargets = value ? number(*value, 0) : 0;
+  } else if (key == "TARGMAX") {
+    // PRIVMSG:4,JOIN:,WHOIS:1
+    targmax_map.clear();
+    for (auto v = value.value_or(""); !v.empty();) {
+      auto item = v.substr(0, v.find(','));
+      v.remove_prefix(std::min(v.size(), item.size() + 1));
+      auto colon = item.find(':');
+      if (colon == item.npos) continue;
+      targmax_map.insert_or_assign(std::string(item.substr(0, colon)),
+                                   number(item.substr(colon + 1), 0));
+    }
+  }
+}
+
+std::optional<std::string_view> ISupport::GetToken(std::string_view key) const {
+  if (auto it = token_map.find(key); it != token_map.end()) return it->second;
+  return std::nullopt;
+}
+
+size_t ISupport::GetTargetLimit(std::string_view command, size_t otherwise) const {
+  if (auto it = targmax_map.find(command); it != targmax_map.end()) return it->second;
+  if (maxtargets && (command == "PRIVMSG" || command == "NOTICE")) return maxtargets;
+  return otherwise;
+}
+
+}  // namespace kbot
@@ -0,0 +1,156 @@
+#pragma once
+
+#include <absl/container/flat_hash_map.h>
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+
+namespace kbot {
+
+// Case mappings
+// Nicknames and channel names compare ignoring case, where what counts as case depends on the
+// server (CASEMAPPING):
+//   - ascii: A-Z and a-z
+//   - rfc1459: also []\^ and {}|~, the upper and lower case of the Scandinavian letters they once
+//     were
+//   - strict-rfc1459: also []\ and {}|, but not ^ and ~
+// Folding goes to lower case through a table per mapping, built at compile time.
+
+enum class CaseMapping : uint8_t {
+  kAscii,
+  kRfc1459,
+  kStrictRfc1459,
+};
+
+using CaseFoldTable = std::array<unsigned char, 256>;
+
+namespace casefold {
+
+constexpr CaseFoldTable MakeTable(CaseMapping mapping) {
+  CaseFoldTable t{};
+  for (int c = 0; c < 256; c++) t[c] = static_cast<unsigned char>(c);
+  for (int c = 'A'; c <= 'Z'; c++) t[c] = static_cast<unsigned char>(c - 'A' + 'a');
+  if (mapping != CaseMapping::kAscii) {
+    t['['] = '{';
+    t[']'] = '}';
+    t['\\'] = '|';
+    if (mapping == CaseMapping::kRfc1459) t['^'] = '~';
+  }
+  return t;
+}
+
+inline constexpr CaseFoldTable kAscii = MakeTable(CaseMapping::kAscii);
+inline constexpr CaseFoldTable kRfc1459 = MakeTable(CaseMapping::kRfc1459);
+inline constexpr CaseFoldTable kStrictRfc1459 = MakeTable(CaseMapping::kStrictRfc1459);
+
+constexpr const CaseFoldTable &GetTable(CaseMapping mapping) {
+  switch (mapping) {
+    case CaseMapping::kAscii:
+      return kAscii;
+    case CaseMapping::kStrictRfc1459:
+      return kStrictRfc1459;
+    case CaseMapping::kRfc1459:
+      break;
+  }
+  return kRfc1459;
+}
+
+std::optional<CaseMapping> ParseMapping(std::string_view name);
+std::string_view MappingName(CaseMapping mapping);
+// Folded copy of s
+std::string Fold(CaseMapping mapping, std::string_view s);
+
+}  // namespace casefold
+
+// Hash and equality for maps keyed by nicknames or channel names, which fold each byte through the
+// table as they go, so looking up a name never allocates. Both are transparent for lookups by
+// std::string_view. A map changing its mapping has to be rebuilt (see RebuildCaseFoldMap).
+struct CaseFoldHash {
+  using is_transparent = void;
+  const CaseFoldTable *table = &casefold::kRfc1459;
+
+  CaseFoldHash() = default;
+  explicit CaseFoldHash(CaseMapping mapping) : table(&casefold::GetTable(mapping)) {}
+  size_t operator()(std::string_view s) const;
+};
+
+struct CaseFoldEq {
+  using is_transparent = void;
+  const CaseFoldTable *table = &casefold::kRfc1459;
+
+  CaseFoldEq() = default;
+  explicit CaseFoldEq(CaseMapping mapping) : table(&casefold::GetTable(mapping)) {}
+  bool operator()(std::string_view a, std::string_view b) const {
+    if (a.size() != b.size()) return false;
+    auto &t = *table;
+    for (size_t i = 0; i < a.size(); i++) {
+      if (t[static_cast<unsigned char>(a[i])] != t[static_cast<unsigned char>(b[i])]) return false;
+    }
+    return true;
+  }
+};
+
+template <class V>
+using CaseFoldMap = absl::flat_hash_map<std::string, V, CaseFoldHash, CaseFoldEq>;
+
+template <class V>
+CaseFoldMap<V> MakeCaseFoldMap(CaseMapping mapping) {
+  return CaseFoldMap<V>(0, CaseFoldHash(mapping), CaseFoldEq(mapping));
+}
+
+// Rehashes the map for another mapping, of names that now fold to the same the first one stays
+template <class V>
+void RebuildCaseFoldMap(CaseFoldMap<V> &map, CaseMapping mapping) {
+  auto rebuilt = MakeCaseFoldMap<V>(mapping);
+  rebuilt.reserve(map.size());
+  for (auto &[k, v] : map) rebuilt.emplace(k, std::move(v));
+  map = std::move(rebuilt);
+}
+
+// ISupport
+// What the server told us about itself in RPL_ISUPPORT (005), the tokens as sent and the ones we
+// use parsed, with the defaults of RFC 1459 for those it left out.
+
+class ISupport {
+  absl::flat_hash_map<std::string, std::string> token_map;
+  CaseMapping casemapping = CaseMapping::kRfc1459;
+  std::string chantypes = "#&";
+  // Channel membership modes, highest first, and the prefix shown for each (PREFIX=(ov)@+)
+  std::string prefix_modes = "ov";
+  std::string prefix_symbols = "@+";
+  size_t linelen = 512;
+  size_t maxtargets = 0;
+  // TARGMAX by command, 0 for no limit
+  absl::flat_hash_map<std::string, size_t> targmax_map;
+
+  void Reparse(std::string_view key);
+
+ public:
+  // Tokens as they follow the nickname, "KEY", "KEY=value" or "-KEY" to remove it. Returns
+  // whether CASEMAPPING changed.
+  bool Apply(std::span<const std::string_view> tokens);
+
+  std::optional<std::string_view> GetToken(std::string_view key) const;
+  CaseMapping GetCaseMapping() const { return casemapping; }
+  std::string_view GetChanTypes() const { return chantypes; }
+  std::string_view GetPrefixModes() const { return prefix_modes; }
+  std::string_view GetPrefixSymbols() const { return prefix_symbols; }
+  // Longest line, CRLF included
+  size_t GetLineLength() const { return linelen; }
+  // Targets one command may name (TARGMAX, MAXTARGETS for PRIVMSG and NOTICE), 0 for no limit,
+  // otherwise if the server didn't say
+  size_t GetTargetLimit(std::string_view command, size_t otherwise = 0) const;
+  bool IsChannel(std::string_view name) const {
+    return !name.empty() && chantypes.find(name[0]) != std::string::npos;
+  }
+};
+
+// Undoes the \xHH escapes of ISUPPORT values
+std::string UnescapeISupportValue(std::string_view value);
+
+}  // namespace kbot
@@ -0,0 +1,247 @@
+#include <fcntl.h>
+#include <fmt/format.h>
+#include <glog/logging.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <Log.hh>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+namespace kbot {
+namespace log {
+
+namespace {
+
+struct Record {
+  static constexpr size_t kSize = 256;
+  int64_t ts_ns;
+  const char *file;
+  int line;
+  Level level;
+  uint16_t len;
+  char msg[kSize - 26];
+};
+
+static_assert(sizeof(Record) == Record::kSize);
+
+// LogQueue
+// Bounded SPSC ring, the owning thread produces and the writer consumes. head and tail live on
+// separate cache lines so the producer does not bounce the line the writer is polling.
+
+struct LogQueue {
+  static constexpr uint64_t kSlots = 512;
+  alignas(64) std::atomic<uint64_t> head = 0;
+  alignas(64) std::atomic<uint64_t> tail = 0;
+  std::atomic<uint64_t> dropped = 0;
+  std::atomic<bool> closed = false;
+  pid_t tid = gettid();
+  std::array<Record, kSlots> ring;
+
+  Record *Reserve() {
+    uint64_t h = head.load(std::memory_order_relaxed);
+    if (h - tail.load(std::memory_order_acquire) == kSlots) {
+      dropped.fetch_add(1, std::memory_order_relaxed);
+      return nullptr;
+    }
+    return &ring[h % kSlots];
+  }
+  // Returns true when the queue has become half full, so the writer should be woken up early
+  bool Commit() {
+    uint64_t h = head.load(std::memory_order_relaxed) + 1;
+    head.store(h, std::memory_order_release);
+    return h - tail.load(std::memory_order_relaxed) == kSlots / 2;
+  }
+};
+
+struct Writer {
+  std::mutex mtx;
+  std::condition_variable cv;
+  std::vector<std::shared_ptr<LogQueue>> queue_vec;
+  std::jthread thread;
+  int fd = -1;
+  bool stop = false;
+};
+
+std::atomic<bool> writer_running = false;
+Writer writer;
+
+constexpr auto kFlushInterval = std::chrono::milliseconds(20);
+
+struct ThreadQueue {
+  std::shared_ptr<LogQueue> q = std::make_shared<LogQueue>();
+  ThreadQueue() {
+    std::unique_lock lock(writer.mtx);
+    writer.queue_vec.push_back(q);
+  }
+  // The writer reaps the queue once it is drained
+  ~ThreadQueue() { q->closed.store(true, std::memory_order_release); }
+};
+
+LogQueue &GetThreadQueue() {
+  thread_local ThreadQueue tq;
+  return *tq.q;
+}
+
+constexpr char LevelChar(Level l) {
+  switch (l) {
+    case Level::kDebug:
+      return 'D';
+    case Level::kInfo:
+      return 'I';
+    case Level::kWarning:
+      return 'W';
+    case Level::kError:
+      return 'E';
+  }
+  return '?';
+}
+
+std::string_view Basename(const char *file) {
+  std::string_view f = file;
+  auto i = f.rfind('/');
+  return i == f.npos ? f : f.substr(i + 1);
+}
+
+void AppendRecord(std::string &out, const Record &r, pid_t tid) {
+  time_t sec = static_cast<time_t>(r.ts_ns / 1000000000);
+  struct tm tm;
+  localtime_r(&sec, &tm);
+  fmt::format_to(std::back_inserter(out), "{}{:04}{:02}{:02} {:02}:{:02}:{:02}.{:06} {} {}:{}] ",
+                 LevelChar(r.level), tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour,
+                 tm.tm_min, tm.tm_sec, (r.ts_ns / 1000) % 1000000, tid, Basename(r.file), r.line);
+  out.append(r.msg, r.len);
+  out.push_back('\n');
+}
+
+void WriteAll(int fd, std::string_view buf) {
+  while (!buf.empty()) {
+    ssize_t r = write(fd, buf.data(), buf.size());
+    if (r < 0) {
+      if (errno == EINTR) continue;
+      return;
+    }
+    buf.remove_prefix(static_cast<size_t>(r));
+  }
+}
+
+// Drains every queue into one buffer and issues a single write for the batch
+void DrainOnce(std::string &batch) {
+  std::vector<std::shared_ptr<LogQueue>> v;
+  {
+    std::unique_lock lock(writer.mtx);
+    v = writer.queue_vec;
+  }
+  for (auto &q : v) {
+    bool closed = q->closed.load(std::memory_order_acquire);
+    uint64_t t = q->tail.load(std::memory_order_relaxed);
+    uint64_t h = q->head.load(std::memory_order_acquire);
+    for (; t != h; t++) AppendRecord(batch, q->ring[t % LogQueue::kSlots], q->tid);
+    q->tail.store(t, std::memory_order_release);
+    if (uint64_t d = q->dropped.exchange(0, std::memory_order_relaxed)) {
+      fmt::format_to(std::back_inserter(batch), "W logging: dropped {} records of thread {}\n", d,
+                     q->tid);
+    }
+    if (closed) {
+      std::unique_lock lock(writer.mtx);
+      std::erase(writer.queue_vec, q);
+    }
+  }
+  if (!batch.empty()) {
+    WriteAll(writer.fd, batch);
+    batch.clear();
+  }
+}
+
+void WriterMain(std::stop_token st) {
+  std::string batch;
+  batch.reserve(64 * 1024);
+  std::unique_lock lock(writer.mtx);
+  while (!writer.stop && !st.stop_requested()) {
+    writer.cv.wait_for(lock, kFlushInterval);
+    lock.unlock();
+    DrainOnce(batch);
+    lock.lock();
+  }
+  lock.unlock();
+  DrainOnce(batch);
+}
+
+}  // namespace
+
+bool Start(std::string_view path) {
+  if (writer_running.load(std::memory_order_relaxed)) return true;
+  if (path.empty()) {
+    writer.fd = STDERR_FILENO;
+  } else {
+    writer.fd = open(std::string(path).c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (writer.fd < 0) {
+      PLOG(ERROR) << "Failed to open log file " << path;
+      return false;
+    }
+  }
+  writer.stop = false;
+  writer.thread = std::jthread(WriterMain);
+  writer_running.store(true, std::memory_order_release);
+  return true;
+}
+
+void Stop() {
+  if (!writer_running.exchange(false, std::memory_order_acq_rel)) return;
+  {
+    std::unique_lock lock(writer.mtx);
+    writer.stop = true;
+  }
+  writer.cv.notify_one();
+  writer.thread.join();
+  if (writer.fd != STDERR_FILENO) close(writer.fd);
+  writer.fd = -1;
+}
+
+void SetLevel(Level l) { runtime_level.store(l, std::memory_order_relaxed); }
+
+void Submit(Level l, const char *file, int line, fmt::string_view f, fmt::format_args args) {
+  if (!writer_running.load(std::memory_order_acquire)) {
+    auto msg = fmt::vformat(f, args);
+    switch (l) {
+      case Level::kDebug:
+        DLOG(INFO) << msg;
+        break;
+      case Level::kInfo:
+        LOG(INFO) << msg;
+        break;
+      case Level::kWarning:
+        LOG(WARNING) << msg;
+        break;
+      case Level::kError:
+        LOG(ERROR) << msg;
+        break;
+    }
+    return;
+  }
+  auto &q = GetThreadQueue();
+  Record *r = q.Reserve();
+  if (r == nullptr) return;
+  r->ts_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                 std::chrono::system_clock::now().time_since_epoch())
+                 .count();
+  r->file = file;
+  r->line = line;
+  r->level = l;
+  auto res = fmt::vformat_to_n(r->msg, sizeof(r->msg), f, args);
+  r->len = static_cast<uint16_t>(std::min(res.size, sizeof(r->msg)));
+  if (q.Commit()) writer.cv.notify_one();
+}
+
+}  // namespace log
+}  // namespace kbot
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <fmt/format.h>
+
+#include <atomic>
+#include <cstdint>
+#include <string_view>
+
+namespace kbot {
+namespace log {
+
+// Asynchronous logging
+// Hot paths (per message work on the server threads) log through KLOG instead of glog, which
+// writes synchronously under a process wide mutex. KLOG formats straight into a slot of a
+// per-thread lock-free SPSC queue; a background writer drains all queues and writes them out in
+// batches. When a queue is full the record is dropped and counted, the caller never blocks.
+//
+// Levels below KBOT_LOG_LEVEL are compiled out entirely, their arguments are never evaluated.
+
+enum class Level : int {
+  kDebug,
+  kInfo,
+  kWarning,
+  kError,
+};
+
+#ifndef KBOT_LOG_LEVEL
+#ifdef NDEBUG
+#define KBOT_LOG_LEVEL Info
+#else
+#define KBOT_LOG_LEVEL Debug
+#endif
+#endif
+
+#define __KBOT_LOG_LEVEL(l) kbot::log::Level::k##l
+#define _KBOT_LOG_LEVEL(l) __KBOT_LOG_LEVEL(l)
+
+inline std::atomic<Level> runtime_level = Level::kDebug;
+
+// Start the writer, an empty path logs to stderr. Until Start is called (and after Stop), records
+// are handed to glog synchronously, which keeps tests and plugins working without a writer.
+bool Start(std::string_view path);
+void Stop();
+void SetLevel(Level l);
+
+void Submit(Level l, const char *file, int line, fmt::string_view f, fmt::format_args args);
+
+template <class... Args>
+inline void Write(Level l, const char *file, int line, fmt::format_string<Args...> f,
+                  Args &&...args) {
+  if (l < runtime_level.load(std::memory_order_relaxed)) return;
+  Submit(l, file, line, f, fmt::make_format_args(args...));
+}
+
+}  // namespace log
+}  // namespace kbot
+
+#define KLOG(level, ...)                                                          \
+  do {                                                                            \
+    if constexpr (__KBOT_LOG_LEVEL(level) >= _KBOT_LOG_LEVEL(KBOT_LOG_LEVEL)) {   \
+      kbot::log::Write(__KBOT_LOG_LEVEL(level), __FILE__, __LINE__, __VA_ARGS__); \
+    }                                                                             \
+  } while (0)
@@ -1,18 +1,27 @@
 #include <fmt/format.h>
+#include <fmt/ranges.h>
 #include <glog/logging.h>
 #include <poll.h>
 #include <sys/signalfd.h>
+#include <unistd.h>
 
 #include <IRC.hh>
+#include <Log.hh>
 #include <Manager.hh>
+#include <PluginRegistry.hh>
 #include <Server.hh>
+#include <Trace.hh>
 #include <UserCommand.hh>
+#include <algorithm>
 #include <cassert>
+#include <chrono>
 #include <cstring>
 #include <exception>
 #include <iostream>
 #include <mutex>
 #include <optional>
+#include <random>
+#include <shared_mutex>
 #include <stdexcept>
 #include <string_view>
 #include <thread>
@@ -56,6 +65,9 @@ void Manager::SetupSignalDelivery(std::string_view server_name) {
 void Manager::TearDownSignalDelivery() { sig_id.fetch_sub(1, std::memory_order_relaxed); }
 
 // Manager
+Manager::Manager(int fd, Server &&server)
+    : EpollManager(fd), server(std::move(server)), command_matcher(":" COMMAND_PREFIX) {}
+
 Manager Manager::CreateNew(Server &&server) {
   int fd = epoll_create1(EPOLL_CLOEXEC);
   if (fd < 0) {
@@ -64,6 +76,218 @@ Manager Manager::CreateNew(Server &&server) {
   return Manager(fd, std::move(server));
 }
 
+http::Engine *Manager::GetHttpEngine() {
+  if (!http_engine) {
+    // Requests count against the plugin whose code is running
+    http_engine = http::Engine::CreateNew(*this, http::Engine::kDefaultOwnerLimit, [] {
+      auto p = CommandPlugin::Current();
+      return p ? std::string(p->GetName()) : std::string();
+    });
+  }
+  return http_engine.get();
+}
+
+bool Manager::LoadPlugin(std::string_view name) {
+  {
+    std::shared_lock lock(server.plugins_map_mtx);
+    if (server.plugins_map.contains(name)) return false;
+  }
+  auto p = plugin::Acquire(name);
+  if (!p) return false;
+  auto a = PluginActivation::CreateNew(*this, std::move(p));
+  if (!a) return false;
+  std::unique_lock lock(server.plugins_map_mtx);
+  server.plugins_map.emplace(name, std::move(a));
+  return true;
+}
+
+bool Manager::UnloadPlugin(std::string_view name) {
+  std::unique_lock lock(server.plugins_map_mtx);
+  auto it = server.plugins_map.find(name);
+  if (it == server.plugins_map.end()) return false;
+  server.plugins_map.erase(it);
+  KLOG(Info, "Unloaded plugin {}", name);
+  return true;
+}
+
+namespace {
+
+void AddWasmCommands(Manager &m, WasmPlugin *p) {
+  for (auto &c : p->GetCommands()) {
+    if (!m.wasm_command_map.emplace(c, p).second) {
+      KLOG(Warning, "WebAssembly plugin {} failed to register command {}", p->GetName(), c);
+    }
+  }
+}
+
+void RemoveWasmCommands(Manager &m, WasmPlugin *p) {
+  for (auto &c : p->GetCommands()) {
+    auto r = m.wasm_command_map.find(c);
+    if (r != m.wasm_command_map.end() && r->second == p) m.wasm_command_map.erase(r);
+  }
+}
+
+}  // namespace
+
+bool Manager::LoadWasmPlugin(std::string_view name) {
+  if (wasm_plugin_map.contains(name)) return false;
+  auto path = plugin::FindWasmPlugin(name);
+  if (!path) return false;
+  auto p = WasmPlugin::Load(name, *path);
+  if (!p) return false;
+  AddWasmCommands(*this, p.get());
+  server.command_generation.fetch_add(1, std::memory_order_relaxed);
+  KLOG(Info, "Loaded WebAssembly plugin {} from {}", name, *path);
+  wasm_plugin_map.emplace(name, std::move(p));
+  return true;
+}
+
+bool Manager::UnloadWasmPlugin(std::string_view name) {
+  auto it = wasm_plugin_map.find(name);
+  if (it == wasm_plugin_map.end()) return false;
+  auto p = std::move(it->second);
+  wasm_plugin_map.erase(it);
+  RemoveWasmCommands(*this, p.get());
+  server.command_generation.fetch_add(1, std::memory_order_relaxed);
+  KLOG(Info, "Unloaded WebAssembly plugin {}", name);
+  return true;
+}
+
+bool Manager::ReloadWasmPlugin(std::string_view name) {
+  auto it = wasm_plugin_map.find(name);
+  if (it == wasm_plugin_map.end()) return false;
+  auto path = plugin::FindWasmPlugin(name);
+  if (!path) return false;
+  auto p = WasmPlugin::Load(name, *path);
+  if (!p) return false;
+  RemoveWasmCommands(*this, it->second.get());
+  AddWasmCommands(*this, p.get());
+  it->second = std::move(p);
+  server.command_generation.fetch_add(1, std::memory_order_relaxed);
+  KLOG(Info, "Reloaded WebAssembly plugin {} from {}", name, *path);
+  return true;
+}
+
+bool Manager::LoadPluginHost(std::string_view name) {
+  if (plugin_host_map.contains(name)) return false;
+  std::string procs;
+  if (governor) {
+    auto p = governor->Admit(name);
+    if (!p) return false;
+    procs = std::move(*p);
+  }
+  auto h = PluginHost::Spawn(*this, name, procs);
+  if (!h) {
+    if (governor) governor->Release(name);
+    return false;
+  }
+  plugin_host_map.emplace(name, std::move(h));
+  if (governor && !governor_timer) {
+    governor_timer = AddTimer(cgroup::Governor::kSampleInterval, [this] { SampleGovernor(); });
+  }
+  return true;
+}
+
+bool Manager::UnloadPluginHost(std::string_view name) {
+  auto it = plugin_host_map.find(name);
+  if (it == plugin_host_map.end()) return false;
+  auto h = std::move(it->second);
+  plugin_host_map.erase(it);
+  for (auto &c : h->GetCommands()) {
+    auto r = remote_command_map.find(c);
+    if (r != remote_command_map.end() && r->second == h.get()) remote_command_map.erase(r);
+  }
+  server.command_generation.fetch_add(1, std::memory_order_relaxed);
+  // The group can only be removed once the child has been reaped
+  h.reset();
+  if (governor) {
+    governor->Release(name);
+    std::unique_lock lock(server.stats.plugin_usage_mtx);
+    server.stats.plugin_usage_map.erase(name);
+  }
+  KLOG(Info, "Unloaded plugin host for {}", name);
+  return true;
+}
+
+void Manager::SampleGovernor() {
+  governor_timer.reset();
+  auto samples = governor->SampleAll();
+  {
+    std::unique_lock lock(server.stats.plugin_usage_mtx);
+    for (auto &s : samples) {
+      server.stats.plugin_usage_map.insert_or_assign(
+          s.plugin, metrics::PluginUsage{s.usage.cpu_usage_usec, s.usage.throttled_usec,
+                                         s.usage.memory_current, s.strikes});
+    }
+  }
+  for (auto &s : samples) {
+    if (!s.evict) continue;
+    LOG(WARNING) << "Plugin " << s.plugin << " kept exceeding its resource limits, unloading it";
+    UnloadPluginHost(s.plugin);
+  }
+  if (!governor->Empty()) {
+    governor_timer = AddTimer(cgroup::Governor::kSampleInterval, [this] { SampleGovernor(); });
+  }
+}
+
+// Reply waits
+
+ReplyAwaiter Manager::WaitReply(ReplyFilter filter, std::chrono::nanoseconds timeout) {
+  return ReplyAwaiter(*this, std::move(filter), timeout);
+}
+
+void Manager::DeliverReplies(const IRCMessage &msg) {
+  auto it = reply_waiter_map.find(msg.GetCommand());
+  if (it == reply_waiter_map.end()) return;
+  std::vector<ReplyAwaiter *> ready;
+  for (auto w : it->second) {
+    if (w->Matches(msg)) ready.push_back(w);
+  }
+  // Resume only after all bookkeeping is done, resumed coroutines may register new waits
+  for (auto w : ready) {
+    w->Detach();
+    w->result.emplace(msg.GetLine());
+  }
+  for (auto w : ready) w->h.resume();
+}
+
+void Manager::CancelReplyWaiters() {
+  while (!reply_waiter_map.empty()) {
+    auto w = reply_waiter_map.begin()->second.front();
+    w->Detach();
+    w->h.resume();
+  }
+}
+
+bool ReplyAwaiter::Matches(const IRCMessage &msg) const {
+  if (filter.target.empty()) return true;
+  auto &params = msg.GetParameters();
+  return params.size() >= 2 && m.server.NameEquals(params[1], filter.target);
+}
+
+void ReplyAwaiter::await_suspend(std::coroutine_handle<> handle) {
+  h = handle;
+  for (auto &c : filter.commands) m.reply_waiter_map[c].push_back(this);
+  if (timeout.count() > 0) {
+    timer = m.AddTimer(timeout, [this] {
+      timer.reset();
+      Detach();
+      h.resume();
+    });
+  }
+}
+
+void ReplyAwaiter::Detach() {
+  for (auto &c : filter.commands) {
+    auto it = m.reply_waiter_map.find(c);
+    if (it == m.reply_waiter_map.end()) continue;
+    std::erase(it->second, this);
+    if (it->second.empty()) m.reply_waiter_map.erase(it);
+  }
+  if (timer) m.CancelTimer(*timer);
+  timer.reset();
+}
+
 // ServerThreadSet
 // Implements a collection that allows waiting for completion of all server threads from the main
 // thread, and insertion of new threads to the existing set.
@@ -80,44 +304,371 @@ bool ServerThreadSet::InsertNewThread(std::jthread &&jthr) {
 
 namespace {
 
-void BuiltinPong(Manager &m, const IRCMessage &msg) {
-  LOG(INFO) << "Received PING, replying with PONG to " << msg.GetParameters()[0];
-  m.server.SendMsg(fmt::format("PONG :{}", msg.GetParameters()[0].substr(1)));
+// Batches whose lines are only of interest to those watching every message, a netsplit is
+// delivered to them as one unit and commands are never run from history
+constexpr std::string_view kPassiveBatchTypes[] = {"netsplit", "netjoin", "chathistory"};
+// Beyond this, lines of a batch are processed as they come
+constexpr size_t kMaxBatchLines = 16384;
+
+void BuiltinPing(Manager &m, const IRCMessagePing &msg) {
+  auto token = msg.GetPongParameter();
+  if (token.starts_with(':')) token.remove_prefix(1);
+  KLOG(Debug, "Received PING, replying with PONG to {}", token);
+  m.server.Pong(token);
+}
+
+void BuiltinPong(Manager &m, const IRCMessagePong &msg) {
+  auto lag = m.watchdog.OnPong(msg.GetToken(), LagWatchdog::Clock::now());
+  if (!lag) return;
+  auto &stats = m.server.stats;
+  stats.lag.Observe(*lag);
+  stats.lag_ns.store(std::chrono::nanoseconds(*lag).count(), std::memory_order_relaxed);
+  KLOG(Debug, "Lag is {}ms",
+       std::chrono::duration_cast<std::chrono::milliseconds>(*lag).count());
+}
+
+// Requests the capabilities we want out of those offered, during registration (LS) or later
+// (NEW, with cap-notify implied by version 302), and ends negotiation once the server replied
+void BuiltinCap(Manager &m, const IRCMessageCap &msg) {
+  auto &s = m.server;
+  auto sub = msg.GetSubcommand();
+  auto find = [](std::string_view name) -> uint32_t {
+    for (auto &[n, cap] : IRCCapabilityTable) {
+      if (n == name) return cap;
+    }
+    return 0;
+  };
+  if (sub == "LS" || sub == "NEW") {
+    if (sub == "LS") {
+      if (s.cap_ls_complete) s.cap_offered_map.clear();
+      s.cap_ls_complete = !msg.IsContinued();
+    }
+    for (auto c : msg.GetCapabilities()) {
+      auto eq = c.find('=');
+      s.cap_offered_map.insert_or_assign(std::string(c.substr(0, eq)),
+                                         eq == c.npos ? "" : std::string(c.substr(eq + 1)));
+    }
+    if (!s.cap_ls_complete) return;
+    uint32_t wanted = s.cap_wanted;
+    // Only while registering, which is what it's for
+    if (s.sasl && sub == "LS") {
+      auto it = s.cap_offered_map.find("sasl");
+      if (it != s.cap_offered_map.end() && s.sasl->IsOffered(it->second)) {
+        wanted |= kCapSasl;
+      } else {
+        KLOG(Warning, "Server doesn't offer SASL {}",
+             SaslClient::MechanismName(s.sasl->GetCredentials().mechanism));
+      }
+    }
+    std::string req;
+    uint32_t enabled = s.cap_enabled.load(std::memory_order_relaxed);
+    for (auto &[name, cap] : IRCCapabilityTable) {
+      if (!(wanted & cap) || (enabled & cap) || !s.cap_offered_map.contains(name)) continue;
+      if (!req.empty()) req.push_back(' ');
+      req.append(name);
+    }
+    if (req.empty()) {
+      if (sub == "LS") s.Cap("END");
+      return;
+    }
+    s.cap_end_pending = sub == "LS";
+    s.Cap(fmt::format("REQ :{}", req));
+  } else if (sub == "ACK" || sub == "NAK" || sub == "DEL") {
+    uint32_t enabled = s.cap_enabled.load(std::memory_order_relaxed);
+    for (auto c : msg.GetCapabilities()) {
+      bool disable = sub == "DEL" || c.starts_with('-');
+      if (c.starts_with('-')) c.remove_prefix(1);
+      if (sub == "NAK") {
+        KLOG(Warning, "Server refused capability {}", c);
+        continue;
+      }
+      if (sub == "DEL") s.cap_offered_map.erase(c);
+      enabled = disable ? enabled & ~find(c) : enabled | find(c);
+    }
+    s.cap_enabled.store(enabled, std::memory_order_relaxed);
+    if (sub == "ACK") {
+      KLOG(Info, "Capabilities acknowledged: {}", fmt::join(msg.GetCapabilities(), " "));
+      // Negotiation then ends with the result of the authentication, see BuiltinNumeric
+      if (s.cap_end_pending && (enabled & kCapSasl) && s.sasl &&
+          s.sasl->GetState() == SaslClient::State::kIdle) {
+        s.Authenticate(s.sasl->Start());
+        return;
+      }
+    }
+    if (std::exchange(s.cap_end_pending, false)) s.Cap("END");
+  }
+}
+
+void BuiltinAuthenticate(Manager &m, const IRCMessageAuthenticate &msg) {
+  auto &s = m.server;
+  if (!s.sasl || !s.sasl->InProgress()) return;
+  for (auto &line : s.sasl->Respond(msg.GetPayload())) s.Authenticate(line);
+}
+
+void BuiltinNumeric(Manager &m, const IRCMessageNumeric &msg) {
+  auto &s = m.server;
+  auto &params = msg.GetParameters();
+  int numeric = msg.GetNumeric();
+  // RPL_YOURHOST, RPL_CREATED, RPL_MYINFO and RPL_ISUPPORT follow the welcome, anything else
+  // (usually LUSERS or the MOTD) means the server told us all about itself
+  if (s.GetState() == ServerState::kWelcomed && (numeric < 2 || numeric > 5)) {
+    s.CompleteRegistration();
+  }
+  switch (numeric) {
+    case 1:
+      // RPL_WELCOME, NickServ before the joins so that they find us identified
+      s.Welcome(params[0]);
+      m.reconnect_delay = {};
+      if (s.sasl && s.sasl->GetState() != SaslClient::State::kSucceeded) {
+        auto &c = s.sasl->GetCredentials();
+        if (c.mechanism == SaslMechanism::kPlain && !c.password.empty()) {
+          KLOG(Info, "Identifying with NickServ instead of SASL");
+          s.PrivMsg("NickServ", fmt::format("identify {} {}", c.account, c.password));
+        }
+      }
+      break;
+    case 5:
+      // RPL_ISUPPORT <nick> <token>... :are supported by this server
+      if (params.size() > 1) {
+        auto end = std::find_if(params.begin() + 1, params.end(),
+                                [](std::string_view p) { return p.starts_with(':'); });
+        s.AddISupport(std::span(params.begin() + 1, end));
+      }
+      break;
+    case 432:
+    case 433:
+      // ERR_ERRONEUSNICKNAME, ERR_NICKNAMEINUSE, registration can't go on without one. One in
+      // use is tried with a '_' appended, an erroneous one would stay so and is replaced with
+      // one valid anywhere (a letter then digits, 9 characters at most).
+      if (s.GetState() == ServerState::kConnected && params.size() > 1) {
+        if (++s.nick_retries > Manager::kMaxNickRetries) {
+          KLOG(Error, "No nickname accepted after {} tries, giving up", Manager::kMaxNickRetries);
+          m.quit = true;
+          break;
+        }
+        auto nick = numeric == 432 ? fmt::format("kbot{:05}", std::random_device()() % 100000)
+                                   : fmt::format("{}_", params[1]);
+        KLOG(Warning, "Nickname {} refused ({}), trying {}", params[1], numeric, nick);
+        s.UpdateNickname(s.GetNickname(), nick);
+        s.Nick(nick);
+      }
+      break;
+    case 403:
+    case 405:
+    case 471:
+    case 473:
+    case 474:
+    case 475:
+    case 477:
+    case 489:
+      // ERR_NOSUCHCHANNEL, ERR_TOOMANYCHANNELS, ERR_CHANNELISFULL, ERR_INVITEONLYCHAN,
+      // ERR_BANNEDFROMCHAN, ERR_BADCHANNELKEY, ERR_NEEDREGGEDNICK, ERR_SECUREONLYCHAN
+      if (params.size() > 1) {
+        KLOG(Warning, "Failed to join {} ({})", params[1], numeric);
+        s.FailJoinChannel(params[1], numeric);
+      }
+      break;
+    case 900:
+      // RPL_LOGGEDIN <nick> <nick!user@host> <account> :You are now logged in as <account>
+      if (params.size() > 2) KLOG(Info, "Logged in as {}", params[2]);
+      break;
+    case 903:
+    case 907:
+      // RPL_SASLSUCCESS, ERR_SASLALREADY
+      if (!s.sasl || !s.sasl->InProgress()) break;
+      s.sasl->Finish(true);
+      if (std::exchange(s.cap_end_pending, false)) s.Cap("END");
+      break;
+    case 902:
+    case 904:
+    case 905:
+    case 906:
+      // ERR_NICKLOCKED, ERR_SASLFAIL, ERR_SASLTOOLONG, ERR_SASLABORTED
+      if (!s.sasl || !s.sasl->InProgress()) break;
+      KLOG(Error, "SASL authentication failed ({})", msg.GetCommand());
+      s.sasl->Finish(false);
+      if (std::exchange(s.cap_end_pending, false)) s.Cap("END");
+      break;
+    default:
+      break;
+  }
+}
+
+void PluginEvents(Manager &m, const IRCMessage &msg);
+
+// Lines of a batch come in between its start and end, where ProcessMessageLine holds them back
+void BuiltinBatch(Manager &m, const IRCMessageBatch &msg) {
+  if (msg.IsStart()) {
+    m.batch_map.try_emplace(msg.GetReference(), Manager::Batch{std::string(msg.GetType()), {}});
+    return;
+  }
+  auto node = m.batch_map.extract(msg.GetReference());
+  if (node.empty()) return;
+  auto &batch = node.mapped();
+  KBOT_TRACE_SPAN(batch, batch.line_vec.size(), batch.type);
+  if (std::find(std::begin(kPassiveBatchTypes), std::end(kPassiveBatchTypes), batch.type) !=
+      std::end(kPassiveBatchTypes)) {
+    for (auto &line : batch.line_vec) {
+      try {
+        IRCMessage member(line);
+        if (m.HasReplyWaiters()) m.DeliverReplies(member);
+        if (m.server.HasEventSubscribers()) PluginEvents(m, member);
+      } catch (std::runtime_error &) {
+        m.server.stats.parse_errors.fetch_add(1, std::memory_order_relaxed);
+      }
+    }
+  } else {
+    // Nothing in a batch ends the connection
+    for (auto &line : batch.line_vec) ProcessMessageLine(m, line);
+  }
 }
 
 void BuiltinNickname(Manager &m, const IRCMessageNick &msg) {
   std::string_view new_nick = msg.GetNewNickname();
-  LOG(INFO) << "Nickname change received, applying " << new_nick;
+  KLOG(Info, "Nickname change received, applying {}", new_nick);
   m.server.UpdateNickname(msg.GetUser().nickname, new_nick);
 }
 
 void BuiltinJoin(Manager &m, const IRCMessageJoin &msg) {
-  DLOG(INFO) << "Join request completion received for " << msg.GetChannel();
+  // Others joining our channels
+  if (!m.server.IsOwnNickname(Message::ParseSourceUser(msg.GetSource()).nickname)) return;
+  KLOG(Debug, "Join request completion received for {}", msg.GetChannel());
   m.server.UpdateJoinChannel(msg.GetChannel());
 }
 
 void BuiltinPart(Manager &m, const IRCMessagePart &msg) {
-  DLOG(INFO) << "Part request completion received for " << msg.GetChannel();
+  // Others leaving our channels
+  if (!m.server.IsOwnNickname(Message::ParseSourceUser(msg.GetSource()).nickname)) return;
+  KLOG(Debug, "Part request completion received for {}", msg.GetChannel());
   m.server.UpdatePartChannel(msg.GetChannel());
 }
 
+void PluginEvents(Manager &m, const IRCMessage &msg) {
+  std::shared_lock lock(m.server.user_command_mtx);
+  auto it = m.server.event_subscriber_map.find(msg.GetCommand());
+  if (it == m.server.event_subscriber_map.end()) return;
+  KBOT_TRACE_SPAN(plugin_event, it->second.size(), msg.GetCommand());
+  for (auto &e : it->second) {
+    CommandPlugin::Scope _(e.plugin);
+    e.callback(m, msg);
+  }
+}
+
+// With user_command_mtx held
+void RefreshPatternMatcher(Manager &m) {
+  uint64_t generation = m.server.pattern_generation.load(std::memory_order_relaxed);
+  if (m.pattern_matcher.GetGeneration() == generation) return;
+  auto &subscribers = m.server.pattern_subscriber_vec;
+  std::vector<PatternMatcher::Pattern> patterns;
+  patterns.reserve(subscribers.size());
+  for (auto &s : subscribers) {
+    patterns.push_back({.regex = s.entry->kind == plugin::PatternEntry::kRegex,
+                        .pattern = s.entry->pattern,
+                        .channel = s.entry->channel});
+  }
+  for (auto i : m.pattern_matcher.SetPatterns(patterns, generation)) {
+    KLOG(Error, "Invalid regex in plugin {}: {}", subscribers[i].plugin->GetName(),
+         patterns[i].pattern);
+  }
+}
+
+// Runs the callbacks of the patterns the last match found in line, msg is line parsed
+void DispatchPatterns(Manager &m, std::string_view line, const IRCMessagePrivMsg &msg,
+                      uint64_t generation) {
+  std::shared_lock lock(m.server.user_command_mtx);
+  // Changed by one of the event callbacks that ran in between
+  if (m.server.pattern_generation.load(std::memory_order_relaxed) != generation) return;
+  auto hits = m.pattern_matcher.GetHits();
+  KBOT_TRACE_SPAN(plugin_pattern, hits.size(), msg.GetChannel());
+  for (auto &h : hits) {
+    auto &s = m.server.pattern_subscriber_vec[h.index];
+    // Same offset in the parsed copy
+    std::string_view match = msg.GetLine().substr(h.match.data() - line.data(), h.match.size());
+    CommandPlugin::Scope _(s.plugin);
+    s.entry->callback(m, msg, match);
+  }
+}
+
+// msg is the one to pass to the command, key its canonical key
+void DispatchCommand(Manager &m, const IRCMessagePrivMsg &msg, std::string_view key) {
+  auto cb_it = UserCommand::user_command_map.find(key);
+  if (cb_it != UserCommand::user_command_map.end()) {
+    KBOT_TRACE_SPAN(command, 0, key);
+    cb_it->second(m, msg);
+  } else {
+    // Take shared_lock here, as taking it early would mean deadlock when invoking plugin
+    // loading/unloading commands, which modify the server's command map (otherwise DEADLOCK)
+    std::shared_lock lock(m.server.user_command_mtx);
+    auto cb_local_it = m.server.user_command_map.find(key);
+    if (cb_local_it != m.server.user_command_map.end()) {
+      KBOT_TRACE_SPAN(plugin, 1, key);
+      CommandPlugin::Scope _(cb_local_it->second.plugin);
+      cb_local_it->second.callback(m, msg);
+    } else if (auto host_it = m.remote_command_map.find(key);
+               host_it != m.remote_command_map.end()) {
+      KBOT_TRACE_POINT(plugin_host, host_it->second->GetPid());
+      host_it->second->Deliver(msg);
+    } else if (auto wasm_it = m.wasm_command_map.find(key); wasm_it != m.wasm_command_map.end()) {
+      KBOT_TRACE_SPAN(plugin, 2, key);
+      wasm_it->second->Invoke(m, msg);
+    }
+  }
+}
+
+void RefreshCommandMatcher(Manager &m) {
+  uint64_t generation = m.server.command_generation.load(std::memory_order_relaxed);
+  if (m.command_matcher.GetGeneration() == generation) return;
+  std::vector<std::string_view> keys;
+  for (auto &[k, _] : UserCommand::user_command_map) keys.push_back(k);
+  {
+    std::shared_lock lock(m.server.user_command_mtx);
+    for (auto &[k, _] : m.server.user_command_map) keys.push_back(k);
+  }
+  for (auto &[k, _] : m.remote_command_map) keys.push_back(k);
+  for (auto &[k, _] : m.wasm_command_map) keys.push_back(k);
+  m.command_matcher.SetCommands(keys, generation);
+}
+
+// With echo-message our own messages come back, and are never commands
+bool IsEcho(Manager &m, std::string_view nickname) {
+  return m.server.HasCap(kCapEchoMessage) && m.server.IsOwnNickname(nickname);
+}
+
 void BuiltinPrivMsg(Manager &m, const IRCMessagePrivMsg &msg) {
+  auto &params = msg.GetParameters();
+  if (params.size() < 2 || IsEcho(m, msg.GetUser().nickname)) return;
+  RefreshCommandMatcher(m);
+  auto match = m.command_matcher.Resolve(msg.GetChannel(), params[1]);
   try {
-    assert(msg.GetParameters().size() >= 2);
-    auto cb_it = UserCommand::user_command_map.find(msg.GetUserCommand());
-    if (cb_it != UserCommand::user_command_map.end()) {
-      cb_it->second(m, msg);
-    } else {
-      // Take shared_lock here, as taking it early would mean deadlock when invoking plugin
-      // loading/unloading commands, which modify the server's command map (otherwise DEADLOCK)
-      std::shared_lock lock(m.server.user_command_mtx);
-      auto cb_local_it = m.server.user_command_map.find(msg.GetUserCommand());
-      if (cb_local_it != m.server.user_command_map.end()) {
-        cb_local_it->second(m, msg);
+    switch (match.result) {
+      case CommandMatcher::Result::kNotCommand:
+      case CommandMatcher::Result::kUnknown:
+      case CommandMatcher::Result::kDisabled:
+        return;
+      case CommandMatcher::Result::kAmbiguous: {
+        std::string reply = "Ambiguous command, did you mean:";
+        for (auto k : m.command_matcher.GetCandidates(msg.GetChannel(), params[1], 8)) {
+          reply.append(" ").append(k.substr(1));
+        }
+        UserCommand::SendInvokerReply(m, msg, reply);
+        return;
       }
+      case CommandMatcher::Result::kMatched:
+        break;
+    }
+    if (match.key == params[1]) {
+      DispatchCommand(m, msg, match.key);
+      return;
     }
+    // Commands only know their canonical name, so hand them the line as if it had been used
+    std::string_view line = msg.GetLine();
+    size_t pos = params[1].data() - line.data();
+    std::string canonical(line.substr(0, pos));
+    canonical.append(match.key).append(line.substr(pos + params[1].size()));
+    IRCMessagePrivMsg rewritten(IRCMessage(canonical, IRCMessageType::PRIVMSG));
+    DispatchCommand(m, rewritten, match.key);
   } catch (std::out_of_range &) {
-    LOG(ERROR) << "Not enough arguments for user commands, please implement checks";
+    KLOG(Error, "Not enough arguments for user commands, please implement checks");
     return;
   }
 }
@@ -135,11 +686,16 @@ OverloadSet(T...) -> OverloadSet<T...>;
 constexpr auto IRCMessageVisitor = OverloadSet{
     [](Manager &, const std::monostate &) { LOG(ERROR) << "Visitor for monostate called"; },
     [](Manager &, const IRCMessage &) {},
-    [](Manager &m, const IRCMessagePing &msg) { BuiltinPong(m, msg); },
+    [](Manager &m, const IRCMessagePing &msg) { BuiltinPing(m, msg); },
     [](Manager &m, const IRCMessageNick &msg) { BuiltinNickname(m, msg); },
     [](Manager &m, const IRCMessageJoin &msg) { BuiltinJoin(m, msg); },
     [](Manager &m, const IRCMessagePart &msg) { BuiltinPart(m, msg); },
     [](Manager &m, const IRCMessagePrivMsg &msg) { BuiltinPrivMsg(m, msg); },
+    [](Manager &m, const IRCMessageCap &msg) { BuiltinCap(m, msg); },
+    [](Manager &m, const IRCMessageBatch &msg) { BuiltinBatch(m, msg); },
+    [](Manager &m, const IRCMessageAuthenticate &msg) { BuiltinAuthenticate(m, msg); },
+    [](Manager &m, const IRCMessageNumeric &msg) { BuiltinNumeric(m, msg); },
+    [](Manager &m, const IRCMessagePong &msg) { BuiltinPong(m, msg); },
     [](Manager &, const IRCMessageQuit &) {}};
 
 using VisitorBase = decltype(IRCMessageVisitor);
@@ -163,49 +719,230 @@ std::vector<std::string_view> TokenizeMessageMultiple(std::string &msg) {
   return ret;
 }
 
+// Parse errors throw out of the span, which still ends
+IRCMessage ParseTraced(std::string_view line) {
+  KBOT_TRACE_SPAN(parse, line.size(), "");
+  return IRCMessage(line);
+}
+
+// Most lines are chat, which can't be a command once its first byte doesn't start a prefix.
+// ,quit is recognized whatever the prefixes are.
+bool IsPassivePrivMsg(Manager &m, const Message::PrivMsgView &v) {
+  std::string_view word = v.word;
+  if (word.starts_with(':')) word.remove_prefix(1);
+  return !word.starts_with(COMMAND_PREFIX) && !m.command_matcher.MayBeCommand(word);
+}
+
+// Chat only goes to those watching every message and to the patterns it matches, it is parsed
+// only if one of them is there
+void ProcessPassivePrivMsg(Manager &m, std::string_view line, const Message::PrivMsgView &v) {
+  m.server.stats.lines_prefiltered.fetch_add(1, std::memory_order_relaxed);
+  KLOG(Debug, "{}", line);
+  bool matched = false;
+  uint64_t generation = 0;
+  if (m.server.HasPatternSubscribers() && !IsEcho(m, v.nickname)) {
+    std::shared_lock lock(m.server.user_command_mtx);
+    RefreshPatternMatcher(m);
+    generation = m.pattern_matcher.GetGeneration();
+    matched = !m.pattern_matcher.Match(v.target, v.text).empty();
+  }
+  if (!matched && !m.HasReplyWaiters() && !m.server.HasEventSubscribers()) return;
+  IRCMessage msg = ParseTraced(line);
+  if (m.HasReplyWaiters()) m.DeliverReplies(msg);
+  if (m.server.HasEventSubscribers()) PluginEvents(m, msg);
+  if (matched) {
+    msg.message_type = IRCMessageType::PRIVMSG;
+    DispatchPatterns(m, line, IRCMessagePrivMsg(std::move(msg)), generation);
+  }
+}
+
 bool ProcessMessageLine(Manager &m, std::string_view line) try {
-  IRCMessage msg(line);
-  DLOG(INFO) << msg;
+  if (!m.batch_map.empty() && Message::PeekCommand(line) != "BATCH") {
+    if (auto ref = Message::PeekTag(line, "batch")) {
+      if (auto it = m.batch_map.find(*ref);
+          it != m.batch_map.end() && it->second.line_vec.size() < kMaxBatchLines) {
+        it->second.line_vec.emplace_back(line);
+        return true;
+      }
+    }
+  }
+  if (auto v = Message::PeekPrivMsg(line); v && IsPassivePrivMsg(m, *v)) {
+    ProcessPassivePrivMsg(m, line, *v);
+    return true;
+  }
+  IRCMessage msg = ParseTraced(line);
+  KLOG(Debug, "{}", line);
+  if (m.HasReplyWaiters()) m.DeliverReplies(msg);
+  if (m.server.HasEventSubscribers()) PluginEvents(m, msg);
+  KBOT_TRACE_SPAN(dispatch, line.size(), msg.GetCommand());
   auto mv = GetIRCMessageVariantFrom(std::move(msg));
   // Handle termination early
   if (std::holds_alternative<IRCMessageQuit>(mv)) return false;
   std::visit(Visitor{m}, mv);
   return true;
 } catch (std::runtime_error &e) {
-  LOG(INFO) << "Malformed IRCMessage exception: (" << e.what() << ")";
+  KLOG(Info, "Malformed IRCMessage exception: ({})", e.what());
+  m.server.stats.parse_errors.fetch_add(1, std::memory_order_relaxed);
   return true;
 }
 
+namespace {
+
+void LoseConnection(Manager &m);
+
+void OnServerReadable(Manager &m) {
+  auto msg = m.server.RecvMsg();
+  if (!msg) {
+    KLOG(Warning, "Connection to {} closed", m.server.GetAddress());
+    LoseConnection(m);
+    return;
+  }
+  if (msg->empty()) return;
+  auto now = LagWatchdog::Clock::now();
+  m.watchdog.OnReceive(now);
+  auto tok = TokenizeMessageMultiple(*msg);
+  if (m.capture) {
+    for (auto &line : tok) m.capture->Record(line, now);
+  }
+  auto &stats = m.server.stats;
+  stats.bytes_received.fetch_add(msg->size(), std::memory_order_relaxed);
+  stats.lines_received.fetch_add(tok.size(), std::memory_order_relaxed);
+  for (auto &line : tok) {
+    auto start = std::chrono::steady_clock::now();
+    if (!ProcessMessageLine(m, line)) m.quit = true;
+    stats.dispatch_latency.Observe(std::chrono::steady_clock::now() - start);
+    // Lines after a lost connection belong to it
+    if (m.server.GetState() == ServerState::kDisconnected) break;
+  }
+}
+
+void AttachServerFd(Manager &m) {
+  m.RegisterFd(
+      m.server.fd, io::EpollManager::EpollIn, [&m](struct epoll_event) { OnServerReadable(m); },
+      io::EpollManager::EpollConfigDefault);
+}
+
+void TryReconnect(Manager &m);
+
+void ScheduleReconnect(Manager &m) {
+  auto delay = std::max(m.reconnect_delay, std::chrono::seconds(1));
+  m.reconnect_delay = std::min(delay * 2, Manager::kMaxReconnectDelay);
+  KLOG(Info, "Reconnecting to {} in {}s", m.server.GetAddress(), delay.count());
+  m.reconnect_timer = m.AddTimer(delay, [&m] {
+    m.reconnect_timer.reset();
+    TryReconnect(m);
+  });
+}
+
+void TryReconnect(Manager &m) {
+  if (!m.server.Reconnect()) {
+    ScheduleReconnect(m);
+    return;
+  }
+  m.server.stats.reconnects.fetch_add(1, std::memory_order_relaxed);
+  m.watchdog.Reset(LagWatchdog::Clock::now());
+  AttachServerFd(m);
+  // Under the nickname we ended up with, channels are joined again once registered
+  if (m.server.Login(m.server.GetNickname()) < 0) LoseConnection(m);
+}
+
+void LoseConnection(Manager &m) {
+  if (m.server.GetState() == ServerState::kDisconnected) return;
+  m.DeleteFd(m.server.fd);
+  m.server.Disconnect();
+  m.batch_map.clear();
+  // The capture may be all that is left to tell what happened
+  if (m.capture) m.capture->Flush();
+  ScheduleReconnect(m);
+}
+
+void TickCapture(Manager &m) {
+  m.capture->Tick(capture::Clock::now());
+  m.capture_timer = m.AddTimer(capture::Writer::kFlushInterval, [&m] { TickCapture(m); });
+}
+
+void CheckWatchdog(Manager &m) {
+  auto now = LagWatchdog::Clock::now();
+  if (m.server.GetState() != ServerState::kDisconnected) {
+    switch (m.watchdog.Check(now)) {
+      case LagWatchdog::Action::kNone:
+        break;
+      case LagWatchdog::Action::kPing:
+        if (m.server.Ping(m.watchdog.StartPing(now)) >= 0) {
+          m.server.stats.pings_sent.fetch_add(1, std::memory_order_relaxed);
+        }
+        break;
+      case LagWatchdog::Action::kTimeout:
+        KLOG(Warning, "No reply from {} for {}s, reconnecting", m.server.GetAddress(),
+             m.watchdog.GetConfig().timeout.count());
+        m.server.stats.ping_timeouts.fetch_add(1, std::memory_order_relaxed);
+        LoseConnection(m);
+        break;
+    }
+  }
+  m.watchdog_timer = m.AddTimer(m.watchdog.GetCheckInterval(), [&m] { CheckWatchdog(m); });
+}
+
+}  // namespace
+
 void WorkerRun(Manager m) {
   m.server.SetState(ServerState::kConnected);
   Manager::SetupSignalDelivery(m.server.GetAddress());
+  metrics::RegisterServer(&m.server);
   struct Cleanup {
-    ~Cleanup() { Manager::TearDownSignalDelivery(); }
-  } _;
+    Manager &m;
+    ~Cleanup() {
+      if (m.metrics_listener) m.metrics_listener->Detach();
+      metrics::UnregisterServer(&m.server);
+      Manager::TearDownSignalDelivery();
+    }
+  } _{m};
   LOG(INFO) << "Main loop for Server: ";
   // TODO;
   io::EpollManager *mgr = static_cast<io::EpollManager *>(&m);
   if (mgr) {
-    bool r = true;
-    mgr->RegisterFd(
-        m.server.fd, io::EpollManager::EpollIn,
-        [&mm = m, &r](struct epoll_event) {
-          std::string msg(mm.server.RecvMsg());
-          if (msg == "") return;
-          auto tok = TokenizeMessageMultiple(msg);
-          for (auto &line : tok) {
-            r = ProcessMessageLine(mm, line);
-          }
-        },
-        io::EpollManager::EpollConfigDefault);
-    while (r) {
+    if (m.metrics_listener && !m.metrics_listener->Attach(*mgr)) {
+      m.metrics_listener.reset();
+    }
+    int trace_sfd = -1;
+    if (trace::ring_enabled.load(std::memory_order_relaxed)) {
+      trace_sfd = trace::CreateDumpSignalFd();
+      if (trace_sfd >= 0) {
+        mgr->RegisterFd(
+            trace_sfd, io::EpollManager::EpollIn,
+            [trace_sfd](struct epoll_event) { trace::HandleDumpSignal(trace_sfd); },
+            io::EpollManager::EpollConfigDefault);
+      }
+    }
+    AttachServerFd(m);
+    m.watchdog.Reset(LagWatchdog::Clock::now());
+    m.watchdog_timer = m.AddTimer(m.watchdog.GetCheckInterval(), [&m] { CheckWatchdog(m); });
+    if (m.capture) {
+      m.capture_timer = m.AddTimer(capture::Writer::kFlushInterval, [&m] { TickCapture(m); });
+    }
+    for (auto &name : plugin::GetPreloaded()) {
+      bool ok = m.isolate_plugins ? m.LoadPluginHost(name) : m.LoadPlugin(name);
+      if (!ok) KLOG(Error, "Failed to activate preloaded plugin {}", name);
+    }
+    while (!m.quit) {
       int k = mgr->RunEventLoop(-1);
       if (k < 0) {
         PLOG(ERROR) << "Exiting event loop";
         break;
       }
     }
+    // Commands still waiting for a reply finish now, while the loop their timers are on is around
+    m.CancelReplyWaiters();
+    // Plugin timers are cancelled on the event loop, deactivate them while it's still around
+    {
+      std::unique_lock lock(m.server.plugins_map_mtx);
+      m.server.plugins_map.clear();
+    }
     mgr->DeleteFd(m.server.fd);
+    if (trace_sfd >= 0) {
+      mgr->DeleteFd(trace_sfd);
+      close(trace_sfd);
+    }
   } else {
     LOG(ERROR) << "Failed to setup EpollManager instance";
     return;
@@ -7,32 +7,101 @@
 #include <sys/signalfd.h>
 #include <sys/timerfd.h>
 
+#include <CGroup.hh>
+#include <Capture.hh>
+#include <CommandMatcher.hh>
 #include <Epoll.hh>
+#include <Http.hh>
+#include <Metrics.hh>
+#include <PatternMatcher.hh>
+#include <PluginHost.hh>
 #include <Server.hh>
+#include <Task.hh>
+#include <WasmPlugin.hh>
+#include <Watchdog.hh>
 #include <atomic>
 #include <cassert>
+#include <chrono>
 #include <condition_variable>
 #include <deque>
+#include <memory>
 #include <mutex>
+#include <optional>
+#include <string_view>
 #include <thread>
 #include <type_traits>
 #include <unordered_map>
 #include <unordered_set>
 #include <utility>
+#include <vector>
 
 namespace kbot {
 
 using io::EpollManager;
 
+// Describes a server reply a coroutine is waiting for: any of the commands (usually numerics), and
+// optionally the target, i.e. the first parameter after our own nickname, compared ignoring case.
+struct ReplyFilter {
+  std::vector<std::string> commands;
+  std::string target;
+};
+
+class ReplyAwaiter;
+
 // NOTE: Make sure createNew is called in context of thread owning
 // the instance. This essentially means that copying or moving this
 // instance across threads has broken semantics. Threads owning these
 // instances handle all signals through the respective signalfd anyway.
+// Coroutines, timers and reply waits capture the instance, so only start them from WorkerRun,
+// once it has reached its final address.
 class Manager : public EpollManager {
-  explicit Manager(int fd, Server &&server) : EpollManager(fd), server(std::move(server)) {}
+  explicit Manager(int fd, Server &&server);
+
+  absl::flat_hash_map<std::string, std::vector<ReplyAwaiter *>> reply_waiter_map;
+  friend ReplyAwaiter;
 
  public:
   Server server;
+  // Optional /metrics endpoint, attached to this instance's event loop by WorkerRun
+  std::unique_ptr<metrics::Listener> metrics_listener;
+  // Shared by all plugins on this thread, created on first use
+  std::unique_ptr<http::Engine> http_engine;
+  // Load plugins into child processes instead (see PluginHost), optionally each in a cgroup
+  // governed by governor
+  bool isolate_plugins = false;
+  std::unique_ptr<cgroup::Governor> governor;
+  std::optional<io::TimerId> governor_timer;
+  absl::flat_hash_map<std::string, std::unique_ptr<PluginHost>> plugin_host_map;
+  // Commands registered by plugin hosts, the host owning each
+  absl::flat_hash_map<std::string, PluginHost *> remote_command_map;
+  // Sandboxed already, so loaded in-process even when isolate_plugins is set
+  absl::flat_hash_map<std::string, std::unique_ptr<WasmPlugin>> wasm_plugin_map;
+  absl::flat_hash_map<std::string, WasmPlugin *> wasm_command_map;
+  // Maps the first word of a PRIVMSG to the command key for all of the maps above, rebuilt when
+  // server.command_generation moves
+  CommandMatcher command_matcher;
+  // Open IRCv3 batches by reference, the lines in them are held back until they end
+  struct Batch {
+    std::string type;
+    std::vector<std::string> line_vec;
+  };
+  absl::flat_hash_map<std::string, Batch> batch_map;
+  // All patterns of the plugins loaded on this server, rebuilt when server.pattern_generation moves
+  PatternMatcher pattern_matcher;
+  // Pings the server when it's quiet and reconnects once it stops answering, with the delay
+  // doubling between failed attempts
+  LagWatchdog watchdog;
+  std::optional<io::TimerId> watchdog_timer;
+  std::optional<io::TimerId> reconnect_timer;
+  std::chrono::seconds reconnect_delay{0};
+  static constexpr std::chrono::seconds kMaxReconnectDelay{300};
+  // Nicknames tried in place of a refused one before giving up on registration
+  static constexpr int kMaxNickRetries = 5;
+  // Records every line received from the server when set (see Capture.hh)
+  std::unique_ptr<capture::Writer> capture;
+  std::optional<io::TimerId> capture_timer;
+  // Set when the server or a user told us to quit, ends the event loop
+  bool quit = false;
 
   Manager(const Manager &) = delete;
   Manager &operator=(const Manager &) = delete;
@@ -41,10 +110,51 @@ class Manager : public EpollManager {
   ~Manager() = default;
 
   static Manager CreateNew(Server &&server);
+  // Suspends the calling coroutine until a matching reply arrives, resuming with a copy of it, or
+  // with std::nullopt once timeout expires (a zero timeout waits forever)
+  ReplyAwaiter WaitReply(ReplyFilter filter, std::chrono::nanoseconds timeout);
+  void DeliverReplies(const IRCMessage &msg);
+  bool HasReplyWaiters() const { return !reply_waiter_map.empty(); }
+  // Resumes every pending wait with std::nullopt as if it had timed out, so that the coroutines
+  // behind them finish before the instance goes away
+  void CancelReplyWaiters();
+  // Returns nullptr if the engine could not be created
+  http::Engine *GetHttpEngine();
+  // Activates the plugin on this server, opening it through the registry if needed
+  bool LoadPlugin(std::string_view name);
+  bool UnloadPlugin(std::string_view name);
+  bool LoadPluginHost(std::string_view name);
+  bool UnloadPluginHost(std::string_view name);
+  bool LoadWasmPlugin(std::string_view name);
+  bool UnloadWasmPlugin(std::string_view name);
+  // Compiles the module's current file and swaps it in, the loaded one stays if that fails
+  bool ReloadWasmPlugin(std::string_view name);
+  // Samples the governed plugins, publishing their usage and unloading those out of strikes
+  void SampleGovernor();
   static void SetupSignalDelivery(std::string_view server_name);
   static void TearDownSignalDelivery();
 };
 
+class ReplyAwaiter {
+  Manager &m;
+  ReplyFilter filter;
+  std::chrono::nanoseconds timeout;
+  std::optional<io::TimerId> timer;
+  std::optional<IRCMessage> result;
+  std::coroutine_handle<> h;
+
+  friend Manager;
+  bool Matches(const IRCMessage &msg) const;
+  void Detach();
+
+ public:
+  ReplyAwaiter(Manager &m, ReplyFilter filter, std::chrono::nanoseconds timeout)
+      : m(m), filter(std::move(filter)), timeout(timeout) {}
+  bool await_ready() const noexcept { return filter.commands.empty(); }
+  void await_suspend(std::coroutine_handle<> handle);
+  std::optional<IRCMessage> await_resume() { return std::move(result); }
+};
+
 // clang-format off
 template <class T, class... Args>
 concept ServerThreadCallable = requires (T t, Args...) {
@@ -96,6 +206,8 @@ struct ThreadCleanupSelf {
   }
 };
 
+// Handles one line from the server, returns false once it told us to quit
+bool ProcessMessageLine(Manager &m, std::string_view line);
 void WorkerRun(Manager m);
 
 }  // namespace kbot
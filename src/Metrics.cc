@@ -0,0 +1,416 @@
+#include <arpa/inet.h>
+#include <fmt/format.h>
+#include <glog/logging.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <Epoll.hh>
+#include <Metrics.hh>
+#include <Server.hh>
+#include <algorithm>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace kbot {
+namespace metrics {
+
+// Histogram
+
+void Histogram::Observe(std::chrono::nanoseconds d) {
+  double sec = std::chrono::duration<double>(d).count();
+  auto it = std::lower_bound(bounds.begin(), bounds.end(), sec);
+  buckets[it - bounds.begin()].fetch_add(1, std::memory_order_relaxed);
+  sum_ns.fetch_add(static_cast<uint64_t>(d.count()), std::memory_order_relaxed);
+}
+
+void Histogram::Render(std::string &out, std::string_view name, std::string_view labels) const {
+  std::string_view sep = labels.empty() ? "" : ",";
+  uint64_t cumulative = 0;
+  for (size_t i = 0; i < bounds.size(); i++) {
+    cumulative += buckets[i].load(std::memory_order_relaxed);
+    out += fmt::format("{}_bucket{{{}{}le=\"{}\"}} {}\n", name, labels, sep, bounds[i],
+                       cumulative);
+  }
+  cumulative += buckets[bounds.size()].load(std::memory_order_relaxed);
+  out += fmt::format("{}_bucket{{{}{}le=\"+Inf\"}} {}\n", name, labels, sep, cumulative);
+  out += fmt::format("{}_sum{{{}}} {}\n", name, labels,
+                     static_cast<double>(sum_ns.load(std::memory_order_relaxed)) / 1e9);
+  out += fmt::format("{}_count{{{}}} {}\n", name, labels, cumulative);
+}
+
+// Registry
+
+namespace {
+
+std::mutex registry_mtx;
+std::vector<Server *> registry;
+
+std::string EscapeLabel(std::string_view v) {
+  std::string r;
+  r.reserve(v.size());
+  for (char c : v) {
+    if (c == '\\' || c == '"') {
+      r.push_back('\\');
+      r.push_back(c);
+    } else if (c == '\n') {
+      r.append("\\n");
+    } else {
+      r.push_back(c);
+    }
+  }
+  return r;
+}
+
+void Family(std::string &out, std::string_view name, std::string_view type, std::string_view help) {
+  out += fmt::format("# HELP {} {}\n# TYPE {} {}\n", name, help, name, type);
+}
+
+}  // namespace
+
+void RegisterServer(Server *s) {
+  std::unique_lock lock(registry_mtx);
+  registry.push_back(s);
+}
+
+void UnregisterServer(Server *s) {
+  std::unique_lock lock(registry_mtx);
+  std::erase(registry, s);
+}
+
+std::string RenderAll() {
+  struct Snapshot {
+    std::string label;
+    ServerState state;
+    Server::ChannelCount chans;
+    std::vector<std::string> plugins;
+    std::vector<std::pair<std::string, PluginUsage>> usage;
+    const Server *s;
+  };
+  std::unique_lock lock(registry_mtx);
+  std::vector<Snapshot> snap;
+  snap.reserve(registry.size());
+  for (auto s : registry) {
+    snap.push_back({fmt::format("server=\"{}\"", EscapeLabel(fmt::format("{}/{}", s->GetAddress(),
+                                                                           s->GetPort()))),
+                    s->GetState(), s->GetChannelCount(), s->GetPluginNames(), {}, s});
+    std::unique_lock usage_lock(s->stats.plugin_usage_mtx);
+    snap.back().usage.assign(s->stats.plugin_usage_map.begin(), s->stats.plugin_usage_map.end());
+  }
+
+  std::string out;
+  Family(out, "kbot_server_state", "gauge", "Connection state of the server, 1 for the current.");
+  for (auto &p : snap) {
+    for (int i = 0; i < static_cast<int>(ServerState::kMax); i++) {
+      auto st = static_cast<ServerState>(i);
+      out += fmt::format("kbot_server_state{{{},state=\"{}\"}} {}\n", p.label,
+                         Server::StateToString(st), st == p.state ? 1 : 0);
+    }
+  }
+  Family(out, "kbot_channels", "gauge", "Number of channels in chan_map, by state.");
+  for (auto &p : snap) {
+    out += fmt::format("kbot_channels{{{},state=\"join_requested\"}} {}\n", p.label,
+                       p.chans.join_requested);
+    out += fmt::format("kbot_channels{{{},state=\"joined\"}} {}\n", p.label, p.chans.joined);
+    out += fmt::format("kbot_channels{{{},state=\"part_requested\"}} {}\n", p.label,
+                       p.chans.part_requested);
+    out += fmt::format("kbot_channels{{{},state=\"join_failed\"}} {}\n", p.label,
+                       p.chans.join_failed);
+  }
+  Family(out, "kbot_plugins_loaded", "gauge", "Number of plugins loaded for the server.");
+  for (auto &p : snap) {
+    out += fmt::format("kbot_plugins_loaded{{{}}} {}\n", p.label, p.plugins.size());
+  }
+  Family(out, "kbot_plugin_info", "gauge", "Plugins currently present in plugins_map.");
+  for (auto &p : snap) {
+    for (auto &name : p.plugins) {
+      out += fmt::format("kbot_plugin_info{{{},plugin=\"{}\"}} 1\n", p.label, EscapeLabel(name));
+    }
+  }
+
+  auto counter = [&](std::string_view name, std::string_view help, auto get) {
+    Family(out, name, "counter", help);
+    for (auto &p : snap) {
+      out += fmt::format("{}{{{}}} {}\n", name, p.label, get(*p.s));
+    }
+  };
+  counter("kbot_lines_received_total", "IRC lines received from the server.",
+          [](const Server &s) { return s.stats.lines_received.load(std::memory_order_relaxed); });
+  counter("kbot_bytes_received_total", "Bytes received from the server.",
+          [](const Server &s) { return s.stats.bytes_received.load(std::memory_order_relaxed); });
+  counter("kbot_parse_errors_total", "Lines that failed to parse as an IRCMessage.",
+          [](const Server &s) { return s.stats.parse_errors.load(std::memory_order_relaxed); });
+  counter("kbot_lines_prefiltered_total", "PRIVMSG lines rejected as not a command before parsing.",
+          [](const Server &s) {
+            return s.stats.lines_prefiltered.load(std::memory_order_relaxed);
+          });
+  counter("kbot_pings_sent_total", "PINGs sent to measure lag and check the connection.",
+          [](const Server &s) { return s.stats.pings_sent.load(std::memory_order_relaxed); });
+  counter("kbot_ping_timeouts_total", "Connections given up on for not answering a PING.",
+          [](const Server &s) { return s.stats.ping_timeouts.load(std::memory_order_relaxed); });
+  counter("kbot_reconnects_total", "Connections reestablished after losing one.",
+          [](const Server &s) { return s.stats.reconnects.load(std::memory_order_relaxed); });
+  counter("kbot_messages_sent_total", "Send calls issued to the server.",
+          [](const Server &s) { return s.sent_msgs.load(std::memory_order_relaxed); });
+  counter("kbot_bytes_sent_total", "Bytes sent to the server.",
+          [](const Server &s) { return s.sent_bytes.load(std::memory_order_relaxed); });
+
+  auto plugin_family = [&](std::string_view name, std::string_view type, std::string_view help,
+                           auto get) {
+    Family(out, name, type, help);
+    for (auto &p : snap) {
+      for (auto &[plugin, u] : p.usage) {
+        out += fmt::format("{}{{{},plugin=\"{}\"}} {}\n", name, p.label, EscapeLabel(plugin),
+                           get(u));
+      }
+    }
+  };
+  plugin_family("kbot_plugin_cpu_seconds_total", "counter",
+                "CPU time used by the cgroup of an isolated plugin.",
+                [](const PluginUsage &u) { return static_cast<double>(u.cpu_usec) / 1e6; });
+  plugin_family("kbot_plugin_cpu_throttled_seconds_total", "counter",
+                "Time an isolated plugin spent throttled by cpu.max.",
+                [](const PluginUsage &u) { return static_cast<double>(u.throttled_usec) / 1e6; });
+  plugin_family("kbot_plugin_memory_bytes", "gauge",
+                "memory.current of the cgroup of an isolated plugin.",
+                [](const PluginUsage &u) { return u.memory_bytes; });
+  plugin_family("kbot_plugin_budget_strikes", "gauge",
+                "Sampling intervals an isolated plugin exceeded its limits in, net of clean ones.",
+                [](const PluginUsage &u) { return u.strikes; });
+
+  Family(out, "kbot_lag_seconds", "gauge", "Last measured round trip to the server, -1 if none.");
+  for (auto &p : snap) {
+    auto lag = p.s->stats.lag_ns.load(std::memory_order_relaxed);
+    out += fmt::format("kbot_lag_seconds{{{}}} {}\n", p.label,
+                       lag < 0 ? -1.0 : static_cast<double>(lag) / 1e9);
+  }
+  Family(out, "kbot_ping_round_trip_seconds", "histogram",
+         "Time from sending a PING to the server until its PONG arrived.");
+  for (auto &p : snap) p.s->stats.lag.Render(out, "kbot_ping_round_trip_seconds", p.label);
+  Family(out, "kbot_dispatch_latency_seconds", "histogram",
+         "Time taken to parse and dispatch a single IRC line.");
+  for (auto &p : snap) {
+    p.s->stats.dispatch_latency.Render(out, "kbot_dispatch_latency_seconds", p.label);
+  }
+  return out;
+}
+
+// Listener
+
+namespace {
+
+int ListenUnix(std::string_view path) {
+  struct sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr.sun_path)) {
+    LOG(ERROR) << "Metrics socket path too long: " << path;
+    return -1;
+  }
+  std::memcpy(addr.sun_path, path.data(), path.size());
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) return -1;
+  unlink(addr.sun_path);
+  if (bind(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) < 0 ||
+      listen(fd, 16) < 0) {
+    PLOG(ERROR) << "Failed to bind metrics socket " << path;
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+int ListenTcp(std::string_view endpoint) {
+  std::string host = "127.0.0.1";
+  std::string_view port_str = endpoint;
+  if (auto i = endpoint.rfind(':'); i != endpoint.npos) {
+    host = endpoint.substr(0, i);
+    port_str = endpoint.substr(i + 1);
+    if (host.size() >= 2 && host.front() == '[' && host.back() == ']') {
+      host = host.substr(1, host.size() - 2);
+    }
+  }
+  int port = 0;
+  try {
+    port = std::stoi(std::string(port_str));
+  } catch (std::exception &) {
+    port = -1;
+  }
+  if (port <= 0 || port > UINT16_MAX) {
+    LOG(ERROR) << "Invalid metrics endpoint: " << endpoint;
+    return -1;
+  }
+
+  struct sockaddr_storage ss = {};
+  socklen_t len;
+  auto *in4 = reinterpret_cast<struct sockaddr_in *>(&ss);
+  auto *in6 = reinterpret_cast<struct sockaddr_in6 *>(&ss);
+  if (inet_pton(AF_INET, host.c_str(), &in4->sin_addr) == 1) {
+    in4->sin_family = AF_INET;
+    in4->sin_port = htons(static_cast<uint16_t>(port));
+    len = sizeof(*in4);
+  } else if (inet_pton(AF_INET6, host.c_str(), &in6->sin6_addr) == 1) {
+    in6->sin6_family = AF_INET6;
+    in6->sin6_port = htons(static_cast<uint16_t>(port));
+    len = sizeof(*in6);
+  } else {
+    LOG(ERROR) << "Metrics endpoint must be a numeric loopback address: " << host;
+    return -1;
+  }
+  // Scrapes aren't authenticated, so they only come from this host
+  if (ss.ss_family == AF_INET ? ntohl(in4->sin_addr.s_addr) >> 24 != IN_LOOPBACKNET
+                              : !IN6_IS_ADDR_LOOPBACK(&in6->sin6_addr)) {
+    LOG(ERROR) << "Metrics endpoint must be a numeric loopback address: " << host;
+    return -1;
+  }
+
+  int fd = socket(ss.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) return -1;
+  int one = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  if (bind(fd, reinterpret_cast<struct sockaddr *>(&ss), len) < 0 || listen(fd, 16) < 0) {
+    PLOG(ERROR) << "Failed to bind metrics endpoint " << endpoint;
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+std::string HttpResponse(std::string_view status, std::string_view content_type,
+                         std::string_view body) {
+  return fmt::format(
+      "HTTP/1.1 {}\r\nContent-Type: {}\r\nContent-Length: {}\r\nConnection: close\r\n\r\n{}",
+      status, content_type, body.size(), body);
+}
+
+constexpr size_t kMaxRequestSize = 8192;
+
+}  // namespace
+
+std::unique_ptr<Listener> Listener::CreateNew(std::string_view endpoint) {
+  std::unique_ptr<Listener> l(new Listener(std::string(endpoint)));
+  if (endpoint.starts_with("unix:")) {
+    l->unix_path = endpoint.substr(5);
+    l->fd = ListenUnix(l->unix_path);
+  } else {
+    l->fd = ListenTcp(endpoint);
+  }
+  if (l->fd < 0) return nullptr;
+  LOG(INFO) << "Metrics listener bound to " << endpoint;
+  return l;
+}
+
+Listener::~Listener() {
+  Detach();
+  if (fd >= 0) {
+    close(fd);
+    if (!unix_path.empty()) unlink(unix_path.c_str());
+  }
+}
+
+bool Listener::Attach(io::EpollManager &m) {
+  assert(mgr == nullptr);
+  if (!m.RegisterFd(
+          fd, io::EpollManager::EpollIn, [this](struct epoll_event) { OnAccept(); },
+          io::EpollManager::EpollConfigDefault)) {
+    PLOG(ERROR) << "Failed to register metrics listener";
+    return false;
+  }
+  mgr = &m;
+  return true;
+}
+
+void Listener::Detach() {
+  if (mgr == nullptr) return;
+  for (auto &p : conn_map) {
+    mgr->DeleteFd(p.first);
+    close(p.first);
+  }
+  conn_map.clear();
+  mgr->DeleteFd(fd);
+  mgr = nullptr;
+}
+
+void Listener::OnAccept() {
+  for (;;) {
+    int cfd = accept4(fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (cfd < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK) PLOG(ERROR) << "Failed to accept scrape";
+      return;
+    }
+    if (!mgr->RegisterFd(
+            cfd, io::EpollManager::EpollIn,
+            [this, cfd](struct epoll_event ev) {
+              if (ev.events & EPOLLOUT) {
+                OnWritable(cfd);
+              } else {
+                OnReadable(cfd);
+              }
+            },
+            io::EpollManager::EpollConfigDefault)) {
+      close(cfd);
+      continue;
+    }
+    conn_map[cfd];
+  }
+}
+
+void Listener::OnReadable(int cfd) {
+  auto &c = conn_map[cfd];
+  char buf[1024];
+  for (;;) {
+    ssize_t r = recv(cfd, buf, sizeof(buf), 0);
+    if (r > 0) {
+      c.in.append(buf, static_cast<size_t>(r));
+      if (c.in.size() > kMaxRequestSize) break;
+      continue;
+    }
+    if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+    CloseConnection(cfd);
+    return;
+  }
+  if (c.in.size() <= kMaxRequestSize && c.in.find("\r\n\r\n") == c.in.npos) return;
+
+  std::string_view req = c.in;
+  std::string_view request_line = req.substr(0, req.find("\r\n"));
+  if (c.in.size() > kMaxRequestSize) {
+    c.out = HttpResponse("431 Request Header Fields Too Large", "text/plain", "");
+  } else if (!request_line.starts_with("GET ")) {
+    c.out = HttpResponse("405 Method Not Allowed", "text/plain", "Only GET is supported\n");
+  } else if (request_line.starts_with("GET /metrics ") ||
+             request_line.starts_with("GET /metrics?")) {
+    c.out = HttpResponse("200 OK", "text/plain; version=0.0.4; charset=utf-8", RenderAll());
+  } else {
+    c.out = HttpResponse("404 Not Found", "text/plain", "Try /metrics\n");
+  }
+  c.in.clear();
+  OnWritable(cfd);
+}
+
+void Listener::OnWritable(int cfd) {
+  auto &c = conn_map[cfd];
+  while (c.off < c.out.size()) {
+    ssize_t r = send(cfd, c.out.data() + c.off, c.out.size() - c.off, MSG_NOSIGNAL);
+    if (r < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        mgr->ModifyFdEvents(cfd, io::EpollManager::EpollOut);
+        return;
+      }
+      break;
+    }
+    c.off += static_cast<size_t>(r);
+  }
+  CloseConnection(cfd);
+}
+
+void Listener::CloseConnection(int cfd) {
+  mgr->DeleteFd(cfd);
+  conn_map.erase(cfd);
+  close(cfd);
+}
+
+}  // namespace metrics
+}  // namespace kbot
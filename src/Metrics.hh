@@ -0,0 +1,131 @@
+#pragma once
+
+#include <absl/container/flat_hash_map.h>
+
+#include <Epoll.hh>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <string_view>
+
+namespace kbot {
+
+class Server;
+
+namespace metrics {
+
+// Histogram
+// Fixed bucket latency histogram in the Prometheus layout. It is written by the owning server
+// thread and read concurrently by the metrics listener, so everything is a relaxed atomic. The
+// count is the total of the buckets, a scrape may observe a sum one sample off from it, which
+// Prometheus tolerates.
+
+class Histogram {
+ public:
+  static constexpr std::array<double, 14> kBounds = {
+      0.00005, 0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005,
+      0.01,    0.025,  0.05,    0.1,    0.25,  0.5,    1.0,
+  };
+  // For round trips to the server
+  static constexpr std::array<double, kBounds.size()> kLagBounds = {
+      0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1.0, 2.5, 5.0, 10.0, 20.0, 30.0, 60.0, 90.0,
+  };
+  using Bounds = std::span<const double, kBounds.size()>;
+
+ private:
+  Bounds bounds;
+  std::array<std::atomic<uint64_t>, kBounds.size() + 1> buckets = {};
+  std::atomic<uint64_t> sum_ns = 0;
+
+ public:
+  explicit Histogram(Bounds bounds = kBounds) : bounds(bounds) {}
+  Histogram(const Histogram &) = delete;
+  Histogram &operator=(const Histogram &) = delete;
+
+  void Observe(std::chrono::nanoseconds d);
+  void Render(std::string &out, std::string_view name, std::string_view labels) const;
+};
+
+// ServerStats
+// Counters maintained by the server thread for its connection, exported by the listener.
+
+// Resource usage of a plugin running in its own cgroup, as last sampled by the governor
+struct PluginUsage {
+  uint64_t cpu_usec = 0;
+  uint64_t throttled_usec = 0;
+  uint64_t memory_bytes = 0;
+  unsigned strikes = 0;
+};
+
+struct ServerStats {
+  std::atomic<uint64_t> lines_received = 0;
+  std::atomic<uint64_t> bytes_received = 0;
+  std::atomic<uint64_t> parse_errors = 0;
+  // PRIVMSGs turned away as not a command before the full parse
+  std::atomic<uint64_t> lines_prefiltered = 0;
+  Histogram dispatch_latency;
+  // Round trips of our PINGs (see LagWatchdog), the last one in lag_ns, -1 before the first
+  Histogram lag{Histogram::kLagBounds};
+  std::atomic<int64_t> lag_ns = -1;
+  std::atomic<uint64_t> pings_sent = 0;
+  std::atomic<uint64_t> ping_timeouts = 0;
+  std::atomic<uint64_t> reconnects = 0;
+  std::mutex plugin_usage_mtx;
+  absl::flat_hash_map<std::string, PluginUsage> plugin_usage_map;
+
+  ServerStats() = default;
+  ServerStats(const ServerStats &) = delete;
+  ServerStats &operator=(const ServerStats &) = delete;
+};
+
+// Servers register themselves for the lifetime of their worker thread so a single listener can
+// export every network the process is connected to.
+void RegisterServer(Server *s);
+void UnregisterServer(Server *s);
+std::string RenderAll();
+
+// Listener
+// Minimal HTTP/1.1 endpoint serving /metrics, either on a Unix socket ("unix:/path") or on a TCP
+// loopback address ("127.0.0.1:9100", "[::1]:9100", or just a port). All sockets are non-blocking
+// and driven by the EpollManager of the thread it is attached to; no threads are created.
+
+class Listener {
+  struct Connection {
+    std::string in;
+    std::string out;
+    size_t off = 0;
+  };
+
+  int fd = -1;
+  std::string endpoint;
+  std::string unix_path;
+  io::EpollManager *mgr = nullptr;
+  absl::flat_hash_map<int, Connection> conn_map;
+
+  explicit Listener(std::string endpoint) : endpoint(std::move(endpoint)) {}
+  void OnAccept();
+  void OnReadable(int cfd);
+  void OnWritable(int cfd);
+  void CloseConnection(int cfd);
+
+ public:
+  Listener(const Listener &) = delete;
+  Listener &operator=(const Listener &) = delete;
+  Listener(Listener &&) = delete;
+  Listener &operator=(Listener &&) = delete;
+  ~Listener();
+
+  static std::unique_ptr<Listener> CreateNew(std::string_view endpoint);
+  // Must be called once the EpollManager has reached its final address, i.e. from the thread
+  // running its event loop.
+  bool Attach(io::EpollManager &m);
+  void Detach();
+};
+
+}  // namespace metrics
+}  // namespace kbot
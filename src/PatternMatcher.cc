@@ -0,0 +1,176 @@
+#include <PatternMatcher.hh>
+#include <algorithm>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace kbot {
+
+namespace {
+
+constexpr uint32_t kNoState = UINT32_MAX;
+
+char AsciiLower(char c) { return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c; }
+
+}  // namespace
+
+std::vector<size_t> PatternMatcher::SetPatterns(std::span<const Pattern> patterns,
+                                                uint64_t generation) {
+  channel_vec.clear();
+  for (auto &p : patterns) channel_vec.emplace_back(p.channel);
+  BuildKeywords(patterns);
+  auto failed = BuildRegexes(patterns);
+  this->generation = generation;
+  return failed;
+}
+
+void PatternMatcher::BuildKeywords(std::span<const Pattern> patterns) {
+  keyword_vec.clear();
+  byte_class.fill(0);
+  class_count = 1;
+  for (size_t i = 0; i < patterns.size(); i++) {
+    auto &p = patterns[i];
+    if (p.regex || p.pattern.empty()) continue;
+    keyword_vec.push_back({i, p.pattern.size()});
+    for (char c : p.pattern) {
+      auto lower = static_cast<unsigned char>(AsciiLower(c));
+      if (byte_class[lower]) continue;
+      // Upper case letters share the class of their lower case one, so there are never more than
+      // 256 - 26 classes besides 0
+      byte_class[lower] = static_cast<uint8_t>(class_count++);
+      if (lower >= 'a' && lower <= 'z') byte_class[lower - 'a' + 'A'] = byte_class[lower];
+    }
+  }
+
+  // Trie of the keywords, with the transitions it lacks filled in below
+  delta.assign(class_count, kNoState);
+  std::vector<std::vector<uint32_t>> out(1);
+  for (uint32_t k = 0; k < keyword_vec.size(); k++) {
+    uint32_t s = 0;
+    for (char c : patterns[keyword_vec[k].index].pattern) {
+      uint32_t &next = delta[s * class_count + byte_class[static_cast<unsigned char>(c)]];
+      if (next == kNoState) {
+        next = static_cast<uint32_t>(out.size());
+        out.emplace_back();
+        delta.resize(delta.size() + class_count, kNoState);
+      }
+      s = delta[s * class_count + byte_class[static_cast<unsigned char>(c)]];
+    }
+    out[s].push_back(k);
+  }
+
+  // Breadth first, so the state a failure leads to is complete by the time it's needed
+  std::vector<uint32_t> fail(out.size(), 0);
+  std::deque<uint32_t> queue;
+  for (size_t a = 0; a < class_count; a++) {
+    uint32_t &t = delta[a];
+    if (t == kNoState) {
+      t = 0;
+    } else {
+      queue.push_back(t);
+    }
+  }
+  while (!queue.empty()) {
+    uint32_t s = queue.front();
+    queue.pop_front();
+    for (size_t a = 0; a < class_count; a++) {
+      uint32_t &t = delta[s * class_count + a];
+      uint32_t f = delta[fail[s] * class_count + a];
+      if (t == kNoState) {
+        t = f;
+        continue;
+      }
+      fail[t] = f;
+      out[t].insert(out[t].end(), out[f].begin(), out[f].end());
+      queue.push_back(t);
+    }
+  }
+
+  out_begin.assign(1, 0);
+  out_vec.clear();
+  for (auto &o : out) {
+    out_vec.insert(out_vec.end(), o.begin(), o.end());
+    out_begin.push_back(static_cast<uint32_t>(out_vec.size()));
+  }
+  seen_vec.assign(keyword_vec.size(), 0);
+  seen_stamp = 0;
+}
+
+std::vector<size_t> PatternMatcher::BuildRegexes(std::span<const Pattern> patterns) {
+  std::vector<size_t> failed;
+  regex_vec.clear();
+  regex_set.reset();
+  RE2::Options options;
+  options.set_log_errors(false);
+  auto set = std::make_unique<RE2::Set>(options, RE2::UNANCHORED);
+  for (size_t i = 0; i < patterns.size(); i++) {
+    auto &p = patterns[i];
+    if (!p.regex) continue;
+    auto re = std::make_unique<RE2>(re2::StringPiece(p.pattern.data(), p.pattern.size()), options);
+    // Same index as in the set
+    if (!re->ok() || set->Add(re->pattern(), nullptr) < 0) {
+      failed.push_back(i);
+      continue;
+    }
+    regex_vec.push_back({i, std::move(re)});
+  }
+  if (regex_vec.empty()) return failed;
+  if (!set->Compile()) {
+    // Out of memory for the combined automaton
+    for (auto &r : regex_vec) failed.push_back(r.index);
+    std::sort(failed.begin(), failed.end());
+    regex_vec.clear();
+    return failed;
+  }
+  regex_set = std::move(set);
+  return failed;
+}
+
+bool PatternMatcher::InChannel(size_t index, std::string_view channel) const {
+  std::string_view c = channel_vec[index];
+  return c.empty() ||
+         std::equal(c.begin(), c.end(), channel.begin(), channel.end(),
+                    [](char x, char y) { return AsciiLower(x) == AsciiLower(y); });
+}
+
+std::span<const PatternMatcher::Hit> PatternMatcher::Match(std::string_view channel,
+                                                           std::string_view text) {
+  hit_vec.clear();
+  if (!keyword_vec.empty()) {
+    if (++seen_stamp == 0) {
+      std::fill(seen_vec.begin(), seen_vec.end(), 0);
+      seen_stamp = 1;
+    }
+    uint32_t s = 0;
+    for (size_t i = 0; i < text.size(); i++) {
+      s = delta[s * class_count + byte_class[static_cast<unsigned char>(text[i])]];
+      for (uint32_t o = out_begin[s]; o < out_begin[s + 1]; o++) {
+        uint32_t k = out_vec[o];
+        if (seen_vec[k] == seen_stamp) continue;
+        seen_vec[k] = seen_stamp;
+        auto &kw = keyword_vec[k];
+        if (InChannel(kw.index, channel)) {
+          hit_vec.push_back({kw.index, text.substr(i + 1 - kw.size, kw.size)});
+        }
+      }
+    }
+  }
+  if (regex_set && regex_set->Match(re2::StringPiece(text.data(), text.size()), &set_hit_vec)) {
+    for (int j : set_hit_vec) {
+      auto &r = regex_vec[j];
+      if (!InChannel(r.index, channel)) continue;
+      re2::StringPiece m;
+      if (r.re->Match(re2::StringPiece(text.data(), text.size()), 0, text.size(), RE2::UNANCHORED,
+                      &m, 1)) {
+        hit_vec.push_back({r.index, std::string_view(m.data(), m.size())});
+      }
+    }
+  }
+  std::sort(hit_vec.begin(), hit_vec.end(),
+            [](const Hit &a, const Hit &b) { return a.index < b.index; });
+  return hit_vec;
+}
+
+}  // namespace kbot
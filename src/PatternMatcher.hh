@@ -0,0 +1,98 @@
+#pragma once
+
+#include <re2/re2.h>
+#include <re2/set.h>
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace kbot {
+
+// PatternMatcher
+// Matches the text of a message against all patterns plugins subscribed to at once, so the cost
+// per message depends on the length of the text and not on the number of patterns:
+//   - keywords, found anywhere in the text ignoring ASCII case, by one Aho-Corasick automaton
+//   - regular expressions (RE2 syntax, unanchored), by one RE2::Set
+// Only the regexes the set reports are run again on their own to find what they matched. A
+// pattern may be limited to one channel, which is checked for matches only.
+//
+// One instance belongs to one server thread, Match reuses buffers of it.
+
+class PatternMatcher {
+ public:
+  struct Pattern {
+    bool regex = false;
+    std::string_view pattern;
+    // Empty for every channel
+    std::string_view channel;
+  };
+  struct Hit {
+    // Index of the pattern as passed to SetPatterns
+    size_t index;
+    // First occurrence of a keyword, or what a regex matched, as a view into the text
+    std::string_view match;
+  };
+
+ private:
+  struct Keyword {
+    size_t index;
+    size_t size;
+  };
+  struct Regex {
+    size_t index;
+    std::unique_ptr<RE2> re;
+  };
+
+  // Aho-Corasick automaton with the transitions of every state filled in, over classes of the
+  // bytes that appear in keywords (class 0 for all others)
+  std::array<uint8_t, 256> byte_class{};
+  size_t class_count = 1;
+  std::vector<uint32_t> delta;
+  // Keywords ending in each state, directly or through its suffixes, at out_vec[out_begin[s]] up to
+  // out_vec[out_begin[s + 1]]
+  std::vector<uint32_t> out_begin;
+  std::vector<uint32_t> out_vec;
+  std::vector<Keyword> keyword_vec;
+
+  std::unique_ptr<RE2::Set> regex_set;
+  std::vector<Regex> regex_vec;
+
+  std::vector<std::string> channel_vec;
+  uint64_t generation = UINT64_MAX;
+
+  // Per Match
+  std::vector<Hit> hit_vec;
+  std::vector<int> set_hit_vec;
+  std::vector<uint32_t> seen_vec;
+  uint32_t seen_stamp = 0;
+
+  void BuildKeywords(std::span<const Pattern> patterns);
+  std::vector<size_t> BuildRegexes(std::span<const Pattern> patterns);
+  bool InChannel(size_t index, std::string_view channel) const;
+
+ public:
+  PatternMatcher() = default;
+  PatternMatcher(const PatternMatcher &) = delete;
+  PatternMatcher &operator=(const PatternMatcher &) = delete;
+  PatternMatcher(PatternMatcher &&) = default;
+  PatternMatcher &operator=(PatternMatcher &&) = default;
+  ~PatternMatcher() = default;
+
+  // Replaces all patterns, the generation identifies the set. Returns the indices of regexes that
+  // failed to compile, which never match.
+  std::vector<size_t> SetPatterns(std::span<const Pattern> patterns, uint64_t generation);
+  uint64_t GetGeneration() const { return generation; }
+  bool Empty() const { return keyword_vec.empty() && regex_vec.empty(); }
+  // Valid until the next call, sorted by index
+  std::span<const Hit> Match(std::string_view channel, std::string_view text);
+  // Those of the last Match
+  std::span<const Hit> GetHits() const { return hit_vec; }
+};
+
+}  // namespace kbot
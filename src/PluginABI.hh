@@ -0,0 +1,87 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <span>
+#include <string_view>
+
+namespace kbot {
+
+class Manager;
+class IRCMessage;
+class IRCMessagePrivMsg;
+
+namespace plugin {
+
+// Plugin ABI
+// A plugin exports a single Descriptor under kDescriptorSymbol, resolved once when it is opened.
+// It lists everything the plugin wants from us: its commands with their help, the IRC commands
+// (including numerics) it wants to see, patterns to look for in channel messages, and periodic
+// timers. Registration then happens in one go and we never look anything up in the plugin again
+// while it's loaded.
+//
+// Plugins built against the first ABI only export the Register/Delete/HelpPluginCommands_<name>
+// functions, those are still accepted. plugins/Plugin.hh emits both. Version 2 descriptors end
+// before patterns.
+
+inline constexpr uint32_t kAbiVersion = 3;
+inline constexpr uint32_t kMinAbiVersion = 2;
+inline constexpr const char *kDescriptorSymbol = "KbotPluginDescriptor";
+
+using command_callback_t = void (*)(Manager &, const IRCMessagePrivMsg &);
+using event_callback_t = void (*)(Manager &, const IRCMessage &);
+using timer_callback_t = void (*)(Manager &);
+// match is what the pattern matched, as a view into the message
+using pattern_callback_t = void (*)(Manager &, const IRCMessagePrivMsg &, std::string_view match);
+
+struct CommandEntry {
+  // Key in the command map, i.e. ":" COMMAND_PREFIX "<name>"
+  std::string_view command;
+  command_callback_t callback;
+  std::string_view help;
+};
+
+struct EventEntry {
+  // IRC command or numeric, as in IRCMessage::GetCommand
+  std::string_view command;
+  event_callback_t callback;
+};
+
+// Looked for in the text of every PRIVMSG that isn't a command, see PatternMatcher.hh
+struct PatternEntry {
+  enum Kind : uint32_t {
+    // Anywhere in the text, ignoring ASCII case
+    kKeyword,
+    // RE2 syntax, unanchored
+    kRegex,
+  };
+  Kind kind;
+  std::string_view pattern;
+  // Empty for every channel
+  std::string_view channel;
+  pattern_callback_t callback;
+};
+
+struct TimerEntry {
+  std::chrono::milliseconds interval;
+  timer_callback_t callback;
+};
+
+// Only ever extended at the end, with abi_version bumped
+struct Descriptor {
+  uint32_t abi_version;
+  std::string_view name;
+  std::span<const CommandEntry> commands;
+  std::span<const EventEntry> events;
+  std::span<const TimerEntry> timers;
+  // Since version 3
+  std::span<const PatternEntry> patterns;
+};
+
+inline std::span<const PatternEntry> GetPatterns(const Descriptor &desc) {
+  if (desc.abi_version < 3) return {};
+  return desc.patterns;
+}
+
+}  // namespace plugin
+}  // namespace kbot
@@ -0,0 +1,285 @@
+#include <fcntl.h>
+#include <fmt/format.h>
+#include <glog/logging.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <IRC.hh>
+#include <Log.hh>
+#include <Manager.hh>
+#include <PluginHost.hh>
+#include <PluginRegistry.hh>
+#include <Server.hh>
+#include <ShmRing.hh>
+#include <charconv>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+
+namespace kbot {
+
+namespace {
+
+// Upper bound on the commands a single plugin may register with us
+constexpr size_t kMaxCommands = 256;
+// How long the child gets to unload the plugin and exit when asked to
+constexpr int kShutdownTimeoutMs = 200;
+
+constexpr uint32_t ToType(PluginRecord r) { return static_cast<uint32_t>(r); }
+
+}  // namespace
+
+// Parent
+
+std::unique_ptr<PluginHost> PluginHost::Spawn(Manager &m, std::string_view name,
+                                              std::string_view cgroup_procs) {
+  auto to_child = ipc::ShmRing::CreateNew(kRingSize);
+  auto to_parent = ipc::ShmRing::CreateNew(kRingSize);
+  if (!to_child || !to_parent) return nullptr;
+  std::unique_ptr<PluginHost> h(
+      new PluginHost(m, std::string(name), std::move(*to_child), std::move(*to_parent)));
+
+  // Everything the child needs is prepared here, after fork it may only make async-signal-safe
+  // calls as the parent is multithreaded
+  const int fds[] = {h->to_child.GetMemFd(), h->to_child.GetEventFd(), h->to_parent.GetMemFd(),
+                     h->to_parent.GetEventFd()};
+  std::string spec = fmt::format("{}:{},{},{},{}", name, fds[0], fds[1], fds[2], fds[3]);
+  std::string nickname = m.server.GetNickname();
+  std::string search_path = plugin::GetSearchPath();
+  const char *argv[] = {"kbot",  "-n",    nickname.c_str(), "-H", spec.c_str(),
+                        nullptr, nullptr, nullptr};
+  if (!search_path.empty()) {
+    argv[5] = "-P";
+    argv[6] = search_path.c_str();
+  }
+  std::string procs(cgroup_procs);
+  sigset_t empty_set;
+  sigemptyset(&empty_set);
+  pid_t parent = getpid();
+
+  pid_t pid = fork();
+  if (pid < 0) {
+    PLOG(ERROR) << "Failed to fork plugin host";
+    return nullptr;
+  }
+  if (pid == 0) {
+    // Die with the server thread that spawned us
+    if (prctl(PR_SET_PDEATHSIG, SIGKILL) < 0 || getppid() != parent) _exit(1);
+    if (!procs.empty()) {
+      // Writing 0 moves the writer itself
+      int fd = open(procs.c_str(), O_WRONLY | O_CLOEXEC);
+      if (fd < 0 || write(fd, "0", 1) != 1) _exit(1);
+      close(fd);
+    }
+    for (int fd : fds) {
+      if (fcntl(fd, F_SETFD, 0) < 0) _exit(1);
+    }
+    // Server threads block signals they handle through signalfd, don't inherit that
+    sigprocmask(SIG_SETMASK, &empty_set, nullptr);
+    execv("/proc/self/exe", const_cast<char *const *>(argv));
+    _exit(127);
+  }
+
+  h->pid = pid;
+  h->pidfd = static_cast<int>(syscall(SYS_pidfd_open, pid, 0));
+  if (h->pidfd < 0) {
+    PLOG(ERROR) << "Failed to open pidfd for plugin host";
+    return nullptr;
+  }
+  auto raw = h.get();
+  if (!m.RegisterFd(
+          h->to_parent.GetEventFd(), io::EpollManager::EpollIn,
+          [raw](struct epoll_event) { raw->OnRecords(); }, io::EpollManager::EpollConfigDefault) ||
+      !m.RegisterFd(
+          h->pidfd, io::EpollManager::EpollIn, [raw](struct epoll_event) { raw->OnExit(); },
+          io::EpollManager::EpollConfigDefault)) {
+    PLOG(ERROR) << "Failed to watch plugin host";
+    return nullptr;
+  }
+  KLOG(Info, "Spawned plugin host for {} as process {}", name, pid);
+  return h;
+}
+
+void PluginHost::Stop() {
+  if (pid < 0) return;
+  to_child.Push(ToType(PluginRecord::kShutdown), "");
+  struct pollfd p = {pidfd, POLLIN, 0};
+  if (poll(&p, 1, kShutdownTimeoutMs) <= 0) {
+    LOG(WARNING) << "Plugin host for " << name << " did not exit, killing it";
+    kill(pid, SIGKILL);
+  }
+  waitpid(pid, nullptr, 0);
+  pid = -1;
+}
+
+PluginHost::~PluginHost() {
+  m.DeleteFd(to_parent.GetEventFd());
+  if (pidfd >= 0) m.DeleteFd(pidfd);
+  Stop();
+  if (pidfd >= 0) close(pidfd);
+}
+
+void PluginHost::OnRecords() {
+  bool ready = false;
+  auto r = to_parent.Drain([&](uint32_t type, std::string_view data) {
+    switch (static_cast<PluginRecord>(type)) {
+      case PluginRecord::kRegister:
+        if (command_vec.size() < kMaxCommands &&
+            m.remote_command_map.emplace(std::string(data), this).second) {
+          command_vec.emplace_back(data);
+          m.server.command_generation.fetch_add(1, std::memory_order_relaxed);
+        } else {
+          KLOG(Warning, "Plugin {} failed to register command {}", name, data);
+        }
+        break;
+      case PluginRecord::kReady:
+        ready = true;
+        break;
+      case PluginRecord::kReply:
+        m.server.SendMsg(data);
+        break;
+      default:
+        KLOG(Warning, "Unexpected record type {} from plugin {}", type, name);
+        break;
+    }
+  });
+  if (r < 0) {
+    LOG(ERROR) << "Plugin host for " << name << " corrupted its ring, killing it";
+    kill(pid, SIGKILL);
+  }
+  if (ready) {
+    KLOG(Info, "Plugin {} loaded in process {} ({} commands)", name, pid, command_vec.size());
+  }
+}
+
+void PluginHost::OnExit() {
+  int status = 0;
+  if (waitpid(pid, &status, WNOHANG) == pid) {
+    if (WIFSIGNALED(status)) {
+      LOG(ERROR) << "Plugin host for " << name << " killed by signal " << WTERMSIG(status);
+    } else {
+      LOG(WARNING) << "Plugin host for " << name << " exited with status " << WEXITSTATUS(status);
+    }
+    pid = -1;
+  }
+  // Destroys this instance
+  std::string n = name;
+  m.UnloadPluginHost(n);
+}
+
+bool PluginHost::Deliver(const IRCMessagePrivMsg &msg) {
+  if (to_child.Push(ToType(PluginRecord::kMessage), msg.GetLine())) return true;
+  KLOG(Warning, "Plugin host for {} is not keeping up, dropped {} messages", name, ++dropped);
+  return false;
+}
+
+bool PluginHost::Help(const IRCMessagePrivMsg &msg) {
+  return to_child.Push(ToType(PluginRecord::kHelp), msg.GetLine());
+}
+
+// Child
+
+namespace {
+
+bool ParseSpec(std::string_view spec, std::string &name, int (&fds)[4]) {
+  auto colon = spec.rfind(':');
+  if (colon == spec.npos || colon == 0) return false;
+  name = spec.substr(0, colon);
+  const char *p = spec.data() + colon + 1;
+  const char *end = spec.data() + spec.size();
+  for (size_t i = 0; i < 4; i++) {
+    auto [next, ec] = std::from_chars(p, end, fds[i]);
+    if (ec != std::errc() || fds[i] < 0) return false;
+    p = next;
+    if (i < 3) {
+      if (p == end || *p != ',') return false;
+      p++;
+    }
+  }
+  return p == end;
+}
+
+void DispatchMessage(Manager &m, CommandPlugin &plugin, PluginRecord type,
+                     std::string_view line) try {
+  IRCMessagePrivMsg msg(IRCMessage(line, IRCMessageType::PRIVMSG));
+  if (type == PluginRecord::kHelp) {
+    plugin.Help(m, msg);
+    return;
+  }
+  auto it = m.server.user_command_map.find(msg.GetUserCommand());
+  if (it != m.server.user_command_map.end()) {
+    CommandPlugin::Scope _(it->second.plugin);
+    it->second.callback(m, msg);
+  }
+} catch (std::exception &e) {
+  KLOG(Warning, "Plugin host failed to handle message: {}", e.what());
+}
+
+}  // namespace
+
+int PluginHostMain(std::string_view spec, const char *nickname) {
+  std::string name;
+  int fds[4];
+  if (!ParseSpec(spec, name, fds)) {
+    LOG(ERROR) << "Bad plugin host specification: " << spec;
+    return 1;
+  }
+  auto in = ipc::ShmRing::Attach(fds[0], fds[1]);
+  auto out = ipc::ShmRing::Attach(fds[2], fds[3]);
+  if (!in || !out) return 1;
+
+  auto m = Manager::CreateNew(Server(-1, "plugin-host", 0, nickname));
+  m.server.send_sink = [&out](std::string_view msg) -> ssize_t {
+    // Only this process waits if the parent falls behind, so block for a while before giving up
+    for (int i = 0; i < 1000; i++) {
+      if (out->Push(ToType(PluginRecord::kReply), msg)) return static_cast<ssize_t>(msg.size());
+      usleep(1000);
+    }
+    errno = ENOBUFS;
+    return -1;
+  };
+
+  auto plugin = plugin::Acquire(name);
+  if (!plugin) {
+    LOG(ERROR) << "Plugin host failed to load " << name;
+    return 1;
+  }
+  auto activation = PluginActivation::CreateNew(m, plugin);
+  if (!activation) {
+    LOG(ERROR) << "Plugin host failed to activate " << name;
+    return 1;
+  }
+  for (auto &p : m.server.user_command_map) out->Push(ToType(PluginRecord::kRegister), p.first);
+  out->Push(ToType(PluginRecord::kReady), "");
+
+  bool running = true;
+  m.RegisterFd(
+      in->GetEventFd(), io::EpollManager::EpollIn,
+      [&](struct epoll_event) {
+        auto r = in->Drain([&](uint32_t type, std::string_view data) {
+          auto t = static_cast<PluginRecord>(type);
+          if (t == PluginRecord::kShutdown) {
+            running = false;
+          } else if (running && (t == PluginRecord::kMessage || t == PluginRecord::kHelp)) {
+            DispatchMessage(m, *plugin, t, data);
+          }
+        });
+        if (r < 0) running = false;
+      },
+      io::EpollManager::EpollConfigDefault);
+  while (running) {
+    if (m.RunEventLoop(-1) < 0) break;
+  }
+  m.DeleteFd(in->GetEventFd());
+  activation.reset();
+  return 0;
+}
+
+}  // namespace kbot
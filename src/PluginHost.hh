@@ -0,0 +1,83 @@
+#pragma once
+
+#include <sys/types.h>
+
+#include <IRC.hh>
+#include <ShmRing.hh>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace kbot {
+
+class Manager;
+
+// PluginHost
+// Runs a plugin in a child process instead of the bot's address space, so that a crashing or
+// misbehaving plugin only takes itself down. The child is kbot itself, re-executed in plugin host
+// mode: it loads the plugin through the usual plugins/Plugin.hh ABI into a shadow Server without
+// a socket, and everything the plugin sends is captured and streamed back to us.
+//
+// Both directions use an ipc::ShmRing. We send PRIVMSG lines for the commands the child
+// registered, and help requests; the child sends its command names once loaded, and raw IRC
+// lines to forward to the server. The child optionally moves itself into a cgroup of its own
+// (see cgroup::Governor) before exec'ing, and dies with the server thread that spawned it.
+
+enum class PluginRecord : uint32_t {
+  // To the child
+  kMessage,
+  kHelp,
+  kShutdown,
+  // To the parent
+  kRegister,
+  kReady,
+  kReply,
+};
+
+class PluginHost {
+  Manager &m;
+  std::string name;
+  pid_t pid = -1;
+  int pidfd = -1;
+  ipc::ShmRing to_child;
+  ipc::ShmRing to_parent;
+  std::vector<std::string> command_vec;
+  uint64_t dropped = 0;
+
+  PluginHost(Manager &m, std::string name, ipc::ShmRing to_child, ipc::ShmRing to_parent)
+      : m(m),
+        name(std::move(name)),
+        to_child(std::move(to_child)),
+        to_parent(std::move(to_parent)) {}
+  void OnRecords();
+  void OnExit();
+  void Stop();
+
+ public:
+  static constexpr size_t kRingSize = 1 << 20;
+
+  PluginHost(const PluginHost &) = delete;
+  PluginHost &operator=(const PluginHost &) = delete;
+  PluginHost(PluginHost &&) = delete;
+  PluginHost &operator=(PluginHost &&) = delete;
+  // Asks the child to unload the plugin and exit, killing it if it does not do so promptly
+  ~PluginHost();
+
+  // Spawns the child and attaches it to the Manager's event loop; its commands become available
+  // once it has loaded the plugin. cgroup_procs is the cgroup.procs file of the group to place
+  // the child in, or empty.
+  static std::unique_ptr<PluginHost> Spawn(Manager &m, std::string_view name,
+                                           std::string_view cgroup_procs);
+  std::string_view GetName() const { return name; }
+  pid_t GetPid() const { return pid; }
+  const std::vector<std::string> &GetCommands() const { return command_vec; }
+  bool Deliver(const IRCMessagePrivMsg &msg);
+  bool Help(const IRCMessagePrivMsg &msg);
+};
+
+// Entry point of the child, spec is the argument built by Spawn. Returns the exit status.
+int PluginHostMain(std::string_view spec, const char *nickname);
+
+}  // namespace kbot
@@ -0,0 +1,179 @@
+#include <fcntl.h>
+#include <fmt/format.h>
+#include <unistd.h>
+
+#include <Log.hh>
+#include <PluginRegistry.hh>
+#include <Server.hh>
+#include <algorithm>
+#include <cstdlib>
+#include <future>
+#include <initializer_list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace kbot {
+namespace plugin {
+
+namespace {
+
+std::mutex registry_mtx;
+std::vector<std::string> search_path;
+absl::flat_hash_map<std::string, std::weak_ptr<CommandPlugin>> plugin_map;
+std::vector<std::string> preloaded_names;
+// Only when they are opened here
+std::vector<std::shared_ptr<CommandPlugin>> preloaded;
+
+// Names come from IRC, don't let them escape the search path
+bool ValidName(std::string_view name) {
+  return !name.empty() && std::all_of(name.begin(), name.end(), [](char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+           c == '_' || c == '-';
+  });
+}
+
+// Returns the first of files found in the search path
+std::optional<std::string> Find(std::initializer_list<std::string> files) {
+  std::vector<std::string> dirs;
+  {
+    std::unique_lock lock(registry_mtx);
+    dirs = search_path;
+  }
+  if (dirs.empty()) {
+    struct RAII {
+      char *ptr = get_current_dir_name();
+      ~RAII() { free(ptr); }
+    } r;
+    if (!r.ptr) return std::nullopt;
+    dirs.emplace_back(r.ptr);
+  }
+  for (auto &dir : dirs) {
+    for (auto &file : files) {
+      std::string path = fmt::format("{}/{}", dir, file);
+      if (path.size() <= PATH_MAX && access(path.c_str(), R_OK) == 0) return path;
+    }
+  }
+  return std::nullopt;
+}
+
+std::shared_ptr<CommandPlugin> Open(std::string_view name, bool snapshot) {
+  auto path = FindPlugin(name);
+  if (!path) {
+    KLOG(Warning, "Plugin {} not found in search path", name);
+    return nullptr;
+  }
+  auto p = std::make_shared<CommandPlugin>();
+  if (!p->OpenHandle(name, *path, snapshot)) return nullptr;
+  KLOG(Info, "Opened plugin {} from {}", name, *path);
+  return p;
+}
+
+}  // namespace
+
+void SetSearchPath(std::string_view path) {
+  std::unique_lock lock(registry_mtx);
+  search_path.clear();
+  while (!path.empty()) {
+    auto colon = path.find(':');
+    auto dir = path.substr(0, colon);
+    path.remove_prefix(colon == path.npos ? path.size() : colon + 1);
+    if (!dir.empty()) search_path.emplace_back(dir);
+  }
+}
+
+std::string GetSearchPath() {
+  std::unique_lock lock(registry_mtx);
+  std::string r;
+  for (auto &dir : search_path) {
+    if (!r.empty()) r.push_back(':');
+    r.append(dir);
+  }
+  return r;
+}
+
+std::optional<std::string> FindPlugin(std::string_view name) {
+  if (!ValidName(name)) return std::nullopt;
+  return Find({fmt::format("lib{}.so", name)});
+}
+
+std::optional<std::string> FindWasmPlugin(std::string_view name) {
+  if (!ValidName(name)) return std::nullopt;
+  // Precompiled takes precedence
+  return Find({fmt::format("{}.cwasm", name), fmt::format("{}.wasm", name)});
+}
+
+std::shared_ptr<CommandPlugin> Acquire(std::string_view name) {
+  std::unique_lock lock(registry_mtx);
+  if (auto it = plugin_map.find(name); it != plugin_map.end()) {
+    if (auto p = it->second.lock()) return p;
+  }
+  lock.unlock();
+  // Opened without the lock held, if two servers race the first one to finish is kept. Only then
+  // is the name entered, a failed load leaves nothing behind.
+  auto p = Open(name, false);
+  if (!p) return nullptr;
+  lock.lock();
+  auto [it, inserted] = plugin_map.try_emplace(name, p);
+  if (!inserted) {
+    if (auto existing = it->second.lock()) return existing;
+    it->second = p;
+  }
+  return p;
+}
+
+std::shared_ptr<CommandPlugin> AcquireSnapshot(std::string_view name) {
+  auto p = Open(name, true);
+  if (!p) return nullptr;
+  std::unique_lock lock(registry_mtx);
+  plugin_map[name] = p;
+  // Don't keep the old version open for good
+  for (auto &pre : preloaded) {
+    if (pre->GetName() == name) pre = p;
+  }
+  return p;
+}
+
+bool Preload(std::span<const std::string> names, bool open) {
+  if (!open) {
+    bool ok = true;
+    for (auto &name : names) {
+      if (!FindPlugin(name)) {
+        KLOG(Error, "Failed to preload plugin {}: not found in search path", name);
+        ok = false;
+        continue;
+      }
+      std::unique_lock lock(registry_mtx);
+      preloaded_names.push_back(name);
+    }
+    return ok;
+  }
+  std::vector<std::future<std::shared_ptr<CommandPlugin>>> v;
+  v.reserve(names.size());
+  for (auto &name : names) {
+    v.push_back(std::async(std::launch::async, [&name] { return Acquire(name); }));
+  }
+  bool ok = true;
+  for (size_t i = 0; i < v.size(); i++) {
+    auto p = v[i].get();
+    if (!p) {
+      KLOG(Error, "Failed to preload plugin {}", names[i]);
+      ok = false;
+      continue;
+    }
+    std::unique_lock lock(registry_mtx);
+    preloaded.push_back(std::move(p));
+    preloaded_names.push_back(names[i]);
+  }
+  return ok;
+}
+
+std::vector<std::string> GetPreloaded() {
+  std::unique_lock lock(registry_mtx);
+  return preloaded_names;
+}
+
+}  // namespace plugin
+}  // namespace kbot
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <memory>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace kbot {
+
+class CommandPlugin;
+
+namespace plugin {
+
+// PluginRegistry
+// Process-wide: each plugin is opened once and shared by every server that activates it (see
+// PluginActivation), instead of each server opening and registering its own copy. The registry
+// only holds weak references, a plugin is closed once no server has it active, except for
+// preloaded ones which stay open for the lifetime of the process.
+//
+// Plugins are looked up as lib<name>.so in each directory of the search path in turn, the current
+// directory if none is set. WebAssembly plugins (see WasmPlugin) are looked up the same way, but
+// are opened by each server on its own.
+
+// Takes a colon separated list of directories, call before any server is started
+void SetSearchPath(std::string_view path);
+std::string GetSearchPath();
+std::optional<std::string> FindPlugin(std::string_view name);
+std::optional<std::string> FindWasmPlugin(std::string_view name);
+// Returns the open instance of the plugin, opening it if there is none
+std::shared_ptr<CommandPlugin> Acquire(std::string_view name);
+// Opens the plugin's current file anew, used by new activations from now on
+std::shared_ptr<CommandPlugin> AcquireSnapshot(std::string_view name);
+// Opens the plugins in parallel before servers are started, returns false if any failed. Without
+// open they are only looked up, for plugins that will run in plugin hosts (see PluginHost.hh) and
+// mustn't run any of their code in this process.
+bool Preload(std::span<const std::string> names, bool open = true);
+std::vector<std::string> GetPreloaded();
+
+}  // namespace plugin
+}  // namespace kbot
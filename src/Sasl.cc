@@ -0,0 +1,100 @@
+#include <Sasl.hh>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace kbot {
+
+std::string_view SaslClient::MechanismName(SaslMechanism mechanism) {
+  switch (mechanism) {
+    case SaslMechanism::kPlain:
+      return "PLAIN";
+    case SaslMechanism::kExternal:
+      return "EXTERNAL";
+  }
+  return "";
+}
+
+std::optional<SaslMechanism> SaslClient::ParseMechanism(std::string_view name) {
+  auto eq = [name](std::string_view m) {
+    if (name.size() != m.size()) return false;
+    for (size_t i = 0; i < m.size(); i++) {
+      char c = name[i];
+      if ((c >= 'a' && c <= 'z' ? c - 'a' + 'A' : c) != m[i]) return false;
+    }
+    return true;
+  };
+  if (eq("PLAIN")) return SaslMechanism::kPlain;
+  if (eq("EXTERNAL")) return SaslMechanism::kExternal;
+  return std::nullopt;
+}
+
+std::string SaslClient::Base64Encode(std::string_view data) {
+  static constexpr char kAlphabet[] =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  std::string out;
+  out.reserve((data.size() + 2) / 3 * 4);
+  size_t i = 0;
+  for (; i + 3 <= data.size(); i += 3) {
+    uint32_t v = static_cast<unsigned char>(data[i]) << 16 |
+                 static_cast<unsigned char>(data[i + 1]) << 8 |
+                 static_cast<unsigned char>(data[i + 2]);
+    out.push_back(kAlphabet[v >> 18 & 63]);
+    out.push_back(kAlphabet[v >> 12 & 63]);
+    out.push_back(kAlphabet[v >> 6 & 63]);
+    out.push_back(kAlphabet[v & 63]);
+  }
+  if (size_t rest = data.size() - i) {
+    uint32_t v = static_cast<unsigned char>(data[i]) << 16;
+    if (rest == 2) v |= static_cast<unsigned char>(data[i + 1]) << 8;
+    out.push_back(kAlphabet[v >> 18 & 63]);
+    out.push_back(kAlphabet[v >> 12 & 63]);
+    out.push_back(rest == 2 ? kAlphabet[v >> 6 & 63] : '=');
+    out.push_back('=');
+  }
+  return out;
+}
+
+bool SaslClient::IsOffered(std::string_view cap_value) const {
+  if (cap_value.empty()) return true;
+  while (!cap_value.empty()) {
+    auto comma = cap_value.find(',');
+    if (ParseMechanism(cap_value.substr(0, comma)) == credentials.mechanism) return true;
+    cap_value.remove_prefix(comma == cap_value.npos ? cap_value.size() : comma + 1);
+  }
+  return false;
+}
+
+std::string SaslClient::Start() {
+  state = State::kMechanismSent;
+  return std::string(MechanismName(credentials.mechanism));
+}
+
+std::vector<std::string> SaslClient::Respond(std::string_view challenge) {
+  std::vector<std::string> v;
+  if (state != State::kMechanismSent || challenge != "+") {
+    state = State::kFailed;
+    v.emplace_back("*");
+    return v;
+  }
+  state = State::kResponseSent;
+  std::string payload;
+  if (credentials.mechanism == SaslMechanism::kPlain) {
+    // authzid NUL authcid NUL passwd, some services insist on both being the account
+    std::string message = credentials.account;
+    message.push_back('\0');
+    message += credentials.account;
+    message.push_back('\0');
+    message += credentials.password;
+    payload = Base64Encode(message);
+  }
+  // A payload that ends on a full line is followed by an empty one, so the server knows it ended
+  for (size_t i = 0; i < payload.size(); i += kChunkSize) {
+    v.push_back(payload.substr(i, kChunkSize));
+  }
+  if (payload.size() % kChunkSize == 0) v.emplace_back("+");
+  return v;
+}
+
+}  // namespace kbot
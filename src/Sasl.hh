@@ -0,0 +1,75 @@
+#pragma once
+
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace kbot {
+
+// SaslClient
+// Client side of IRCv3 SASL authentication (AUTHENTICATE), run during capability negotiation so
+// registration only completes once we are logged in to our account:
+//   - PLAIN, authenticating as an account with its password
+//   - EXTERNAL, authenticating with the TLS client certificate of the connection. Connections
+//     don't use TLS yet, so main refuses to configure it.
+//
+// It only produces the parameters of the AUTHENTICATE lines to send and tracks where the exchange
+// is, BuiltinCap and BuiltinAuthenticate feed it what the server says.
+
+enum class SaslMechanism {
+  kPlain,
+  kExternal,
+};
+
+struct SaslCredentials {
+  SaslMechanism mechanism = SaslMechanism::kPlain;
+  // Account name (authcid) and password, for PLAIN
+  std::string account;
+  std::string password;
+};
+
+class SaslClient {
+ public:
+  enum class State {
+    kIdle,
+    // AUTHENTICATE <mechanism> sent, waiting for "AUTHENTICATE +"
+    kMechanismSent,
+    // Response sent, waiting for the result numeric
+    kResponseSent,
+    kSucceeded,
+    kFailed,
+  };
+  // Payloads are split into lines of this many base64 characters
+  static constexpr size_t kChunkSize = 400;
+
+ private:
+  SaslCredentials credentials;
+  State state = State::kIdle;
+
+ public:
+  explicit SaslClient(SaslCredentials credentials) : credentials(std::move(credentials)) {}
+
+  static std::string_view MechanismName(SaslMechanism mechanism);
+  static std::optional<SaslMechanism> ParseMechanism(std::string_view name);
+  static std::string Base64Encode(std::string_view data);
+
+  const SaslCredentials &GetCredentials() const { return credentials; }
+  State GetState() const { return state; }
+  // Whether our mechanism is among those in the value of the sasl capability (a comma separated
+  // list, or empty when the server doesn't say)
+  bool IsOffered(std::string_view cap_value) const;
+  // Parameter of the first AUTHENTICATE line, the mechanism name
+  std::string Start();
+  // For an AUTHENTICATE from the server, the parameters of the lines to answer with. Servers
+  // send "+" (an empty challenge) for both mechanisms we support, anything else aborts with "*".
+  std::vector<std::string> Respond(std::string_view challenge);
+  // Once the server replied with 903 (success) or one of the failure numerics
+  void Finish(bool success) { state = success ? State::kSucceeded : State::kFailed; }
+  bool InProgress() const {
+    return state == State::kMechanismSent || state == State::kResponseSent;
+  }
+};
+
+}  // namespace kbot
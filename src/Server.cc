@@ -1,14 +1,24 @@
+#include <absl/container/flat_hash_set.h>
 #include <arpa/inet.h>
+#include <fcntl.h>
 #include <fmt/format.h>
 #include <glog/logging.h>
 #include <netdb.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #include <Database.hh>
 #include <IRC.hh>
+#include <Log.hh>
+#include <Manager.hh>
+#include <PluginABI.hh>
 #include <Server.hh>
+#include <UserCommand.hh>
+#include <algorithm>
 #include <atomic>
 #include <cassert>
 #include <cstdlib>
@@ -27,55 +37,198 @@ namespace kbot {
 // and access is thread safe so we don't need to take care of synchronization except when accessing
 // our own data.
 
-bool CommandPlugin::OpenHandle(std::string_view name) {
-  struct RAII {
-    char *ptr = get_current_dir_name();
-    ~RAII() { free(ptr); }
-  } r;
-  if (r.ptr) {
-    std::string cwd = fmt::format("{}/lib{}.so", r.ptr, name);
-    if (cwd.size() > PATH_MAX) {
-      return false;
-    } else {
-      handle = dlopen(cwd.c_str(), RTLD_LAZY);
-      if (handle != nullptr) {
-        return true;
-      } else {
-        PLOG(ERROR) << "Failed to load plugin";
-        return false;
-      }
-    }
+namespace {
+
+void *GetSymbol(void *handle, const std::string &symbol) {
+  (void)dlerror();
+  auto sym = dlsym(handle, symbol.c_str());
+  if (!sym) LOG(ERROR) << (dlerror() ?: "Symbol not found");
+  return sym;
+}
+
+int CopyToMemFd(const std::string &path) {
+  int in = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (in < 0) {
+    PLOG(ERROR) << "Failed to open " << path;
+    return -1;
+  }
+  int out = memfd_create("kbot-plugin", MFD_CLOEXEC);
+  struct stat st;
+  bool ok = out >= 0 && fstat(in, &st) == 0;
+  for (off_t off = 0; ok && off < st.st_size;) {
+    ok = sendfile(out, in, &off, static_cast<size_t>(st.st_size - off)) > 0;
+  }
+  if (!ok) {
+    PLOG(ERROR) << "Failed to snapshot " << path;
+    if (out >= 0) close(out);
+    out = -1;
+  }
+  close(in);
+  return out;
+}
+
+}  // namespace
+
+thread_local CommandPlugin *CommandPlugin::current = nullptr;
+
+CommandPlugin *CommandPlugin::Current() { return current; }
+
+bool CommandPlugin::OpenHandle(std::string_view name_, const std::string &path, bool snapshot) {
+  name = name_;
+  std::string load_path = path;
+  if (snapshot) {
+    // The dynamic linker matches on the path, a unique one makes it map the file again. The memfd
+    // stays open so that its path isn't reused while we're loaded.
+    memfd = CopyToMemFd(path);
+    if (memfd < 0) return false;
+    load_path = fmt::format("/proc/self/fd/{}", memfd);
   }
+  handle = dlopen(load_path.c_str(), RTLD_LAZY);
+  if (handle == nullptr) {
+    LOG(ERROR) << "Failed to load plugin: " << (dlerror() ?: "unknown error");
+    CloseHandle();
+    return false;
+  }
+
+  auto desc = static_cast<const plugin::Descriptor *>(dlsym(handle, plugin::kDescriptorSymbol));
+  if (desc && desc->abi_version >= plugin::kMinAbiVersion &&
+      desc->abi_version <= plugin::kAbiVersion) {
+    descriptor = desc;
+    return true;
+  }
+  if (desc) {
+    KLOG(Warning, "Plugin {} has unsupported ABI version {}, trying v1", name,
+         desc->abi_version);
+  }
+  auto get = [&](std::string_view prefix) {
+    return reinterpret_cast<registration_callback_t>(
+        GetSymbol(handle, fmt::format("{}_{}", prefix, name)));
+  };
+  reg_func = get("RegisterPluginCommands");
+  del_func = get("DeletePluginCommands");
+  help_func = get("HelpPluginCommands");
+  if (reg_func && del_func && help_func) return true;
+  CloseHandle();
   return false;
 }
 
-namespace {
+void CommandPlugin::CloseHandle() {
+  if (handle) {
+    dlclose(std::exchange(handle, nullptr));
+    KLOG(Debug, "Closed plugin {}", name);
+  }
+  if (memfd >= 0) close(std::exchange(memfd, -1));
+}
 
-CommandPlugin::registration_callback_t GetFunc(void *handle, std::string_view symbol) {
-  (void)dlerror();
-  auto sym = dlsym(handle, symbol.data());
-  if (sym) {
-    return reinterpret_cast<CommandPlugin::registration_callback_t>(sym);
-  } else {
-    LOG(ERROR) << (dlerror() ?: "Symbol not found");
-    return nullptr;
+void CommandPlugin::Help(Manager &m, const IRCMessagePrivMsg &msg) {
+  Scope _(this);
+  if (!descriptor) {
+    auto p = std::make_pair(&m, &msg);
+    help_func(&p);
+    return;
   }
+  std::string help;
+  for (auto &c : descriptor->commands) {
+    if (c.help.empty()) continue;
+    if (!help.empty()) help.append(" | ");
+    help.append(c.help);
+  }
+  UserCommand::SendInvokerReply(m, msg, help.empty() ? "No help available." : help);
 }
 
-}  // namespace
+// PluginActivation
+
+std::unique_ptr<PluginActivation> PluginActivation::CreateNew(
+    Manager &m, std::shared_ptr<CommandPlugin> plugin) {
+  std::unique_ptr<PluginActivation> a(new PluginActivation(m, std::move(plugin)));
+  auto &p = *a->plugin;
+  CommandPlugin::Scope _(&p);
+  if (!p.descriptor) {
+    p.reg_func(&m.server);
+    return a;
+  }
+  // Destroying the activation removes nothing of another plugin's
+  if (!m.server.AddPlugin(*p.descriptor, &p)) return nullptr;
+  a->StartTimers();
+  KLOG(Info, "Activated plugin {}: {} commands, {} subscriptions, {} patterns, {} timers", p.name,
+       p.descriptor->commands.size(), p.descriptor->events.size(),
+       plugin::GetPatterns(*p.descriptor).size(), p.descriptor->timers.size());
+  return a;
+}
+
+PluginActivation::~PluginActivation() {
+  CommandPlugin::Scope _(plugin.get());
+  if (!plugin->descriptor) {
+    plugin->del_func(&m.server);
+    return;
+  }
+  StopTimers();
+  m.server.RemovePlugin(*plugin->descriptor, plugin.get());
+}
+
+bool PluginActivation::Replace(std::shared_ptr<CommandPlugin> next) {
+  if (!plugin->descriptor || !next->descriptor) {
+    // Dispatch happens on the calling thread, so nothing observes the commands missing in between
+    {
+      CommandPlugin::Scope _(plugin.get());
+      if (plugin->descriptor) {
+        StopTimers();
+        m.server.RemovePlugin(*plugin->descriptor, plugin.get());
+      } else {
+        plugin->del_func(&m.server);
+      }
+    }
+    auto prev = std::exchange(plugin, std::move(next));
+    CommandPlugin::Scope _(plugin.get());
+    if (plugin->descriptor) {
+      if (!m.server.AddPlugin(*plugin->descriptor, plugin.get())) {
+        // Only an ABI v1 plugin can have been replaced here, it registers again
+        plugin = std::move(prev);
+        CommandPlugin::Scope _(plugin.get());
+        plugin->reg_func(&m.server);
+        return false;
+      }
+      StartTimers();
+    } else {
+      plugin->reg_func(&m.server);
+    }
+    return true;
+  }
+  StopTimers();
+  bool ok =
+      m.server.ReplacePlugin(*plugin->descriptor, plugin.get(), *next->descriptor, next.get());
+  if (ok) plugin = std::move(next);
+  StartTimers();
+  return ok;
+}
 
-CommandPlugin::registration_callback_t CommandPlugin::GetRegistrationFunc(
-    std::string_view plugin_name) {
-  return GetFunc(handle, fmt::format("RegisterPluginCommands_{}", plugin_name));
+// Re-armed before running the callback, so that it may unload its own plugin. The timer being
+// alive means the activation is, StopTimers drops them before it goes away.
+void PluginActivation::ArmTimer(const std::shared_ptr<Timer> &t) {
+  t->id = m.AddTimer(t->entry.interval, [this, &m = m, weak = std::weak_ptr<Timer>(t)] {
+    auto t = weak.lock();
+    if (!t) return;
+    auto keep = plugin;
+    auto cb = t->entry.callback;
+    ArmTimer(t);
+    CommandPlugin::Scope _(keep.get());
+    cb(m);
+  });
 }
 
-CommandPlugin::registration_callback_t CommandPlugin::GetDeletionFunc(
-    std::string_view plugin_name) {
-  return GetFunc(handle, fmt::format("DeletePluginCommands_{}", plugin_name));
+void PluginActivation::StartTimers() {
+  for (auto &e : plugin->descriptor->timers) {
+    auto t = std::make_shared<Timer>(Timer{e, std::nullopt});
+    ArmTimer(t);
+    timer_vec.push_back(std::move(t));
+  }
 }
 
-CommandPlugin::registration_callback_t CommandPlugin::GetHelpFunc(std::string_view plugin_name) {
-  return GetFunc(handle, fmt::format("HelpPluginCommands_{}", plugin_name));
+void PluginActivation::StopTimers() {
+  for (auto &t : timer_vec) {
+    if (t->id) m.CancelTimer(*t->id);
+  }
+  timer_vec.clear();
 }
 
 // Server
@@ -85,11 +238,17 @@ CommandPlugin::registration_callback_t CommandPlugin::GetHelpFunc(std::string_vi
 Server::Server(Server &&s)
     : IRC(static_cast<IRC &&>(s)),
       address(std::move(s.address)),
+      socket_options(s.socket_options),
       chan_map(std::move(s.chan_map)),
       nickname(std::move(s.nickname)),
-      local_db(std::move(s.local_db)) {
+      local_db(std::move(s.local_db)),
+      deferred_msg_vec(std::move(s.deferred_msg_vec)),
+      isupport(std::move(s.isupport)),
+      sasl(std::move(s.sasl)),
+      admin_account(std::move(s.admin_account)) {
   assert(s.state.load(std::memory_order_relaxed) == ServerState::kSetup);
   port = s.port;
+  casemapping = s.GetCaseMapping();
 }
 
 // Likewise, don't move Server around except when setting things up
@@ -97,10 +256,16 @@ Server &Server::operator=(Server &&s) {
   assert(s.state.load(std::memory_order_relaxed) == ServerState::kSetup);
   static_cast<IRC &>(*this) = static_cast<IRC &&>(s);
   address = std::move(s.address);
+  socket_options = s.socket_options;
   chan_map = std::move(s.chan_map);
   nickname = std::move(s.nickname);
   local_db = std::move(s.local_db);
+  deferred_msg_vec = std::move(s.deferred_msg_vec);
+  isupport = std::move(s.isupport);
+  sasl = std::move(s.sasl);
+  admin_account = std::move(s.admin_account);
   port = s.port;
+  casemapping = s.GetCaseMapping();
   return *this;
 }
 
@@ -125,26 +290,122 @@ void Server::DumpInfo() {
 }
 
 void Server::SetState(const ServerState state_) {
-  LOG(INFO) << "State transition for server: " << StateToString(state_) << " -> "
-            << StateToString(state_);
+  KLOG(Info, "State transition for server: {} -> {}", StateToString(GetState()),
+       StateToString(state_));
   state.store(state_, std::memory_order_relaxed);
 }
 
+void Server::Welcome(std::string_view nickname_) {
+  {
+    std::unique_lock lock(nick_mtx);
+    if (nickname != nickname_) {
+      KLOG(Info, "Registered as {} instead of {}", nickname_, nickname);
+      nickname = nickname_;
+    }
+  }
+  SetState(ServerState::kWelcomed);
+}
+
+void Server::AddISupport(std::span<const std::string_view> tokens) {
+  std::unique_lock lock(server_mtx);
+  if (!isupport.Apply(tokens)) return;
+  auto mapping = isupport.GetCaseMapping();
+  KLOG(Info, "Server uses casemapping {}", casefold::MappingName(mapping));
+  // Channels joined so far were hashed folding the old way
+  std::unique_lock chan_lock(chan_mtx);
+  RebuildCaseFoldMap(chan_map, mapping);
+  casemapping.store(mapping, std::memory_order_relaxed);
+}
+
+size_t Server::GetLineLimit() {
+  std::unique_lock lock(server_mtx);
+  return isupport.GetLineLength();
+}
+
+size_t Server::GetTargetLimit(std::string_view command, size_t otherwise) {
+  std::unique_lock lock(server_mtx);
+  return isupport.GetTargetLimit(command, otherwise);
+}
+
+bool Server::IsChannel(std::string_view name) {
+  std::unique_lock lock(server_mtx);
+  return isupport.IsChannel(name);
+}
+
+namespace {
+
+// Room to leave for the source the server prepends when relaying our messages,
+// ":nick!user@host ", with the usual limits of 10 bytes for user names and 63 for host names
+constexpr size_t SourceReserve(size_t nickname_size) {
+  return sizeof(":!@ ") - 1 + nickname_size + 10 + 63;
+}
+
+std::string FormatPrivMsgs(std::span<const std::string_view> targets, std::string_view msg,
+                           size_t line_limit, size_t max_targets) {
+  std::string buf;
+  for (auto &l : Message::PackPrivMsgs(targets, msg, line_limit, max_targets)) {
+    buf += fmt::format("\rPRIVMSG {}\r\n", l);
+  }
+  return buf;
+}
+
+}  // namespace
+
+void Server::CompleteRegistration() {
+  auto line_limit = GetLineLimit();
+  auto max_targets = GetTargetLimit("JOIN");
+  auto msg_line_limit = line_limit - SourceReserve(GetNickname().size());
+  // Servers that don't say may only take one
+  auto max_msg_targets = GetTargetLimit("PRIVMSG", 1);
+  std::string buf;
+  {
+    std::unique_lock lock(chan_mtx);
+    SetState(ServerState::kLoggedIn);
+    // Including those left from a previous connection
+    std::vector<std::pair<std::string, std::string>> joins;
+    for (auto &[name, chan] : chan_map) {
+      if (chan.state == Channel::JoinRequested) joins.emplace_back(name, chan.key);
+    }
+    auto lines = Message::PackJoins(joins, line_limit, max_targets);
+    for (auto &l : lines) buf += fmt::format("\rJOIN {}\r\n", l);
+    if (!joins.empty()) {
+      KLOG(Info, "Joining {} channels with {} lines", joins.size(), lines.size());
+    }
+    // Runs of the same message were most likely one broadcast
+    std::vector<std::string_view> targets;
+    for (size_t i = 0; i < deferred_msg_vec.size(); i++) {
+      auto &[channel, msg] = deferred_msg_vec[i];
+      targets.push_back(channel);
+      if (i + 1 == deferred_msg_vec.size() || deferred_msg_vec[i + 1].second != msg) {
+        buf += FormatPrivMsgs(targets, msg, msg_line_limit, max_msg_targets);
+        targets.clear();
+      }
+    }
+    deferred_msg_vec.clear();
+  }
+  if (!buf.empty() && SendMsg(buf) < 0) PLOG(ERROR) << "Failed to send deferred joins";
+}
+
 // Channel API
 
-void Server::JoinChannel(std::string_view channel) {
+void Server::JoinChannel(std::string_view channel, std::string_view key) {
   std::unique_lock lock(chan_mtx);
   auto it = chan_map.find(channel);
-  auto r = IRC::Join(channel);
+  // Otherwise sent by CompleteRegistration
+  ssize_t r = 0;
+  if (IsRegistered()) {
+    r = key.empty() ? IRC::Join(channel) : IRC::Join(fmt::format("{} {}", channel, key));
+  }
   if (r < 0) {
     PLOG(ERROR) << "Failed to initiate Join request for channel: " << channel;
     return;
   }
   if (it == chan_map.end()) {
-    chan_map.insert({std::string(channel), Channel{Channel::JoinRequested}});
+    chan_map.insert({std::string(channel), Channel{Channel::JoinRequested, std::string(key)}});
   } else {
     it->second.state = Channel::JoinRequested;
-    return;
+    if (!key.empty()) it->second.key = key;
+    it->second.error = 0;
   }
 }
 
@@ -154,7 +415,17 @@ void Server::UpdateJoinChannel(std::string_view channel) {
     if (it->second.state == Channel::JoinRequested) {
       it->second.state = Channel::Joined;
     } else {
-      DLOG(INFO) << "Part has already been requested for " << channel;
+      KLOG(Debug, "Part has already been requested for {}", channel);
+    }
+  }
+}
+
+void Server::FailJoinChannel(std::string_view channel, int numeric) {
+  std::unique_lock lock(chan_mtx);
+  if (auto it = chan_map.find(channel); it != chan_map.end()) {
+    if (it->second.state == Channel::JoinRequested) {
+      it->second.state = Channel::JoinFailed;
+      it->second.error = numeric;
     }
   }
 }
@@ -165,13 +436,63 @@ void Server::UpdatePartChannel(std::string_view channel) {
     if (it->second.state == Channel::PartRequested) {
       chan_map.erase(it);
     } else {
-      DLOG(INFO) << "Rejoin has already been requested for " << channel;
+      KLOG(Debug, "Rejoin has already been requested for {}", channel);
+    }
+  }
+}
+
+Server::ChannelCount Server::GetChannelCount() {
+  ChannelCount c;
+  std::shared_lock read_lock(chan_mtx);
+  for (auto &p : chan_map) {
+    switch (p.second.state) {
+      case Channel::JoinRequested:
+        c.join_requested++;
+        break;
+      case Channel::Joined:
+        c.joined++;
+        break;
+      case Channel::PartRequested:
+        c.part_requested++;
+        break;
+      case Channel::JoinFailed:
+        c.join_failed++;
+        break;
     }
   }
+  return c;
 }
 
 bool Server::SendChannel(std::string_view channel, std::string_view msg) {
-  return IRC::PrivMsg(channel, msg);
+  return Broadcast(std::span(&channel, 1), msg);
+}
+
+bool Server::Broadcast(std::span<const std::string_view> targets, std::string_view msg) {
+  if (!IsRegistered()) {
+    std::unique_lock lock(chan_mtx);
+    // Registration may have completed meanwhile
+    if (!IsRegistered()) {
+      for (auto t : targets) deferred_msg_vec.emplace_back(t, msg);
+      return true;
+    }
+  }
+  // Each target once, as the server tells names apart
+  auto mapping = GetCaseMapping();
+  absl::flat_hash_set<std::string_view, CaseFoldHash, CaseFoldEq> seen(
+      targets.size(), CaseFoldHash(mapping), CaseFoldEq(mapping));
+  std::vector<std::string_view> unique;
+  unique.reserve(targets.size());
+  for (auto t : targets) {
+    if (seen.insert(t).second) unique.push_back(t);
+  }
+  auto buf = FormatPrivMsgs(unique, msg, GetLineLimit() - SourceReserve(GetNickname().size()),
+                            GetTargetLimit("PRIVMSG", 1));
+  if (buf.empty()) return true;
+  if (SendMsg(buf) < 0) {
+    PLOG(ERROR) << "Failed to send PRIVMSG message";
+    return false;
+  }
+  return true;
 }
 
 bool Server::PartChannel(std::string_view channel) {
@@ -194,9 +515,24 @@ bool Server::PartChannel(std::string_view channel) {
 // Ensure that read lock is not held for the map when calling these methods, especially if the call
 // is not punted to the workqueue
 
+std::vector<std::string> Server::GetPluginNames() {
+  std::shared_lock lock(plugins_map_mtx);
+  std::vector<std::string> v;
+  v.reserve(plugins_map.size());
+  for (auto &p : plugins_map) v.push_back(p.first);
+  return v;
+}
+
+// ABI v1 plugins register through a callback without a reference to themselves, they are owned by
+// the plugin being registered
 void Server::AddPluginCommands(std::span<const std::pair<std::string, Server::callback_t>> sp) {
   std::unique_lock lock(user_command_mtx);
-  user_command_map.insert(sp.begin(), sp.end());
+  for (auto &[command, cb] : sp) {
+    if (!user_command_map.emplace(command, PluginCommand{cb, CommandPlugin::Current()}).second) {
+      KLOG(Warning, "Command {} is already registered by another plugin, not adding it", command);
+    }
+  }
+  command_generation.fetch_add(1, std::memory_order_relaxed);
 }
 
 void Server::RemovePluginCommands(std::span<const std::string_view> sp) {
@@ -204,11 +540,78 @@ void Server::RemovePluginCommands(std::span<const std::string_view> sp) {
   for (auto &sv : sp) {
     user_command_map.erase(sv);
   }
+  command_generation.fetch_add(1, std::memory_order_relaxed);
+}
+
+bool Server::AddPlugin(const plugin::Descriptor &desc, CommandPlugin *owner) {
+  std::unique_lock lock(user_command_mtx);
+  return AddPluginLocked(desc, owner);
+}
+
+void Server::RemovePlugin(const plugin::Descriptor &desc, CommandPlugin *owner) {
+  std::unique_lock lock(user_command_mtx);
+  RemovePluginLocked(desc, owner);
+}
+
+bool Server::ReplacePlugin(const plugin::Descriptor &old_desc, CommandPlugin *old_owner,
+                           const plugin::Descriptor &desc, CommandPlugin *owner) {
+  std::unique_lock lock(user_command_mtx);
+  RemovePluginLocked(old_desc, old_owner);
+  if (AddPluginLocked(desc, owner)) return true;
+  // Its commands were just removed, so they can't collide
+  AddPluginLocked(old_desc, old_owner);
+  return false;
+}
+
+bool Server::AddPluginLocked(const plugin::Descriptor &desc, CommandPlugin *owner) {
+  for (auto &c : desc.commands) {
+    if (user_command_map.contains(c.command)) {
+      KLOG(Error, "Command {} of plugin {} is already registered by another plugin", c.command,
+           desc.name);
+      return false;
+    }
+  }
+  user_command_map.reserve(user_command_map.size() + desc.commands.size());
+  for (auto &c : desc.commands) {
+    user_command_map.emplace(c.command, PluginCommand{c.callback, owner});
+  }
+  for (auto &e : desc.events) event_subscriber_map[e.command].push_back({e.callback, owner});
+  event_subscriber_count.fetch_add(desc.events.size(), std::memory_order_relaxed);
+  command_generation.fetch_add(1, std::memory_order_relaxed);
+  if (auto patterns = plugin::GetPatterns(desc); !patterns.empty()) {
+    for (auto &p : patterns) pattern_subscriber_vec.push_back({&p, owner});
+    pattern_subscriber_count.store(pattern_subscriber_vec.size(), std::memory_order_relaxed);
+    pattern_generation.fetch_add(1, std::memory_order_relaxed);
+  }
+  return true;
+}
+
+void Server::RemovePluginLocked(const plugin::Descriptor &desc, CommandPlugin *owner) {
+  for (auto &c : desc.commands) {
+    if (auto it = user_command_map.find(c.command);
+        it != user_command_map.end() && it->second.plugin == owner) {
+      user_command_map.erase(it);
+    }
+  }
+  for (auto &e : desc.events) {
+    auto it = event_subscriber_map.find(e.command);
+    if (it == event_subscriber_map.end()) continue;
+    event_subscriber_count.fetch_sub(
+        std::erase_if(it->second, [owner](const PluginEvent &pe) { return pe.plugin == owner; }),
+        std::memory_order_relaxed);
+    if (it->second.empty()) event_subscriber_map.erase(it);
+  }
+  command_generation.fetch_add(1, std::memory_order_relaxed);
+  if (std::erase_if(pattern_subscriber_vec,
+                    [owner](const PluginPattern &pp) { return pp.plugin == owner; })) {
+    pattern_subscriber_count.store(pattern_subscriber_vec.size(), std::memory_order_relaxed);
+    pattern_generation.fetch_add(1, std::memory_order_relaxed);
+  }
 }
 
 namespace {
 
-int GetConnectionFd(const char *addr, uint16_t port) {
+int GetConnectionFd(const char *addr, uint16_t port, const SocketOptions &options) {
   int fd = -1;
 
   struct addrinfo hints, *result;
@@ -219,7 +622,7 @@ int GetConnectionFd(const char *addr, uint16_t port) {
 
   int r = getaddrinfo(addr, std::to_string(port).c_str(), &hints, &result);
   if (r != 0) {
-    LOG(ERROR) << "Failed to resolve name: " << gai_strerror(errno);
+    LOG(ERROR) << "Failed to resolve name: " << gai_strerror(r);
     return fd;
   }
 
@@ -227,7 +630,13 @@ int GetConnectionFd(const char *addr, uint16_t port) {
   for (; i != nullptr; i = i->ai_next) {
     fd = socket(i->ai_family, i->ai_socktype | SOCK_CLOEXEC, i->ai_protocol);
     if (fd < 0) break;
+    options.Apply(fd);
     if (connect(fd, i->ai_addr, i->ai_addrlen) == 0) break;
+    // Try the next address
+    int saved = errno;
+    close(fd);
+    fd = -1;
+    errno = saved;
   }
 
   freeaddrinfo(result);
@@ -236,14 +645,59 @@ int GetConnectionFd(const char *addr, uint16_t port) {
 
 }  // namespace
 
-std::optional<Server> ConnectionNew(std::string address, uint16_t port, const char *nickname) {
-  int fd = GetConnectionFd(address.c_str(), port);
+void Server::Disconnect() {
+  if (fd >= 0) {
+    close(fd);
+    fd = -1;
+  }
+  recv_partial.clear();
+  SetState(ServerState::kDisconnected);
+  cap_enabled.store(0, std::memory_order_relaxed);
+  cap_offered_map.clear();
+  cap_ls_complete = true;
+  cap_end_pending = false;
+  nick_retries = 0;
+  if (sasl) {
+    // emplace destroys the client before constructing the new one
+    auto credentials = sasl->GetCredentials();
+    sasl.emplace(std::move(credentials));
+  }
+  std::unique_lock lock(server_mtx);
+  isupport = ISupport();
+  std::unique_lock chan_lock(chan_mtx);
+  if (GetCaseMapping() != isupport.GetCaseMapping()) {
+    RebuildCaseFoldMap(chan_map, isupport.GetCaseMapping());
+    casemapping.store(isupport.GetCaseMapping(), std::memory_order_relaxed);
+  }
+  absl::erase_if(chan_map, [](const auto &p) { return p.second.state == Channel::PartRequested; });
+  for (auto &[name, chan] : chan_map) {
+    if (chan.state == Channel::Joined) chan.state = Channel::JoinRequested;
+  }
+}
+
+bool Server::Reconnect() {
+  int new_fd = GetConnectionFd(address.c_str(), port, socket_options);
+  if (new_fd < 0) {
+    PLOG(ERROR) << "Failed to reconnect to " << address << "/" << port;
+    return false;
+  }
+  fd = new_fd;
+  KLOG(Debug, "Socket options for {}/{}: {}", address, port, SocketOptions::Report(fd));
+  SetState(ServerState::kConnected);
+  return true;
+}
+
+std::optional<Server> ConnectionNew(std::string address, uint16_t port, const char *nickname,
+                                    const SocketOptions &options) {
+  int fd = GetConnectionFd(address.c_str(), port, options);
   if (fd < 0) {
     PLOG(ERROR) << "Failed to create server for " << address << "/" << port << " (" << nickname
                 << ')';
     return std::nullopt;
   }
-  return Server{fd, address, port, nickname};
+  LOG(INFO) << "Socket options for " << address << "/" << port << ": "
+            << SocketOptions::Report(fd);
+  return Server{fd, address, port, nickname, options};
 }
 
 }  // namespace kbot
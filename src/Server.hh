@@ -5,8 +5,15 @@
 #include <glog/logging.h>
 
 #include <Database.hh>
+#include <Epoll.hh>
 #include <IRC.hh>
+#include <ISupport.hh>
+#include <Metrics.hh>
+#include <PluginABI.hh>
+#include <Sasl.hh>
+#include <SocketOptions.hh>
 #include <atomic>
+#include <chrono>
 #include <cstdint>
 #include <memory>
 #include <mutex>
@@ -15,13 +22,19 @@
 #include <span>
 #include <string>
 #include <string_view>
+#include <utility>
+#include <vector>
 
 namespace kbot {
 
 enum class ServerState {
   kSetup,
   kConnected,
+  // Welcome (001) received, ISUPPORT (005) follows
+  kWelcomed,
   kLoggedIn,
+  // Lost the connection, reconnecting
+  kDisconnected,
   kFailed,
   kMax,
 };
@@ -29,7 +42,9 @@ enum class ServerState {
 constexpr const char *const ServerStateStringTable[(int)ServerState::kMax] = {
     "Uninitialized",
     "Connected",
+    "Welcomed",
     "Logged In",
+    "Disconnected",
     "Failed",
 };
 
@@ -37,35 +52,97 @@ struct Channel;
 class Manager;
 
 // CommandPlugin
-// These are automatically ref-counted, so each server user just needs to keep the Plugin object
-// alive for itself while it's loaded, mapped to its internal user_command_map.
+// Owns a loaded plugin shared object, always through a shared_ptr: every server that activated it
+// holds one reference (see PluginActivation and PluginRegistry.hh), and so does anything that may
+// still run the plugin's code after the command that started it returned (suspended coroutine
+// commands, a timer callback in progress). The object is only unmapped once the last of these is
+// gone, so a plugin can be unloaded or replaced with ,reload while invocations of it are still in
+// flight.
 
-class CommandPlugin {
+class CommandPlugin : public std::enable_shared_from_this<CommandPlugin> {
+  friend class PluginActivation;
+  using registration_callback_t = void (*)(void *);
+
+  static thread_local CommandPlugin *current;
+  std::string name;
   void *handle = nullptr;
+  // Backs the handle of a snapshot, see OpenHandle
+  int memfd = -1;
+  // Resolved once by OpenHandle, either descriptor or all of the ABI v1 functions are set
+  const plugin::Descriptor *descriptor = nullptr;
+  registration_callback_t reg_func = nullptr;
+  registration_callback_t del_func = nullptr;
+  registration_callback_t help_func = nullptr;
 
-  void CloseHandle() {
-    if (handle) {
-      dlclose(handle);
-    }
-  }
+  void CloseHandle();
 
  public:
+  // Marks the calling thread as running code of plugin for its lifetime
+  class Scope {
+    CommandPlugin *prev;
+
+   public:
+    explicit Scope(CommandPlugin *plugin) : prev(std::exchange(current, plugin)) {}
+    Scope(const Scope &) = delete;
+    Scope &operator=(const Scope &) = delete;
+    ~Scope() { current = prev; }
+  };
+
   CommandPlugin() = default;
   CommandPlugin(const CommandPlugin &) = delete;
   CommandPlugin &operator=(const CommandPlugin &) = delete;
-  CommandPlugin(CommandPlugin &&u) { std::swap(handle, u.handle); }
-  CommandPlugin &operator=(CommandPlugin &&u) {
-    dlclose(handle);
-    handle = std::exchange(u.handle, nullptr);
-    return *this;
-  }
+  CommandPlugin(CommandPlugin &&) = delete;
+  CommandPlugin &operator=(CommandPlugin &&) = delete;
   ~CommandPlugin() { CloseHandle(); }
 
-  using registration_callback_t = void (*)(void *);
-  bool OpenHandle(std::string_view name);
-  registration_callback_t GetRegistrationFunc(std::string_view plugin_name);
-  registration_callback_t GetDeletionFunc(std::string_view plugin_name);
-  registration_callback_t GetHelpFunc(std::string_view plugin_name);
+  // Opens the shared object at path and resolves its entry points, fails if it exports neither
+  // ABI. A snapshot is opened from a private copy of the file, which the dynamic linker maps anew
+  // even while the plugin is already loaded from the same path.
+  bool OpenHandle(std::string_view name, const std::string &path, bool snapshot = false);
+  std::string_view GetName() const { return name; }
+  // nullptr for ABI v1 plugins
+  const plugin::Descriptor *GetDescriptor() const { return descriptor; }
+  void Help(Manager &m, const IRCMessagePrivMsg &msg);
+  // The plugin whose code the calling thread is running, if any
+  static CommandPlugin *Current();
+};
+
+// PluginActivation
+// A plugin loaded on one server: its commands and subscriptions are in the server's maps, and its
+// timers run on the server's event loop. Created and destroyed on the server thread.
+
+class PluginActivation {
+  struct Timer {
+    plugin::TimerEntry entry;
+    std::optional<io::TimerId> id;
+  };
+
+  Manager &m;
+  std::shared_ptr<CommandPlugin> plugin;
+  // Their callbacks only hold weak references, a timer stopped while already due doesn't run
+  std::vector<std::shared_ptr<Timer>> timer_vec;
+
+  PluginActivation(Manager &m, std::shared_ptr<CommandPlugin> plugin)
+      : m(m), plugin(std::move(plugin)) {}
+  void ArmTimer(const std::shared_ptr<Timer> &t);
+  void StartTimers();
+  void StopTimers();
+
+ public:
+  PluginActivation(const PluginActivation &) = delete;
+  PluginActivation &operator=(const PluginActivation &) = delete;
+  PluginActivation(PluginActivation &&) = delete;
+  PluginActivation &operator=(PluginActivation &&) = delete;
+  // Removes the plugin's commands and subscriptions again
+  ~PluginActivation();
+
+  // nullptr when the plugin's commands collide with another plugin's
+  static std::unique_ptr<PluginActivation> CreateNew(Manager &m,
+                                                     std::shared_ptr<CommandPlugin> plugin);
+  // Swaps in another version of the plugin, in one step when both use ABI v2. Fails, keeping the
+  // loaded one, when the new version's commands collide with another plugin's.
+  bool Replace(std::shared_ptr<CommandPlugin> next);
+  CommandPlugin &GetPlugin() const { return *plugin; }
 };
 
 class Server : public IRC {
@@ -73,22 +150,82 @@ class Server : public IRC {
   std::atomic<ServerState> state = ServerState::kSetup;
   std::string address;
   uint16_t port;
+  // Applied to every connection made, the first one and reconnects
+  SocketOptions socket_options;
   std::shared_mutex chan_mtx;
-  absl::flat_hash_map<std::string, Channel> chan_map;
+  // Keyed ignoring case, as the server's CASEMAPPING has it
+  CaseFoldMap<Channel> chan_map;
   std::mutex nick_mtx;
   std::string nickname;
   db::Database local_db;
+  // Messages to channels sent before registration completed, held back until it does
+  std::vector<std::pair<std::string, std::string>> deferred_msg_vec;
+  // What the server supports (005), protected by server_mtx
+  ISupport isupport;
+  // Copy of its CASEMAPPING, for comparing names without taking server_mtx
+  std::atomic<CaseMapping> casemapping = CaseMapping::kRfc1459;
 
   using callback_t = void (*)(Manager &, const IRCMessagePrivMsg &);
 
+  bool AddPluginLocked(const plugin::Descriptor &desc, CommandPlugin *owner);
+  void RemovePluginLocked(const plugin::Descriptor &desc, CommandPlugin *owner);
+
  public:
+  struct PluginCommand {
+    callback_t callback;
+    CommandPlugin *plugin;
+  };
+  struct PluginEvent {
+    plugin::event_callback_t callback;
+    CommandPlugin *plugin;
+  };
+  struct PluginPattern {
+    const plugin::PatternEntry *entry;
+    CommandPlugin *plugin;
+  };
+
+  // Keys are copies, the plugin that first registered a name may be unloaded while another one
+  // still has it
   std::shared_mutex user_command_mtx;
-  absl::flat_hash_map<std::string, callback_t> user_command_map;
+  absl::flat_hash_map<std::string, PluginCommand> user_command_map;
+  // Plugins subscribed to each IRC command, also protected by user_command_mtx
+  absl::flat_hash_map<std::string, std::vector<PluginEvent>> event_subscriber_map;
+  std::atomic<size_t> event_subscriber_count = 0;
+  // Bumped whenever the set of commands changes, here or in the Manager's maps
+  std::atomic<uint64_t> command_generation = 0;
+  // Patterns of all plugins, the index of each is what the Manager's PatternMatcher reports. Also
+  // protected by user_command_mtx, and the generation is bumped whenever it changes.
+  std::vector<PluginPattern> pattern_subscriber_vec;
+  std::atomic<size_t> pattern_subscriber_count = 0;
+  std::atomic<uint64_t> pattern_generation = 0;
   std::shared_mutex plugins_map_mtx;
-  absl::flat_hash_map<std::string, CommandPlugin> plugins_map;
+  absl::flat_hash_map<std::string, std::unique_ptr<PluginActivation>> plugins_map;
+  metrics::ServerStats stats;
+  // IRCv3 capabilities, negotiated on the server thread (see BuiltinCap)
+  std::atomic<uint32_t> cap_enabled = 0;
+  uint32_t cap_wanted = kCapMessageTags | kCapServerTime | kCapBatch | kCapMultiPrefix |
+                        kCapEchoMessage | kCapAccountTag;
+  // Offered by the server, with their values
+  absl::flat_hash_map<std::string, std::string> cap_offered_map;
+  bool cap_ls_complete = true;
+  // Registration waits for CAP END
+  bool cap_end_pending = false;
+  // Nicknames refused during registration on this connection, see BuiltinNumeric
+  int nick_retries = 0;
+  // Authenticates during negotiation when credentials were given, with NickServ as the fallback
+  // for PLAIN if the server doesn't support SASL
+  std::optional<SaslClient> sasl;
+  // Services account granted every permission, recognized through account-tag. Set before the
+  // server thread starts.
+  std::string admin_account;
 
-  explicit Server(int sockfd, std::string address, uint16_t port, const char *nickname)
-      : IRC(sockfd), address(std::move(address)), port(port), nickname(nickname) {}
+  explicit Server(int sockfd, std::string address, uint16_t port, const char *nickname,
+                  SocketOptions socket_options = {})
+      : IRC(sockfd),
+        address(std::move(address)),
+        port(port),
+        socket_options(socket_options),
+        nickname(nickname) {}
   Server(const Server &) = delete;
   Server &operator=(const Server &) = delete;
   Server(Server &&);
@@ -100,17 +237,50 @@ class Server : public IRC {
   }
   // Basic API
   void DumpInfo();
-  ServerState GetState() { return state.load(std::memory_order_relaxed); }
+  ServerState GetState() const { return state.load(std::memory_order_relaxed); }
   void SetState(const ServerState state);
-  std::string GetAddress() { return address; }
+  bool IsRegistered() const { return GetState() == ServerState::kLoggedIn; }
+  // Registration: Connected, then Welcomed on 001 (the nickname is the one the server gave us),
+  // then once ISUPPORT is complete the joins and messages requested so far are sent in one go,
+  // as few JOIN lines as the limits allow
+  void Welcome(std::string_view nickname);
+  void AddISupport(std::span<const std::string_view> tokens);
+  void CompleteRegistration();
+  // Longest line the server accepts, CRLF included (LINELEN, or 512)
+  size_t GetLineLimit();
+  // Targets a command may name (TARGMAX, or MAXTARGETS for PRIVMSG and NOTICE), 0 for no limit,
+  // otherwise if the server didn't say
+  size_t GetTargetLimit(std::string_view command, size_t otherwise = 0);
+  bool IsChannel(std::string_view name);
+  CaseMapping GetCaseMapping() const { return casemapping.load(std::memory_order_relaxed); }
+  // Whether two nicknames or channel names are the same to the server
+  bool NameEquals(std::string_view a, std::string_view b) const {
+    return CaseFoldEq(GetCaseMapping())(a, b);
+  }
+  // Last round trip to the server measured by the watchdog, std::nullopt before the first
+  std::optional<std::chrono::nanoseconds> GetLag() const {
+    auto lag = stats.lag_ns.load(std::memory_order_relaxed);
+    if (lag < 0) return std::nullopt;
+    return std::chrono::nanoseconds(lag);
+  }
+  // Closes the connection and forgets what was negotiated on it, channels we were in are joined
+  // again once registration completes on the next one
+  void Disconnect();
+  // Connects again (blocking), leaving registration to the caller
+  bool Reconnect();
+  std::string GetAddress() const { return address; }
   uint16_t GetPort() const { return port; }
   const std::string &GetNickname() {
     std::unique_lock lock(nick_mtx);
     return nickname;
   }
+  bool IsOwnNickname(std::string_view nick) {
+    std::unique_lock lock(nick_mtx);
+    return NameEquals(nick, nickname);
+  }
   void UpdateNickname(std::string_view old_nick, std::string_view new_nick) {
     std::unique_lock lock(nick_mtx);
-    if (old_nick == nickname) {
+    if (NameEquals(old_nick, nickname)) {
       nickname = new_nick;
     } else {
       LOG(ERROR) << "Old nickname doesn't match current nickname, no update made";
@@ -123,17 +293,52 @@ class Server : public IRC {
       return;
     }
   }
-  // Channel API
-  void JoinChannel(std::string_view channel);
+  // Channel API, joins and messages are deferred until registration completes
+  void JoinChannel(std::string_view channel, std::string_view key = "");
   void UpdateJoinChannel(std::string_view channel);
+  // The server refused to join, with the numeric it replied
+  void FailJoinChannel(std::string_view channel, int numeric);
   void UpdatePartChannel(std::string_view channel);
   bool SendChannel(std::string_view channel, std::string_view msg);
+  // Sends the same message to all targets (channels or nicknames), in as few PRIVMSG lines as the
+  // server's target and line limits allow and with one write. Long messages are split.
+  bool Broadcast(std::span<const std::string_view> targets, std::string_view msg);
   bool SetTopic(std::string_view channel, std::string_view topic);
   std::string GetTopic(std::string_view channel);
   bool PartChannel(std::string_view channel);
+  struct ChannelCount {
+    size_t join_requested = 0;
+    size_t joined = 0;
+    size_t part_requested = 0;
+    size_t join_failed = 0;
+  };
+  ChannelCount GetChannelCount();
   // Plugin API
+  std::vector<std::string> GetPluginNames();
   void AddPluginCommands(std::span<const std::pair<std::string, callback_t>> commands);
   void RemovePluginCommands(std::span<const std::string_view> commands);
+  // Fails, adding nothing, when another plugin already registered one of the commands
+  bool AddPlugin(const plugin::Descriptor &desc, CommandPlugin *owner);
+  void RemovePlugin(const plugin::Descriptor &desc, CommandPlugin *owner);
+  // Atomically with respect to command dispatch, the old plugin stays when the new one fails to
+  // be added
+  bool ReplacePlugin(const plugin::Descriptor &old_desc, CommandPlugin *old_owner,
+                     const plugin::Descriptor &desc, CommandPlugin *owner);
+  bool HasEventSubscribers() const {
+    return event_subscriber_count.load(std::memory_order_relaxed) != 0;
+  }
+  bool HasCap(IRCCapability cap) const {
+    return (cap_enabled.load(std::memory_order_relaxed) & cap) != 0;
+  }
+  // Sender of msg, with its account if the server vouches for the account tag
+  IRCUser GetInvoker(const IRCMessagePrivMsg &msg) const {
+    IRCUser u = msg.GetUser();
+    if (HasCap(kCapAccountTag)) u.account = msg.GetAccountTag();
+    return u;
+  }
+  bool HasPatternSubscribers() const {
+    return pattern_subscriber_count.load(std::memory_order_relaxed) != 0;
+  }
 };
 
 struct Channel {
@@ -141,10 +346,16 @@ struct Channel {
     JoinRequested,
     Joined,
     PartRequested,
+    JoinFailed,
     // Parted
   } state = JoinRequested;
+  // Needed again to rejoin
+  std::string key;
+  // Numeric the server refused the join with
+  int error = 0;
 };
 
-std::optional<Server> ConnectionNew(std::string, uint16_t, const char *);
+std::optional<Server> ConnectionNew(std::string, uint16_t, const char *,
+                                    const SocketOptions & = {});
 
 }  // namespace kbot
@@ -0,0 +1,136 @@
+#include <glog/logging.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <ShmRing.hh>
+#include <cerrno>
+#include <cstring>
+#include <optional>
+#include <string_view>
+#include <utility>
+
+namespace kbot {
+namespace ipc {
+
+ShmRing &ShmRing::operator=(ShmRing &&r) {
+  if (this != &r) {
+    this->~ShmRing();
+    mem_fd = std::exchange(r.mem_fd, -1);
+    event_fd = std::exchange(r.event_fd, -1);
+    map = std::exchange(r.map, nullptr);
+    map_size = std::exchange(r.map_size, 0);
+    hdr = std::exchange(r.hdr, nullptr);
+    data = std::exchange(r.data, nullptr);
+    capacity = std::exchange(r.capacity, 0);
+  }
+  return *this;
+}
+
+ShmRing::~ShmRing() {
+  if (map) munmap(map, map_size);
+  if (mem_fd >= 0) close(mem_fd);
+  if (event_fd >= 0) close(event_fd);
+  map = nullptr;
+  mem_fd = event_fd = -1;
+}
+
+// Reserve address space for the header and two copies of the data area, then map the memfd over
+// it: the header page, followed by the data area twice.
+bool ShmRing::Map() {
+  map_size = kHeaderSize + 2 * capacity;
+  map = mmap(nullptr, map_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (map == MAP_FAILED) {
+    map = nullptr;
+    PLOG(ERROR) << "Failed to reserve address space for ring";
+    return false;
+  }
+  auto base = static_cast<char *>(map);
+  constexpr int prot = PROT_READ | PROT_WRITE;
+  if (mmap(base, kHeaderSize, prot, MAP_SHARED | MAP_FIXED, mem_fd, 0) == MAP_FAILED ||
+      mmap(base + kHeaderSize, capacity, prot, MAP_SHARED | MAP_FIXED, mem_fd, kHeaderSize) ==
+          MAP_FAILED ||
+      mmap(base + kHeaderSize + capacity, capacity, prot, MAP_SHARED | MAP_FIXED, mem_fd,
+           kHeaderSize) == MAP_FAILED) {
+    PLOG(ERROR) << "Failed to map ring";
+    return false;
+  }
+  hdr = reinterpret_cast<Header *>(base);
+  data = base + kHeaderSize;
+  return true;
+}
+
+std::optional<ShmRing> ShmRing::CreateNew(size_t capacity) {
+  static_assert(sizeof(Header) <= kHeaderSize);
+  size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+  ShmRing r;
+  r.capacity = (capacity + page - 1) / page * page;
+  r.mem_fd = memfd_create("kbot-ring", MFD_CLOEXEC);
+  if (r.mem_fd < 0) {
+    PLOG(ERROR) << "Failed to create memfd for ring";
+    return std::nullopt;
+  }
+  if (ftruncate(r.mem_fd, static_cast<off_t>(kHeaderSize + r.capacity)) < 0) {
+    PLOG(ERROR) << "Failed to size memfd for ring";
+    return std::nullopt;
+  }
+  r.event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (r.event_fd < 0) {
+    PLOG(ERROR) << "Failed to create eventfd for ring";
+    return std::nullopt;
+  }
+  if (!r.Map()) return std::nullopt;
+  new (r.hdr) Header{};
+  return r;
+}
+
+std::optional<ShmRing> ShmRing::Attach(int mem_fd, int event_fd) {
+  ShmRing r;
+  r.mem_fd = mem_fd;
+  r.event_fd = event_fd;
+  struct stat st;
+  if (fstat(mem_fd, &st) < 0) {
+    PLOG(ERROR) << "Failed to stat ring memfd";
+    return std::nullopt;
+  }
+  size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+  if (static_cast<size_t>(st.st_size) <= kHeaderSize || st.st_size % page) {
+    LOG(ERROR) << "Ring memfd has bad size " << st.st_size;
+    return std::nullopt;
+  }
+  r.capacity = static_cast<size_t>(st.st_size) - kHeaderSize;
+  if (!r.Map()) return std::nullopt;
+  return r;
+}
+
+void ShmRing::Signal() {
+  uint64_t v = 1;
+  (void)!write(event_fd, &v, sizeof(v));
+}
+
+char *ShmRing::Reserve(size_t len) {
+  uint64_t h = hdr->head.load(std::memory_order_relaxed);
+  uint64_t used = h - hdr->tail.load(std::memory_order_acquire);
+  if (used > capacity || RecordSize(len) > capacity - used || len > UINT32_MAX) return nullptr;
+  return data + h % capacity + sizeof(RecordHeader);
+}
+
+void ShmRing::Commit(uint32_t type, size_t len) {
+  uint64_t h = hdr->head.load(std::memory_order_relaxed);
+  RecordHeader rh = {static_cast<uint32_t>(len), type};
+  std::memcpy(data + h % capacity, &rh, sizeof(rh));
+  hdr->head.store(h + RecordSize(len), std::memory_order_seq_cst);
+  if (hdr->tail.load(std::memory_order_seq_cst) == h) Signal();
+}
+
+bool ShmRing::Push(uint32_t type, std::string_view payload) {
+  char *p = Reserve(payload.size());
+  if (p == nullptr) return false;
+  std::memcpy(p, payload.data(), payload.size());
+  Commit(type, payload.size());
+  return true;
+}
+
+}  // namespace ipc
+}  // namespace kbot
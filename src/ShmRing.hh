@@ -0,0 +1,113 @@
+#pragma once
+
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <string_view>
+#include <utility>
+
+namespace kbot {
+namespace ipc {
+
+// ShmRing
+// Single producer, single consumer ring of variable sized records in a memfd shared between two
+// processes, with an eventfd to wake up the consumer. The data area is mapped twice back to back,
+// so every record is contiguous in memory even when it wraps around: producers format straight
+// into the ring and consumers get views into it, no bytes are copied on either side.
+//
+// The producer only signals the eventfd when the consumer has caught up with everything before
+// the new record, i.e. when it may be about to sleep; a busy consumer picks new records up on its
+// own. Both sides treat the shared header as untrusted, a corrupted ring is reported and never
+// read out of bounds.
+
+class ShmRing {
+  struct Header {
+    alignas(64) std::atomic<uint64_t> head;
+    alignas(64) std::atomic<uint64_t> tail;
+  };
+  struct RecordHeader {
+    uint32_t size;
+    uint32_t type;
+  };
+
+  int mem_fd = -1;
+  int event_fd = -1;
+  void *map = nullptr;
+  size_t map_size = 0;
+  Header *hdr = nullptr;
+  char *data = nullptr;
+  uint64_t capacity = 0;
+
+  ShmRing() = default;
+  bool Map();
+  void Signal();
+  static constexpr uint64_t RecordSize(uint64_t len) {
+    return (sizeof(RecordHeader) + len + 7) & ~uint64_t(7);
+  }
+
+ public:
+  static constexpr size_t kHeaderSize = 4096;
+
+  ShmRing(const ShmRing &) = delete;
+  ShmRing &operator=(const ShmRing &) = delete;
+  ShmRing(ShmRing &&r) { *this = std::move(r); }
+  ShmRing &operator=(ShmRing &&r);
+  ~ShmRing();
+
+  // Capacity is rounded up to the page size
+  static std::optional<ShmRing> CreateNew(size_t capacity);
+  // Takes ownership of both fds, e.g. the ones inherited by a child process
+  static std::optional<ShmRing> Attach(int mem_fd, int event_fd);
+
+  int GetMemFd() const { return mem_fd; }
+  int GetEventFd() const { return event_fd; }
+  size_t GetCapacity() const { return capacity; }
+
+  // Producer
+  // Returns len bytes of contiguous space for the next record, or nullptr if the ring is full
+  char *Reserve(size_t len);
+  // Publishes the record reserved last, len may be smaller than what was reserved
+  void Commit(uint32_t type, size_t len);
+  bool Push(uint32_t type, std::string_view payload);
+
+  // Consumer
+  // Invokes f(type, payload) for every record, the view is only valid during the call. Returns the
+  // number of records consumed, or -1 if the ring is corrupted.
+  template <class F>
+  ssize_t Drain(F &&f);
+};
+
+template <class F>
+ssize_t ShmRing::Drain(F &&f) {
+  uint64_t v;
+  (void)!read(event_fd, &v, sizeof(v));
+  ssize_t n = 0;
+  uint64_t t = hdr->tail.load(std::memory_order_relaxed);
+  for (;;) {
+    uint64_t h = hdr->head.load(std::memory_order_acquire);
+    if (h - t > capacity) return -1;
+    while (t != h) {
+      const char *p = data + t % capacity;
+      RecordHeader rh;
+      std::memcpy(&rh, p, sizeof(rh));
+      uint64_t size = RecordSize(rh.size);
+      if (size > h - t) return -1;
+      f(rh.type, std::string_view(p + sizeof(RecordHeader), rh.size));
+      t += size;
+      n++;
+    }
+    // Pairs with the producer's check in Commit, either it sees that we caught up and signals, or
+    // we see its new record here
+    hdr->tail.store(t, std::memory_order_seq_cst);
+    if (hdr->head.load(std::memory_order_seq_cst) == t) break;
+  }
+  return n;
+}
+
+}  // namespace ipc
+}  // namespace kbot
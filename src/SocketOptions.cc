@@ -0,0 +1,148 @@
+#include <fmt/format.h>
+#include <glog/logging.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include <SocketOptions.hh>
+#include <charconv>
+#include <string>
+#include <string_view>
+
+namespace kbot {
+
+namespace {
+
+std::optional<uint64_t> ParseU64(std::string_view s) {
+  uint64_t v;
+  auto [p, ec] = std::from_chars(s.data(), s.data() + s.size(), v);
+  if (ec != std::errc() || p != s.data() + s.size()) return std::nullopt;
+  return v;
+}
+
+std::optional<uint64_t> ParseSize(std::string_view s) {
+  uint64_t shift = 0;
+  if (s.ends_with('K')) {
+    shift = 10;
+  } else if (s.ends_with('M')) {
+    shift = 20;
+  }
+  if (shift) s.remove_suffix(1);
+  auto v = ParseU64(s);
+  // setsockopt takes an int
+  if (!v || *v > (uint64_t{INT32_MAX} >> shift)) return std::nullopt;
+  return *v << shift;
+}
+
+std::optional<unsigned> ParseUnsigned(std::string_view s) {
+  auto v = ParseU64(s);
+  if (!v || *v > UINT32_MAX / 2) return std::nullopt;
+  return static_cast<unsigned>(*v);
+}
+
+struct Option {
+  const char *name;
+  int level;
+  int option;
+};
+
+constexpr Option kReported[] = {
+    {"TCP_NODELAY", IPPROTO_TCP, TCP_NODELAY},
+    {"SO_KEEPALIVE", SOL_SOCKET, SO_KEEPALIVE},
+    {"TCP_KEEPIDLE", IPPROTO_TCP, TCP_KEEPIDLE},
+    {"TCP_KEEPINTVL", IPPROTO_TCP, TCP_KEEPINTVL},
+    {"TCP_KEEPCNT", IPPROTO_TCP, TCP_KEEPCNT},
+    {"SO_RCVBUF", SOL_SOCKET, SO_RCVBUF},
+    {"SO_SNDBUF", SOL_SOCKET, SO_SNDBUF},
+    {"TCP_USER_TIMEOUT", IPPROTO_TCP, TCP_USER_TIMEOUT},
+    {"SO_BUSY_POLL", SOL_SOCKET, SO_BUSY_POLL},
+    {"TCP_NOTSENT_LOWAT", IPPROTO_TCP, TCP_NOTSENT_LOWAT},
+};
+
+}  // namespace
+
+std::optional<SocketOptions> SocketOptions::Parse(std::string_view spec) {
+  SocketOptions o;
+  while (!spec.empty()) {
+    auto comma = spec.find(',');
+    auto kv = spec.substr(0, comma);
+    spec.remove_prefix(comma == spec.npos ? spec.size() : comma + 1);
+    auto eq = kv.find('=');
+    auto key = kv.substr(0, eq);
+    if (key == "nodelay" && eq == kv.npos) {
+      o.nodelay = true;
+      continue;
+    }
+    if (eq == kv.npos) return std::nullopt;
+    auto value = kv.substr(eq + 1);
+    if (key == "nodelay") {
+      auto v = ParseU64(value);
+      if (!v || *v > 1) return std::nullopt;
+      o.nodelay = *v;
+    } else if (key == "keepalive") {
+      // <idle>[:<interval>[:<count>]]
+      unsigned *fields[] = {&o.keepalive_idle, &o.keepalive_interval, &o.keepalive_count};
+      for (auto *f : fields) {
+        auto colon = value.find(':');
+        auto v = ParseUnsigned(value.substr(0, colon));
+        if (!v) return std::nullopt;
+        *f = *v;
+        value.remove_prefix(colon == value.npos ? value.size() : colon + 1);
+        if (value.empty()) break;
+      }
+      if (!value.empty()) return std::nullopt;
+    } else if (key == "rcvbuf" || key == "sndbuf" || key == "notsent_lowat") {
+      auto v = ParseSize(value);
+      if (!v) return std::nullopt;
+      (key == "rcvbuf" ? o.rcvbuf : key == "sndbuf" ? o.sndbuf : o.notsent_lowat) = *v;
+    } else if (key == "user_timeout" || key == "busy_poll") {
+      auto v = ParseUnsigned(value);
+      if (!v) return std::nullopt;
+      (key == "user_timeout" ? o.user_timeout_ms : o.busy_poll_usec) = *v;
+    } else {
+      return std::nullopt;
+    }
+  }
+  return o;
+}
+
+bool SocketOptions::Apply(int fd) const {
+  bool ok = true;
+  auto set = [&](const char *name, int level, int option, uint64_t value) {
+    int v = static_cast<int>(value);
+    if (setsockopt(fd, level, option, &v, sizeof(v)) < 0) {
+      PLOG(WARNING) << "Failed to set " << name << " to " << value;
+      ok = false;
+    }
+  };
+  set("TCP_NODELAY", IPPROTO_TCP, TCP_NODELAY, nodelay);
+  set("SO_KEEPALIVE", SOL_SOCKET, SO_KEEPALIVE, keepalive_idle != 0);
+  if (keepalive_idle) {
+    set("TCP_KEEPIDLE", IPPROTO_TCP, TCP_KEEPIDLE, keepalive_idle);
+    if (keepalive_interval) set("TCP_KEEPINTVL", IPPROTO_TCP, TCP_KEEPINTVL, keepalive_interval);
+    if (keepalive_count) set("TCP_KEEPCNT", IPPROTO_TCP, TCP_KEEPCNT, keepalive_count);
+  }
+  if (rcvbuf) set("SO_RCVBUF", SOL_SOCKET, SO_RCVBUF, *rcvbuf);
+  if (sndbuf) set("SO_SNDBUF", SOL_SOCKET, SO_SNDBUF, *sndbuf);
+  if (user_timeout_ms) set("TCP_USER_TIMEOUT", IPPROTO_TCP, TCP_USER_TIMEOUT, *user_timeout_ms);
+  if (busy_poll_usec) set("SO_BUSY_POLL", SOL_SOCKET, SO_BUSY_POLL, *busy_poll_usec);
+  if (notsent_lowat) set("TCP_NOTSENT_LOWAT", IPPROTO_TCP, TCP_NOTSENT_LOWAT, *notsent_lowat);
+  return ok;
+}
+
+std::string SocketOptions::Report(int fd) {
+  std::string out;
+  for (auto &o : kReported) {
+    int v = 0;
+    socklen_t len = sizeof(v);
+    if (!out.empty()) out.push_back(' ');
+    if (getsockopt(fd, o.level, o.option, &v, &len) < 0) {
+      out += fmt::format("{}=?", o.name);
+    } else {
+      out += fmt::format("{}={}", o.name, v);
+    }
+  }
+  return out;
+}
+
+}  // namespace kbot
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+
+namespace kbot {
+
+// SocketOptions
+// Tuning applied to the TCP socket of a server connection, before it connects (so that buffer
+// sizes take part in window scaling). Unset options keep the kernel's defaults; by default only
+// Nagle is turned off, replies being single short lines, and keepalive is on so that a peer gone
+// without a word is noticed even while we have nothing to send.
+//
+// Options the kernel refuses (SO_BUSY_POLL above net.core.busy_read wants CAP_NET_ADMIN) are
+// logged and skipped, Report reads back what is in effect.
+
+struct SocketOptions {
+  bool nodelay = true;
+  // SO_KEEPALIVE with TCP_KEEPIDLE, TCP_KEEPINTVL (seconds) and TCP_KEEPCNT, idle 0 for off
+  unsigned keepalive_idle = 120;
+  unsigned keepalive_interval = 30;
+  unsigned keepalive_count = 4;
+  // SO_RCVBUF and SO_SNDBUF in bytes, the kernel doubles them for its bookkeeping
+  std::optional<uint64_t> rcvbuf;
+  std::optional<uint64_t> sndbuf;
+  // TCP_USER_TIMEOUT, how long sent data may stay unacknowledged before the connection is dropped
+  std::optional<unsigned> user_timeout_ms;
+  // SO_BUSY_POLL, microseconds to busy poll the device queue on a blocking receive
+  std::optional<unsigned> busy_poll_usec;
+  // TCP_NOTSENT_LOWAT, unsent bytes in the send queue beyond which it stops being writable
+  std::optional<uint64_t> notsent_lowat;
+
+  // Parses "nodelay[=0|1],keepalive=<idle>[:<interval>[:<count>]],rcvbuf=<bytes>[KM],
+  // sndbuf=<bytes>[KM],user_timeout=<ms>,busy_poll=<usec>,notsent_lowat=<bytes>[KM]", any subset
+  // in any order, over the defaults
+  static std::optional<SocketOptions> Parse(std::string_view spec);
+  // Returns false if any option could not be set, the others are set regardless
+  bool Apply(int fd) const;
+  // Effective values as the kernel reports them, e.g. "TCP_NODELAY=1 SO_KEEPALIVE=1 ..."
+  static std::string Report(int fd);
+};
+
+}  // namespace kbot
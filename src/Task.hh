@@ -0,0 +1,204 @@
+#pragma once
+
+#include <glog/logging.h>
+
+#include <Epoll.hh>
+#include <cerrno>
+#include <chrono>
+#include <coroutine>
+#include <cstdint>
+#include <exception>
+#include <optional>
+#include <type_traits>
+#include <utility>
+
+namespace kbot {
+
+// Task
+// Lazily started coroutine type for cooperative multitasking on a server thread. A Task either is
+// co_await'ed by another coroutine (which it resumes on completion through symmetric transfer) or
+// handed to Spawn, which starts it detached so that the frame frees itself when it finishes.
+// Nothing here is thread safe, every Task belongs to the thread running its EpollManager.
+
+template <class T = void>
+class Task;
+
+namespace detail {
+
+struct TaskPromiseBase {
+  std::coroutine_handle<> continuation;
+  std::exception_ptr exception;
+  bool detached = false;
+
+  std::suspend_always initial_suspend() noexcept { return {}; }
+  void unhandled_exception() { exception = std::current_exception(); }
+
+  template <class Promise>
+  struct FinalAwaiter {
+    bool await_ready() noexcept { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> h) noexcept {
+      auto &p = h.promise();
+      if (p.detached) {
+        if (p.exception) {
+          try {
+            std::rethrow_exception(p.exception);
+          } catch (std::exception &e) {
+            LOG(ERROR) << "Detached task terminated with exception: " << e.what();
+          } catch (...) {
+            LOG(ERROR) << "Detached task terminated with unknown exception";
+          }
+        }
+        h.destroy();
+        return std::noop_coroutine();
+      }
+      return p.continuation ? p.continuation : std::noop_coroutine();
+    }
+    void await_resume() noexcept {}
+  };
+};
+
+template <class T>
+struct TaskPromise : TaskPromiseBase {
+  std::optional<T> value;
+
+  Task<T> get_return_object();
+  FinalAwaiter<TaskPromise> final_suspend() noexcept { return {}; }
+  template <class U>
+  void return_value(U &&v) {
+    value.emplace(std::forward<U>(v));
+  }
+  T Result() {
+    if (exception) std::rethrow_exception(exception);
+    return std::move(*value);
+  }
+};
+
+template <>
+struct TaskPromise<void> : TaskPromiseBase {
+  Task<void> get_return_object();
+  FinalAwaiter<TaskPromise> final_suspend() noexcept { return {}; }
+  void return_void() {}
+  void Result() {
+    if (exception) std::rethrow_exception(exception);
+  }
+};
+
+}  // namespace detail
+
+template <class T>
+class [[nodiscard]] Task {
+ public:
+  using promise_type = detail::TaskPromise<T>;
+  using handle_type = std::coroutine_handle<promise_type>;
+
+ private:
+  handle_type h;
+
+  template <class U>
+  friend void Spawn(Task<U> t);
+
+ public:
+  explicit Task(handle_type h) : h(h) {}
+  Task(const Task &) = delete;
+  Task &operator=(const Task &) = delete;
+  Task(Task &&t) : h(std::exchange(t.h, nullptr)) {}
+  Task &operator=(Task &&t) {
+    if (this != &t) {
+      if (h) h.destroy();
+      h = std::exchange(t.h, nullptr);
+    }
+    return *this;
+  }
+  ~Task() {
+    if (h) h.destroy();
+  }
+
+  bool await_ready() const noexcept { return !h || h.done(); }
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<> c) noexcept {
+    h.promise().continuation = c;
+    return h;
+  }
+  T await_resume() { return h.promise().Result(); }
+};
+
+namespace detail {
+
+template <class T>
+Task<T> TaskPromise<T>::get_return_object() {
+  return Task<T>{std::coroutine_handle<TaskPromise>::from_promise(*this)};
+}
+
+inline Task<void> TaskPromise<void>::get_return_object() {
+  return Task<void>{std::coroutine_handle<TaskPromise>::from_promise(*this)};
+}
+
+}  // namespace detail
+
+// Start the task and let it run to completion on its own
+template <class T>
+void Spawn(Task<T> t) {
+  auto h = std::exchange(t.h, nullptr);
+  h.promise().detached = true;
+  h.resume();
+}
+
+namespace io {
+
+// Awaitables driven by the EpollManager of the current thread. The manager must not move while
+// any of them is pending.
+
+class SleepAwaiter {
+  EpollManager &m;
+  std::chrono::nanoseconds after;
+  bool armed = false;
+
+ public:
+  SleepAwaiter(EpollManager &m, std::chrono::nanoseconds after) : m(m), after(after) {}
+  bool await_ready() const noexcept { return after.count() <= 0; }
+  bool await_suspend(std::coroutine_handle<> h) {
+    armed = m.AddTimer(after, [h] { h.resume(); }).has_value();
+    return armed;
+  }
+  // Returns false if no timer could be created and the wait was skipped
+  bool await_resume() const noexcept { return armed || after.count() <= 0; }
+};
+
+inline SleepAwaiter Sleep(EpollManager &m, std::chrono::nanoseconds after) { return {m, after}; }
+
+class FdAwaiter {
+  EpollManager &m;
+  int fd;
+  EpollManager::EventFlags events;
+  uint32_t revents = 0;
+  int err = 0;
+
+ public:
+  FdAwaiter(EpollManager &m, int fd, EpollManager::EventFlags events)
+      : m(m), fd(fd), events(events) {}
+  bool await_ready() const noexcept { return false; }
+  bool await_suspend(std::coroutine_handle<> h) {
+    bool r = m.RegisterFd(
+        fd, events,
+        [this, h](struct epoll_event ev) {
+          revents = ev.events;
+          m.DeleteFd(fd);
+          h.resume();
+        },
+        EpollManager::EpollOneshot);
+    if (!r) err = errno;
+    return r;
+  }
+  // Returns the ready events, or 0 with errno set if the fd could not be watched (e.g. it is
+  // already registered with the manager)
+  uint32_t await_resume() const noexcept {
+    if (err) errno = err;
+    return revents;
+  }
+};
+
+inline FdAwaiter WaitFd(EpollManager &m, int fd, EpollManager::EventFlags events) {
+  return {m, fd, events};
+}
+
+}  // namespace io
+}  // namespace kbot
@@ -0,0 +1,200 @@
+#include <fmt/format.h>
+#include <glog/logging.h>
+#include <signal.h>
+#include <sys/signalfd.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <Trace.hh>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+namespace kbot {
+namespace trace {
+
+namespace {
+
+struct Event {
+  uint64_t ts_ns;
+  const char *name;
+  uint64_t arg;
+  Phase ph;
+  char label[23];
+};
+
+// An event as stored in the ring, its words are read while the writer may be reusing the slot
+struct Slot {
+  static constexpr size_t kWords = sizeof(Event) / sizeof(uint64_t);
+  std::array<std::atomic<uint64_t>, kWords> words;
+
+  void Store(const Event &e) {
+    uint64_t w[kWords];
+    std::memcpy(w, &e, sizeof(e));
+    for (size_t i = 0; i < kWords; i++) words[i].store(w[i], std::memory_order_relaxed);
+  }
+  void Load(Event &e) const {
+    uint64_t w[kWords];
+    for (size_t i = 0; i < kWords; i++) w[i] = words[i].load(std::memory_order_relaxed);
+    std::memcpy(&e, w, sizeof(e));
+  }
+};
+static_assert(sizeof(Event) % sizeof(uint64_t) == 0 && std::is_trivially_copyable_v<Event>);
+
+// TraceRing
+// Single writer (the owning thread), any number of concurrent readers. Readers copy the window and
+// then discard every slot the writer may have reused meanwhile, so a dump never contains torn
+// events.
+
+struct TraceRing {
+  static constexpr size_t kSize = 1 << 14;
+  std::atomic<uint64_t> head = 0;
+  pid_t tid = gettid();
+  std::array<Slot, kSize> slots;
+};
+
+std::mutex ring_vec_mtx;
+// Rings are never freed, so events of exited threads are still part of a dump
+std::vector<std::unique_ptr<TraceRing>> ring_vec;
+std::string dump_path;
+
+TraceRing &GetThreadRing() {
+  thread_local TraceRing *ring = [] {
+    auto r = std::make_unique<TraceRing>();
+    std::unique_lock lock(ring_vec_mtx);
+    return ring_vec.emplace_back(std::move(r)).get();
+  }();
+  return *ring;
+}
+
+uint64_t NowNs() {
+  return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                   std::chrono::steady_clock::now().time_since_epoch())
+                                   .count());
+}
+
+std::string ThreadName(pid_t tid) {
+  std::ifstream f(fmt::format("/proc/self/task/{}/comm", tid));
+  std::string name;
+  if (f && std::getline(f, name)) return name;
+  return fmt::format("kbot-{}", tid);
+}
+
+void AppendJsonString(std::string &out, std::string_view s) {
+  out.push_back('"');
+  for (unsigned char c : s) {
+    if (c == '"' || c == '\\') {
+      out.push_back('\\');
+      out.push_back(static_cast<char>(c));
+    } else if (c < 0x20) {
+      out += fmt::format("\\u{:04x}", c);
+    } else {
+      out.push_back(static_cast<char>(c));
+    }
+  }
+  out.push_back('"');
+}
+
+}  // namespace
+
+void EnableRing(std::string_view path) {
+  dump_path = path;
+  ring_enabled.store(true, std::memory_order_relaxed);
+}
+
+void Record(const char *name, Phase ph, uint64_t arg, std::string_view label) {
+  auto &r = GetThreadRing();
+  uint64_t h = r.head.load(std::memory_order_relaxed);
+  Event e{};
+  e.ts_ns = NowNs();
+  e.name = name;
+  e.arg = arg;
+  e.ph = ph;
+  size_t n = std::min(label.size(), sizeof(e.label) - 1);
+  std::memcpy(e.label, label.data(), n);
+  // A reader that sees any of the slot's new words then sees the head past h too
+  std::atomic_thread_fence(std::memory_order_release);
+  r.slots[h % TraceRing::kSize].Store(e);
+  r.head.store(h + 1, std::memory_order_release);
+}
+
+bool DumpChromeJson() {
+  std::string out = "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+  bool first = true;
+  pid_t pid = getpid();
+  std::vector<Event> copy(TraceRing::kSize);
+  std::unique_lock lock(ring_vec_mtx);
+  for (auto &r : ring_vec) {
+    uint64_t h = r->head.load(std::memory_order_acquire);
+    uint64_t begin = h > TraceRing::kSize ? h - TraceRing::kSize : 0;
+    for (uint64_t i = begin; i < h; i++) r->slots[i % TraceRing::kSize].Load(copy[i - begin]);
+    // Slots up to (and including) the one being written now may have been recycled. The fence
+    // keeps the loads above from moving past reading the head again.
+    std::atomic_thread_fence(std::memory_order_acquire);
+    uint64_t h2 = r->head.load(std::memory_order_relaxed);
+    uint64_t valid = h2 >= TraceRing::kSize ? std::max(begin, h2 - TraceRing::kSize + 1) : begin;
+
+    if (!first) out.push_back(',');
+    first = false;
+    out += fmt::format("{{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":{},\"tid\":{},", pid,
+                       r->tid);
+    out += "\"args\":{\"name\":";
+    AppendJsonString(out, ThreadName(r->tid));
+    out += "}}";
+    for (uint64_t i = valid; i < h; i++) {
+      const Event &e = copy[i - begin];
+      out += fmt::format(",{{\"name\":\"{}\",\"ph\":\"{}\",\"ts\":{:.3f},\"pid\":{},\"tid\":{},",
+                         e.name, static_cast<char>(e.ph), static_cast<double>(e.ts_ns) / 1000.0,
+                         pid, r->tid);
+      if (e.ph == Phase::kInstant) out += "\"s\":\"t\",";
+      out += fmt::format("\"args\":{{\"arg\":{}", e.arg);
+      if (e.label[0]) {
+        out += ",\"label\":";
+        AppendJsonString(out, e.label);
+      }
+      out += "}}";
+    }
+  }
+  lock.unlock();
+  out += "]}\n";
+
+  std::string path = dump_path.empty() ? fmt::format("kbot-trace.{}.json", pid) : dump_path;
+  FILE *f = std::fopen(path.c_str(), "w");
+  if (f == nullptr) {
+    PLOG(ERROR) << "Failed to open trace dump file " << path;
+    return false;
+  }
+  bool ok = std::fwrite(out.data(), 1, out.size(), f) == out.size();
+  ok = (std::fclose(f) == 0) && ok;
+  LOG(INFO) << "Trace ring dumped to " << path;
+  return ok;
+}
+
+int CreateDumpSignalFd() {
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR2);
+  int sfd = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (sfd < 0) PLOG(ERROR) << "Failed to create signalfd for trace dumps";
+  return sfd;
+}
+
+void HandleDumpSignal(int sfd) {
+  struct signalfd_siginfo si;
+  bool dump = false;
+  while (read(sfd, &si, sizeof(si)) == sizeof(si)) dump = true;
+  if (dump) DumpChromeJson();
+}
+
+}  // namespace trace
+}  // namespace kbot
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string_view>
+#include <utility>
+
+#ifdef KBOT_HAVE_SDT
+#include <sys/sdt.h>
+#endif
+
+namespace kbot {
+namespace trace {
+
+// Tracing
+// Two independent mechanisms share the same call sites:
+//  * USDT probes (provider "kbot"), compiled in whenever <sys/sdt.h> is available. They are a
+//    single nop until bpftrace/perf attaches, e.g. bpftrace -e 'usdt:./kbot:kbot:plugin_entry {}'
+//  * An in-process per-thread ring buffer, enabled at runtime with -t, which can be dumped as
+//    Chrome trace JSON (chrome://tracing, Perfetto) by sending SIGUSR2 to the process.
+// When both are disabled the cost of a trace point is one relaxed load and a predicted branch.
+
+enum class Phase : char {
+  kBegin = 'B',
+  kEnd = 'E',
+  kInstant = 'i',
+};
+
+inline std::atomic<bool> ring_enabled = false;
+
+void EnableRing(std::string_view dump_path);
+void Record(const char *name, Phase ph, uint64_t arg, std::string_view label = "");
+bool DumpChromeJson();
+// The dump signal must be blocked in every thread before this is called
+int CreateDumpSignalFd();
+void HandleDumpSignal(int sfd);
+
+// Runs f when the scope it is declared in is left, by return or by exception
+template <class F>
+class SpanEnd {
+  F f;
+
+ public:
+  explicit SpanEnd(F f) : f(std::move(f)) {}
+  SpanEnd(const SpanEnd &) = delete;
+  SpanEnd &operator=(const SpanEnd &) = delete;
+  ~SpanEnd() { f(); }
+};
+
+}  // namespace trace
+}  // namespace kbot
+
+#ifdef KBOT_HAVE_SDT
+#define KBOT_USDT(probe, ...) STAP_PROBEV(kbot, probe, ##__VA_ARGS__)
+#else
+#define KBOT_USDT(probe, ...) \
+  do {                        \
+  } while (0)
+#endif
+
+#define __KBOT_TRACE_RING(name, ph, arg, label)                                           \
+  do {                                                                                    \
+    if (__builtin_expect(kbot::trace::ring_enabled.load(std::memory_order_relaxed), 0)) { \
+      kbot::trace::Record(name, ph, static_cast<uint64_t>(arg), label);                   \
+    }                                                                                     \
+  } while (0)
+
+// Instant event, e.g. completion of a recv or send
+#define KBOT_TRACE_POINT(probe, arg)                                  \
+  do {                                                                \
+    KBOT_USDT(probe, arg);                                            \
+    __KBOT_TRACE_RING(#probe, kbot::trace::Phase::kInstant, arg, ""); \
+  } while (0)
+
+#define __KBOT_TRACE_BEGIN(probe, arg, label)                          \
+  do {                                                                 \
+    KBOT_USDT(probe##_entry, arg);                                     \
+    __KBOT_TRACE_RING(#probe, kbot::trace::Phase::kBegin, arg, label); \
+  } while (0)
+
+#define __KBOT_TRACE_END(probe, arg)                              \
+  do {                                                            \
+    KBOT_USDT(probe##_exit, arg);                                 \
+    __KBOT_TRACE_RING(#probe, kbot::trace::Phase::kEnd, arg, ""); \
+  } while (0)
+
+// Span from here to the end of the enclosing scope, however it is left, so that begin and end
+// events always pair up. The USDT probes are named <probe>_entry and <probe>_exit, both get arg as
+// it was at the start.
+#define KBOT_TRACE_SPAN(probe, arg, label)                                       \
+  __KBOT_TRACE_BEGIN(probe, arg, label);                                         \
+  kbot::trace::SpanEnd __kbot_span_##probe([__kbot_arg = static_cast<uint64_t>(arg)] { \
+    __KBOT_TRACE_END(probe, __kbot_arg);                                         \
+  })
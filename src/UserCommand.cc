@@ -3,13 +3,21 @@
 #include <fmt/format.h>
 
 #include <IRC.hh>
+#include <Log.hh>
 #include <Manager.hh>
+#include <PluginRegistry.hh>
 #include <Server.hh>
+#include <Task.hh>
 #include <UserCommand.hh>
+#include <WasmPlugin.hh>
+#include <chrono>
+#include <exception>
 #include <mutex>
+#include <optional>
 #include <shared_mutex>
 #include <string>
 #include <string_view>
+#include <vector>
 
 namespace kbot {
 namespace UserCommand {
@@ -17,7 +25,7 @@ namespace UserCommand {
 void SendInvokerReply(Manager &m, const IRCMessagePrivMsg &msg, std::string_view reply) {
   auto u = msg.GetUser();
   std::string_view recv = msg.GetChannel();
-  if (recv == m.server.GetNickname()) {
+  if (m.server.IsOwnNickname(recv)) {
     // Private buffer
     recv = u.nickname;
   }
@@ -25,7 +33,7 @@ void SendInvokerReply(Manager &m, const IRCMessagePrivMsg &msg, std::string_view
 }
 
 bool InvokerPermissionCheck(Manager &m, const IRCMessagePrivMsg &msg, IRCUserCapability mask) {
-  if (Message::IsUserCapable(msg.GetUser(), mask)) {
+  if (Message::IsUserCapable(m.server.GetInvoker(msg), mask, m.server.admin_account)) {
     return true;
   } else {
     SendInvokerReply(m, msg, "Error: Permission denied.");
@@ -33,6 +41,19 @@ bool InvokerPermissionCheck(Manager &m, const IRCMessagePrivMsg &msg, IRCUserCap
   return false;
 }
 
+Task<> HoldPlugin(Manager &m, std::shared_ptr<CommandPlugin> plugin, Task<> task) {
+  std::exception_ptr e;
+  try {
+    co_await std::move(task);
+  } catch (...) {
+    e = std::current_exception();
+  }
+  // Ours may be the last reference, and code of the plugin may still be on the stack below us,
+  // e.g. the callback of the timer that resumed it. Drop it from the event loop instead.
+  m.AddTimer(std::chrono::nanoseconds(0), [plugin = std::move(plugin)] {});
+  if (e) std::rethrow_exception(e);
+}
+
 namespace {
 
 // Builtin User Commands
@@ -41,70 +62,230 @@ void BuiltinCommandHi(Manager &m, const IRCMessagePrivMsg &msg) {
   SendInvokerReply(m, msg, "Hello!");
 }
 
-void BuiltinCommandNick(Manager &m, const IRCMessagePrivMsg &msg) {
+void BuiltinCommandNick(Manager &m, const IRCMessagePrivMsg &msg, Nick nickname) {
   if (InvokerPermissionCheck(m, msg, IRCUserCapability::kNickModify)) {
-    m.server.SetNickname(msg.GetUserCommandParameters().at(0));
+    m.server.SetNickname(nickname.value);
   }
 }
 
-void BuiltinCommandJoin(Manager &m, const IRCMessagePrivMsg &msg) {
+void BuiltinCommandJoin(Manager &m, const IRCMessagePrivMsg &msg, Channel channel,
+                        std::optional<std::string_view> key) {
   if (InvokerPermissionCheck(m, msg, IRCUserCapability::kJoin)) {
-    m.server.JoinChannel(msg.GetUserCommandParameters().at(0));
+    m.server.JoinChannel(channel.value, key.value_or(""));
   }
 }
 
-void BuiltinCommandPart(Manager &m, const IRCMessagePrivMsg &msg) {
+void BuiltinCommandPart(Manager &m, const IRCMessagePrivMsg &msg, Channel channel) {
   if (InvokerPermissionCheck(m, msg, IRCUserCapability::kPart)) {
-    if (!m.server.PartChannel(msg.GetUserCommandParameters().at(0))) {
+    if (!m.server.PartChannel(channel.value)) {
       SendInvokerReply(m, msg, "Error: No such channel exists.");
     }
   }
 }
 
-void BuiltinCommandLoadPlugin(Manager &m, const IRCMessagePrivMsg &msg) {
-  CommandPlugin u;
-  std::string_view plugin_name = msg.GetUserCommandParameters().at(0);
-  if (u.OpenHandle(plugin_name)) {
-    auto reg_func = u.GetRegistrationFunc(plugin_name);
-    assert(reg_func);
-    reg_func(&m.server);
-    LOG(INFO) << "Successfully loaded plugin";
-    std::unique_lock lock(m.server.plugins_map_mtx);
-    m.server.plugins_map.insert({std::string(plugin_name), CommandPlugin{std::move(u)}});
+void BuiltinCommandLoadPlugin(Manager &m, const IRCMessagePrivMsg &msg,
+                              std::string_view plugin_name) {
+  if (WasmPlugin::IsAvailable() && plugin::FindWasmPlugin(plugin_name)) {
+    if (m.LoadWasmPlugin(plugin_name)) {
+      SendInvokerReply(m, msg, fmt::format("Loaded {}", plugin_name));
+    } else {
+      SendInvokerReply(m, msg, "Failed to load plugin.");
+    }
+    return;
+  }
+  if (m.isolate_plugins) {
+    if (m.LoadPluginHost(plugin_name)) {
+      SendInvokerReply(m, msg, fmt::format("Loading {} in a separate process", plugin_name));
+    } else {
+      SendInvokerReply(m, msg, "Failed to load plugin.");
+    }
+    return;
+  }
+  if (m.LoadPlugin(plugin_name)) {
+    KLOG(Info, "Successfully loaded plugin {}", plugin_name);
     SendInvokerReply(m, msg, fmt::format("Loaded {}", plugin_name));
   } else {
     SendInvokerReply(m, msg, "Failed to load plugin.");
   }
 }
 
-void BuiltinCommandUnloadPlugin(Manager &m, const IRCMessagePrivMsg &msg) {
-  std::unique_lock lock(m.server.plugins_map_mtx);
-  std::string_view plugin_name = msg.GetUserCommandParameters().at(0);
-  if (auto it = m.server.plugins_map.find(plugin_name); it != m.server.plugins_map.end()) {
-    auto del_func = it->second.GetDeletionFunc(it->first);
-    assert(del_func);
-    del_func(&m.server);
-    LOG(INFO) << "Successfully unloaded plugin";
-    m.server.plugins_map.erase(it);
+void BuiltinCommandUnloadPlugin(Manager &m, const IRCMessagePrivMsg &msg,
+                                std::string_view plugin_name) {
+  if (m.UnloadPluginHost(plugin_name) || m.UnloadWasmPlugin(plugin_name) ||
+      m.UnloadPlugin(plugin_name)) {
     SendInvokerReply(m, msg, fmt::format("Unloaded {}", plugin_name));
   } else {
     SendInvokerReply(m, msg, "No such plugin loaded.");
   }
 }
 
-void BuiltinCommandHelp(Manager &m, const IRCMessagePrivMsg &msg) {
-  auto v = msg.GetUserCommandParameters();
-  if (v.size()) {
+// Loads the current lib<name>.so next to the loaded one and swaps its commands in, the old code is
+// unmapped once its in-flight invocations are done. Other servers keep the version they have until
+// reloaded themselves.
+void BuiltinCommandReloadPlugin(Manager &m, const IRCMessagePrivMsg &msg,
+                                std::string_view plugin_name) {
+  if (!InvokerPermissionCheck(m, msg, IRCUserCapability::kConfigure)) return;
+  if (m.plugin_host_map.contains(plugin_name)) {
+    // The child loads the file anew, though its commands are gone until it is ready
+    m.UnloadPluginHost(plugin_name);
+    if (m.LoadPluginHost(plugin_name)) {
+      SendInvokerReply(m, msg, fmt::format("Reloading {} in a separate process", plugin_name));
+    } else {
+      SendInvokerReply(m, msg, "Failed to reload plugin.");
+    }
+    return;
+  }
+  if (m.wasm_plugin_map.contains(plugin_name)) {
+    // Calls never outlive the command, there is nothing to drain
+    if (m.ReloadWasmPlugin(plugin_name)) {
+      SendInvokerReply(m, msg, fmt::format("Reloaded {}", plugin_name));
+    } else {
+      SendInvokerReply(m, msg, "Failed to reload plugin, keeping the loaded one.");
+    }
+    return;
+  }
+  std::unique_lock lock(m.server.plugins_map_mtx);
+  auto it = m.server.plugins_map.find(plugin_name);
+  if (it == m.server.plugins_map.end()) {
+    SendInvokerReply(m, msg, "No such plugin loaded.");
+    return;
+  }
+  auto next = plugin::AcquireSnapshot(plugin_name);
+  if (!next) {
+    SendInvokerReply(m, msg, "Failed to reload plugin, keeping the loaded one.");
+    return;
+  }
+  auto old = it->second->GetPlugin().shared_from_this();
+  if (!it->second->Replace(std::move(next))) {
+    SendInvokerReply(m, msg, "Failed to reload plugin, keeping the loaded one.");
+    return;
+  }
+  // Besides ours, the remaining references are other servers and invocations still in flight
+  KLOG(Info, "Reloaded plugin {}, {} other references to the old version remain", plugin_name,
+       old.use_count() - 1);
+  SendInvokerReply(m, msg, fmt::format("Reloaded {}", plugin_name));
+}
+
+Task<> BuiltinCommandWhois(Manager &m, IRCMessagePrivMsg msg) {
+  std::string nick(msg.GetUserCommandParameters().at(0));
+  if (m.server.Whois(nick) < 0) {
+    SendInvokerReply(m, msg, "Error: Failed to send WHOIS request.");
+    co_return;
+  }
+  // RPL_WHOISUSER, ERR_NOSUCHNICK
+  ReplyFilter filter;
+  filter.commands = {"311", "401"};
+  filter.target = nick;
+  auto reply = co_await m.WaitReply(std::move(filter), std::chrono::seconds(10));
+  if (!reply) {
+    SendInvokerReply(m, msg, "Error: WHOIS request timed out.");
+    co_return;
+  }
+  auto &p = reply->GetParameters();
+  if (reply->GetCommand() == "401" || p.size() < 6) {
+    SendInvokerReply(m, msg, "Error: No such nick.");
+    co_return;
+  }
+  // <me> <nick> <user> <host> * :<real name>
+  std::string_view realname(p[5].data(), p.back().data() + p.back().size());
+  if (realname.starts_with(':')) realname.remove_prefix(1);
+  SendInvokerReply(m, msg, fmt::format("{} is {}@{} ({})", p[1], p[2], p[3], realname));
+}
+
+// Command names may be given with the prefix
+std::string_view StripCommandPrefix(std::string_view name) {
+  if (name.starts_with(COMMAND_PREFIX)) name.remove_prefix(std::string_view(COMMAND_PREFIX).size());
+  return name;
+}
+
+// ,prefix * ! ~ sets the network's prefixes, ,prefix #chan ! those of a channel, and ,prefix #chan
+// alone resets the channel to the network's
+void BuiltinCommandPrefix(Manager &m, const IRCMessagePrivMsg &msg, std::string_view target,
+                          std::optional<Rest> prefixes) {
+  if (!InvokerPermissionCheck(m, msg, IRCUserCapability::kConfigure)) return;
+  Channel channel;
+  if (target != "*" && !ArgParser<Channel>::Parse(target, channel)) {
+    SendInvokerReply(m, msg, "Error: Target must be * or a channel.");
+    return;
+  }
+  std::vector<std::string> v;
+  for (std::string_view rest = prefixes ? prefixes->value : ""; !rest.empty();) {
+    auto end = rest.find(' ');
+    if (end != 0) v.emplace_back(rest.substr(0, end));
+    rest.remove_prefix(end == rest.npos ? rest.size() : end + 1);
+  }
+  if (m.command_matcher.SetPrefixes(channel.value, std::move(v))) {
+    SendInvokerReply(m, msg, "Prefixes updated.");
+  } else {
+    SendInvokerReply(m, msg, "Error: Invalid prefixes.");
+  }
+}
+
+void BuiltinCommandAlias(Manager &m, const IRCMessagePrivMsg &msg, std::string_view alias,
+                         std::string_view command) {
+  if (!InvokerPermissionCheck(m, msg, IRCUserCapability::kConfigure)) return;
+  alias = StripCommandPrefix(alias);
+  command = StripCommandPrefix(command);
+  if (m.command_matcher.AddAlias(alias, command)) {
+    SendInvokerReply(m, msg, fmt::format("{} is now an alias for {}", alias, command));
+  } else {
+    SendInvokerReply(m, msg, "Error: A command of that name exists.");
+  }
+}
+
+void BuiltinCommandUnalias(Manager &m, const IRCMessagePrivMsg &msg, std::string_view alias) {
+  if (!InvokerPermissionCheck(m, msg, IRCUserCapability::kConfigure)) return;
+  if (m.command_matcher.RemoveAlias(StripCommandPrefix(alias))) {
+    SendInvokerReply(m, msg, "Alias removed.");
+  } else {
+    SendInvokerReply(m, msg, "Error: No such alias.");
+  }
+}
+
+void SetCommandEnabled(Manager &m, const IRCMessagePrivMsg &msg, std::string_view command,
+                       Channel channel, bool enabled) {
+  if (!InvokerPermissionCheck(m, msg, IRCUserCapability::kConfigure)) return;
+  command = StripCommandPrefix(command);
+  // Otherwise there would be no way back
+  if (!enabled && command == "enable") {
+    SendInvokerReply(m, msg, "Error: Cannot disable enable.");
+    return;
+  }
+  m.command_matcher.SetEnabled(channel.value, command, enabled);
+  SendInvokerReply(m, msg, fmt::format("{} {} in {}", enabled ? "Enabled" : "Disabled", command,
+                                       channel.value));
+}
+
+void BuiltinCommandEnable(Manager &m, const IRCMessagePrivMsg &msg, std::string_view command,
+                          Channel channel) {
+  SetCommandEnabled(m, msg, command, channel, true);
+}
+
+void BuiltinCommandDisable(Manager &m, const IRCMessagePrivMsg &msg, std::string_view command,
+                           Channel channel) {
+  SetCommandEnabled(m, msg, command, channel, false);
+}
+
+void BuiltinCommandHelp(Manager &m, const IRCMessagePrivMsg &msg,
+                        std::optional<std::string_view> plugin_name) {
+  if (plugin_name) {
     std::shared_lock lock(m.server.plugins_map_mtx);
-    auto it = m.server.plugins_map.find(v[0]);
+    auto it = m.server.plugins_map.find(*plugin_name);
     if (it != m.server.plugins_map.end()) {
-      auto p = std::make_pair(&m, &msg);
-      it->second.GetHelpFunc(v[0])(&p);
+      it->second->GetPlugin().Help(m, msg);
+    } else if (auto host_it = m.plugin_host_map.find(*plugin_name);
+               host_it != m.plugin_host_map.end()) {
+      host_it->second->Help(msg);
+    } else if (auto wasm_it = m.wasm_plugin_map.find(*plugin_name);
+               wasm_it != m.wasm_plugin_map.end()) {
+      wasm_it->second->Help(m, msg);
     } else {
       SendInvokerReply(m, msg, "No such plugin loaded.");
     }
   } else {
-    SendInvokerReply(m, msg, "Commands available: ,hi ,nick ,join ,part ,load ,unload ,quit ,help");
+    SendInvokerReply(m, msg,
+                     "Commands available: ,hi ,nick ,join ,part ,load ,unload ,reload ,whois ,quit "
+                     ",prefix ,alias ,unalias ,enable ,disable ,help");
     std::string plugin_list;
     {
       std::unique_lock lock(m.server.user_command_mtx);
@@ -113,6 +294,8 @@ void BuiltinCommandHelp(Manager &m, const IRCMessagePrivMsg &msg) {
         plugin_list.append(p.first.substr(1)).append(" ");
       }
     }
+    for (auto &p : m.remote_command_map) plugin_list.append(p.first.substr(1)).append(" ");
+    for (auto &p : m.wasm_command_map) plugin_list.append(p.first.substr(1)).append(" ");
     SendInvokerReply(m, msg, plugin_list);
   }
 }
@@ -120,13 +303,20 @@ void BuiltinCommandHelp(Manager &m, const IRCMessagePrivMsg &msg) {
 }  // namespace
 
 const absl::flat_hash_map<std::string, callback_t> user_command_map = {
-    STATIC_REGISTER_USER_COMMAND("hi", BuiltinCommandHi, 0, 0),
-    STATIC_REGISTER_USER_COMMAND("nick", BuiltinCommandNick, 1, 1),
-    STATIC_REGISTER_USER_COMMAND("join", BuiltinCommandJoin, 1, 1),
-    STATIC_REGISTER_USER_COMMAND("part", BuiltinCommandPart, 1, 1),
-    STATIC_REGISTER_USER_COMMAND("load", BuiltinCommandLoadPlugin, 1, 1),
-    STATIC_REGISTER_USER_COMMAND("unload", BuiltinCommandUnloadPlugin, 1, 1),
-    STATIC_REGISTER_USER_COMMAND("help", BuiltinCommandHelp, 0, 1),
+    STATIC_REGISTER_TYPED_COMMAND("hi", BuiltinCommandHi),
+    STATIC_REGISTER_TYPED_COMMAND("nick", BuiltinCommandNick),
+    STATIC_REGISTER_TYPED_COMMAND("join", BuiltinCommandJoin),
+    STATIC_REGISTER_TYPED_COMMAND("part", BuiltinCommandPart),
+    STATIC_REGISTER_TYPED_COMMAND("load", BuiltinCommandLoadPlugin),
+    STATIC_REGISTER_TYPED_COMMAND("unload", BuiltinCommandUnloadPlugin),
+    STATIC_REGISTER_TYPED_COMMAND("reload", BuiltinCommandReloadPlugin),
+    STATIC_REGISTER_TYPED_COMMAND("prefix", BuiltinCommandPrefix),
+    STATIC_REGISTER_TYPED_COMMAND("alias", BuiltinCommandAlias),
+    STATIC_REGISTER_TYPED_COMMAND("unalias", BuiltinCommandUnalias),
+    STATIC_REGISTER_TYPED_COMMAND("enable", BuiltinCommandEnable),
+    STATIC_REGISTER_TYPED_COMMAND("disable", BuiltinCommandDisable),
+    STATIC_REGISTER_TYPED_COMMAND("help", BuiltinCommandHelp),
+    STATIC_REGISTER_USER_COROUTINE("whois", BuiltinCommandWhois, 1, 1),
 };
 
 }  // namespace UserCommand
@@ -1,15 +1,22 @@
 #pragma once
 
 #include <absl/container/flat_hash_map.h>
+#include <fmt/format.h>
 #include <glog/logging.h>
 #include <linux/limits.h>
 #include <unistd.h>
 
+#include <CommandArgs.hh>
 #include <IRC.hh>
 #include <Manager.hh>
+#include <Task.hh>
+#include <algorithm>
 #include <memory>
+#include <span>
 #include <string>
 #include <string_view>
+#include <tuple>
+#include <type_traits>
 
 namespace kbot {
 namespace UserCommand {
@@ -24,12 +31,24 @@ namespace UserCommand {
 #define STATIC_REGISTER_USER_COMMAND(command, callback, min, max) \
   { ":" COMMAND_PREFIX command, &kbot::UserCommand::UserCommandForward<min, max, &callback> }
 
+// Coroutine commands take the message by value, as they outlive the line it was parsed from
+#define STATIC_REGISTER_USER_COROUTINE(command, callback, min, max) \
+  STATIC_REGISTER_USER_COMMAND(command, callback, min, max)
+
+// The callback takes its arguments as typed parameters after the message, see CommandArgs.hh
+#define STATIC_REGISTER_TYPED_COMMAND(command, callback) \
+  { ":" COMMAND_PREFIX command, &kbot::UserCommand::TypedCommandForward<&callback> }
+
 using callback_t = void (*)(Manager &, const IRCMessagePrivMsg &);
+using coroutine_callback_t = Task<> (*)(Manager &, IRCMessagePrivMsg);
 
 // Hash map storing callbacks
 extern const absl::flat_hash_map<std::string, callback_t> user_command_map;
 
 void SendInvokerReply(Manager &m, const IRCMessagePrivMsg &msg, std::string_view reply);
+// Runs task while holding a reference to plugin, so that its code stays mapped until the task is
+// done. Defined out of line, as the frame must not live in the plugin's own code.
+Task<> HoldPlugin(Manager &m, std::shared_ptr<CommandPlugin> plugin, Task<> task);
 bool InvokerPermissionCheck(Manager &m, const IRCMessagePrivMsg &msg, IRCUserCapability mask);
 
 template <unsigned min = ARGS_MIN, unsigned max = ARGS_MAX>
@@ -43,16 +62,56 @@ bool ExpectArgsRange(const IRCMessagePrivMsg &m) {
   return false;
 }
 
-template <unsigned min, unsigned max, callback_t cb_ptr>
+template <coroutine_callback_t cb_ptr>
+void UserCommandSpawn(Manager &m, const IRCMessagePrivMsg &msg);
+
+// cb_ptr is either a callback_t or a coroutine_callback_t
+template <unsigned min, unsigned max, auto cb_ptr>
 void UserCommandForward(Manager &m, const IRCMessagePrivMsg &msg) {
   static_assert(cb_ptr != nullptr, "No callback present");
   if (ExpectArgsRange<min, max>(msg)) {
-    cb_ptr(m, msg);
+    if constexpr (std::is_same_v<decltype(cb_ptr), coroutine_callback_t>) {
+      UserCommandSpawn<cb_ptr>(m, msg);
+    } else {
+      cb_ptr(m, msg);
+    }
   } else {
     SendInvokerReply(m, msg,
                      "Incorrect number of arguments passed to command, see " COMMAND_PREFIX "help");
   }
 }
 
+template <auto cb_ptr>
+void TypedCommandForward(Manager &m, const IRCMessagePrivMsg &msg) {
+  using Signature = CommandSignature<decltype(cb_ptr)>;
+  typename Signature::args_tuple args;
+  auto &params = msg.GetParameters();
+  // Channel and command come first, always present for a message dispatched as a command
+  auto err = ParseArgs(std::span(params).subspan(std::min<size_t>(2, params.size())), args);
+  if (err.kind == ArgError::kNone) {
+    std::apply([&](auto &...a) { cb_ptr(m, msg, a...); }, args);
+    return;
+  }
+  std::string_view command = msg.GetUserCommand().substr(1);
+  constexpr std::string_view usage = Signature::spec::kUsage;
+  if (err.kind == ArgError::kInvalid) {
+    SendInvokerReply(m, msg,
+                     fmt::format("Error: {} is not a valid {}. Usage: {}{}", params[err.index + 2],
+                                 Signature::spec::kLabels[err.index], command, usage));
+  } else {
+    SendInvokerReply(m, msg, fmt::format("Usage: {}{}", command, usage));
+  }
+}
+
+template <coroutine_callback_t cb_ptr>
+void UserCommandSpawn(Manager &m, const IRCMessagePrivMsg &msg) {
+  auto task = cb_ptr(m, IRCMessagePrivMsg(IRCMessage(msg.GetLine(), IRCMessageType::PRIVMSG)));
+  if (auto plugin = CommandPlugin::Current()) {
+    Spawn(HoldPlugin(m, plugin->shared_from_this(), std::move(task)));
+  } else {
+    Spawn(std::move(task));
+  }
+}
+
 }  // namespace UserCommand
 }  // namespace kbot
@@ -0,0 +1,342 @@
+#include <fmt/format.h>
+#ifdef KBOT_HAVE_WASMTIME
+#include <wasmtime.h>
+#endif
+
+#include <Log.hh>
+#include <Manager.hh>
+#include <UserCommand.hh>
+#include <WasmPlugin.hh>
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace kbot {
+
+#ifdef KBOT_HAVE_WASMTIME
+
+namespace {
+
+constexpr std::string_view kCommandExportPrefix = "kbot_command_";
+constexpr std::string_view kHelpExport = "kbot_help";
+// A command looping over reply would otherwise flood the channel until it ran out of fuel
+constexpr unsigned kMaxRepliesPerCall = 4;
+
+// What the host functions act on, only set while a call is in progress
+struct CallContext {
+  Manager *m = nullptr;
+  const IRCMessagePrivMsg *msg = nullptr;
+  unsigned replies = 0;
+};
+
+// The engine holds the compiled code and is thread safe, one is shared by all plugins
+wasm_engine_t *GetEngine() {
+  static wasm_engine_t *engine = [] {
+    wasm_config_t *config = wasm_config_new();
+    wasmtime_config_consume_fuel_set(config, true);
+    wasmtime_config_cranelift_opt_level_set(config, WASMTIME_OPT_LEVEL_SPEED);
+    return wasm_engine_new_with_config(config);
+  }();
+  return engine;
+}
+
+std::string TakeMessage(wasm_byte_vec_t &v) {
+  std::string_view sv(v.data, v.size);
+  // Messages from the C API may include the terminator
+  if (sv.ends_with('\0')) sv.remove_suffix(1);
+  std::string s(sv);
+  wasm_byte_vec_delete(&v);
+  return s;
+}
+
+std::string ErrorString(wasmtime_error_t *error) {
+  wasm_message_t message;
+  wasmtime_error_message(error, &message);
+  wasmtime_error_delete(error);
+  return TakeMessage(message);
+}
+
+std::string TrapString(wasm_trap_t *trap) {
+  wasm_message_t message;
+  wasm_trap_message(trap, &message);
+  wasm_trap_delete(trap);
+  return TakeMessage(message);
+}
+
+wasm_trap_t *Trap(std::string_view msg) { return wasmtime_trap_new(msg.data(), msg.size()); }
+
+// Bounds checked view of [ptr, ptr + len) in the caller's memory
+std::optional<std::span<uint8_t>> GuestMemory(wasmtime_caller_t *caller, int32_t ptr,
+                                              int32_t len) {
+  wasmtime_extern_t item;
+  if (!wasmtime_caller_export_get(caller, "memory", 6, &item)) return std::nullopt;
+  if (item.kind != WASMTIME_EXTERN_MEMORY) return std::nullopt;
+  auto *ctx = wasmtime_caller_context(caller);
+  uint8_t *data = wasmtime_memory_data(ctx, &item.of.memory);
+  size_t size = wasmtime_memory_data_size(ctx, &item.of.memory);
+  auto p = static_cast<uint32_t>(ptr);
+  auto l = static_cast<uint32_t>(len);
+  if (p > size || l > size - p) return std::nullopt;
+  return std::span<uint8_t>(data + p, l);
+}
+
+// Host functions
+
+wasm_trap_t *HostParamCount(void *env, wasmtime_caller_t *, const wasmtime_val_t *, size_t,
+                            wasmtime_val_t *results, size_t) {
+  auto *c = static_cast<CallContext *>(env);
+  if (!c->msg) return Trap("kbot.param_count called outside of a command");
+  results[0].kind = WASMTIME_I32;
+  results[0].of.i32 = static_cast<int32_t>(c->msg->GetUserCommandParameters().size());
+  return nullptr;
+}
+
+wasm_trap_t *HostParam(void *env, wasmtime_caller_t *caller, const wasmtime_val_t *args, size_t,
+                       wasmtime_val_t *results, size_t) {
+  auto *c = static_cast<CallContext *>(env);
+  if (!c->msg) return Trap("kbot.param called outside of a command");
+  auto v = c->msg->GetUserCommandParameters();
+  results[0].kind = WASMTIME_I32;
+  int32_t index = args[0].of.i32;
+  if (index < 0 || static_cast<size_t>(index) >= v.size()) {
+    results[0].of.i32 = -1;
+    return nullptr;
+  }
+  auto mem = GuestMemory(caller, args[1].of.i32, args[2].of.i32);
+  if (!mem) return Trap("kbot.param: buffer out of bounds");
+  auto p = v[index];
+  std::copy_n(p.data(), std::min(p.size(), mem->size()), mem->data());
+  results[0].of.i32 = static_cast<int32_t>(p.size());
+  return nullptr;
+}
+
+wasm_trap_t *HostReply(void *env, wasmtime_caller_t *caller, const wasmtime_val_t *args, size_t,
+                       wasmtime_val_t *, size_t) {
+  auto *c = static_cast<CallContext *>(env);
+  if (!c->msg) return Trap("kbot.reply called outside of a command");
+  if (++c->replies > kMaxRepliesPerCall) return Trap("kbot.reply: too many replies");
+  auto mem = GuestMemory(caller, args[0].of.i32, args[1].of.i32);
+  if (!mem) return Trap("kbot.reply: string out of bounds");
+  std::string_view reply(reinterpret_cast<const char *>(mem->data()), mem->size());
+  // Unlike native plugins, modules don't get to send raw lines
+  if (reply.find_first_of(std::string_view("\r\n\0", 3)) != reply.npos) {
+    return Trap("kbot.reply: line break in reply");
+  }
+  UserCommand::SendInvokerReply(*c->m, *c->msg, reply);
+  return nullptr;
+}
+
+}  // namespace
+
+struct WasmPlugin::State {
+  wasmtime_module_t *module = nullptr;
+  wasmtime_store_t *store = nullptr;
+  wasmtime_linker_t *linker = nullptr;
+  wasmtime_instance_t instance;
+  // Keyed by command map key, and kHelpExport
+  absl::flat_hash_map<std::string, wasmtime_func_t> func_map;
+  CallContext context;
+
+  State() = default;
+  State(const State &) = delete;
+  State &operator=(const State &) = delete;
+  ~State() {
+    if (linker) wasmtime_linker_delete(linker);
+    if (store) wasmtime_store_delete(store);
+    if (module) wasmtime_module_delete(module);
+  }
+};
+
+bool WasmPlugin::IsAvailable() { return true; }
+
+std::unique_ptr<WasmPlugin> WasmPlugin::CreateNew(std::string_view name,
+                                                  std::span<const uint8_t> wasm) {
+  auto state = std::make_unique<State>();
+  if (auto *error = wasmtime_module_new(GetEngine(), wasm.data(), wasm.size(), &state->module)) {
+    KLOG(Warning, "Failed to compile WebAssembly plugin {}: {}", name, ErrorString(error));
+    return nullptr;
+  }
+  return Instantiate(name, std::move(state));
+}
+
+std::unique_ptr<WasmPlugin> WasmPlugin::Load(std::string_view name, const std::string &path) {
+  if (path.ends_with(".cwasm")) {
+    auto state = std::make_unique<State>();
+    if (auto *error =
+            wasmtime_module_deserialize_file(GetEngine(), path.c_str(), &state->module)) {
+      KLOG(Warning, "Failed to load precompiled plugin {}: {}", path, ErrorString(error));
+      return nullptr;
+    }
+    return Instantiate(name, std::move(state));
+  }
+  std::ifstream f(path, std::ios::binary);
+  if (!f) {
+    KLOG(Warning, "Failed to open {}", path);
+    return nullptr;
+  }
+  std::vector<uint8_t> wasm((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+  return CreateNew(name, wasm);
+}
+
+std::unique_ptr<WasmPlugin> WasmPlugin::Instantiate(std::string_view name,
+                                                    std::unique_ptr<State> state) {
+  auto &s = *state;
+  s.store = wasmtime_store_new(GetEngine(), nullptr, nullptr);
+  // Memory size, table elements, instances, tables, memories
+  wasmtime_store_limiter(s.store, kMemoryMax, -1, 1, 1, 1);
+  auto *ctx = wasmtime_store_context(s.store);
+  s.linker = wasmtime_linker_new(GetEngine());
+
+  struct Import {
+    std::string_view name;
+    wasm_functype_t *type;
+    wasmtime_func_callback_t callback;
+  } imports[] = {
+      {"param_count", wasm_functype_new_0_1(wasm_valtype_new_i32()), HostParamCount},
+      {"param",
+       wasm_functype_new_3_1(wasm_valtype_new_i32(), wasm_valtype_new_i32(),
+                             wasm_valtype_new_i32(), wasm_valtype_new_i32()),
+       HostParam},
+      {"reply", wasm_functype_new_2_0(wasm_valtype_new_i32(), wasm_valtype_new_i32()), HostReply},
+  };
+  wasmtime_error_t *error = nullptr;
+  for (auto &i : imports) {
+    if (!error) {
+      error = wasmtime_linker_define_func(s.linker, "kbot", 4, i.name.data(), i.name.size(), i.type,
+                                          i.callback, &s.context, nullptr);
+    }
+    wasm_functype_delete(i.type);
+  }
+  // The start function is metered too
+  if (!error) error = wasmtime_context_set_fuel(ctx, kFuelPerCall);
+  wasm_trap_t *trap = nullptr;
+  if (!error) error = wasmtime_linker_instantiate(s.linker, ctx, s.module, &s.instance, &trap);
+  if (error) {
+    KLOG(Warning, "Failed to instantiate WebAssembly plugin {}: {}", name, ErrorString(error));
+    return nullptr;
+  }
+  if (trap) {
+    KLOG(Warning, "WebAssembly plugin {} trapped on start: {}", name, TrapString(trap));
+    return nullptr;
+  }
+
+  wasmtime_extern_t item;
+  if (!wasmtime_instance_export_get(ctx, &s.instance, "memory", 6, &item) ||
+      item.kind != WASMTIME_EXTERN_MEMORY) {
+    KLOG(Warning, "WebAssembly plugin {} doesn't export its memory", name);
+    return nullptr;
+  }
+  std::vector<std::string> commands;
+  wasm_exporttype_vec_t exports;
+  wasmtime_module_exports(s.module, &exports);
+  for (size_t i = 0; i < exports.size; i++) {
+    const wasm_name_t *n = wasm_exporttype_name(exports.data[i]);
+    std::string_view export_name(n->data, n->size);
+    if (wasm_externtype_kind(wasm_exporttype_type(exports.data[i])) != WASM_EXTERN_FUNC) continue;
+    std::string key;
+    if (export_name.starts_with(kCommandExportPrefix) &&
+        export_name.size() > kCommandExportPrefix.size()) {
+      key = fmt::format(":" COMMAND_PREFIX "{}", export_name.substr(kCommandExportPrefix.size()));
+      commands.push_back(key);
+    } else if (export_name == kHelpExport) {
+      key = kHelpExport;
+    } else {
+      continue;
+    }
+    if (wasmtime_instance_export_get(ctx, &s.instance, export_name.data(), export_name.size(),
+                                     &item)) {
+      s.func_map.emplace(std::move(key), item.of.func);
+    }
+  }
+  wasm_exporttype_vec_delete(&exports);
+  if (commands.empty()) {
+    KLOG(Warning, "WebAssembly plugin {} exports no commands", name);
+    return nullptr;
+  }
+  std::unique_ptr<WasmPlugin> p(new WasmPlugin(std::string(name), std::move(state)));
+  p->command_vec = std::move(commands);
+  return p;
+}
+
+bool WasmPlugin::Call(Manager &m, const IRCMessagePrivMsg &msg, std::string_view key) {
+  auto &s = *state;
+  auto it = s.func_map.find(key);
+  if (it == s.func_map.end()) return false;
+  auto *ctx = wasmtime_store_context(s.store);
+  // Whatever the last call left over doesn't carry over
+  if (auto *error = wasmtime_context_set_fuel(ctx, kFuelPerCall)) {
+    KLOG(Warning, "Failed to refuel WebAssembly plugin {}: {}", name, ErrorString(error));
+    return false;
+  }
+  s.context = CallContext{&m, &msg, 0};
+  wasm_trap_t *trap = nullptr;
+  auto *error = wasmtime_func_call(ctx, &it->second, nullptr, 0, nullptr, 0, &trap);
+  s.context = CallContext{};
+  if (error) {
+    KLOG(Warning, "WebAssembly plugin {} failed to run {}: {}", name, key, ErrorString(error));
+    return false;
+  }
+  if (trap) {
+    wasmtime_trap_code_t code;
+    if (wasmtime_trap_code(trap, &code) && code == WASMTIME_TRAP_CODE_OUT_OF_FUEL) {
+      wasm_trap_delete(trap);
+      KLOG(Warning, "WebAssembly plugin {} ran out of fuel in {}", name, key);
+    } else {
+      KLOG(Warning, "WebAssembly plugin {} trapped in {}: {}", name, key, TrapString(trap));
+    }
+    return false;
+  }
+  return true;
+}
+
+bool WasmPlugin::Invoke(Manager &m, const IRCMessagePrivMsg &msg) {
+  return Call(m, msg, msg.GetUserCommand());
+}
+
+void WasmPlugin::Help(Manager &m, const IRCMessagePrivMsg &msg) {
+  if (!state->func_map.contains(kHelpExport)) {
+    UserCommand::SendInvokerReply(m, msg, "No help available.");
+    return;
+  }
+  Call(m, msg, kHelpExport);
+}
+
+#else
+
+struct WasmPlugin::State {};
+
+bool WasmPlugin::IsAvailable() { return false; }
+
+std::unique_ptr<WasmPlugin> WasmPlugin::CreateNew(std::string_view name,
+                                                  std::span<const uint8_t>) {
+  KLOG(Warning, "Can't load WebAssembly plugin {}, built without wasmtime", name);
+  return nullptr;
+}
+
+std::unique_ptr<WasmPlugin> WasmPlugin::Load(std::string_view name, const std::string &) {
+  return CreateNew(name, {});
+}
+
+std::unique_ptr<WasmPlugin> WasmPlugin::Instantiate(std::string_view, std::unique_ptr<State>) {
+  return nullptr;
+}
+
+bool WasmPlugin::Call(Manager &, const IRCMessagePrivMsg &, std::string_view) { return false; }
+
+bool WasmPlugin::Invoke(Manager &, const IRCMessagePrivMsg &) { return false; }
+
+void WasmPlugin::Help(Manager &, const IRCMessagePrivMsg &) {}
+
+#endif
+
+WasmPlugin::WasmPlugin(std::string name, std::unique_ptr<State> state)
+    : name(std::move(name)), state(std::move(state)) {}
+
+WasmPlugin::~WasmPlugin() = default;
+
+}  // namespace kbot
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <IRC.hh>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace kbot {
+
+class Manager;
+
+// WasmPlugin
+// A plugin compiled to WebAssembly, run inside the bot's process but confined to its own linear
+// memory, with nothing but the host functions below to reach the outside. Each invocation gets a
+// fixed amount of fuel (roughly one unit per instruction), a command that runs out of it traps
+// and is abandoned, and the module's memory can't grow past a cap. Only available when built
+// against the wasmtime C API (KBOT_HAVE_WASMTIME), otherwise loading always fails.
+//
+// Modules are looked up as <name>.cwasm, precompiled by a matching `wasmtime compile` and trusted
+// like a native plugin, or <name>.wasm, compiled at load.
+//
+// ABI: every exported function named kbot_command_<name> (no parameters or results) becomes the
+// command ,<name>, and kbot_help is called for ,help <plugin>. The module exports its memory as
+// "memory" and may import from module "kbot":
+//   param_count() -> i32                   GetUserCommandParameters().size()
+//   param(i32 index, i32 ptr, i32 len) -> i32
+//                                          copies up to len bytes of the parameter to ptr,
+//                                          returns its full length, -1 if index is out of range
+//   reply(i32 ptr, i32 len)                SendInvokerReply with the string at ptr
+
+class WasmPlugin {
+  struct State;
+  std::string name;
+  std::unique_ptr<State> state;
+  std::vector<std::string> command_vec;
+
+  WasmPlugin(std::string name, std::unique_ptr<State> state);
+  // Takes a state holding the compiled module
+  static std::unique_ptr<WasmPlugin> Instantiate(std::string_view name,
+                                                 std::unique_ptr<State> state);
+  // Runs the export for the command key, or kbot_help
+  bool Call(Manager &m, const IRCMessagePrivMsg &msg, std::string_view key);
+
+ public:
+  static constexpr uint64_t kFuelPerCall = 10'000'000;
+  static constexpr int64_t kMemoryMax = 16 << 20;
+
+  WasmPlugin(const WasmPlugin &) = delete;
+  WasmPlugin &operator=(const WasmPlugin &) = delete;
+  WasmPlugin(WasmPlugin &&) = delete;
+  WasmPlugin &operator=(WasmPlugin &&) = delete;
+  ~WasmPlugin();
+
+  // Whether this build can run modules at all
+  static bool IsAvailable();
+  // Returns nullptr if the module fails to compile or instantiate, or doesn't follow the ABI
+  static std::unique_ptr<WasmPlugin> CreateNew(std::string_view name,
+                                               std::span<const uint8_t> wasm);
+  static std::unique_ptr<WasmPlugin> Load(std::string_view name, const std::string &path);
+  std::string_view GetName() const { return name; }
+  // The command map keys, i.e. ":" COMMAND_PREFIX "<name>"
+  const std::vector<std::string> &GetCommands() const { return command_vec; }
+  // Runs the command's export, false if it trapped or ran out of fuel
+  bool Invoke(Manager &m, const IRCMessagePrivMsg &msg);
+  void Help(Manager &m, const IRCMessagePrivMsg &msg);
+};
+
+}  // namespace kbot
@@ -0,0 +1,53 @@
+#include <fmt/format.h>
+
+#include <Watchdog.hh>
+#include <algorithm>
+#include <charconv>
+#include <string>
+#include <string_view>
+
+namespace kbot {
+
+LagWatchdog::Clock::duration LagWatchdog::GetCheckInterval() const {
+  auto shortest = std::min({config.idle, config.interval, config.timeout});
+  return std::clamp<Clock::duration>(shortest / 4, std::chrono::seconds(1),
+                                     std::chrono::seconds(10));
+}
+
+void LagWatchdog::Reset(Clock::time_point now) {
+  last_recv = now;
+  last_ping = now;
+  outstanding.reset();
+}
+
+LagWatchdog::Action LagWatchdog::Check(Clock::time_point now) const {
+  if (outstanding) {
+    if (now - *outstanding < config.timeout) return Action::kNone;
+    // Anything else arriving since shows the connection is alive and only the PONG got lost
+    return last_recv > *outstanding ? Action::kPing : Action::kTimeout;
+  }
+  if (now - last_recv >= config.idle || now - last_ping >= config.interval) return Action::kPing;
+  return Action::kNone;
+}
+
+std::string LagWatchdog::StartPing(Clock::time_point now) {
+  last_ping = now;
+  outstanding = now;
+  return fmt::format("{}{}", kTokenPrefix, now.time_since_epoch().count());
+}
+
+std::optional<LagWatchdog::Clock::duration> LagWatchdog::OnPong(std::string_view token,
+                                                                Clock::time_point now) {
+  if (!token.starts_with(kTokenPrefix)) return std::nullopt;
+  token.remove_prefix(kTokenPrefix.size());
+  Clock::rep sent = 0;
+  auto [p, ec] = std::from_chars(token.data(), token.data() + token.size(), sent);
+  if (ec != std::errc() || p != token.data() + token.size()) return std::nullopt;
+  auto sent_at = Clock::time_point(Clock::duration(sent));
+  // From another process, or before a reset of the clock
+  if (sent_at > now) return std::nullopt;
+  outstanding.reset();
+  return now - sent_at;
+}
+
+}  // namespace kbot
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+
+namespace kbot {
+
+// LagWatchdog
+// Notices dead connections (a half-open TCP socket looks just like a quiet server) and measures
+// lag. Once nothing was received for a while, or no lag was measured for longer, we send a PING
+// whose token carries the time it was sent, and the PONG echoing it back gives the round trip.
+// No PONG (or anything else) within the timeout means the connection is gone.
+//
+// Only the decisions live here, the Manager checks it from a timer on the server's event loop,
+// sends the PINGs and reconnects.
+
+class LagWatchdog {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  struct Config {
+    // Quiet for this long, PING
+    std::chrono::seconds idle = std::chrono::seconds(30);
+    // Measure lag at least this often, even while busy
+    std::chrono::seconds interval = std::chrono::seconds(120);
+    // Nothing received for this long after a PING, give up on the connection
+    std::chrono::seconds timeout = std::chrono::seconds(90);
+  };
+
+  enum class Action {
+    kNone,
+    kPing,
+    kTimeout,
+  };
+
+  static constexpr std::string_view kTokenPrefix = "kbot-";
+
+ private:
+  Config config;
+  Clock::time_point last_recv;
+  Clock::time_point last_ping;
+  // Sent time of the PING we're waiting on
+  std::optional<Clock::time_point> outstanding;
+
+ public:
+  LagWatchdog() : LagWatchdog(Config(), Clock::now()) {}
+  explicit LagWatchdog(Config config, Clock::time_point now = Clock::now())
+      : config(config), last_recv(now), last_ping(now) {}
+
+  const Config &GetConfig() const { return config; }
+  // How often Check should run to act within a few seconds of when it should
+  Clock::duration GetCheckInterval() const;
+  // A new connection, nothing is outstanding
+  void Reset(Clock::time_point now);
+  void OnReceive(Clock::time_point now) { last_recv = now; }
+  Action Check(Clock::time_point now) const;
+  // Token for the PING to send now, which is then outstanding
+  std::string StartPing(Clock::time_point now);
+  // The lag a PONG with this token measured, std::nullopt if it isn't one of ours. Answers to
+  // earlier PINGs still count, whatever is outstanding is over once any arrives.
+  std::optional<Clock::duration> OnPong(std::string_view token, Clock::time_point now);
+  bool PingOutstanding() const { return outstanding.has_value(); }
+};
+
+}  // namespace kbot
@@ -0,0 +1,109 @@
+#include <benchmark/benchmark.h>
+#ifdef KBOT_HAVE_WASMTIME
+#include <wasmtime.h>
+#endif
+
+#include <IRC.hh>
+#include <Manager.hh>
+#include <Server.hh>
+#include <UserCommand.hh>
+#include <WasmPlugin.hh>
+#include <memory>
+#include <span>
+#include <string_view>
+#include <vector>
+
+// Per call cost of a plugin command, from the lookup in the command map to the callback
+// returning, native against WebAssembly. Replies go to a sink that drops them, so the echo
+// variants include formatting the reply but not the send.
+
+using namespace kbot;
+
+namespace {
+
+constexpr std::string_view kNoopLine = ":joe!u@h PRIVMSG #c :,noop";
+constexpr std::string_view kEchoLine = ":joe!u@h PRIVMSG #c :,echo hello";
+
+Manager MakeManager() {
+  auto m = Manager::CreateNew(Server(-1, "bench", 0, "kbot"));
+  m.server.send_sink = [](std::string_view msg) { return static_cast<ssize_t>(msg.size()); };
+  return m;
+}
+
+void NativeNoop(Manager &, const IRCMessagePrivMsg &msg) { benchmark::DoNotOptimize(&msg); }
+
+void NativeEcho(Manager &m, const IRCMessagePrivMsg &msg) {
+  UserCommand::SendInvokerReply(m, msg, msg.GetUserCommandParameters().at(0));
+}
+
+// Same path as BuiltinPrivMsg for plugin commands
+void BenchNative(benchmark::State &state, std::string_view line) {
+  auto m = MakeManager();
+  m.server.user_command_map.emplace(":,noop", Server::PluginCommand{&NativeNoop, nullptr});
+  m.server.user_command_map.emplace(":,echo", Server::PluginCommand{&NativeEcho, nullptr});
+  IRCMessagePrivMsg msg(IRCMessage(line, IRCMessageType::PRIVMSG));
+  for (auto _ : state) {
+    auto it = m.server.user_command_map.find(msg.GetUserCommand());
+    CommandPlugin::Scope scope(it->second.plugin);
+    it->second.callback(m, msg);
+  }
+}
+
+void BM_NativeNoop(benchmark::State &state) { BenchNative(state, kNoopLine); }
+void BM_NativeEcho(benchmark::State &state) { BenchNative(state, kEchoLine); }
+BENCHMARK(BM_NativeNoop);
+BENCHMARK(BM_NativeEcho);
+
+#ifdef KBOT_HAVE_WASMTIME
+
+constexpr std::string_view kModule = R"(
+(module
+  (import "kbot" "param" (func $param (param i32 i32 i32) (result i32)))
+  (import "kbot" "reply" (func $reply (param i32 i32)))
+  (memory (export "memory") 1)
+  (func (export "kbot_command_noop"))
+  (func (export "kbot_command_echo")
+    (call $reply (i32.const 0) (call $param (i32.const 0) (i32.const 0) (i32.const 256)))))
+)";
+
+std::unique_ptr<WasmPlugin> MakeWasmPlugin() {
+  wasm_byte_vec_t wasm;
+  if (auto *error = wasmtime_wat2wasm(kModule.data(), kModule.size(), &wasm)) {
+    wasmtime_error_delete(error);
+    return nullptr;
+  }
+  auto p = WasmPlugin::CreateNew(
+      "bench", std::span(reinterpret_cast<const uint8_t *>(wasm.data), wasm.size));
+  wasm_byte_vec_delete(&wasm);
+  return p;
+}
+
+// Same path as BuiltinPrivMsg for WebAssembly commands
+void BenchWasm(benchmark::State &state, std::string_view line) {
+  auto m = MakeManager();
+  auto p = MakeWasmPlugin();
+  if (!p) {
+    state.SkipWithError("Failed to create module");
+    return;
+  }
+  for (auto &c : p->GetCommands()) m.wasm_command_map.emplace(c, p.get());
+  IRCMessagePrivMsg msg(IRCMessage(line, IRCMessageType::PRIVMSG));
+  for (auto _ : state) {
+    auto it = m.wasm_command_map.find(msg.GetUserCommand());
+    if (!it->second->Invoke(m, msg)) {
+      state.SkipWithError("Call failed");
+      break;
+    }
+  }
+}
+
+void BM_WasmNoop(benchmark::State &state) { BenchWasm(state, kNoopLine); }
+void BM_WasmEcho(benchmark::State &state) { BenchWasm(state, kEchoLine); }
+BENCHMARK(BM_WasmNoop);
+BENCHMARK(BM_WasmEcho);
+
+#endif
+
+}  // namespace
+
+BENCHMARK_MAIN();
@@ -0,0 +1,102 @@
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include <Capture.hh>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <sstream>
+#include <string>
+#include <string_view>
+
+// Driver for the fuzz targets when libFuzzer isn't there (GCC, or builds without -DKBOT_FUZZ=ON):
+// runs every file given, and every file in the directories given, once through the target. This
+// is how ctest replays the corpora, and how a crash found elsewhere is reproduced under a debugger.
+//
+// Options for libFuzzer (-runs=0 and the like) are ignored, so ctest runs either build the same
+// way. Captures taken with kbot -C (see Capture.hh) are run line by line. With --export <dir>
+// first, their lines are written to dir as one file each instead, to seed a corpus from real
+// traffic.
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+extern "C" __attribute__((weak)) int LLVMFuzzerInitialize(int *argc, char ***argv);
+
+namespace {
+
+std::string ReadFile(const std::string &path) {
+  std::ifstream f(path, std::ios::binary);
+  std::ostringstream ss;
+  ss << f.rdbuf();
+  return std::move(ss).str();
+}
+
+// FNV-1a, names exported inputs by their contents so that exporting twice adds nothing
+std::string Name(std::string_view data) {
+  uint64_t h = 14695981039346656037ull;
+  for (unsigned char c : data) h = (h ^ c) * 1099511628211ull;
+  char buf[17];
+  std::snprintf(buf, sizeof(buf), "%016llx", static_cast<unsigned long long>(h));
+  return buf;
+}
+
+size_t RunFile(const std::string &path, const char *export_dir) {
+  auto data = ReadFile(path);
+  auto capture = kbot::capture::Reader::FromBuffer(data);
+  if (!capture) {
+    LLVMFuzzerTestOneInput(reinterpret_cast<const uint8_t *>(data.data()), data.size());
+    return 1;
+  }
+  size_t n = 0;
+  while (auto e = capture->Next()) {
+    if (export_dir) {
+      std::ofstream(std::string(export_dir) + "/" + Name(e->line), std::ios::binary) << e->line;
+    } else {
+      LLVMFuzzerTestOneInput(reinterpret_cast<const uint8_t *>(e->line.data()), e->line.size());
+    }
+    n++;
+  }
+  return n;
+}
+
+size_t Run(const std::string &path, const char *export_dir) {
+  struct stat st;
+  if (stat(path.c_str(), &st) < 0) {
+    std::fprintf(stderr, "Can't open %s: %s\n", path.c_str(), std::strerror(errno));
+    return 0;
+  }
+  if (!S_ISDIR(st.st_mode)) return RunFile(path, export_dir);
+  size_t n = 0;
+  DIR *dir = opendir(path.c_str());
+  while (dir) {
+    auto *ent = readdir(dir);
+    if (!ent) break;
+    if (ent->d_name[0] == '.') continue;
+    n += Run(path + "/" + ent->d_name, export_dir);
+  }
+  if (dir) closedir(dir);
+  return n;
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  if (LLVMFuzzerInitialize) LLVMFuzzerInitialize(&argc, &argv);
+  const char *export_dir = nullptr;
+  int i = 1;
+  if (argc > 2 && std::string_view(argv[1]) == "--export") {
+    export_dir = argv[2];
+    i = 3;
+  }
+  if (i == argc || (argc == 2 && argv[1][0] == '-')) {
+    std::fprintf(stderr, "Usage: %s [--export <dir>] <input or directory>...\n", argv[0]);
+    return 1;
+  }
+  size_t n = 0;
+  for (; i < argc; i++) {
+    if (argv[i][0] != '-') n += Run(argv[i], export_dir);
+  }
+  std::fprintf(stderr, "%s %zu inputs\n", export_dir ? "Exported" : "Ran", n);
+  return n ? 0 : 1;
+}
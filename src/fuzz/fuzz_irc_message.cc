@@ -0,0 +1,45 @@
+#include <IRC.hh>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+// IRCMessage construction and its accessors on arbitrary lines. Malformed lines may only be
+// rejected with std::runtime_error, and every view of a parsed message lies within its line, also
+// after moving it (short lines live in the SSO buffer, which moves with the object).
+
+namespace {
+
+bool Within(std::string_view line, std::string_view v) {
+  return !v.data() || (v.data() >= line.data() && v.data() + v.size() <= line.data() + line.size());
+}
+
+void Check(const kbot::IRCMessage &m) {
+  auto line = m.GetLine();
+  bool ok = Within(line, m.GetTags()) && Within(line, m.GetSource()) &&
+            Within(line, m.GetCommand()) && !m.GetParameters().empty() &&
+            !m.GetParameters().front().empty();
+  for (auto p : m.GetParameters()) ok = ok && Within(line, p);
+  for (auto &[k, v] : m.GetTagKV()) ok = ok && Within(line, k) && Within(line, v);
+  if (!ok) __builtin_trap();
+}
+
+}  // namespace
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  std::string_view line(reinterpret_cast<const char *>(data), size);
+  try {
+    kbot::IRCMessage m(line);
+    Check(m);
+    kbot::IRCMessage moved(std::move(m));
+    Check(moved);
+    std::string buf;
+    for (auto &[k, v] : moved.GetTagKV()) {
+      if (!moved.GetTag(k, buf)) __builtin_trap();
+    }
+    (void)moved.GetServerTime();
+  } catch (std::runtime_error &) {
+  }
+  return 0;
+}
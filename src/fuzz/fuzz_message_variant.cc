@@ -0,0 +1,73 @@
+#include <IRC.hh>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <variant>
+
+// GetIRCMessageVariantFrom on whatever IRCMessage accepts, then the accessors of the type it
+// picked, as the handlers call them. Accessors may throw std::out_of_range for a parameter the
+// line doesn't have (dispatch catches that), and std::runtime_error for a source that isn't a
+// user; anything else escaping, or an assertion, is a bug.
+
+namespace {
+
+struct Visitor {
+  void operator()(const kbot::IRCMessagePing &m) { (void)m.GetPongParameter(); }
+  void operator()(const kbot::IRCMessageNick &m) {
+    (void)m.GetNewNickname();
+    (void)m.GetUser();
+  }
+  void operator()(const kbot::IRCMessageJoin &m) { (void)m.GetChannel(); }
+  void operator()(const kbot::IRCMessagePart &m) { (void)m.GetChannel(); }
+  void operator()(const kbot::IRCMessagePrivMsg &m) {
+    (void)m.GetUser();
+    (void)m.GetChannel();
+    (void)m.GetUserCommand();
+    (void)m.GetUserCommandParameters();
+  }
+  void operator()(const kbot::IRCMessageCap &m) {
+    (void)m.GetSubcommand();
+    (void)m.IsContinued();
+    (void)m.GetCapabilities();
+  }
+  void operator()(const kbot::IRCMessageBatch &m) {
+    (void)m.IsStart();
+    (void)m.GetReference();
+    (void)m.GetType();
+  }
+  void operator()(const kbot::IRCMessageAuthenticate &m) { (void)m.GetPayload(); }
+  void operator()(const kbot::IRCMessageNumeric &m) {
+    auto n = m.GetNumeric();
+    if (n < 0 || n > 999) __builtin_trap();
+  }
+  void operator()(const kbot::IRCMessagePong &m) { (void)m.GetToken(); }
+  void operator()(const auto &) {}
+};
+
+}  // namespace
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  std::string_view line(reinterpret_cast<const char *>(data), size);
+  std::optional<kbot::IRCMessage> m;
+  try {
+    m.emplace(line);
+  } catch (std::runtime_error &) {
+    return 0;
+  }
+  auto command = std::string(m->GetCommand());
+  auto mv = kbot::GetIRCMessageVariantFrom(std::move(*m));
+  // Only what GetSetIRCMessageType recognized gets its own type
+  if (std::holds_alternative<kbot::IRCMessageNumeric>(mv) && command.size() != 3) __builtin_trap();
+  if (std::holds_alternative<kbot::IRCMessagePing>(mv) && command != "PING") __builtin_trap();
+  if (std::holds_alternative<kbot::IRCMessagePrivMsg>(mv) && command != "PRIVMSG") {
+    __builtin_trap();
+  }
+  try {
+    std::visit(Visitor{}, mv);
+  } catch (std::out_of_range &) {
+  } catch (std::runtime_error &) {
+  }
+  return 0;
+}
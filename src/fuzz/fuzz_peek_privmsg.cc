@@ -0,0 +1,74 @@
+#include <IRC.hh>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+// Differential: the fast paths that look at raw lines without parsing them (Message::PeekPrivMsg,
+// PeekCommand and PeekTag) against IRCMessage, the reference. A faster parser replacing either
+// gets checked the same way, by comparing it in Compare below.
+//
+// Whatever a fast path claims must match the reference. PeekPrivMsg may decline lines the
+// reference accepts (they take the slow path) but never one that is a PRIVMSG from a user with a
+// text, and never accept one the reference rejects.
+
+namespace {
+
+struct Reference {
+  std::optional<kbot::IRCMessage> msg;
+
+  explicit Reference(std::string_view line) {
+    try {
+      msg.emplace(line);
+    } catch (std::runtime_error &) {
+    }
+  }
+};
+
+void Check(bool ok, const char *what) {
+  if (!ok) {
+    fprintf(stderr, "Mismatch: %s\n", what);
+    __builtin_trap();
+  }
+}
+
+void Compare(std::string_view line, const Reference &ref) {
+  auto peek = kbot::Message::PeekPrivMsg(line);
+  if (!ref.msg) {
+    Check(!peek, "PeekPrivMsg accepted a line the parser rejects");
+    return;
+  }
+  auto &m = *ref.msg;
+  auto &params = m.GetParameters();
+  Check(kbot::Message::PeekCommand(line) == m.GetCommand(), "PeekCommand");
+  std::string buf, peek_buf;
+  for (auto &[key, value] : m.GetTagKV()) {
+    auto peek_tag = kbot::Message::PeekTag(line, key);
+    auto tag = m.GetTag(key, buf);
+    Check(peek_tag.has_value() && tag.has_value(), "PeekTag missed a tag");
+    Check(kbot::Message::UnescapeTagValue(*peek_tag, peek_buf) == *tag, "PeekTag value");
+  }
+  bool privmsg = m.GetCommand() == "PRIVMSG" && kbot::Message::IsUserMessage(m.GetSource()) &&
+                 params.size() >= 2;
+  Check(peek.has_value() == privmsg, "PeekPrivMsg disagrees on what is a PRIVMSG");
+  if (!peek) return;
+  Check(peek->nickname == kbot::Message::ParseSourceUser(m.GetSource()).nickname, "nickname");
+  Check(peek->target == params[0], "target");
+  Check(peek->word == params[1], "first word");
+  // The text is the rest of the line, which the parameters are the words of
+  auto text = peek->text;
+  Check(text.data() + text.size() == line.data() + line.size(), "text ends the line");
+  auto first = params[1].starts_with(':') ? params[1].substr(1) : params[1];
+  Check(text.starts_with(first), "text starts with the first word");
+}
+
+}  // namespace
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  std::string_view line(reinterpret_cast<const char *>(data), size);
+  Compare(line, Reference(line));
+  return 0;
+}
@@ -0,0 +1,36 @@
+#include <IRC.hh>
+#include <Manager.hh>
+#include <PluginRegistry.hh>
+#include <Server.hh>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+// The whole path a line from the server takes: the batch and passive PRIVMSG prefilters, parsing
+// and dispatch to the builtin handlers, on a fresh registered Manager whose replies go nowhere.
+// Inputs are sessions of lines separated by '\n', so that state carried between lines (CAP
+// negotiation, SASL, batches, joins) is exercised too.
+
+extern "C" int LLVMFuzzerInitialize(int *, char ***) {
+  // Lines may ask to load plugins, from where there are none
+  kbot::plugin::SetSearchPath("/nonexistent");
+  return 0;
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  std::string_view session(reinterpret_cast<const char *>(data), size);
+  auto m = kbot::Manager::CreateNew(kbot::Server(-1, "fuzz", 0, "kbot"));
+  m.server.send_sink = [](std::string_view msg) { return static_cast<ssize_t>(msg.size()); };
+  m.server.SetState(kbot::ServerState::kConnected);
+  while (!session.empty()) {
+    auto nl = session.find('\n');
+    auto line = session.substr(0, nl);
+    session.remove_prefix(nl == session.npos ? session.size() : nl + 1);
+    if (line.ends_with('\r')) line.remove_suffix(1);
+    if (line.empty()) continue;
+    if (!kbot::ProcessMessageLine(m, line)) break;
+  }
+  // Commands still waiting for a reply, e.g. ,whois
+  m.CancelReplyWaiters();
+  return 0;
+}
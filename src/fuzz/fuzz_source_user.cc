@@ -0,0 +1,32 @@
+#include <IRC.hh>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string_view>
+
+// Message::ParseSourceUser on arbitrary sources: it throws std::runtime_error without a '!', and
+// otherwise splits nick!user@host so that the pieces put back together give the source again.
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  std::string_view source(reinterpret_cast<const char *>(data), size);
+  kbot::IRCUser u;
+  try {
+    u = kbot::Message::ParseSourceUser(source);
+  } catch (std::runtime_error &) {
+    if (source.find('!') != source.npos) __builtin_trap();
+    return 0;
+  }
+  if (u.nickname.find('!') != u.nickname.npos || u.username.find('@') != u.username.npos ||
+      !u.account.empty()) {
+    __builtin_trap();
+  }
+  std::string joined(u.nickname);
+  joined += '!';
+  joined += u.username;
+  if (source.find('@', u.nickname.size()) != source.npos) {
+    joined += '@';
+    joined += u.hostname;
+  }
+  if (joined != source) __builtin_trap();
+  return 0;
+}
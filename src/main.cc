@@ -1,19 +1,57 @@
+#include <curl/curl.h>
 #include <glog/logging.h>
+#include <signal.h>
 #include <unistd.h>
 
+#include <CGroup.hh>
+#include <Capture.hh>
+#include <Log.hh>
 #include <Manager.hh>
+#include <PluginHost.hh>
+#include <PluginRegistry.hh>
+#include <Sasl.hh>
 #include <Server.hh>
+#include <SocketOptions.hh>
+#include <Trace.hh>
+#include <algorithm>
+#include <charconv>
+#include <chrono>
 #include <cstdio>
 #include <iostream>
 #include <memory>
+#include <optional>
 #include <stdexcept>
+#include <string>
+#include <string_view>
 #include <thread>
+#include <utility>
+#include <vector>
 
 #define KBOT_VERSION "0.1"
 
 [[noreturn]] void usage(void) {
-  LOG(INFO) << "Usage:   kbot -s <server> -p <port> -c <channel> -n <nickname>";
+  LOG(INFO) << "Usage:   kbot -s <server> -p <port> -c <channel>[:<key>][,...] -n <nickname>";
   LOG(INFO) << "              -x <password> -l (ssl)";
+  LOG(INFO) << "              -S plain[:<account>] (SASL mechanism, default plain as <nickname> "
+               "with -x)";
+  LOG(INFO) << "              -A <account> (services account allowed to run every command, needs "
+               "account-tag)";
+  LOG(INFO) << "              -w <idle>[:<timeout>] (seconds quiet before a PING, and until the "
+               "connection is given up without an answer, default 30:90)";
+  LOG(INFO) << "              -O nodelay[=0],keepalive=<idle>[:<interval>[:<count>]],"
+               "rcvbuf=<bytes>[KM],sndbuf=<bytes>[KM],";
+  LOG(INFO) << "                 user_timeout=<ms>,busy_poll=<usec>,notsent_lowat=<bytes>[KM] "
+               "(socket tuning, default nodelay,keepalive=120:30:4)";
+  LOG(INFO) << "              -m <metrics endpoint> (unix:/path or [addr:]port on loopback)";
+  LOG(INFO) << "              -C <capture file> (record received lines for kbot-loadgen)";
+  LOG(INFO) << "              -t <trace file> (record trace ring, dump on SIGUSR2)";
+  LOG(INFO) << "              -f <log file> (asynchronous hot path log, default stderr)";
+  LOG(INFO) << "              -i (load plugins into separate processes)";
+  LOG(INFO) << "              -g <cgroup dir> (delegated cgroup v2 directory for plugin processes)";
+  LOG(INFO) << "              -L cpu=<percent>,memory=<bytes>[KMG],pids=<n> (limits per plugin "
+               "process, with -g)";
+  LOG(INFO) << "              -P <dir>[:<dir>...] (plugin search path, default current directory)";
+  LOG(INFO) << "              -a <plugin>[,<plugin>...] (load at startup, shared by all servers)";
   LOG(INFO) << "Example: kbot chat.freenode.net 6667 ##kbot kbot";
   LOG(INFO) << "         kbot -s chat.freenode.net -n kbot -p 6667 -c ##kbot";
   LOG(INFO) << "Version " << KBOT_VERSION << " (" << __DATE__ << ", " << __TIME__ << ")";
@@ -25,14 +63,26 @@ int main(int argc, char *argv[]) {
   const char *address = "chat.freenode.net";
   uint16_t port = 6667;
   const char *nickname = "kbot";
-  const char *channel = "##kbot";
+  std::vector<std::pair<std::string, std::string>> channels = {{"##kbot", ""}};
   std::string password = "";
+  std::optional<kbot::SaslCredentials> sasl;
+  std::string admin_account;
+  kbot::LagWatchdog::Config watchdog;
+  kbot::SocketOptions socket_options;
   bool ssl = false;
+  const char *metrics_endpoint = nullptr;
+  const char *log_path = "";
+  const char *capture_path = nullptr;
+  bool isolate_plugins = false;
+  const char *plugin_cgroup = "";
+  kbot::cgroup::Limits plugin_limits;
+  const char *plugin_host_spec = nullptr;
+  std::vector<std::string> preload;
 
   google::InitGoogleLogging(argv[0]);
   google::InstallFailureSignalHandler();
   int opt = -1;
-  while ((opt = getopt(argc, argv, "hs:n:p:c:x::l")) != -1) {
+  while ((opt = getopt(argc, argv, "hs:n:p:c:x::lm:t:f:ig:L:P:a:H:S:A:w:O:C:")) != -1) {
     switch (opt) {
       case 's':
         address = optarg;
@@ -60,7 +110,16 @@ int main(int argc, char *argv[]) {
         port = static_cast<uint16_t>(r);
         break;
       case 'c':
-        channel = optarg;
+        channels.clear();
+        // Channel names can't contain ':' or ','
+        for (std::string_view v = optarg; !v.empty();) {
+          auto item = v.substr(0, v.find(','));
+          v.remove_prefix(std::min(v.size(), item.size() + 1));
+          if (item.empty()) continue;
+          auto colon = item.find(':');
+          channels.emplace_back(item.substr(0, colon),
+                                colon == item.npos ? "" : item.substr(colon + 1));
+        }
         break;
       case 'x':
         if (optarg != nullptr)
@@ -73,15 +132,143 @@ int main(int argc, char *argv[]) {
       case 'l':
         ssl = true;
         break;
+      case 'S': {
+        std::string_view v = optarg;
+        auto colon = v.find(':');
+        auto mechanism = kbot::SaslClient::ParseMechanism(v.substr(0, colon));
+        if (!mechanism) {
+          LOG(ERROR) << "Unsupported SASL mechanism: " << optarg;
+          return 1;
+        }
+        // Connections are plain TCP, there is no client certificate to authenticate with
+        if (*mechanism == kbot::SaslMechanism::kExternal) {
+          LOG(ERROR) << "SASL EXTERNAL needs a TLS client certificate, which kbot can't present";
+          return 1;
+        }
+        sasl.emplace();
+        sasl->mechanism = *mechanism;
+        if (colon != v.npos) sasl->account = v.substr(colon + 1);
+        break;
+      }
+      case 'A':
+        admin_account = optarg;
+        break;
+      case 'w': {
+        // <idle>[:<timeout>] in seconds
+        auto seconds = [](std::string_view s, std::chrono::seconds &out) {
+          unsigned n = 0;
+          auto [p, ec] = std::from_chars(s.data(), s.data() + s.size(), n);
+          if (ec != std::errc() || p != s.data() + s.size() || !n) return false;
+          out = std::chrono::seconds(n);
+          return true;
+        };
+        std::string_view v = optarg;
+        auto colon = v.find(':');
+        if (!seconds(v.substr(0, colon), watchdog.idle) ||
+            (colon != v.npos && !seconds(v.substr(colon + 1), watchdog.timeout))) {
+          LOG(ERROR) << "Bad watchdog timing: " << optarg;
+          return 1;
+        }
+        break;
+      }
+      case 'O':
+        if (auto o = kbot::SocketOptions::Parse(optarg)) {
+          socket_options = *o;
+        } else {
+          LOG(ERROR) << "Bad socket options: " << optarg;
+          return 1;
+        }
+        break;
+      case 'm':
+        metrics_endpoint = optarg;
+        break;
+      case 'C':
+        capture_path = optarg;
+        break;
+      case 'f':
+        log_path = optarg;
+        break;
+      case 'i':
+        isolate_plugins = true;
+        break;
+      case 'g':
+        plugin_cgroup = optarg;
+        break;
+      case 'L':
+        if (auto l = kbot::cgroup::Limits::Parse(optarg)) {
+          plugin_limits = *l;
+        } else {
+          LOG(ERROR) << "Bad plugin limits: " << optarg;
+          return 1;
+        }
+        break;
+      case 'P':
+        kbot::plugin::SetSearchPath(optarg);
+        break;
+      case 'a':
+        for (std::string_view v = optarg; !v.empty();) {
+          auto comma = v.find(',');
+          if (comma) preload.emplace_back(v.substr(0, comma));
+          v.remove_prefix(comma == v.npos ? v.size() : comma + 1);
+        }
+        break;
+      case 'H':
+        // Internal, see PluginHost
+        plugin_host_spec = optarg;
+        break;
+      case 't': {
+        // Route SIGUSR2 to the signalfd of the server threads, which inherit this mask
+        sigset_t set;
+        sigemptyset(&set);
+        sigaddset(&set, SIGUSR2);
+        pthread_sigmask(SIG_BLOCK, &set, nullptr);
+        kbot::trace::EnableRing(optarg);
+        break;
+      }
       default:
         usage();
     }
   }
 
+  if (plugin_host_spec) return kbot::PluginHostMain(plugin_host_spec, nickname);
+
+  if (!password.empty() && !sasl) sasl.emplace();
+  if (sasl) {
+    if (sasl->account.empty()) sasl->account = nickname;
+    sasl->password = password;
+    if (sasl->mechanism == kbot::SaslMechanism::kPlain && password.empty()) {
+      LOG(ERROR) << "SASL PLAIN needs a password (-x)";
+      return 1;
+    }
+  }
+
+  if (!kbot::log::Start(log_path)) {
+    LOG(ERROR) << "Failed to start logging backend";
+    return 1;
+  }
+  struct LogStop {
+    ~LogStop() { kbot::log::Stop(); }
+  } _;
+
+  // Must happen before any thread is started, server threads create their HTTP engines lazily
+  if (curl_global_init(CURL_GLOBAL_DEFAULT) != CURLE_OK) {
+    LOG(ERROR) << "Failed to initialize libcurl";
+    return 1;
+  }
+  struct CurlCleanup {
+    ~CurlCleanup() { curl_global_cleanup(); }
+  } curl_cleanup;
+
+  // Before any server thread starts, each server then activates its own set of the loaded plugins
+  if (!kbot::plugin::Preload(preload, !isolate_plugins)) {
+    LOG(ERROR) << "Failed to load plugins at startup";
+    return 1;
+  }
+
   std::optional<kbot::Server> server_opt;
   try {
     // Database constructor can throw
-    server_opt = kbot::ConnectionNew(address, port, nickname);
+    server_opt = kbot::ConnectionNew(address, port, nickname, socket_options);
     if (server_opt.has_value() == false) {
       LOG(INFO) << "Failed to establish connection to server";
       usage();
@@ -92,16 +279,34 @@ int main(int argc, char *argv[]) {
     return 1;
   }
   kbot::LaunchServerThread(
-      [nickname, password, channel](kbot::Server &&server) {
+      [nickname, sasl, admin_account, watchdog, channels, metrics_endpoint, capture_path,
+       isolate_plugins, plugin_cgroup, plugin_limits](kbot::Server &&server) {
         kbot::ThreadCleanupSelf _;
         auto m = kbot::Manager::CreateNew(std::move(server));
-        auto r = m.server.Login(nickname, password);
+        m.isolate_plugins = isolate_plugins;
+        m.watchdog = kbot::LagWatchdog(watchdog);
+        if (*plugin_cgroup) {
+          m.governor = kbot::cgroup::Governor::CreateNew(plugin_cgroup, plugin_limits);
+        }
+        if (capture_path) {
+          m.capture = kbot::capture::Writer::CreateNew(capture_path);
+          if (!m.capture) LOG(ERROR) << "Capture disabled";
+        }
+        if (metrics_endpoint) {
+          m.metrics_listener = kbot::metrics::Listener::CreateNew(metrics_endpoint);
+          if (!m.metrics_listener) LOG(ERROR) << "Metrics endpoint disabled";
+        }
+        // The password goes to SASL, or to NickServ once registered if that isn't available
+        if (sasl) m.server.sasl.emplace(*sasl);
+        m.server.admin_account = admin_account;
+        auto r = m.server.Login(nickname);
         if (r < 0) {
           PLOG(ERROR) << "Login failed";
           return;
         }
-        m.server.JoinChannel(channel);
-        m.server.SendChannel(channel, "Hello!");
+        // Held back until registration completes, then joined all at once
+        for (auto &[channel, key] : channels) m.server.JoinChannel(channel, key);
+        if (!channels.empty()) m.server.SendChannel(channels.front().first, "Hello!");
         m.server.DumpInfo();
         kbot::WorkerRun(std::move(m));
       },
@@ -0,0 +1,185 @@
+#pragma once
+
+#include <arpa/inet.h>
+#include <fmt/format.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace kbot {
+namespace fake {
+
+// FakeIRCd
+// Scripted stand-in for an IRC server on a loopback port, driven from the test's thread while
+// the bot runs on its own: accept the connection, send lines (whole or in pieces), and wait for
+// the lines the bot sends back. Every call blocks for at most a timeout, so a bot that hangs
+// fails the test instead of hanging it.
+
+using namespace std::chrono_literals;
+
+class FakeIRCd {
+  int listen_fd = -1;
+  int conn_fd = -1;
+  uint16_t port = 0;
+  std::string in;
+
+ public:
+  static constexpr std::chrono::milliseconds kTimeout = 5s;
+  static constexpr std::string_view kName = "irc.test";
+
+  FakeIRCd() {
+    listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    if (listen_fd < 0 || bind(listen_fd, reinterpret_cast<sockaddr *>(&addr), len) < 0 ||
+        listen(listen_fd, 4) < 0 ||
+        getsockname(listen_fd, reinterpret_cast<sockaddr *>(&addr), &len) < 0) {
+      return;
+    }
+    port = ntohs(addr.sin_port);
+  }
+  FakeIRCd(const FakeIRCd &) = delete;
+  FakeIRCd &operator=(const FakeIRCd &) = delete;
+  ~FakeIRCd() {
+    Disconnect();
+    if (listen_fd >= 0) close(listen_fd);
+  }
+
+  // Zero if listening failed
+  uint16_t GetPort() const { return port; }
+  bool Connected() const { return conn_fd >= 0; }
+
+  bool Accept(std::chrono::milliseconds timeout = kTimeout) {
+    Disconnect();
+    struct pollfd pfd = {.fd = listen_fd, .events = POLLIN, .revents = 0};
+    if (poll(&pfd, 1, static_cast<int>(timeout.count())) != 1) return false;
+    conn_fd = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+    return conn_fd >= 0;
+  }
+
+  // Closes our end, with a FIN so the bot sees EOF rather than a reset
+  void Disconnect() {
+    if (conn_fd < 0) return;
+    shutdown(conn_fd, SHUT_RDWR);
+    close(conn_fd);
+    conn_fd = -1;
+    in.clear();
+  }
+
+  bool Send(std::string_view data) {
+    while (!data.empty()) {
+      ssize_t r = send(conn_fd, data.data(), data.size(), MSG_NOSIGNAL);
+      if (r <= 0) return false;
+      data.remove_prefix(static_cast<size_t>(r));
+    }
+    return true;
+  }
+
+  // One line, CRLF is appended
+  bool SendLine(std::string_view line) { return Send(fmt::format("{}\r\n", line)); }
+
+  // Sends data in pieces of chunk bytes with a pause after each, so that the bot reads lines in
+  // parts
+  bool SendSplit(std::string_view data, size_t chunk, std::chrono::microseconds pause = 1ms) {
+    while (!data.empty()) {
+      auto n = std::min(chunk, data.size());
+      if (!Send(data.substr(0, n))) return false;
+      data.remove_prefix(n);
+      std::this_thread::sleep_for(pause);
+    }
+    return true;
+  }
+
+  // The next line the bot sent, without CRs, std::nullopt on timeout or once it disconnected
+  std::optional<std::string> ReadLine(std::chrono::milliseconds timeout = kTimeout) {
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    for (;;) {
+      if (auto nl = in.find('\n'); nl != in.npos) {
+        std::string line;
+        for (char c : std::string_view(in).substr(0, nl)) {
+          if (c != '\r') line.push_back(c);
+        }
+        in.erase(0, nl + 1);
+        if (line.empty()) continue;
+        return line;
+      }
+      auto left = std::chrono::ceil<std::chrono::milliseconds>(deadline -
+                                                               std::chrono::steady_clock::now());
+      struct pollfd pfd = {.fd = conn_fd, .events = POLLIN, .revents = 0};
+      if (conn_fd < 0 || left.count() <= 0 || poll(&pfd, 1, static_cast<int>(left.count())) != 1) {
+        return std::nullopt;
+      }
+      char buf[4096];
+      ssize_t r = recv(conn_fd, buf, sizeof(buf), 0);
+      if (r <= 0) return std::nullopt;
+      in.append(buf, static_cast<size_t>(r));
+    }
+  }
+
+  // Skips lines until one starting with prefix, skipped lines are appended to skipped if given
+  std::optional<std::string> Expect(std::string_view prefix,
+                                    std::chrono::milliseconds timeout = kTimeout,
+                                    std::vector<std::string> *skipped = nullptr) {
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    for (;;) {
+      auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+          deadline - std::chrono::steady_clock::now());
+      auto line = ReadLine(std::max(left, std::chrono::milliseconds(0)));
+      if (!line || line->starts_with(prefix)) return line;
+      if (skipped) skipped->push_back(std::move(*line));
+    }
+  }
+
+  // Answers what the bot sends on connect, offering no capabilities, until it sent both NICK and
+  // USER, and then welcomes it with isupport as RPL_ISUPPORT. Returns the nickname.
+  std::optional<std::string> Register(
+      std::string_view isupport = "CASEMAPPING=rfc1459 CHANTYPES=# TARGMAX=JOIN:,PRIVMSG:4") {
+    std::string nickname;
+    bool user = false;
+    while (nickname.empty() || !user) {
+      auto line = ReadLine();
+      if (!line) return std::nullopt;
+      std::string_view l = *line;
+      if (l.starts_with("CAP LS")) {
+        SendLine(fmt::format(":{} CAP * LS :", kName));
+      } else if (l.starts_with("NICK ")) {
+        nickname = l.substr(5);
+      } else if (l.starts_with("USER ")) {
+        user = true;
+      }
+    }
+    SendLine(fmt::format(":{} 001 {} :Welcome", kName, nickname));
+    SendLine(fmt::format(":{} 005 {} {} :are supported by this server", kName, nickname,
+                         isupport));
+    SendLine(fmt::format(":{} 422 {} :MOTD File is missing", kName, nickname));
+    return nickname;
+  }
+
+  // Confirms a JOIN line of the bot for every channel in it
+  bool ConfirmJoin(std::string_view nickname, std::string_view join) {
+    if (!join.starts_with("JOIN ")) return false;
+    join.remove_prefix(5);
+    join = join.substr(0, join.find(' '));
+    while (!join.empty()) {
+      auto comma = join.find(',');
+      SendLine(fmt::format(":{}!bot@test JOIN {}", nickname, join.substr(0, comma)));
+      join.remove_prefix(comma == join.npos ? join.size() : comma + 1);
+    }
+    return true;
+  }
+};
+
+}  // namespace fake
+}  // namespace kbot
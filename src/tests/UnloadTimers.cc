@@ -0,0 +1,14 @@
+#include <Plugin.hh>
+
+// Loaded by test_manager: the first timer unloads the plugin while the second one is due as well
+
+COMMAND_CALLBACK(unload_timers, m, msg) { kbot::UserCommand::SendInvokerReply(m, msg, "Armed."); }
+
+TIMER_CALLBACK(unload, m) { m.UnloadPlugin("unload_timers"); }
+
+TIMER_CALLBACK(after, m) { m.server.PrivMsg("#t", "after unload"); }
+
+COMMAND_HELP_VECTOR(HELP(unload_timers, "Usage: ,unload_timers"));
+COMMAND_VECTOR(PLUGIN_COMMAND("unload_timers", unload_timers, 0, 0));
+TIMER_VECTOR(PLUGIN_TIMER(10, unload), PLUGIN_TIMER(10, after));
+DESCRIPTOR(unload_timers);
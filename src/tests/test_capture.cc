@@ -0,0 +1,127 @@
+#include <gtest/gtest.h>
+#include <unistd.h>
+
+#include <Capture.hh>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <string>
+
+using namespace kbot::capture;
+using namespace std::chrono_literals;
+
+TEST(Capture, Varint) {
+  for (uint64_t v : {0ul, 1ul, 127ul, 128ul, 300ul, 1ul << 35, ~0ul}) {
+    std::string s;
+    AppendVarint(s, v);
+    size_t off = 0;
+    EXPECT_EQ(ParseVarint(s, off), v);
+    EXPECT_EQ(off, s.size());
+  }
+  std::string s;
+  AppendVarint(s, 127);
+  EXPECT_EQ(s.size(), 1u);
+  AppendVarint(s, 128);
+  EXPECT_EQ(s.size(), 3u);
+  size_t off = 0;
+  EXPECT_EQ(ParseVarint("\x80\x80", off), std::nullopt);
+}
+
+TEST(Capture, RoundTrip) {
+  char path[] = "/tmp/test_capture.XXXXXX";
+  int fd = mkstemp(path);
+  ASSERT_GE(fd, 0);
+  close(fd);
+  auto t0 = Clock::now();
+  {
+    auto w = Writer::CreateNew(path, t0);
+    ASSERT_TRUE(w);
+    w->Record(":srv 001 kbot :Welcome", t0 + 5ms);
+    w->Record(":joe!u@h PRIVMSG #c :,hi", t0 + 7ms);
+    // Same read
+    w->Record(":joe!u@h PRIVMSG #c :again", t0 + 7ms);
+    w->Record(std::string(1000, 'x'), t0 + 2s);
+  }
+  auto r = Reader::Open(path);
+  unlink(path);
+  ASSERT_TRUE(r);
+  auto e = r->Next();
+  ASSERT_TRUE(e);
+  EXPECT_EQ(e->at, 5ms);
+  EXPECT_EQ(e->line, ":srv 001 kbot :Welcome");
+  e = r->Next();
+  EXPECT_EQ(e->at, 7ms);
+  EXPECT_EQ(e->line, ":joe!u@h PRIVMSG #c :,hi");
+  e = r->Next();
+  EXPECT_EQ(e->at, 7ms);
+  e = r->Next();
+  ASSERT_TRUE(e);
+  EXPECT_EQ(e->at, 2s);
+  EXPECT_EQ(e->line.size(), 1000u);
+  EXPECT_FALSE(r->Next());
+  EXPECT_FALSE(r->Torn());
+}
+
+// Lines of a quiet connection are written out by Tick, not only once the next one arrives
+TEST(Capture, Tick) {
+  char path[] = "/tmp/test_capture.XXXXXX";
+  int fd = mkstemp(path);
+  ASSERT_GE(fd, 0);
+  close(fd);
+  auto t0 = Clock::now();
+  auto w = Writer::CreateNew(path, t0);
+  ASSERT_TRUE(w);
+  w->Record(":srv 001 kbot :Welcome", t0 + 5ms);
+  EXPECT_EQ(std::filesystem::file_size(path), 0u);
+  w->Tick(t0 + 500ms);
+  EXPECT_EQ(std::filesystem::file_size(path), 0u);
+  w->Tick(t0 + Writer::kFlushInterval);
+  auto r = Reader::Open(path);
+  unlink(path);
+  ASSERT_TRUE(r);
+  auto e = r->Next();
+  ASSERT_TRUE(e);
+  EXPECT_EQ(e->line, ":srv 001 kbot :Welcome");
+  EXPECT_FALSE(r->Next());
+}
+
+// A failed write ends the capture instead of leaving a gap in the middle of it
+TEST(Capture, WriteError) {
+  auto w = Writer::CreateNew("/dev/full");
+  ASSERT_TRUE(w);
+  w->Record(":srv 001 kbot :Welcome", Clock::now());
+  EXPECT_FALSE(w->Flush());
+  w->Record(":srv 002 kbot :Your host", Clock::now());
+  EXPECT_FALSE(w->Flush());
+}
+
+TEST(Capture, Malformed) {
+  EXPECT_FALSE(Reader::FromBuffer("KBOTCAP"));
+  EXPECT_FALSE(Reader::FromBuffer("not a capture"));
+  auto r = Reader::FromBuffer(std::string(kMagic));
+  ASSERT_TRUE(r);
+  EXPECT_FALSE(r->Next());
+  EXPECT_FALSE(r->Torn());
+
+  // Cut short in the middle of the second line
+  std::string data(kMagic);
+  AppendVarint(data, 10);
+  AppendVarint(data, 3);
+  data += "abc";
+  AppendVarint(data, 10);
+  AppendVarint(data, 5);
+  data += "de";
+  r = Reader::FromBuffer(data);
+  ASSERT_TRUE(r);
+  auto e = r->Next();
+  ASSERT_TRUE(e);
+  EXPECT_EQ(e->line, "abc");
+  EXPECT_FALSE(r->Next());
+  EXPECT_TRUE(r->Torn());
+  EXPECT_FALSE(r->Next());
+}
+
+int main() {
+  testing::InitGoogleTest();
+  return RUN_ALL_TESTS();
+}
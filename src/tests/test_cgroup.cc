@@ -0,0 +1,168 @@
+#include <gtest/gtest.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <CGroup.hh>
+#include <filesystem>
+#include <fstream>
+#include <string>
+
+using namespace kbot;
+
+namespace {
+
+// A stand-in for a delegated cgroup directory: the kernel creates the interface files of a new
+// group by itself, here they are created up front
+class FakeRoot {
+  std::string root;
+
+ public:
+  FakeRoot() : root("/tmp/kbot_test_cgroup." + std::to_string(getpid())) {
+    std::filesystem::remove_all(root);
+    std::filesystem::create_directory(root);
+    Write("cgroup.subtree_control", "");
+  }
+  ~FakeRoot() { std::filesystem::remove_all(root); }
+
+  const std::string &GetPath() const { return root; }
+  void Write(const std::string &file, const std::string &content) {
+    std::ofstream(root + "/" + file) << content;
+  }
+  std::string Read(const std::string &file) {
+    std::ifstream f(root + "/" + file);
+    return std::string(std::istreambuf_iterator<char>(f), {});
+  }
+  void MakeGroup(const std::string &name) {
+    std::filesystem::create_directory(root + "/" + name);
+    for (auto f : {"cgroup.procs", "cpu.max", "memory.max", "pids.max", "memory.current",
+                   "pids.current", "memory.events", "pids.events"}) {
+      Write(name + "/" + f, "0\n");
+    }
+    SetCpuStat(name, 0, 0, 0);
+  }
+  void SetCpuStat(const std::string &name, uint64_t usage, uint64_t periods, uint64_t throttled) {
+    Write(name + "/cpu.stat", "usage_usec " + std::to_string(usage) + "\nuser_usec 0\nnr_periods " +
+                                  std::to_string(periods) + "\nnr_throttled " +
+                                  std::to_string(throttled) + "\nthrottled_usec 1500\n");
+  }
+};
+
+}  // namespace
+
+TEST(Limits, Parse) {
+  auto l = cgroup::Limits::Parse("cpu=25,memory=64M,pids=16");
+  ASSERT_TRUE(l.has_value());
+  EXPECT_EQ(l->cpu_percent, 25u);
+  EXPECT_EQ(l->memory_max, 64ULL << 20);
+  EXPECT_EQ(l->pids_max, 16u);
+
+  l = cgroup::Limits::Parse("memory=4096");
+  ASSERT_TRUE(l.has_value());
+  EXPECT_EQ(l->memory_max, 4096u);
+  EXPECT_EQ(l->cpu_percent, cgroup::Limits().cpu_percent);
+  EXPECT_EQ(cgroup::Limits::Parse("memory=1G")->memory_max, 1ULL << 30);
+  EXPECT_TRUE(cgroup::Limits::Parse("").has_value());
+
+  EXPECT_FALSE(cgroup::Limits::Parse("cpu").has_value());
+  EXPECT_FALSE(cgroup::Limits::Parse("cpu=x").has_value());
+  EXPECT_FALSE(cgroup::Limits::Parse("pids=1K").has_value());
+  EXPECT_FALSE(cgroup::Limits::Parse("io=5").has_value());
+}
+
+TEST(Limits, OverBudget) {
+  cgroup::Usage prev, cur;
+  EXPECT_FALSE(cgroup::OverBudget(prev, cur));
+  cur.nr_periods = 10;
+  cur.nr_throttled = 5;
+  EXPECT_FALSE(cgroup::OverBudget(prev, cur));
+  cur.nr_throttled = 6;
+  EXPECT_TRUE(cgroup::OverBudget(prev, cur));
+  prev = cur;
+  cur.memory_max_events = 1;
+  EXPECT_TRUE(cgroup::OverBudget(prev, cur));
+  prev = cur;
+  cur.pids_max_events = 3;
+  EXPECT_TRUE(cgroup::OverBudget(prev, cur));
+  prev = cur;
+  // Memory in use is not a strike by itself
+  cur.memory_current = 1ULL << 40;
+  EXPECT_FALSE(cgroup::OverBudget(prev, cur));
+}
+
+TEST(CGroup, SetLimitsReadUsage) {
+  FakeRoot root;
+  root.MakeGroup("g");
+  auto g = cgroup::CGroup::CreateNew(root.GetPath(), "g");
+  ASSERT_TRUE(g.has_value());
+  EXPECT_EQ(g->GetProcsPath(), root.GetPath() + "/g/cgroup.procs");
+  ASSERT_TRUE(g->SetLimits(*cgroup::Limits::Parse("cpu=50,memory=1M,pids=8")));
+  EXPECT_EQ(root.Read("g/cpu.max"), "50000 100000");
+  EXPECT_EQ(root.Read("g/memory.max"), "1048576");
+  EXPECT_EQ(root.Read("g/pids.max"), "8");
+  ASSERT_TRUE(g->SetLimits(*cgroup::Limits::Parse("cpu=0")));
+  EXPECT_EQ(root.Read("g/cpu.max"), "max 100000");
+
+  root.SetCpuStat("g", 12345, 40, 7);
+  root.Write("g/memory.current", "8192\n");
+  root.Write("g/memory.events", "low 0\nhigh 0\nmax 2\noom 1\noom_kill 1\n");
+  root.Write("g/pids.current", "3\n");
+  root.Write("g/pids.events", "max 4\n");
+  auto u = g->ReadUsage();
+  ASSERT_TRUE(u.has_value());
+  EXPECT_EQ(u->cpu_usage_usec, 12345u);
+  EXPECT_EQ(u->nr_periods, 40u);
+  EXPECT_EQ(u->nr_throttled, 7u);
+  EXPECT_EQ(u->throttled_usec, 1500u);
+  EXPECT_EQ(u->memory_current, 8192u);
+  EXPECT_EQ(u->memory_max_events, 2u);
+  EXPECT_EQ(u->oom_kill, 1u);
+  EXPECT_EQ(u->pids_current, 3u);
+  EXPECT_EQ(u->pids_max_events, 4u);
+
+  EXPECT_FALSE(cgroup::CGroup::CreateNew(root.GetPath() + "/missing", "g").has_value());
+}
+
+TEST(Governor, StrikesAndEviction) {
+  FakeRoot root;
+  root.MakeGroup("kbot-a");
+  root.MakeGroup("kbot-b");
+  auto gov = cgroup::Governor::CreateNew(root.GetPath(), cgroup::Limits(), 2);
+  EXPECT_EQ(root.Read("cgroup.subtree_control"), "+cpu +memory +pids");
+  EXPECT_TRUE(gov->Empty());
+  EXPECT_EQ(gov->Admit("a"), root.GetPath() + "/kbot-a/cgroup.procs");
+  EXPECT_EQ(gov->Admit("b"), root.GetPath() + "/kbot-b/cgroup.procs");
+
+  auto sample = [&](std::string_view plugin) {
+    for (auto &s : gov->SampleAll()) {
+      if (s.plugin == plugin) return s;
+    }
+    ADD_FAILURE() << "no sample for " << plugin;
+    return cgroup::Governor::Sample{};
+  };
+  // a is throttled in every period, b stays within its limits
+  root.SetCpuStat("kbot-a", 100, 10, 10);
+  root.SetCpuStat("kbot-b", 100, 10, 0);
+  auto s = sample("a");
+  EXPECT_EQ(s.strikes, 1u);
+  EXPECT_FALSE(s.evict);
+  EXPECT_EQ(s.usage.cpu_usage_usec, 100u);
+  // A clean interval forgives a strike
+  s = sample("a");
+  EXPECT_EQ(s.strikes, 0u);
+  root.Write("kbot-a/memory.events", "max 1\n");
+  EXPECT_EQ(sample("a").strikes, 1u);
+  root.Write("kbot-a/pids.events", "max 1\n");
+  s = sample("a");
+  EXPECT_EQ(s.strikes, 2u);
+  EXPECT_TRUE(s.evict);
+  EXPECT_EQ(sample("b").strikes, 0u);
+
+  gov->Release("a");
+  gov->Release("b");
+  EXPECT_TRUE(gov->Empty());
+}
+
+int main() {
+  testing::InitGoogleTest();
+  return RUN_ALL_TESTS();
+}
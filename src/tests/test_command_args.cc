@@ -0,0 +1,116 @@
+#include <gtest/gtest.h>
+
+#include <CommandArgs.hh>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <vector>
+
+using namespace kbot::UserCommand;
+
+namespace {
+
+// Words as the IRC parser produces them, views into the line
+std::vector<std::string_view> Split(std::string_view line) {
+  std::vector<std::string_view> v;
+  while (!line.empty()) {
+    auto start = line.find_first_not_of(' ');
+    if (start == line.npos) break;
+    line.remove_prefix(start);
+    auto end = line.find(' ');
+    v.push_back(line.substr(0, end));
+    line.remove_prefix(end == line.npos ? line.size() : end);
+  }
+  return v;
+}
+
+template <class... Args>
+ArgError Parse(std::string_view line, std::tuple<Args...> &out) {
+  auto v = Split(line);
+  return ParseArgs(std::span<const std::string_view>(v), out);
+}
+
+}  // namespace
+
+struct Manager;
+struct Msg;
+void Command(Manager &, const Msg &, Channel, const Nick &, int, std::optional<Rest>);
+
+static_assert(ArgSpec<Nick, uint16_t, std::optional<std::string_view>>::kUsage ==
+              " <nick> <number> [word]");
+static_assert(ArgSpec<>::kUsage.empty());
+static_assert(ArgSpec<Channel, std::optional<Rest>>::kRequired == 1);
+static_assert(std::is_same_v<CommandSignature<decltype(&Command)>::args_tuple,
+                             std::tuple<Channel, Nick, int, std::optional<Rest>>>);
+
+TEST(CommandArgs, Integers) {
+  std::tuple<int, uint8_t> t;
+  EXPECT_EQ(Parse("-42 255", t).kind, ArgError::kNone);
+  EXPECT_EQ(std::get<0>(t), -42);
+  EXPECT_EQ(std::get<1>(t), 255);
+
+  auto err = Parse("1 256", t);
+  EXPECT_EQ(err.kind, ArgError::kInvalid);
+  EXPECT_EQ(err.index, 1u);
+  EXPECT_EQ(Parse("1x 1", t).kind, ArgError::kInvalid);
+  EXPECT_EQ(Parse("99999999999 1", t).kind, ArgError::kInvalid);
+  EXPECT_EQ(Parse("1 -1", t).kind, ArgError::kInvalid);
+  EXPECT_EQ(Parse("+1 1", t).kind, ArgError::kInvalid);
+}
+
+TEST(CommandArgs, NickAndChannel) {
+  std::tuple<Nick, Channel> t;
+  EXPECT_EQ(Parse("[kkd]-2 ##kbot", t).kind, ArgError::kNone);
+  EXPECT_EQ(std::get<0>(t).value, "[kkd]-2");
+  EXPECT_EQ(std::get<1>(t).value, "##kbot");
+
+  EXPECT_EQ(Parse("2kkd #c", t).index, 0u);
+  EXPECT_EQ(Parse("-kkd #c", t).kind, ArgError::kInvalid);
+  EXPECT_EQ(Parse("kk.d #c", t).kind, ArgError::kInvalid);
+  auto err = Parse("kkd c", t);
+  EXPECT_EQ(err.kind, ArgError::kInvalid);
+  EXPECT_EQ(err.index, 1u);
+  EXPECT_EQ(Parse("kkd #", t).kind, ArgError::kInvalid);
+  EXPECT_EQ(Parse("kkd #a,#b", t).kind, ArgError::kInvalid);
+  EXPECT_EQ(Parse("kkd &local", t).kind, ArgError::kNone);
+}
+
+TEST(CommandArgs, Counts) {
+  std::tuple<std::string_view, std::optional<int>> t;
+  auto err = Parse("", t);
+  EXPECT_EQ(err.kind, ArgError::kTooFew);
+  EXPECT_EQ(Parse("a 1 b", t).kind, ArgError::kTooMany);
+
+  EXPECT_EQ(Parse("a", t).kind, ArgError::kNone);
+  EXPECT_EQ(std::get<0>(t), "a");
+  EXPECT_FALSE(std::get<1>(t).has_value());
+  EXPECT_EQ(Parse("a 7", t).kind, ArgError::kNone);
+  EXPECT_EQ(std::get<1>(t), 7);
+  // A present optional argument must still parse
+  EXPECT_EQ(Parse("a b", t).kind, ArgError::kInvalid);
+
+  std::tuple<> none;
+  EXPECT_EQ(Parse("", none).kind, ArgError::kNone);
+  EXPECT_EQ(Parse("x", none).kind, ArgError::kTooMany);
+}
+
+TEST(CommandArgs, Rest) {
+  std::string line = "#c  some   reason here";
+  std::tuple<Channel, Rest> t;
+  EXPECT_EQ(Parse(line, t).kind, ArgError::kNone);
+  EXPECT_EQ(std::get<1>(t).value, "some   reason here");
+  EXPECT_EQ(Parse("#c", t).kind, ArgError::kTooFew);
+
+  std::tuple<Channel, std::optional<Rest>> o;
+  EXPECT_EQ(Parse("#c", o).kind, ArgError::kNone);
+  EXPECT_FALSE(std::get<1>(o).has_value());
+  EXPECT_EQ(Parse("#c x", o).kind, ArgError::kNone);
+  EXPECT_EQ(std::get<1>(o)->value, "x");
+}
+
+int main() {
+  testing::InitGoogleTest();
+  return RUN_ALL_TESTS();
+}
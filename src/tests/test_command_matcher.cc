@@ -0,0 +1,122 @@
+#include <gtest/gtest.h>
+
+#include <CommandMatcher.hh>
+#include <string_view>
+#include <vector>
+
+using namespace kbot;
+using Result = CommandMatcher::Result;
+
+namespace {
+
+CommandMatcher MakeMatcher() {
+  CommandMatcher cm(":,");
+  std::vector<std::string_view> keys = {":,hi", ":,help", ":,join", ":,part", ":,seen",
+                                        ":,search", ":,s"};
+  cm.SetCommands(keys, 1);
+  return cm;
+}
+
+}  // namespace
+
+TEST(CommandMatcher, Exact) {
+  auto cm = MakeMatcher();
+  EXPECT_EQ(cm.GetGeneration(), 1u);
+  auto m = cm.Resolve("#c", ":,help");
+  EXPECT_EQ(m.result, Result::kMatched);
+  EXPECT_EQ(m.key, ":,help");
+  // A name that is a prefix of others still resolves to itself
+  m = cm.Resolve("#c", ":,s");
+  EXPECT_EQ(m.result, Result::kMatched);
+  EXPECT_EQ(m.key, ":,s");
+  EXPECT_EQ(cm.Resolve("#c", ",hi").key, ":,hi");
+  EXPECT_EQ(cm.Resolve("#c", ":,helpme").result, Result::kUnknown);
+  EXPECT_EQ(cm.Resolve("#c", ":,nope").result, Result::kUnknown);
+}
+
+TEST(CommandMatcher, Abbreviation) {
+  auto cm = MakeMatcher();
+  auto m = cm.Resolve("#c", ":,hel");
+  EXPECT_EQ(m.result, Result::kMatched);
+  EXPECT_EQ(m.key, ":,help");
+  EXPECT_EQ(cm.Resolve("#c", ":,j").key, ":,join");
+  EXPECT_EQ(cm.Resolve("#c", ":,see").key, ":,seen");
+
+  EXPECT_EQ(cm.Resolve("#c", ":,h").result, Result::kAmbiguous);
+  EXPECT_EQ(cm.Resolve("#c", ":,se").result, Result::kAmbiguous);
+  auto v = cm.GetCandidates("#c", ":,se", 8);
+  ASSERT_EQ(v.size(), 2u);
+  EXPECT_EQ(v[0], ":,search");
+  EXPECT_EQ(v[1], ":,seen");
+  EXPECT_EQ(cm.GetCandidates("#c", ":,h", 1).size(), 1u);
+}
+
+TEST(CommandMatcher, NotCommand) {
+  auto cm = MakeMatcher();
+  EXPECT_EQ(cm.Resolve("#c", ":hello").result, Result::kNotCommand);
+  EXPECT_EQ(cm.Resolve("#c", ":").result, Result::kNotCommand);
+  EXPECT_EQ(cm.Resolve("#c", "").result, Result::kNotCommand);
+  // The prefix alone
+  EXPECT_EQ(cm.Resolve("#c", ":,").result, Result::kNotCommand);
+}
+
+TEST(CommandMatcher, Alias) {
+  auto cm = MakeMatcher();
+  EXPECT_FALSE(cm.AddAlias("hi", "help"));
+  EXPECT_TRUE(cm.AddAlias("greet", "hi"));
+  EXPECT_EQ(cm.Resolve("#c", ":,greet").key, ":,hi");
+  EXPECT_EQ(cm.Resolve("#c", ":,gr").key, ":,hi");
+  // An alias and its command don't make an abbreviation ambiguous
+  EXPECT_TRUE(cm.AddAlias("hello", "hi"));
+  EXPECT_EQ(cm.Resolve("#c", ":,hell").key, ":,hi");
+  EXPECT_EQ(cm.Resolve("#c", ":,hel").result, Result::kAmbiguous);
+
+  // Aliases survive a new set of commands, and wait for theirs to return
+  std::vector<std::string_view> keys = {":,help"};
+  cm.SetCommands(keys, 2);
+  EXPECT_EQ(cm.Resolve("#c", ":,greet").result, Result::kUnknown);
+  keys = {":,help", ":,hi"};
+  cm.SetCommands(keys, 3);
+  EXPECT_EQ(cm.Resolve("#c", ":,greet").key, ":,hi");
+
+  EXPECT_TRUE(cm.RemoveAlias("greet"));
+  EXPECT_FALSE(cm.RemoveAlias("greet"));
+  EXPECT_EQ(cm.Resolve("#c", ":,greet").result, Result::kUnknown);
+}
+
+TEST(CommandMatcher, Prefixes) {
+  auto cm = MakeMatcher();
+  EXPECT_FALSE(cm.SetPrefixes("", {}));
+  EXPECT_FALSE(cm.SetPrefixes("#c", {""}));
+  EXPECT_TRUE(cm.SetPrefixes("", {",", "!"}));
+  EXPECT_EQ(cm.Resolve("#c", ":!hi").key, ":,hi");
+  EXPECT_EQ(cm.Resolve("#c", ":,hi").key, ":,hi");
+
+  // Channel names ignore case
+  EXPECT_TRUE(cm.SetPrefixes("#Bots", {"kbot:", "k"}));
+  EXPECT_EQ(cm.Resolve("#bots", ":!hi").result, Result::kNotCommand);
+  EXPECT_EQ(cm.Resolve("#bots", ":khi").key, ":,hi");
+  // The longest prefix wins, kbot:hi isn't ,bot:hi
+  EXPECT_EQ(cm.Resolve("#BOTS", ":kbot:hi").key, ":,hi");
+  EXPECT_EQ(cm.Resolve("#c", ":khi").result, Result::kNotCommand);
+
+  EXPECT_TRUE(cm.SetPrefixes("#bots", {}));
+  EXPECT_EQ(cm.Resolve("#bots", ":!hi").key, ":,hi");
+}
+
+TEST(CommandMatcher, Disabled) {
+  auto cm = MakeMatcher();
+  ASSERT_TRUE(cm.AddAlias("greet", "hi"));
+  cm.SetEnabled("#c", "hi", false);
+  auto m = cm.Resolve("#C", ":,greet");
+  EXPECT_EQ(m.result, Result::kDisabled);
+  EXPECT_EQ(m.key, ":,hi");
+  EXPECT_EQ(cm.Resolve("#d", ":,hi").result, Result::kMatched);
+  cm.SetEnabled("#c", "hi", true);
+  EXPECT_EQ(cm.Resolve("#c", ":,hi").result, Result::kMatched);
+}
+
+int main() {
+  testing::InitGoogleTest();
+  return RUN_ALL_TESTS();
+}
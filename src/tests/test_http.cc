@@ -0,0 +1,236 @@
+#include <arpa/inet.h>
+#include <curl/curl.h>
+#include <gtest/gtest.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <Epoll.hh>
+#include <Http.hh>
+#include <Task.hh>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace kbot;
+using namespace std::chrono_literals;
+
+namespace {
+
+class TestManager : public io::EpollManager {
+ public:
+  TestManager() : EpollManager(epoll_create1(EPOLL_CLOEXEC)) {}
+  void RunUntil(const bool &done) {
+    while (!done) ASSERT_EQ(RunEventLoop(-1), 0);
+  }
+};
+
+// Blocking HTTP/1.1 stand-in serving one connection at a time with keep-alive
+class HttpStandIn {
+  int fd = -1;
+  uint16_t port = 0;
+  std::jthread thread;
+
+  static std::string Reply(std::string_view path) {
+    std::string body;
+    if (path == "/hello") {
+      body = "hello";
+    } else if (path == "/big") {
+      body.assign(64 * 1024, 'x');
+    } else if (path == "/slow") {
+      std::this_thread::sleep_for(100ms);
+      body = "slow";
+    } else {
+      return "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+    }
+    return "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: " +
+           std::to_string(body.size()) + "\r\n\r\n" + body;
+  }
+
+  void Serve(int cfd) {
+    std::string in;
+    char buf[4096];
+    for (;;) {
+      size_t end;
+      while ((end = in.find("\r\n\r\n")) == in.npos) {
+        ssize_t r = read(cfd, buf, sizeof(buf));
+        if (r <= 0) return;
+        in.append(buf, static_cast<size_t>(r));
+      }
+      auto sp1 = in.find(' ');
+      auto sp2 = in.find(' ', sp1 + 1);
+      std::string out = Reply(std::string_view(in).substr(sp1 + 1, sp2 - sp1 - 1));
+      in.erase(0, end + 4);
+      if (write(cfd, out.data(), out.size()) != static_cast<ssize_t>(out.size())) return;
+    }
+  }
+
+ public:
+  std::atomic<int> accepted = 0;
+
+  HttpStandIn() {
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    if (bind(fd, reinterpret_cast<sockaddr *>(&addr), len) < 0 || listen(fd, 16) < 0 ||
+        getsockname(fd, reinterpret_cast<sockaddr *>(&addr), &len) < 0) {
+      throw std::runtime_error("Failed to set up HTTP stand-in");
+    }
+    port = ntohs(addr.sin_port);
+    thread = std::jthread([this] {
+      int cfd;
+      while ((cfd = accept4(fd, nullptr, nullptr, SOCK_CLOEXEC)) >= 0) {
+        accepted++;
+        std::jthread([this, cfd] {
+          Serve(cfd);
+          close(cfd);
+        }).detach();
+      }
+    });
+  }
+  ~HttpStandIn() {
+    shutdown(fd, SHUT_RDWR);
+    thread.join();
+    close(fd);
+  }
+  std::string Url(std::string_view path) const {
+    return "http://127.0.0.1:" + std::to_string(port) + std::string(path);
+  }
+};
+
+Task<> FetchTwice(http::Engine &e, const HttpStandIn &s, std::vector<std::string> &bodies,
+                  bool &done) {
+  for (int i = 0; i < 2; i++) {
+    http::Request req;
+    req.url = s.Url("/hello");
+    auto res = co_await e.FetchAsync(std::move(req));
+    bodies.push_back(res.Ok() ? res.body : res.error);
+  }
+  done = true;
+}
+
+}  // namespace
+
+TEST(Http, Fetch) {
+  HttpStandIn s;
+  TestManager m;
+  auto e = http::Engine::CreateNew(m);
+  ASSERT_NE(e, nullptr);
+  bool done = false;
+  http::Response res;
+  http::Request req;
+  req.url = s.Url("/hello");
+  ASSERT_TRUE(e->Fetch(std::move(req), [&](http::Response r) {
+    res = std::move(r);
+    done = true;
+  }));
+  m.RunUntil(done);
+  EXPECT_TRUE(res.Ok()) << res.error;
+  EXPECT_EQ(res.status, 200);
+  EXPECT_EQ(res.body, "hello");
+  EXPECT_EQ(res.content_type, "text/plain");
+  EXPECT_EQ(e->GetInflight(), 0u);
+}
+
+TEST(Http, NotFound) {
+  HttpStandIn s;
+  TestManager m;
+  auto e = http::Engine::CreateNew(m);
+  bool done = false;
+  http::Response res;
+  http::Request req;
+  req.url = s.Url("/missing");
+  ASSERT_TRUE(e->Fetch(std::move(req), [&](http::Response r) {
+    res = std::move(r);
+    done = true;
+  }));
+  m.RunUntil(done);
+  EXPECT_TRUE(res.error.empty());
+  EXPECT_EQ(res.status, 404);
+  EXPECT_FALSE(res.Ok());
+}
+
+TEST(Http, SizeCap) {
+  HttpStandIn s;
+  TestManager m;
+  auto e = http::Engine::CreateNew(m);
+  bool done = false;
+  http::Response res;
+  http::Request req;
+  req.url = s.Url("/big");
+  req.max_size = 1024;
+  ASSERT_TRUE(e->Fetch(std::move(req), [&](http::Response r) {
+    res = std::move(r);
+    done = true;
+  }));
+  m.RunUntil(done);
+  EXPECT_FALSE(res.Ok());
+  EXPECT_FALSE(res.error.empty());
+  EXPECT_TRUE(res.body.empty());
+}
+
+TEST(Http, OwnerLimit) {
+  HttpStandIn s;
+  TestManager m;
+  std::string owner = "a";
+  auto e = http::Engine::CreateNew(m, 1, [&owner] { return owner; });
+  int completed = 0;
+  bool done = false;
+  auto cb = [&](http::Response r) {
+    EXPECT_EQ(r.body, "slow");
+    done = ++completed == 2;
+  };
+  http::Request req;
+  req.url = s.Url("/slow");
+  ASSERT_TRUE(e->Fetch(req, cb));
+  EXPECT_FALSE(e->Fetch(req, cb));
+  EXPECT_EQ(e->GetInflight("a"), 1u);
+  // Other owners are accounted separately
+  owner = "b";
+  ASSERT_TRUE(e->Fetch(req, cb));
+  m.RunUntil(done);
+  EXPECT_EQ(e->GetInflight("a"), 0u);
+  EXPECT_EQ(e->GetInflight(), 0u);
+}
+
+TEST(Http, ConnectionReuse) {
+  HttpStandIn s;
+  TestManager m;
+  auto e = http::Engine::CreateNew(m);
+  std::vector<std::string> bodies;
+  bool done = false;
+  Spawn(FetchTwice(*e, s, bodies, done));
+  m.RunUntil(done);
+  EXPECT_EQ(bodies, (std::vector<std::string>{"hello", "hello"}));
+  EXPECT_EQ(s.accepted.load(), 1);
+}
+
+TEST(Http, Timeout) {
+  HttpStandIn s;
+  TestManager m;
+  auto e = http::Engine::CreateNew(m);
+  bool done = false;
+  http::Response res;
+  http::Request req;
+  req.url = s.Url("/slow");
+  req.timeout = 20ms;
+  ASSERT_TRUE(e->Fetch(std::move(req), [&](http::Response r) {
+    res = std::move(r);
+    done = true;
+  }));
+  m.RunUntil(done);
+  EXPECT_FALSE(res.error.empty());
+}
+
+int main() {
+  curl_global_init(CURL_GLOBAL_DEFAULT);
+  testing::InitGoogleTest();
+  int r = RUN_ALL_TESTS();
+  curl_global_cleanup();
+  return r;
+}
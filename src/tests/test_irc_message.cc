@@ -1,8 +1,14 @@
+#include <fmt/format.h>
 #include <gtest/gtest.h>
 
 #include <IRC.hh>
+#include <algorithm>
+#include <chrono>
 #include <stdexcept>
+#include <string>
 #include <string_view>
+#include <utility>
+#include <variant>
 #include <vector>
 
 using namespace std::string_view_literals;
@@ -52,6 +58,30 @@ TEST(IRCMessage, BadMessage1) {
   ASSERT_NO_THROW(kbot::IRCMessage("@key=val;key= :source command pa ra me te rs"));
 }
 
+// Found by fuzzing: NUL is an ordinary byte of the line, it neither ends it nor a command
+TEST(IRCMessage, EmbeddedNul1) {
+  using namespace std::string_view_literals;
+  const kbot::IRCMessage m(":a!b@c \0PRIVMSG #kbot :hi"sv);
+  ASSERT_EQ(m.GetCommand(), "\0PRIVMSG"sv);
+  ASSERT_EQ(m.GetParameters().at(0), "#kbot"sv);
+  ASSERT_FALSE(kbot::Message::PeekPrivMsg(":a!b@c \0PRIVMSG #kbot :hi"sv));
+  ASSERT_THROW(kbot::IRCMessage(":a!b@c \0"sv), std::runtime_error);
+  auto v = kbot::GetIRCMessageVariantFrom(kbot::IRCMessage("PING\0 :irc.test"sv));
+  ASSERT_TRUE(std::holds_alternative<kbot::IRCMessage>(v));
+}
+
+// Found by fuzzing: messages of the server itself used to trip asserts
+TEST(IRCMessage, ServerSource1) {
+  auto generic = [](std::string_view line) {
+    auto v = kbot::GetIRCMessageVariantFrom(kbot::IRCMessage(line));
+    return std::holds_alternative<kbot::IRCMessage>(v);
+  };
+  ASSERT_TRUE(generic(":irc.test PRIVMSG #kbot :,hi"));
+  ASSERT_TRUE(generic("PRIVMSG #kbot :,hi"));
+  ASSERT_TRUE(generic(":irc.test NICK kbot"));
+  ASSERT_FALSE(generic(":a!b@c NICK d"));
+}
+
 TEST(IRCMessage, UserRecord1) {
   const kbot::IRCMessagePrivMsg m(kbot::IRCMessage(":dan!~d@localhost/foo command param"));
   auto u = m.GetUser();
@@ -71,6 +101,269 @@ TEST(IRCMessage, UserRecord1) {
             m2.GetUser().hostname);
 }
 
+TEST(IRCMessage, PeekPrivMsg1) {
+  auto v = kbot::Message::PeekPrivMsg("@a=b :dan!d@h PRIVMSG #chan   :,hi there");
+  ASSERT_TRUE(v.has_value());
+  ASSERT_EQ(v->target, "#chan");
+  ASSERT_EQ(v->word, ":,hi");
+  ASSERT_EQ(v->text, ",hi there");
+  ASSERT_EQ(v->nickname, "dan");
+  ASSERT_EQ(kbot::Message::PeekPrivMsg(":dan!d@h PRIVMSG kbot word")->word, "word");
+  ASSERT_EQ(kbot::Message::PeekPrivMsg("@a :dan!d@h PRIVMSG #chan :hi")->nickname, "dan");
+  // Left to the full parse
+  ASSERT_FALSE(kbot::Message::PeekPrivMsg(":server PRIVMSG #chan :hi"));
+  ASSERT_FALSE(kbot::Message::PeekPrivMsg("@ :dan!d@h PRIVMSG #chan :hi"));
+  ASSERT_FALSE(kbot::Message::PeekPrivMsg(":dan!d@h NOTICE #chan :hi"));
+  ASSERT_FALSE(kbot::Message::PeekPrivMsg(":dan!d@h PRIVMSG #chan"));
+  ASSERT_FALSE(kbot::Message::PeekPrivMsg(":dan!d@h PRIVMSG #chan  "));
+  ASSERT_FALSE(kbot::Message::PeekPrivMsg(":dan!d@h PRIVMSG  #chan :hi"));
+  ASSERT_FALSE(kbot::Message::PeekPrivMsg("PRIVMSG #chan :hi"));
+}
+
+// Whatever the raw check accepts, the full parse reads the same way
+TEST(IRCMessage, PeekPrivMsgAgreesWithParse1) {
+  const std::vector<std::string_view> lines = {
+      ":dan!d@h PRIVMSG #c :hello",
+      ":dan!d@h PRIVMSG #c :,seen kkd",
+      ":dan!d@h PRIVMSG #c    :a   b   ",
+      ":dan! PRIVMSG kbot x",
+      "@time=1;msgid=x :dan!d@h PRIVMSG #c :,hi",
+      "@t= :d!u@h PRIVMSG #c :x",
+      "@a;b=;c :d!u@h PRIVMSG #c :x",
+      ":d!u@h PRIVMSG #c ::",
+      ":d!u@h PRIVMSGX #c :x",
+      ":d!u@h PRIVMSG\x01 #c :x",
+  };
+  for (auto line : lines) {
+    auto v = kbot::Message::PeekPrivMsg(line);
+    if (!v) continue;
+    const kbot::IRCMessage m(line);
+    ASSERT_EQ(m.GetCommand(), "PRIVMSG") << line;
+    ASSERT_TRUE(kbot::Message::IsUserMessage(m.GetSource())) << line;
+    ASSERT_GE(m.GetParameters().size(), 2) << line;
+    ASSERT_EQ(m.GetParameters()[0], v->target) << line;
+    ASSERT_EQ(m.GetParameters()[1], v->word) << line;
+  }
+}
+
+TEST(IRCMessage, ValuelessTags1) {
+  const kbot::IRCMessage m("@draft/bot;a=1;+example.com/x :dan!d@h PRIVMSG #c :hi");
+  auto &tag_kv = m.GetTagKV();
+  ASSERT_EQ(tag_kv.size(), 3);
+  ASSERT_EQ(tag_kv[0].first, "draft/bot");
+  ASSERT_EQ(tag_kv[0].second, "");
+  ASSERT_EQ(tag_kv[2].first, "+example.com/x");
+  std::string buf;
+  ASSERT_EQ(m.GetTag("draft/bot", buf), "");
+  ASSERT_EQ(m.GetTag("a", buf), "1");
+  ASSERT_FALSE(m.GetTag("b", buf));
+  ASSERT_THROW(kbot::IRCMessage("@ :dan!d@h PRIVMSG #c :hi"), std::runtime_error);
+}
+
+TEST(IRCMessage, TagUnescape1) {
+  const kbot::IRCMessage m(R"(@k=a\:b\sc\\d\r\n;x=y\;z=end\;k=last :s CMD p)");
+  std::string buf;
+  // Unknown escapes stand for the character itself, a trailing backslash is dropped
+  ASSERT_EQ(m.GetTag("x", buf), "y");
+  ASSERT_EQ(m.GetTag("z", buf), "end");
+  // The last one wins
+  ASSERT_EQ(m.GetTag("k", buf), "last");
+  ASSERT_EQ(m.GetTagKV()[0].second, R"(a\:b\sc\\d\r\n)");
+  std::string out;
+  ASSERT_EQ(kbot::Message::UnescapeTagValue(R"(a\:b\sc\\d\r\n)", out), "a;b c\\d\r\n");
+  ASSERT_EQ(kbot::Message::UnescapeTagValue(R"(\b\)", out), "b");
+  ASSERT_EQ(kbot::Message::UnescapeTagValue("plain", out), "plain");
+}
+
+TEST(IRCMessage, ServerTime1) {
+  using namespace std::chrono;
+  auto t = kbot::IRCMessage("@time=2011-10-19T16:40:51.620Z :s CMD p").GetServerTime();
+  ASSERT_TRUE(t.has_value());
+  ASSERT_EQ(duration_cast<milliseconds>(t->time_since_epoch()).count(), 1319042451620);
+  t = kbot::IRCMessage("@time=2011-10-19T16:40:51Z :s CMD p").GetServerTime();
+  ASSERT_EQ(duration_cast<milliseconds>(t->time_since_epoch()).count(), 1319042451000);
+  t = kbot::IRCMessage("@time=2011-10-19T16:40:51.6123456789Z :s CMD p").GetServerTime();
+  ASSERT_EQ(duration_cast<milliseconds>(t->time_since_epoch()).count(), 1319042451612);
+  ASSERT_FALSE(kbot::IRCMessage(":s CMD p").GetServerTime());
+  ASSERT_FALSE(kbot::IRCMessage("@time=2011-10-19 16:40:51Z :s CMD p").GetServerTime());
+  ASSERT_FALSE(kbot::IRCMessage("@time=2011-02-30T16:40:51Z :s CMD p").GetServerTime());
+  ASSERT_FALSE(kbot::IRCMessage("@time=2011-10-19T16:40:51.Z :s CMD p").GetServerTime());
+  ASSERT_FALSE(kbot::IRCMessage("@time=2011-10-19T16:40:51.6x0Z :s CMD p").GetServerTime());
+  // Found by fuzzing: out of the range of system_clock
+  ASSERT_FALSE(kbot::IRCMessage("@time=9999-10-19T16:40:51Z :s CMD p").GetServerTime());
+  ASSERT_FALSE(kbot::IRCMessage("@time=0000-10-19T16:40:51Z :s CMD p").GetServerTime());
+}
+
+TEST(IRCMessage, PeekTagCommand1) {
+  constexpr std::string_view line = "@batch=ab;time=x :srv!u@h QUIT :Ping timeout";
+  ASSERT_EQ(kbot::Message::PeekTag(line, "batch"), "ab");
+  ASSERT_EQ(kbot::Message::PeekTag(line, "time"), "x");
+  ASSERT_FALSE(kbot::Message::PeekTag(line, "bat"));
+  ASSERT_FALSE(kbot::Message::PeekTag(":srv QUIT :x", "batch"));
+  ASSERT_EQ(kbot::Message::PeekCommand(line), "QUIT");
+  ASSERT_EQ(kbot::Message::PeekCommand(":srv BATCH +ab netsplit"), "BATCH");
+  ASSERT_EQ(kbot::Message::PeekCommand("PING :x"), "PING");
+  ASSERT_EQ(kbot::Message::PeekCommand(":srv"), "");
+}
+
+TEST(IRCMessage, Cap1) {
+  auto v = kbot::GetIRCMessageVariantFrom(
+      kbot::IRCMessage(":srv CAP * LS * :multi-prefix sasl=PLAIN,EXTERNAL"));
+  auto *cap = std::get_if<kbot::IRCMessageCap>(&v);
+  ASSERT_NE(cap, nullptr);
+  ASSERT_EQ(cap->GetSubcommand(), "LS");
+  ASSERT_TRUE(cap->IsContinued());
+  ASSERT_EQ(cap->GetCapabilities(),
+            (std::vector<std::string_view>{"multi-prefix", "sasl=PLAIN,EXTERNAL"}));
+  const kbot::IRCMessageCap ack(kbot::IRCMessage(":srv CAP kbot ACK :batch -echo-message"));
+  ASSERT_FALSE(ack.IsContinued());
+  ASSERT_EQ(ack.GetCapabilities(), (std::vector<std::string_view>{"batch", "-echo-message"}));
+  const kbot::IRCMessageCap last(kbot::IRCMessage(":srv CAP * LS :server-time"));
+  ASSERT_FALSE(last.IsContinued());
+  ASSERT_EQ(last.GetCapabilities(), (std::vector<std::string_view>{"server-time"}));
+}
+
+TEST(IRCMessage, Batch1) {
+  const kbot::IRCMessageBatch start(
+      kbot::IRCMessage(":srv BATCH +yXNAbvnRHTRBv netsplit a.net b.net"));
+  ASSERT_TRUE(start.IsStart());
+  ASSERT_EQ(start.GetReference(), "yXNAbvnRHTRBv");
+  ASSERT_EQ(start.GetType(), "netsplit");
+  const kbot::IRCMessageBatch end(kbot::IRCMessage(":srv BATCH -yXNAbvnRHTRBv"));
+  ASSERT_FALSE(end.IsStart());
+  ASSERT_EQ(end.GetReference(), "yXNAbvnRHTRBv");
+  ASSERT_EQ(end.GetType(), "");
+}
+
+TEST(IRCMessage, AccountTag1) {
+  const kbot::IRCMessagePrivMsg m(kbot::IRCMessage("@account=dan :dan!d@h PRIVMSG #c :hi"));
+  ASSERT_EQ(m.GetAccountTag(), "dan");
+  // Only the server knows whether to trust it
+  ASSERT_EQ(m.GetUser().account, "");
+  const kbot::IRCMessagePrivMsg m1(kbot::IRCMessage(":dan!d@h PRIVMSG #c :hi"));
+  ASSERT_EQ(m1.GetAccountTag(), "");
+}
+
+TEST(IRCMessage, PackJoins1) {
+  using Joins = std::vector<std::pair<std::string, std::string>>;
+  using Lines = std::vector<std::string>;
+  ASSERT_EQ(kbot::Message::PackJoins(Joins{}, 512, 0), Lines{});
+  ASSERT_EQ(kbot::Message::PackJoins(Joins{{"#a", ""}, {"#b", "k"}, {"#c", ""}}, 512, 0),
+            Lines{"#b,#a,#c k"});
+  // Targets per line
+  Joins joins = {{"#a", ""}, {"#b", ""}, {"#c", ""}, {"#d", "x"}, {"#e", "y"}};
+  ASSERT_EQ(kbot::Message::PackJoins(joins, 512, 2), (Lines{"#d,#e x,y", "#a,#b", "#c"}));
+  // "JOIN #d,#e x,y\r\n" is 16 bytes, and keys stay with their channels across lines
+  ASSERT_EQ(kbot::Message::PackJoins(joins, 16, 0), (Lines{"#d,#e x,y", "#a,#b,#c"}));
+  ASSERT_EQ(kbot::Message::PackJoins(joins, 15, 0), (Lines{"#d x", "#e,#a y", "#b,#c"}));
+  // Too long for any line, sent alone
+  ASSERT_EQ(kbot::Message::PackJoins(Joins{{"#a", ""}, {"#long", ""}}, 10, 0),
+            (Lines{"#a", "#long"}));
+}
+
+// Hundreds of channels take a handful of lines, none over the limit
+TEST(IRCMessage, PackJoins2) {
+  std::vector<std::pair<std::string, std::string>> joins;
+  for (int i = 0; i < 500; i++) {
+    joins.emplace_back(fmt::format("#channel-{}", i), i % 7 ? "" : fmt::format("key{}", i));
+  }
+  auto lines = kbot::Message::PackJoins(joins, 512, 0);
+  ASSERT_LE(lines.size(), 15);
+  size_t count = 0;
+  for (auto &l : lines) {
+    ASSERT_LE(l.size() + sizeof("JOIN \r\n") - 1, 512);
+    auto chans = std::string_view(l).substr(0, l.find(' '));
+    count += std::count(chans.begin(), chans.end(), ',') + 1;
+  }
+  ASSERT_EQ(count, 500);
+  ASSERT_EQ(lines[0].substr(0, lines[0].find(',')), "#channel-0");
+  ASSERT_NE(lines[0].find(" key0,key7,"), std::string::npos);
+}
+
+TEST(IRCMessage, SplitUtf81) {
+  using Pieces = std::vector<std::string_view>;
+  ASSERT_EQ(kbot::Message::SplitUtf8("", 10), Pieces{""});
+  ASSERT_EQ(kbot::Message::SplitUtf8("short", 10), Pieces{"short"});
+  ASSERT_EQ(kbot::Message::SplitUtf8("abcdefghij", 4), (Pieces{"abcd", "efgh", "ij"}));
+  // After a space near the end
+  ASSERT_EQ(kbot::Message::SplitUtf8("the quick brown fox", 12),
+            (Pieces{"the quick ", "brown fox"}));
+  ASSERT_EQ(kbot::Message::SplitUtf8("hello world", 8), (Pieces{"hello wo", "rld"}));
+  // Never inside a sequence: "a" then three two-byte and one four-byte character
+  ASSERT_EQ(kbot::Message::SplitUtf8("a\xc3\xa4\xc3\xb6\xc3\xbc\xf0\x9f\x98\x80", 4),
+            (Pieces{"a\xc3\xa4", "\xc3\xb6\xc3\xbc", "\xf0\x9f\x98\x80"}));
+  // Not UTF-8, cut where it must be
+  ASSERT_EQ(kbot::Message::SplitUtf8("\x80\x80\x80\x80\x80\x80", 4),
+            (Pieces{"\x80\x80\x80\x80", "\x80\x80"}));
+}
+
+TEST(IRCMessage, SplitUtf82) {
+  std::string text;
+  for (int i = 0; i < 700; i++) text += i % 5 ? "\xc3\xa4" : " ";
+  auto pieces = kbot::Message::SplitUtf8(text, 101);
+  std::string joined;
+  for (auto p : pieces) {
+    ASSERT_LE(p.size(), 101);
+    // Starts on a character
+    ASSERT_NE(static_cast<unsigned char>(p[0]) & 0xc0, 0x80);
+    joined += p;
+  }
+  ASSERT_EQ(joined, text);
+}
+
+TEST(IRCMessage, PackPrivMsgs1) {
+  using Targets = std::vector<std::string_view>;
+  using Lines = std::vector<std::string>;
+  ASSERT_EQ(kbot::Message::PackPrivMsgs(Targets{}, "hi", 512, 0), Lines{});
+  ASSERT_EQ(kbot::Message::PackPrivMsgs(Targets{"#a", "#b", "nick"}, "hi", 512, 0),
+            Lines{"#a,#b,nick :hi"});
+  ASSERT_EQ(kbot::Message::PackPrivMsgs(Targets{"#a", "#b", "#c"}, "hi", 512, 2),
+            (Lines{"#a,#b :hi", "#c :hi"}));
+  // "PRIVMSG #a,#b :hi\r\n" is 19 bytes
+  ASSERT_EQ(kbot::Message::PackPrivMsgs(Targets{"#a", "#b", "#c"}, "hi", 19, 0),
+            (Lines{"#a,#b :hi", "#c :hi"}));
+  // Too long to go along with a target, split so that the targets still share lines
+  ASSERT_EQ(kbot::Message::PackPrivMsgs(Targets{"#a", "#b"}, "0123456789", 22, 0),
+            (Lines{"#a,#b :0123", "#a,#b :4567", "#a,#b :89"}));
+  // Each group gets all pieces in order
+  ASSERT_EQ(kbot::Message::PackPrivMsgs(Targets{"#a", "#b"}, "0123456789", 22, 1),
+            (Lines{"#a :01234", "#a :56789", "#b :01234", "#b :56789"}));
+  // Empty names are dropped, with none left there is nothing to send however long the text
+  std::string text(1000, 'x');
+  ASSERT_EQ(kbot::Message::PackPrivMsgs(Targets{""}, text, 512, 0), Lines{});
+  ASSERT_EQ(kbot::Message::PackPrivMsgs(Targets{}, text, 512, 0), Lines{});
+  ASSERT_EQ(kbot::Message::PackPrivMsgs(Targets{"", "#a", ""}, "hi", 512, 0), Lines{"#a :hi"});
+  // Splitting never settles on pieces that leave no room for the targets
+  for (auto &l : kbot::Message::PackPrivMsgs(Targets{"#a"}, text, 512, 0)) {
+    ASSERT_LE(l.size() + sizeof("PRIVMSG \r\n") - 1, 512);
+  }
+}
+
+// Fanning out to hundreds of channels takes a handful of lines, none over the limit
+TEST(IRCMessage, PackPrivMsgs2) {
+  std::vector<std::string> channels;
+  for (int i = 0; i < 200; i++) channels.push_back(fmt::format("#channel-{}", i));
+  std::vector<std::string_view> targets(channels.begin(), channels.end());
+  std::string text = "New release out now, see https://example.org/releases/latest";
+  auto lines = kbot::Message::PackPrivMsgs(targets, text, 400, 0);
+  ASSERT_LE(lines.size(), 10);
+  size_t count = 0;
+  for (auto &l : lines) {
+    ASSERT_LE(l.size() + sizeof("PRIVMSG \r\n") - 1, 400);
+    ASSERT_TRUE(l.ends_with(" :" + text));
+    auto list = std::string_view(l).substr(0, l.find(' '));
+    count += std::count(list.begin(), list.end(), ',') + 1;
+  }
+  ASSERT_EQ(count, 200);
+  ASSERT_EQ(kbot::Message::PackPrivMsgs(targets, text, 400, 4).size(), 50);
+
+  // Long text is split for all of them
+  std::string long_text(1000, 'x');
+  lines = kbot::Message::PackPrivMsgs(targets, long_text, 400, 0);
+  for (auto &l : lines) ASSERT_LE(l.size() + sizeof("PRIVMSG \r\n") - 1, 400);
+  ASSERT_LE(lines.size(), 3 * 25);
+}
+
 int main() {
   testing::InitGoogleTest();
   return RUN_ALL_TESTS();
@@ -0,0 +1,133 @@
+#include <gtest/gtest.h>
+
+#include <ISupport.hh>
+#include <string>
+#include <string_view>
+#include <vector>
+
+using namespace kbot;
+
+TEST(CaseFold, Tables) {
+  EXPECT_EQ(casefold::Fold(CaseMapping::kAscii, "#Foo[]\\~"), "#foo[]\\~");
+  EXPECT_EQ(casefold::Fold(CaseMapping::kRfc1459, "#Foo[]\\~"), "#foo{}|~");
+  // ^ is the upper case of ~, like the rest each entry folds to lower case
+  EXPECT_EQ(casefold::Fold(CaseMapping::kRfc1459, "A^"), "a~");
+  EXPECT_EQ(casefold::Fold(CaseMapping::kStrictRfc1459, "A^"), "a^");
+  EXPECT_EQ(casefold::Fold(CaseMapping::kStrictRfc1459, "#Foo[]\\~"), "#foo{}|~");
+  // Bytes above ASCII are left alone
+  EXPECT_EQ(casefold::Fold(CaseMapping::kRfc1459, "\xc3\x84"), "\xc3\x84");
+  for (int c = 0; c < 256; c++) {
+    // Folding twice changes nothing
+    auto once = casefold::kRfc1459[c];
+    EXPECT_EQ(casefold::kRfc1459[once], once);
+  }
+  EXPECT_EQ(casefold::ParseMapping("strict-rfc1459"), CaseMapping::kStrictRfc1459);
+  EXPECT_EQ(casefold::ParseMapping("rfc7613"), std::nullopt);
+}
+
+TEST(CaseFold, HashEq) {
+  CaseFoldHash hash;
+  CaseFoldEq eq;
+  EXPECT_TRUE(eq("Nick[away]", "nick{AWAY}"));
+  EXPECT_EQ(hash("Nick[away]"), hash("nick{AWAY}"));
+  EXPECT_TRUE(eq("a~", "A^"));
+  EXPECT_FALSE(eq("nick", "nick_"));
+  EXPECT_FALSE(eq("nick", "nicc"));
+
+  CaseFoldHash ascii_hash(CaseMapping::kAscii);
+  CaseFoldEq ascii_eq(CaseMapping::kAscii);
+  EXPECT_FALSE(ascii_eq("a[", "a{"));
+  EXPECT_TRUE(ascii_eq("ABC", "abc"));
+  EXPECT_EQ(ascii_hash("ABC"), ascii_hash("abc"));
+  EXPECT_FALSE(CaseFoldEq(CaseMapping::kStrictRfc1459)("a~", "a^"));
+}
+
+TEST(CaseFold, Map) {
+  auto map = MakeCaseFoldMap<int>(CaseMapping::kAscii);
+  map.emplace("#Chan[1]", 1);
+  map.emplace("#chan{1}", 2);
+  EXPECT_EQ(map.size(), 2u);
+  std::string_view lookup = "#CHAN[1]";
+  ASSERT_TRUE(map.contains(lookup));
+  EXPECT_EQ(map.find(lookup)->second, 1);
+  // Both are the same channel to rfc1459, the first one stays
+  RebuildCaseFoldMap(map, CaseMapping::kRfc1459);
+  EXPECT_EQ(map.size(), 1u);
+  EXPECT_EQ(map.find("#CHAN{1}")->first, "#Chan[1]");
+}
+
+TEST(ISupport, Defaults) {
+  ISupport is;
+  EXPECT_EQ(is.GetCaseMapping(), CaseMapping::kRfc1459);
+  EXPECT_EQ(is.GetChanTypes(), "#&");
+  EXPECT_EQ(is.GetPrefixModes(), "ov");
+  EXPECT_EQ(is.GetPrefixSymbols(), "@+");
+  EXPECT_EQ(is.GetLineLength(), 512u);
+  EXPECT_EQ(is.GetTargetLimit("JOIN"), 0u);
+  EXPECT_EQ(is.GetTargetLimit("PRIVMSG", 1), 1u);
+  EXPECT_TRUE(is.IsChannel("&local"));
+  EXPECT_FALSE(is.IsChannel("nick"));
+  EXPECT_FALSE(is.IsChannel(""));
+}
+
+TEST(ISupport, Apply) {
+  ISupport is;
+  std::vector<std::string_view> tokens = {"CASEMAPPING=ascii",
+                                          "CHANTYPES=#",
+                                          "PREFIX=(qaohv)~&@%+",
+                                          "LINELEN=2048",
+                                          "MAXTARGETS=3",
+                                          "TARGMAX=JOIN:,KICK:1,PRIVMSG:4,WHOIS:",
+                                          "NETWORK=Example\\x20Net",
+                                          "EXCEPTS"};
+  EXPECT_TRUE(is.Apply(tokens));
+  EXPECT_EQ(is.GetCaseMapping(), CaseMapping::kAscii);
+  EXPECT_TRUE(is.IsChannel("#c"));
+  EXPECT_FALSE(is.IsChannel("&c"));
+  EXPECT_EQ(is.GetPrefixModes(), "qaohv");
+  EXPECT_EQ(is.GetPrefixSymbols(), "~&@%+");
+  EXPECT_EQ(is.GetLineLength(), 2048u);
+  EXPECT_EQ(is.GetTargetLimit("JOIN", 7), 0u);
+  EXPECT_EQ(is.GetTargetLimit("KICK"), 1u);
+  EXPECT_EQ(is.GetTargetLimit("PRIVMSG"), 4u);
+  // MAXTARGETS where TARGMAX doesn't say
+  EXPECT_EQ(is.GetTargetLimit("NOTICE"), 3u);
+  EXPECT_EQ(is.GetTargetLimit("PART", 7), 7u);
+  EXPECT_EQ(is.GetToken("NETWORK"), "Example Net");
+  EXPECT_EQ(is.GetToken("EXCEPTS"), "");
+  EXPECT_EQ(is.GetToken("INVEX"), std::nullopt);
+
+  // Unchanged casemapping, then removed tokens go back to their defaults
+  std::vector<std::string_view> more = {"CASEMAPPING=ascii", "-LINELEN", "-PREFIX", "-TARGMAX"};
+  EXPECT_FALSE(is.Apply(more));
+  EXPECT_EQ(is.GetLineLength(), 512u);
+  EXPECT_EQ(is.GetPrefixModes(), "ov");
+  EXPECT_EQ(is.GetTargetLimit("PRIVMSG"), 3u);
+  EXPECT_EQ(is.GetToken("LINELEN"), std::nullopt);
+  std::vector<std::string_view> removed = {"-CASEMAPPING"};
+  EXPECT_TRUE(is.Apply(removed));
+  EXPECT_EQ(is.GetCaseMapping(), CaseMapping::kRfc1459);
+}
+
+TEST(ISupport, Malformed) {
+  ISupport is;
+  std::vector<std::string_view> tokens = {"CASEMAPPING=rfc7613", "PREFIX=(ov)@", "LINELEN=100",
+                                          "TARGMAX=JOIN,PRIVMSG:x", "="};
+  is.Apply(tokens);
+  // Unknown mappings fold ASCII at least
+  EXPECT_EQ(is.GetCaseMapping(), CaseMapping::kAscii);
+  EXPECT_EQ(is.GetPrefixModes(), "ov");
+  EXPECT_EQ(is.GetPrefixSymbols(), "@+");
+  EXPECT_EQ(is.GetLineLength(), 512u);
+  EXPECT_EQ(is.GetTargetLimit("JOIN", 5), 5u);
+  EXPECT_EQ(is.GetTargetLimit("PRIVMSG", 5), 0u);
+  std::vector<std::string_view> empty_prefix = {"PREFIX="};
+  is.Apply(empty_prefix);
+  EXPECT_EQ(is.GetPrefixModes(), "");
+  EXPECT_EQ(UnescapeISupportValue("a\\x3Db\\x5c\\xzz\\x2"), "a=b\\\\xzz\\x2");
+}
+
+int main() {
+  testing::InitGoogleTest();
+  return RUN_ALL_TESTS();
+}
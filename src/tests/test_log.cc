@@ -0,0 +1,68 @@
+#include <gtest/gtest.h>
+#include <unistd.h>
+
+// Compile Info and Debug out of this translation unit only
+#define KBOT_LOG_LEVEL Warning
+#include <Log.hh>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+std::string TempPath() { return "/tmp/kbot_test_log." + std::to_string(getpid()); }
+
+std::vector<std::string> ReadLines(const std::string &path) {
+  std::ifstream f(path);
+  std::vector<std::string> v;
+  for (std::string l; std::getline(f, l);) v.push_back(l);
+  return v;
+}
+
+}  // namespace
+
+TEST(Log, CompiledOut) {
+  int evaluated = 0;
+  KLOG(Debug, "{}", ++evaluated);
+  KLOG(Info, "{}", ++evaluated);
+  ASSERT_EQ(evaluated, 0);
+}
+
+TEST(Log, BatchedFromThreads) {
+  auto path = TempPath();
+  unlink(path.c_str());
+  ASSERT_TRUE(kbot::log::Start(path));
+  std::vector<std::jthread> v;
+  for (int t = 0; t < 4; t++) {
+    v.emplace_back([t] {
+      for (int i = 0; i < 200; i++) KLOG(Warning, "thread {} line {}", t, i);
+    });
+  }
+  v.clear();
+  kbot::log::Stop();
+  auto lines = ReadLines(path);
+  unlink(path.c_str());
+  ASSERT_EQ(lines.size(), 800);
+  ASSERT_EQ(lines[0][0], 'W');
+  ASSERT_NE(lines[0].find("test_log.cc:"), std::string::npos);
+  ASSERT_NE(lines[0].find("] thread "), std::string::npos);
+}
+
+TEST(Log, Truncation) {
+  auto path = TempPath();
+  unlink(path.c_str());
+  ASSERT_TRUE(kbot::log::Start(path));
+  KLOG(Error, "{}", std::string(4096, 'x'));
+  kbot::log::Stop();
+  auto lines = ReadLines(path);
+  unlink(path.c_str());
+  ASSERT_EQ(lines.size(), 1);
+  ASSERT_LT(lines[0].size(), 300);
+  ASSERT_EQ(lines[0].back(), 'x');
+}
+
+int main() {
+  testing::InitGoogleTest();
+  return RUN_ALL_TESTS();
+}
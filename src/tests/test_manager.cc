@@ -0,0 +1,480 @@
+#include <gtest/gtest.h>
+
+#include <FakeIRCd.hh>
+#include <Manager.hh>
+#include <PluginABI.hh>
+#include <PluginRegistry.hh>
+#include <Sasl.hh>
+#include <Server.hh>
+#include <Trace.hh>
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <optional>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace kbot;
+using fake::FakeIRCd;
+using namespace std::chrono_literals;
+
+namespace {
+
+// Runs a bot on its own thread like main does, connected to the fake server
+std::jthread StartBot(const FakeIRCd &ircd, std::string nickname, std::vector<std::string> channels,
+                      std::optional<SaslCredentials> sasl = std::nullopt) {
+  auto server = ConnectionNew("127.0.0.1", ircd.GetPort(), nickname.c_str());
+  if (!server) return {};
+  return std::jthread(
+      [nickname, channels, sasl](Server &&server) {
+        auto m = Manager::CreateNew(std::move(server));
+        if (sasl) m.server.sasl.emplace(*sasl);
+        if (m.server.Login(nickname) < 0) return;
+        for (auto &c : channels) m.server.JoinChannel(c, "");
+        WorkerRun(std::move(m));
+      },
+      std::move(*server));
+}
+
+// Any QUIT ends the event loop. A bot waiting to reconnect is let in first.
+void StopBot(FakeIRCd &ircd, std::jthread &bot) {
+  if (!bot.joinable()) return;
+  if (!ircd.Connected()) ircd.Accept();
+  ircd.SendLine(":op!u@h QUIT :bye");
+  bot.join();
+}
+
+class BotTest : public ::testing::Test {
+ protected:
+  FakeIRCd ircd;
+  std::jthread bot;
+  std::string nickname;
+
+  // Registers a bot in #a and #b
+  void Start(std::optional<SaslCredentials> sasl = std::nullopt) {
+    ASSERT_NE(ircd.GetPort(), 0);
+    bot = StartBot(ircd, "kbot", {"#a", "#b"}, std::move(sasl));
+    ASSERT_TRUE(bot.joinable());
+    ASSERT_TRUE(ircd.Accept());
+    auto n = ircd.Register();
+    ASSERT_EQ(n, "kbot");
+    nickname = *n;
+    auto join = ircd.Expect("JOIN ");
+    ASSERT_EQ(join, "JOIN #a,#b");
+    ircd.ConfirmJoin(nickname, *join);
+  }
+
+  void TearDown() override { StopBot(ircd, bot); }
+};
+
+TEST_F(BotTest, Registration) {
+  Start();
+  ircd.SendLine(":joe!u@h PRIVMSG #a :,hi");
+  EXPECT_EQ(ircd.Expect("PRIVMSG "), "PRIVMSG #a :joe: Hello!");
+  // Private messages are answered privately
+  ircd.SendLine(":joe!u@h PRIVMSG KBOT :,hi");
+  EXPECT_EQ(ircd.Expect("PRIVMSG "), "PRIVMSG joe :joe: Hello!");
+}
+
+TEST_F(BotTest, Ping) {
+  Start();
+  ircd.SendLine("PING :irc.test-1234");
+  auto pong = ircd.Expect("PONG ");
+  ASSERT_TRUE(pong);
+  EXPECT_NE(pong->find("irc.test-1234"), std::string::npos) << *pong;
+}
+
+TEST_F(BotTest, PartialWrites) {
+  Start();
+  std::string lines =
+      ":joe!u@h PRIVMSG #a :,hi\r\n"
+      "PING :split\r\n"
+      ":ann!u@h PRIVMSG #b :,hi\r\n";
+  // Byte by byte, then in pieces that cut lines and CRLFs anywhere
+  for (size_t chunk : {1, 3, 7, 25}) {
+    ASSERT_TRUE(ircd.SendSplit(lines, chunk));
+    EXPECT_EQ(ircd.Expect("PRIVMSG "), "PRIVMSG #a :joe: Hello!") << chunk;
+    auto pong = ircd.Expect("PONG ");
+    ASSERT_TRUE(pong) << chunk;
+    EXPECT_NE(pong->find("split"), std::string::npos) << *pong;
+    EXPECT_EQ(ircd.Expect("PRIVMSG "), "PRIVMSG #b :ann: Hello!") << chunk;
+  }
+  // Many lines in one write
+  std::string burst;
+  for (int i = 0; i < 100; i++) burst += fmt::format(":u{}!u@h PRIVMSG #a :,hi\r\n", i);
+  ASSERT_TRUE(ircd.Send(burst));
+  for (int i = 0; i < 100; i++) {
+    EXPECT_EQ(ircd.Expect("PRIVMSG "), fmt::format("PRIVMSG #a :u{}: Hello!", i));
+  }
+}
+
+TEST_F(BotTest, Reconnect) {
+  Start();
+  // Half a line, then the connection goes away, the rest must not be taken for a new line
+  ircd.Send(":joe!u@h PRIVMSG #a :,h");
+  ircd.Disconnect();
+  ASSERT_TRUE(ircd.Accept());
+  ASSERT_EQ(ircd.Register(), nickname);
+  // Channels we were in are joined again
+  auto join = ircd.Expect("JOIN ");
+  ASSERT_EQ(join, "JOIN #a,#b");
+  ircd.ConfirmJoin(nickname, *join);
+  ircd.SendLine("i\r\n:joe!u@h PRIVMSG #b :,hi");
+  EXPECT_EQ(ircd.Expect("PRIVMSG "), "PRIVMSG #b :joe: Hello!");
+}
+
+// A command waiting for a reply when the bot quits doesn't outlive it
+TEST_F(BotTest, QuitWhileWaiting) {
+  Start();
+  ircd.SendLine(":joe!u@h PRIVMSG #a :,whois nobody");
+  EXPECT_EQ(ircd.Expect("WHOIS "), "WHOIS nobody");
+}
+
+// The credentials are kept for the next connection
+TEST_F(BotTest, ReconnectWithSasl) {
+  // Longer than any string stored inline
+  Start(SaslCredentials{.account = "kbot-account-name", .password = "a-rather-long-password"});
+  for (int i = 0; i < 2; i++) {
+    ircd.Disconnect();
+    ASSERT_TRUE(ircd.Accept());
+    ASSERT_EQ(ircd.Register(), nickname);
+    // No sasl capability offered, so NickServ it is
+    auto identify = ircd.Expect("PRIVMSG NickServ ");
+    ASSERT_TRUE(identify);
+    EXPECT_NE(identify->find("kbot-account-name a-rather-long-password"), std::string::npos)
+        << *identify;
+    auto join = ircd.Expect("JOIN ");
+    ASSERT_EQ(join, "JOIN #a,#b");
+    ircd.ConfirmJoin(nickname, *join);
+  }
+  ircd.SendLine(":joe!u@h PRIVMSG #b :,hi");
+  EXPECT_EQ(ircd.Expect("PRIVMSG #b "), "PRIVMSG #b :joe: Hello!");
+}
+
+// Many bots, each with its own server, all busy at once
+TEST(Stress, ManyServers) {
+  constexpr int kServers = 8;
+  constexpr int kCommands = 500;
+  std::vector<std::unique_ptr<FakeIRCd>> ircds;
+  std::vector<std::jthread> bots;
+  for (int i = 0; i < kServers; i++) {
+    ircds.push_back(std::make_unique<FakeIRCd>());
+    bots.push_back(StartBot(*ircds.back(), fmt::format("kbot{}", i), {"#a", "#b"}));
+    ASSERT_TRUE(bots.back().joinable());
+  }
+  std::atomic<int> replies = 0;
+  std::vector<std::jthread> drivers;
+  for (int i = 0; i < kServers; i++) {
+    drivers.emplace_back([&ircd = *ircds[i], &replies] {
+      if (!ircd.Accept()) return;
+      auto nickname = ircd.Register();
+      if (!nickname) return;
+      auto join = ircd.Expect("JOIN ");
+      if (!join) return;
+      ircd.ConfirmJoin(*nickname, *join);
+      // In bursts of 50 lines, with PINGs among them
+      for (int sent = 0; sent < kCommands;) {
+        std::string burst;
+        for (int j = 0; j < 50; j++, sent++) {
+          burst += fmt::format(":u{}!u@h PRIVMSG {} :,hi\r\n", sent, sent % 2 ? "#a" : "#b");
+        }
+        burst += "PING :stress\r\n";
+        ircd.SendSplit(burst, 1000, std::chrono::microseconds(0));
+      }
+      for (int j = 0; j < kCommands; j++) {
+        if (!ircd.Expect("PRIVMSG ")) return;
+        replies.fetch_add(1, std::memory_order_relaxed);
+      }
+    });
+  }
+  drivers.clear();
+  EXPECT_EQ(replies.load(), kServers * kCommands);
+  for (int i = 0; i < kServers; i++) StopBot(*ircds[i], bots[i]);
+}
+
+// A Manager without a connection, its replies go nowhere
+Manager OfflineManager() {
+  auto m = Manager::CreateNew(Server(-1, "offline", 0, "kbot"));
+  m.server.send_sink = [](std::string_view msg) { return static_cast<ssize_t>(msg.size()); };
+  m.server.SetState(ServerState::kLoggedIn);
+  return m;
+}
+
+std::atomic<int> notices_a = 0, notices_b = 0, commands_b = 0;
+
+// What a plugin's descriptor points to, on the heap so that using it after the plugin went away
+// is caught like a read of its unmapped .rodata would be
+struct FakePlugin {
+  std::string event = "NOTICE";
+  std::string command;
+  std::vector<plugin::EventEntry> events;
+  std::vector<plugin::CommandEntry> commands;
+  plugin::Descriptor desc;
+  CommandPlugin owner;
+
+  FakePlugin(std::string name, plugin::event_callback_t on_notice,
+             plugin::command_callback_t on_command)
+      : command(":," + name) {
+    if (on_notice) events.push_back({event, on_notice});
+    if (on_command) commands.push_back({command, on_command, ""});
+    desc = {plugin::kAbiVersion, "", commands, events, {}, {}};
+  }
+};
+
+// Unloading the plugin that first subscribed leaves the others working
+TEST(Plugins, UnloadFirstSubscriber) {
+  auto m = OfflineManager();
+  auto a = std::make_unique<FakePlugin>(
+      "a", [](Manager &, const IRCMessage &) { notices_a++; }, nullptr);
+  auto b = std::make_unique<FakePlugin>(
+      "b", [](Manager &, const IRCMessage &) { notices_b++; },
+      [](Manager &, const IRCMessagePrivMsg &) { commands_b++; });
+  m.server.AddPlugin(a->desc, &a->owner);
+  m.server.AddPlugin(b->desc, &b->owner);
+  ASSERT_TRUE(ProcessMessageLine(m, ":irc.test NOTICE kbot :one"));
+  EXPECT_EQ(notices_a, 1);
+  EXPECT_EQ(notices_b, 1);
+  m.server.RemovePlugin(a->desc, &a->owner);
+  a.reset();
+  // Enough commands to make the map grow again
+  std::vector<std::unique_ptr<FakePlugin>> more;
+  for (int i = 0; i < 64; i++) {
+    more.push_back(std::make_unique<FakePlugin>(
+        fmt::format("c{}", i), nullptr, [](Manager &, const IRCMessagePrivMsg &) {}));
+    m.server.AddPlugin(more.back()->desc, &more.back()->owner);
+  }
+  ASSERT_TRUE(ProcessMessageLine(m, ":irc.test NOTICE kbot :two"));
+  EXPECT_EQ(notices_a, 1);
+  EXPECT_EQ(notices_b, 2);
+  ASSERT_TRUE(ProcessMessageLine(m, ":joe!u@h PRIVMSG #a :,b"));
+  EXPECT_EQ(commands_b, 1);
+  for (auto &p : more) m.server.RemovePlugin(p->desc, &p->owner);
+  m.server.RemovePlugin(b->desc, &b->owner);
+}
+
+// A plugin whose command another one already registered isn't added at all
+TEST(Plugins, CommandCollision) {
+  auto m = OfflineManager();
+  static std::atomic<int> commands_a = 0;
+  FakePlugin a("x", nullptr, [](Manager &, const IRCMessagePrivMsg &) { commands_a++; });
+  FakePlugin b(
+      "x", [](Manager &, const IRCMessage &) { notices_b++; },
+      [](Manager &, const IRCMessagePrivMsg &) { commands_b++; });
+  ASSERT_TRUE(m.server.AddPlugin(a.desc, &a.owner));
+  EXPECT_FALSE(m.server.AddPlugin(b.desc, &b.owner));
+  int notices = notices_b, commands = commands_b;
+  ASSERT_TRUE(ProcessMessageLine(m, ":joe!u@h PRIVMSG #a :,x"));
+  ASSERT_TRUE(ProcessMessageLine(m, ":irc.test NOTICE kbot :hi"));
+  EXPECT_EQ(commands_a, 1);
+  EXPECT_EQ(commands_b, commands);
+  EXPECT_EQ(notices_b, notices);
+  m.server.RemovePlugin(a.desc, &a.owner);
+}
+
+// A timer unloading its plugin keeps the plugin's other timer, due at the same time, from running
+TEST(Plugins, UnloadFromTimer) {
+  auto m = OfflineManager();
+  std::vector<std::string> sent;
+  m.server.send_sink = [&sent](std::string_view msg) {
+    sent.emplace_back(msg);
+    return static_cast<ssize_t>(msg.size());
+  };
+  plugin::SetSearchPath(KBOT_TEST_PLUGIN_DIR);
+  ASSERT_TRUE(m.LoadPlugin("unload_timers"));
+  bool done = false;
+  m.AddTimer(50ms, [&done] { done = true; });
+  // Both timers are due by the time the loop looks
+  std::this_thread::sleep_for(20ms);
+  while (!done) ASSERT_GE(m.RunEventLoop(-1), 0);
+  plugin::SetSearchPath("");
+  EXPECT_FALSE(m.UnloadPlugin("unload_timers"));
+  EXPECT_TRUE(sent.empty()) << sent.front();
+}
+
+// The metrics endpoint isn't authenticated, so it only binds to loopback addresses
+TEST(Metrics, LoopbackOnly) {
+  for (auto endpoint : {"0.0.0.0:19090", "[::]:19090", "192.0.2.1:19090", "localhost:19090"}) {
+    EXPECT_FALSE(metrics::Listener::CreateNew(endpoint)) << endpoint;
+  }
+}
+
+// Each network keeps its own sightings, though the plugin is shared
+TEST(Plugins, SeenPerNetwork) {
+  plugin::SetSearchPath(KBOT_TEST_PLUGIN_DIR);
+  auto a = OfflineManager();
+  auto b = Manager::CreateNew(Server(-1, "elsewhere", 0, "kbot"));
+  b.server.SetState(ServerState::kLoggedIn);
+  std::vector<std::string> sent;
+  for (auto *m : {&a, &b}) {
+    m->server.send_sink = [&sent](std::string_view msg) {
+      sent.emplace_back(msg);
+      return static_cast<ssize_t>(msg.size());
+    };
+    ASSERT_TRUE(m->LoadPlugin("seen"));
+  }
+  plugin::SetSearchPath("");
+  ASSERT_TRUE(ProcessMessageLine(a, ":joe!u@h JOIN #a"));
+  ASSERT_TRUE(ProcessMessageLine(b, ":eve!e@h PRIVMSG #b :,seen joe"));
+  ASSERT_EQ(sent.size(), 1u);
+  EXPECT_NE(sent.back().find("I haven't seen joe."), std::string::npos) << sent.back();
+  ASSERT_TRUE(ProcessMessageLine(a, ":eve!e@h PRIVMSG #a :,seen JOE"));
+  ASSERT_EQ(sent.size(), 2u);
+  EXPECT_NE(sent.back().find("joining #a"), std::string::npos) << sent.back();
+  EXPECT_TRUE(a.UnloadPlugin("seen"));
+  EXPECT_TRUE(b.UnloadPlugin("seen"));
+}
+
+// An account tag is only believed when the server enabled account-tag
+TEST(Permissions, AccountTag) {
+  auto m = OfflineManager();
+  std::vector<std::string> sent;
+  m.server.send_sink = [&sent](std::string_view msg) {
+    sent.emplace_back(msg);
+    return static_cast<ssize_t>(msg.size());
+  };
+  m.server.admin_account = "admin";
+  constexpr std::string_view kPart = "@account=admin :eve!e@h PRIVMSG #a :,part #nowhere";
+  ASSERT_TRUE(ProcessMessageLine(m, kPart));
+  ASSERT_EQ(sent.size(), 1u);
+  EXPECT_NE(sent.back().find("Permission denied"), std::string::npos) << sent.back();
+  m.server.cap_enabled.fetch_or(kCapAccountTag);
+  ASSERT_TRUE(ProcessMessageLine(m, kPart));
+  ASSERT_EQ(sent.size(), 2u);
+  EXPECT_NE(sent.back().find("No such channel"), std::string::npos) << sent.back();
+  // Other accounts are nobody special
+  ASSERT_TRUE(ProcessMessageLine(m, "@account=eve :eve!e@h PRIVMSG #a :,part #nowhere"));
+  ASSERT_EQ(sent.size(), 3u);
+  EXPECT_NE(sent.back().find("Permission denied"), std::string::npos) << sent.back();
+  // Nor is anyone without an admin account configured
+  m.server.admin_account.clear();
+  ASSERT_TRUE(ProcessMessageLine(m, kPart));
+  ASSERT_EQ(sent.size(), 4u);
+  EXPECT_NE(sent.back().find("Permission denied"), std::string::npos) << sent.back();
+  // Reloading plugins takes the same permission as configuring the bot
+  ASSERT_TRUE(ProcessMessageLine(m, ":eve!e@h PRIVMSG #a :,reload seen"));
+  ASSERT_EQ(sent.size(), 5u);
+  EXPECT_NE(sent.back().find("Permission denied"), std::string::npos) << sent.back();
+}
+
+// Only our own PART completes a part we asked for
+TEST(Channels, OthersParting) {
+  auto m = OfflineManager();
+  m.server.JoinChannel("#a");
+  ASSERT_TRUE(ProcessMessageLine(m, ":kbot!u@h JOIN #a"));
+  ASSERT_EQ(m.server.GetChannelCount().joined, 1u);
+  ASSERT_TRUE(m.server.PartChannel("#a"));
+  ASSERT_TRUE(ProcessMessageLine(m, ":joe!u@h PART #a"));
+  EXPECT_EQ(m.server.GetChannelCount().part_requested, 1u);
+  ASSERT_TRUE(ProcessMessageLine(m, ":kbot!u@h PART #a"));
+  EXPECT_EQ(m.server.GetChannelCount().part_requested, 0u);
+}
+
+// Replies are matched to their request under the server's case mapping
+TEST(Channels, WhoisCaseMapping) {
+  auto m = OfflineManager();
+  std::vector<std::string> sent;
+  m.server.send_sink = [&sent](std::string_view msg) {
+    sent.emplace_back(msg);
+    return static_cast<ssize_t>(msg.size());
+  };
+  ASSERT_TRUE(ProcessMessageLine(m, ":eve!e@h PRIVMSG #a :,whois Joe[x]"));
+  ASSERT_EQ(sent.size(), 1u);
+  EXPECT_NE(sent.back().find("WHOIS Joe[x]"), std::string::npos) << sent.back();
+  ASSERT_TRUE(ProcessMessageLine(m, ":irc.test 311 kbot joe{X} u h * :Joe"));
+  ASSERT_EQ(sent.size(), 2u);
+  EXPECT_NE(sent.back().find("joe{X} is u@h (Joe)"), std::string::npos) << sent.back();
+}
+
+// A refused nickname is replaced a bounded number of times, an erroneous one with a valid one
+TEST(Registration, RefusedNickname) {
+  auto m = OfflineManager();
+  std::vector<std::string> sent;
+  m.server.send_sink = [&sent](std::string_view msg) {
+    sent.emplace_back(msg);
+    return static_cast<ssize_t>(msg.size());
+  };
+  m.server.SetState(ServerState::kConnected);
+  ASSERT_TRUE(ProcessMessageLine(m, ":irc.test 433 * kbot :Nickname is already in use"));
+  ASSERT_EQ(sent.size(), 1u);
+  EXPECT_NE(sent.back().find("NICK kbot_"), std::string::npos) << sent.back();
+  EXPECT_EQ(m.server.GetNickname(), "kbot_");
+  ASSERT_TRUE(ProcessMessageLine(m, ":irc.test 432 * kbot_ :Erroneous nickname"));
+  ASSERT_EQ(sent.size(), 2u);
+  auto nick = m.server.GetNickname();
+  EXPECT_EQ(nick.size(), 9u);
+  EXPECT_TRUE(nick.starts_with("kbot")) << nick;
+  EXPECT_TRUE(std::all_of(nick.begin() + 4, nick.end(), ::isdigit)) << nick;
+  EXPECT_NE(sent.back().find("NICK " + nick), std::string::npos) << sent.back();
+  for (int i = 2; i < Manager::kMaxNickRetries; i++) {
+    ASSERT_TRUE(ProcessMessageLine(
+        m, fmt::format(":irc.test 433 * {} :Nickname is already in use", m.server.GetNickname())));
+  }
+  EXPECT_EQ(sent.size(), size_t(Manager::kMaxNickRetries));
+  EXPECT_FALSE(m.quit);
+  ASSERT_TRUE(ProcessMessageLine(m, ":irc.test 433 * x :Nickname is already in use"));
+  EXPECT_EQ(sent.size(), size_t(Manager::kMaxNickRetries));
+  EXPECT_TRUE(m.quit);
+  // Tries start over on the next connection
+  m.server.Disconnect();
+  EXPECT_EQ(m.server.nick_retries, 0);
+}
+
+// Spans end however the line's handling does, so the dump nests properly
+TEST(Trace, SpansBalanced) {
+  std::string path = fmt::format("/tmp/kbot-trace-test.{}.json", getpid());
+  trace::EnableRing(path);
+  auto m = OfflineManager();
+  FakePlugin p("throw", nullptr,
+               [](Manager &, const IRCMessagePrivMsg &) { throw std::runtime_error("oops"); });
+  m.server.AddPlugin(p.desc, &p.owner);
+  // Parse error, a command throwing, and QUIT ending the loop early
+  EXPECT_TRUE(ProcessMessageLine(m, ":srv"));
+  EXPECT_TRUE(ProcessMessageLine(m, ":joe!u@h PRIVMSG #a :,throw"));
+  EXPECT_FALSE(ProcessMessageLine(m, ":op!u@h QUIT :bye"));
+  m.server.RemovePlugin(p.desc, &p.owner);
+  trace::ring_enabled = false;
+  ASSERT_TRUE(trace::DumpChromeJson());
+  std::ifstream f(path);
+  std::stringstream ss;
+  ss << f.rdbuf();
+  std::remove(path.c_str());
+  std::string dump = ss.str();
+  auto count = [&](std::string_view what) {
+    size_t n = 0;
+    for (size_t i = dump.find(what); i != dump.npos; i = dump.find(what, i + 1)) n++;
+    return n;
+  };
+  EXPECT_GE(count("\"name\":\"parse\",\"ph\":\"B\""), 3u);
+  EXPECT_GE(count("\"name\":\"plugin\",\"ph\":\"B\""), 1u);
+  EXPECT_EQ(count("\"ph\":\"B\""), count("\"ph\":\"E\""));
+}
+
+// Dumps read the rings while their threads keep writing (run under TSan)
+TEST(Trace, DumpWhileRecording) {
+  std::string path = fmt::format("/tmp/kbot-trace-test.{}.json", getpid());
+  trace::EnableRing(path);
+  std::atomic<bool> stop = false;
+  std::jthread writer([&stop] {
+    for (uint64_t i = 0; !stop.load(std::memory_order_relaxed); i++) {
+      KBOT_TRACE_POINT(test_point, i);
+    }
+  });
+  for (int i = 0; i < 10; i++) EXPECT_TRUE(trace::DumpChromeJson());
+  stop = true;
+  writer.join();
+  trace::ring_enabled = false;
+  std::remove(path.c_str());
+}
+
+}  // namespace
+
+int main() {
+  testing::InitGoogleTest();
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,109 @@
+#include <gtest/gtest.h>
+
+#include <PatternMatcher.hh>
+#include <string>
+#include <string_view>
+#include <vector>
+
+using namespace kbot;
+
+namespace {
+
+std::vector<size_t> Indices(std::span<const PatternMatcher::Hit> hits) {
+  std::vector<size_t> v;
+  for (auto &h : hits) v.push_back(h.index);
+  return v;
+}
+
+}  // namespace
+
+TEST(PatternMatcher, Keywords) {
+  PatternMatcher pm;
+  std::vector<PatternMatcher::Pattern> patterns = {
+      {.pattern = "he"}, {.pattern = "she"}, {.pattern = "his"}, {.pattern = "hers"},
+  };
+  EXPECT_TRUE(pm.SetPatterns(patterns, 1).empty());
+  EXPECT_EQ(pm.GetGeneration(), 1u);
+
+  auto hits = pm.Match("#c", "uSHErs");
+  ASSERT_EQ(Indices(hits), (std::vector<size_t>{0, 1, 3}));
+  // Views into the text, as it was written
+  EXPECT_EQ(hits[0].match, "HE");
+  EXPECT_EQ(hits[1].match, "SHE");
+  EXPECT_EQ(hits[2].match, "HErs");
+  EXPECT_TRUE(pm.Match("#c", "nothing to see").empty());
+  // Reported once, at the first occurrence
+  std::string text = "ahis his";
+  hits = pm.Match("#c", text);
+  ASSERT_EQ(Indices(hits), (std::vector<size_t>{2}));
+  EXPECT_EQ(hits[0].match.data(), text.data() + 1);
+  EXPECT_EQ(Indices(pm.GetHits()), (std::vector<size_t>{2}));
+}
+
+TEST(PatternMatcher, Regexes) {
+  PatternMatcher pm;
+  std::vector<PatternMatcher::Pattern> patterns = {
+      {.regex = true, .pattern = R"(https?://\S+)"},
+      {.pattern = "kbot"},
+      {.regex = true, .pattern = "(unbalanced"},
+      {.regex = true, .pattern = R"((?i)\bping\b)"},
+  };
+  EXPECT_EQ(pm.SetPatterns(patterns, 2), (std::vector<size_t>{2}));
+
+  auto hits = pm.Match("#c", "kbot: see http://example.org/x and PING me");
+  ASSERT_EQ(Indices(hits), (std::vector<size_t>{0, 1, 3}));
+  EXPECT_EQ(hits[0].match, "http://example.org/x");
+  EXPECT_EQ(hits[1].match, "kbot");
+  EXPECT_EQ(hits[2].match, "PING");
+  EXPECT_EQ(Indices(pm.Match("#c", "pinging")), (std::vector<size_t>{}));
+}
+
+TEST(PatternMatcher, Channels) {
+  PatternMatcher pm;
+  std::vector<PatternMatcher::Pattern> patterns = {
+      {.pattern = "alert", .channel = "#Ops"},
+      {.regex = true, .pattern = "al+ert", .channel = "#dev"},
+      {.pattern = "alert"},
+  };
+  pm.SetPatterns(patterns, 3);
+  EXPECT_EQ(Indices(pm.Match("#ops", "alert!")), (std::vector<size_t>{0, 2}));
+  EXPECT_EQ(Indices(pm.Match("#dev", "alllert alert")), (std::vector<size_t>{1, 2}));
+  EXPECT_EQ(Indices(pm.Match("#other", "alert")), (std::vector<size_t>{2}));
+}
+
+TEST(PatternMatcher, Replace) {
+  PatternMatcher pm;
+  EXPECT_TRUE(pm.Empty());
+  EXPECT_TRUE(pm.Match("#c", "anything").empty());
+  std::vector<PatternMatcher::Pattern> patterns = {{.pattern = "a"}};
+  pm.SetPatterns(patterns, 1);
+  EXPECT_FALSE(pm.Empty());
+  patterns = {{.regex = true, .pattern = "b"}};
+  pm.SetPatterns(patterns, 2);
+  EXPECT_TRUE(pm.Match("#c", "a").empty());
+  EXPECT_EQ(pm.Match("#c", "b").size(), 1u);
+  pm.SetPatterns({}, 3);
+  EXPECT_TRUE(pm.Empty());
+}
+
+// Many overlapping keywords against a naive search
+TEST(PatternMatcher, ManyKeywords) {
+  PatternMatcher pm;
+  std::vector<std::string> words;
+  for (int i = 0; i < 500; i++) words.push_back(std::to_string(i * 7919 % 10007));
+  std::vector<PatternMatcher::Pattern> patterns;
+  for (auto &w : words) patterns.push_back({.pattern = w});
+  pm.SetPatterns(patterns, 1);
+  std::string text;
+  for (int i = 0; i < 200; i++) text += std::to_string(i * 31 % 977) + " ";
+  std::vector<size_t> expected;
+  for (size_t i = 0; i < words.size(); i++) {
+    if (text.find(words[i]) != text.npos) expected.push_back(i);
+  }
+  EXPECT_EQ(Indices(pm.Match("#c", text)), expected);
+}
+
+int main() {
+  testing::InitGoogleTest();
+  return RUN_ALL_TESTS();
+}
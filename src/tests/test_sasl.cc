@@ -0,0 +1,162 @@
+#include <gtest/gtest.h>
+
+#include <Sasl.hh>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+using namespace kbot;
+using State = SaslClient::State;
+
+namespace {
+
+std::string Base64Decode(std::string_view s) {
+  constexpr std::string_view alphabet =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  std::string out;
+  uint32_t v = 0;
+  int bits = 0;
+  for (char c : s) {
+    if (c == '=') break;
+    v = v << 6 | static_cast<uint32_t>(alphabet.find(c));
+    bits += 6;
+    if (bits >= 8) {
+      bits -= 8;
+      out.push_back(static_cast<char>(v >> bits & 0xff));
+    }
+  }
+  return out;
+}
+
+// The server side of the exchange, as an IRCd with services speaks it: collects the response
+// lines up to one shorter than a full chunk (or "+") and answers with the result numeric
+struct StandInIRCd {
+  std::string account;
+  std::string password;
+  bool external_ok;
+  std::string payload;
+
+  StandInIRCd(std::string account, std::string password, bool external_ok = false)
+      : account(std::move(account)), password(std::move(password)), external_ok(external_ok) {}
+
+  // AUTHENTICATE <param> from the client, returns what the server sends back
+  std::string Receive(std::string_view param) {
+    if (param == "PLAIN" || param == "EXTERNAL") return "AUTHENTICATE +";
+    if (param == "*") return "906";
+    if (param != "+") payload += param;
+    if (param.size() == SaslClient::kChunkSize) return "";
+    if (payload.empty()) return external_ok ? "903" : "904";
+    auto plain = Base64Decode(payload);
+    std::string expected = account + '\0' + account + '\0' + password;
+    return plain == expected ? "903" : "904";
+  }
+};
+
+SaslCredentials Plain(std::string account, std::string password) {
+  SaslCredentials c;
+  c.account = std::move(account);
+  c.password = std::move(password);
+  return c;
+}
+
+SaslCredentials External() {
+  SaslCredentials c;
+  c.mechanism = SaslMechanism::kExternal;
+  return c;
+}
+
+// Runs the whole exchange, returning the final numeric
+std::string Exchange(SaslClient &c, StandInIRCd &ircd) {
+  auto reply = ircd.Receive(c.Start());
+  EXPECT_EQ(c.GetState(), State::kMechanismSent);
+  EXPECT_EQ(reply, "AUTHENTICATE +");
+  for (auto &line : c.Respond("+")) {
+    reply = ircd.Receive(line);
+    if (!reply.empty()) break;
+  }
+  c.Finish(reply == "903");
+  return reply;
+}
+
+}  // namespace
+
+TEST(Sasl, Base64) {
+  EXPECT_EQ(SaslClient::Base64Encode(""), "");
+  EXPECT_EQ(SaslClient::Base64Encode("f"), "Zg==");
+  EXPECT_EQ(SaslClient::Base64Encode("fo"), "Zm8=");
+  EXPECT_EQ(SaslClient::Base64Encode("foo"), "Zm9v");
+  EXPECT_EQ(SaslClient::Base64Encode("foobar"), "Zm9vYmFy");
+  EXPECT_EQ(SaslClient::Base64Encode(std::string("jilles\0jilles\0sesame", 20)),
+            "amlsbGVzAGppbGxlcwBzZXNhbWU=");
+  EXPECT_EQ(SaslClient::Base64Encode("\xff\xfe"), "//4=");
+}
+
+TEST(Sasl, Mechanisms) {
+  EXPECT_EQ(SaslClient::ParseMechanism("plain"), SaslMechanism::kPlain);
+  EXPECT_EQ(SaslClient::ParseMechanism("EXTERNAL"), SaslMechanism::kExternal);
+  EXPECT_FALSE(SaslClient::ParseMechanism("SCRAM-SHA-256"));
+  SaslClient c(External());
+  EXPECT_TRUE(c.IsOffered(""));
+  EXPECT_TRUE(c.IsOffered("PLAIN,EXTERNAL"));
+  EXPECT_FALSE(c.IsOffered("PLAIN,SCRAM-SHA-256"));
+  EXPECT_FALSE(c.IsOffered("EXTERNALX"));
+}
+
+TEST(Sasl, Plain) {
+  StandInIRCd ircd("kbot", "hunter2");
+  SaslClient c(Plain("kbot", "hunter2"));
+  EXPECT_EQ(Exchange(c, ircd), "903");
+  EXPECT_EQ(c.GetState(), State::kSucceeded);
+  EXPECT_FALSE(c.InProgress());
+
+  StandInIRCd wrong("kbot", "other");
+  SaslClient d(Plain("kbot", "hunter2"));
+  EXPECT_EQ(Exchange(d, wrong), "904");
+  EXPECT_EQ(d.GetState(), State::kFailed);
+}
+
+// Payloads longer than a line are split, one that ends on a full line is terminated by "+"
+TEST(Sasl, Chunks) {
+  for (size_t size : {100, 289, 290, 291, 590, 700}) {
+    std::string password(size, 'p');
+    SaslClient c(Plain("kbot", password));
+    c.Start();
+    auto lines = c.Respond("+");
+    size_t encoded = (2 * 4 + size + 2 + 2) / 3 * 4;
+    ASSERT_EQ(lines.size(), encoded / SaslClient::kChunkSize + 1) << size;
+    if (encoded % SaslClient::kChunkSize == 0) {
+      EXPECT_EQ(lines.back(), "+");
+    }
+    for (size_t i = 0; i + 1 < lines.size(); i++) EXPECT_EQ(lines[i].size(), 400u);
+
+    StandInIRCd ircd("kbot", password);
+    SaslClient e(Plain("kbot", password));
+    EXPECT_EQ(Exchange(e, ircd), "903") << size;
+  }
+}
+
+TEST(Sasl, External) {
+  StandInIRCd ircd("", "", true);
+  SaslClient c(External());
+  EXPECT_EQ(c.Start(), "EXTERNAL");
+  EXPECT_EQ(c.Respond("+"), std::vector<std::string>{"+"});
+  SaslClient d(External());
+  EXPECT_EQ(Exchange(d, ircd), "903");
+}
+
+// Anything but an empty challenge, or one out of turn, aborts
+TEST(Sasl, Abort) {
+  SaslClient c(Plain("kbot", "x"));
+  EXPECT_EQ(c.Respond("+"), std::vector<std::string>{"*"});
+  EXPECT_EQ(c.GetState(), State::kFailed);
+  SaslClient d(Plain("kbot", "x"));
+  d.Start();
+  EXPECT_EQ(d.Respond("Y2hhbGxlbmdl"), std::vector<std::string>{"*"});
+  EXPECT_FALSE(d.InProgress());
+}
+
+int main() {
+  testing::InitGoogleTest();
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,122 @@
+#include <gtest/gtest.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <ShmRing.hh>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+using namespace kbot;
+
+namespace {
+
+std::vector<std::pair<uint32_t, std::string>> DrainAll(ipc::ShmRing &r) {
+  std::vector<std::pair<uint32_t, std::string>> v;
+  EXPECT_GE(r.Drain([&](uint32_t type, std::string_view data) { v.emplace_back(type, data); }), 0);
+  return v;
+}
+
+bool Readable(int fd, int timeout_ms) {
+  struct pollfd p = {fd, POLLIN, 0};
+  return poll(&p, 1, timeout_ms) == 1;
+}
+
+}  // namespace
+
+TEST(ShmRing, PushDrain) {
+  auto r = ipc::ShmRing::CreateNew(4096);
+  ASSERT_TRUE(r.has_value());
+  EXPECT_EQ(r->GetCapacity(), 4096u);
+  EXPECT_FALSE(Readable(r->GetEventFd(), 0));
+  ASSERT_TRUE(r->Push(1, "PRIVMSG #chan :,hi"));
+  ASSERT_TRUE(r->Push(2, ""));
+  EXPECT_TRUE(Readable(r->GetEventFd(), 0));
+  auto v = DrainAll(*r);
+  ASSERT_EQ(v.size(), 2u);
+  EXPECT_EQ(v[0], std::make_pair(1u, std::string("PRIVMSG #chan :,hi")));
+  EXPECT_EQ(v[1], std::make_pair(2u, std::string()));
+  // Draining consumes the wakeup as well
+  EXPECT_FALSE(Readable(r->GetEventFd(), 0));
+}
+
+TEST(ShmRing, WrapAroundIsContiguous) {
+  auto r = ipc::ShmRing::CreateNew(4096);
+  ASSERT_TRUE(r.has_value());
+  std::string s(1000, 'a');
+  for (int i = 0; i < 20; i++) {
+    s.assign(1000, static_cast<char>('a' + i));
+    ASSERT_TRUE(r->Push(static_cast<uint32_t>(i), s));
+    auto v = DrainAll(*r);
+    ASSERT_EQ(v.size(), 1u);
+    EXPECT_EQ(v[0].first, static_cast<uint32_t>(i));
+    EXPECT_EQ(v[0].second, s);
+  }
+}
+
+TEST(ShmRing, Full) {
+  auto r = ipc::ShmRing::CreateNew(4096);
+  ASSERT_TRUE(r.has_value());
+  std::string s(1000, 'x');
+  int pushed = 0;
+  while (r->Push(0, s)) pushed++;
+  EXPECT_EQ(pushed, 4);
+  EXPECT_EQ(r->Reserve(4096), nullptr);
+  EXPECT_EQ(DrainAll(*r).size(), 4u);
+  EXPECT_TRUE(r->Push(0, s));
+}
+
+TEST(ShmRing, ReserveCommit) {
+  auto r = ipc::ShmRing::CreateNew(4096);
+  ASSERT_TRUE(r.has_value());
+  char *p = r->Reserve(64);
+  ASSERT_NE(p, nullptr);
+  std::memcpy(p, "PONG", 4);
+  // Nothing is visible before commit
+  EXPECT_TRUE(DrainAll(*r).empty());
+  r->Commit(7, 4);
+  auto v = DrainAll(*r);
+  ASSERT_EQ(v.size(), 1u);
+  EXPECT_EQ(v[0], std::make_pair(7u, std::string("PONG")));
+}
+
+TEST(ShmRing, CrossProcess) {
+  auto r = ipc::ShmRing::CreateNew(4096);
+  ASSERT_TRUE(r.has_value());
+  constexpr int kCount = 10000;
+  pid_t pid = fork();
+  ASSERT_GE(pid, 0);
+  if (pid == 0) {
+    auto c = ipc::ShmRing::Attach(dup(r->GetMemFd()), dup(r->GetEventFd()));
+    if (!c) _exit(1);
+    for (int i = 0; i < kCount;) {
+      if (c->Push(static_cast<uint32_t>(i), std::to_string(i))) {
+        i++;
+      } else {
+        usleep(10);
+      }
+    }
+    _exit(0);
+  }
+  int next = 0;
+  bool ok = true;
+  while (next < kCount && ok) {
+    ASSERT_TRUE(Readable(r->GetEventFd(), 5000));
+    r->Drain([&](uint32_t type, std::string_view data) {
+      ok = ok && type == static_cast<uint32_t>(next) && data == std::to_string(next);
+      next++;
+    });
+  }
+  EXPECT_TRUE(ok);
+  EXPECT_EQ(next, kCount);
+  int status;
+  ASSERT_EQ(waitpid(pid, &status, 0), pid);
+  EXPECT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+int main() {
+  testing::InitGoogleTest();
+  return RUN_ALL_TESTS();
+}
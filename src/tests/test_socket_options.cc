@@ -0,0 +1,83 @@
+#include <gtest/gtest.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <SocketOptions.hh>
+#include <string>
+
+using namespace kbot;
+
+TEST(SocketOptions, Parse) {
+  auto o = SocketOptions::Parse("");
+  ASSERT_TRUE(o);
+  EXPECT_TRUE(o->nodelay);
+  EXPECT_EQ(o->keepalive_idle, 120u);
+  EXPECT_FALSE(o->rcvbuf);
+
+  o = SocketOptions::Parse(
+      "nodelay=0,keepalive=60:10:5,rcvbuf=256K,sndbuf=1M,user_timeout=30000,busy_poll=50,"
+      "notsent_lowat=16384");
+  ASSERT_TRUE(o);
+  EXPECT_FALSE(o->nodelay);
+  EXPECT_EQ(o->keepalive_idle, 60u);
+  EXPECT_EQ(o->keepalive_interval, 10u);
+  EXPECT_EQ(o->keepalive_count, 5u);
+  EXPECT_EQ(o->rcvbuf, 256u << 10);
+  EXPECT_EQ(o->sndbuf, 1u << 20);
+  EXPECT_EQ(o->user_timeout_ms, 30000u);
+  EXPECT_EQ(o->busy_poll_usec, 50u);
+  EXPECT_EQ(o->notsent_lowat, 16384u);
+
+  // Only what is given changes
+  o = SocketOptions::Parse("keepalive=300,nodelay");
+  ASSERT_TRUE(o);
+  EXPECT_TRUE(o->nodelay);
+  EXPECT_EQ(o->keepalive_idle, 300u);
+  EXPECT_EQ(o->keepalive_interval, 30u);
+  EXPECT_EQ(SocketOptions::Parse("keepalive=0")->keepalive_idle, 0u);
+
+  EXPECT_FALSE(SocketOptions::Parse("nodelay=2"));
+  EXPECT_FALSE(SocketOptions::Parse("keepalive=1:2:3:4"));
+  EXPECT_FALSE(SocketOptions::Parse("keepalive=x"));
+  EXPECT_FALSE(SocketOptions::Parse("rcvbuf"));
+  EXPECT_FALSE(SocketOptions::Parse("rcvbuf=1G"));
+  EXPECT_FALSE(SocketOptions::Parse("sndbuf=2048M"));
+  EXPECT_FALSE(SocketOptions::Parse("user_timeout=-1"));
+  EXPECT_FALSE(SocketOptions::Parse("tos=16"));
+}
+
+TEST(SocketOptions, ApplyReport) {
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  ASSERT_GE(fd, 0);
+  auto o = SocketOptions::Parse("keepalive=60:10:5,sndbuf=64K,user_timeout=30000,notsent_lowat=4K");
+  ASSERT_TRUE(o);
+  EXPECT_TRUE(o->Apply(fd));
+  auto report = SocketOptions::Report(fd);
+  for (auto expected : {"TCP_NODELAY=1", "SO_KEEPALIVE=1", "TCP_KEEPIDLE=60", "TCP_KEEPINTVL=10",
+                        "TCP_KEEPCNT=5", "TCP_USER_TIMEOUT=30000", "TCP_NOTSENT_LOWAT=4096",
+                        "SO_SNDBUF=131072"}) {
+    EXPECT_NE(report.find(expected), std::string::npos) << expected << " in " << report;
+  }
+
+  SocketOptions off;
+  off.nodelay = false;
+  off.keepalive_idle = 0;
+  EXPECT_TRUE(off.Apply(fd));
+  report = SocketOptions::Report(fd);
+  EXPECT_NE(report.find("TCP_NODELAY=0"), std::string::npos) << report;
+  EXPECT_NE(report.find("SO_KEEPALIVE=0"), std::string::npos) << report;
+  close(fd);
+
+  // Not a TCP socket, the TCP options fail but the rest are still set
+  int ufd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  ASSERT_GE(ufd, 0);
+  EXPECT_FALSE(o->Apply(ufd));
+  EXPECT_NE(SocketOptions::Report(ufd).find("TCP_NODELAY=?"), std::string::npos);
+  close(ufd);
+}
+
+int main() {
+  testing::InitGoogleTest();
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,136 @@
+#include <gtest/gtest.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include <Epoll.hh>
+#include <Task.hh>
+#include <chrono>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace kbot;
+using namespace std::chrono_literals;
+
+namespace {
+
+class TestManager : public io::EpollManager {
+ public:
+  TestManager() : EpollManager(epoll_create1(EPOLL_CLOEXEC)) {}
+  void RunUntil(const bool &done) {
+    while (!done) ASSERT_EQ(RunEventLoop(-1), 0);
+  }
+};
+
+Task<int> Add(io::EpollManager &m, int a, int b) {
+  co_await io::Sleep(m, 1ms);
+  co_return a + b;
+}
+
+Task<> Sleeper(io::EpollManager &m, std::chrono::milliseconds d, std::vector<int> &order, int id,
+               bool &done) {
+  co_await io::Sleep(m, d);
+  order.push_back(id);
+  done = true;
+}
+
+Task<> Nested(io::EpollManager &m, int &result, bool &done) {
+  result = co_await Add(m, 2, 3);
+  result += co_await Add(m, result, 10);
+  done = true;
+}
+
+Task<> Reader(io::EpollManager &m, int fd, std::string &out, bool &done) {
+  uint32_t ev = co_await io::WaitFd(m, fd, io::EpollManager::EpollIn);
+  if (ev & EPOLLIN) {
+    char buf[16];
+    ssize_t r = read(fd, buf, sizeof(buf));
+    if (r > 0) out.assign(buf, static_cast<size_t>(r));
+  }
+  done = true;
+}
+
+Task<> Thrower(io::EpollManager &m, bool &done) {
+  done = true;
+  co_await io::Sleep(m, 1ms);
+  throw std::runtime_error("expected");
+}
+
+}  // namespace
+
+TEST(Task, SleepOrder) {
+  TestManager m;
+  std::vector<int> order;
+  bool done[3] = {};
+  Spawn(Sleeper(m, 30ms, order, 3, done[2]));
+  Spawn(Sleeper(m, 10ms, order, 1, done[0]));
+  Spawn(Sleeper(m, 20ms, order, 2, done[1]));
+  m.RunUntil(done[2]);
+  EXPECT_EQ(order, (std::vector<int>{1, 2, 3}));
+}
+
+TEST(Task, NestedAwait) {
+  TestManager m;
+  int result = 0;
+  bool done = false;
+  Spawn(Nested(m, result, done));
+  m.RunUntil(done);
+  EXPECT_EQ(result, 20);
+}
+
+TEST(Task, CancelTimer) {
+  TestManager m;
+  bool fired = false, done = false;
+  auto id = m.AddTimer(5ms, [&] { fired = true; });
+  ASSERT_TRUE(id.has_value());
+  EXPECT_TRUE(m.CancelTimer(*id));
+  EXPECT_FALSE(m.CancelTimer(*id));
+  m.AddTimer(20ms, [&] { done = true; });
+  m.RunUntil(done);
+  EXPECT_FALSE(fired);
+}
+
+// A timer cancelled by another one due at the same time doesn't run
+TEST(Task, CancelDueTimer) {
+  TestManager m;
+  bool fired = false, done = false;
+  std::optional<io::TimerId> second;
+  ASSERT_TRUE(m.AddTimer(5ms, [&] { EXPECT_TRUE(m.CancelTimer(*second)); }));
+  second = m.AddTimer(5ms, [&] { fired = true; });
+  ASSERT_TRUE(second.has_value());
+  m.AddTimer(20ms, [&] { done = true; });
+  // Both are due by the time the loop looks
+  std::this_thread::sleep_for(10ms);
+  m.RunUntil(done);
+  EXPECT_FALSE(fired);
+}
+
+TEST(Task, WaitFd) {
+  TestManager m;
+  int p[2];
+  ASSERT_EQ(pipe(p), 0);
+  std::string out;
+  bool done = false, written = false;
+  Spawn(Reader(m, p[0], out, done));
+  m.AddTimer(5ms, [&] { written = write(p[1], "kbot", 4) == 4; });
+  m.RunUntil(done);
+  EXPECT_TRUE(written);
+  EXPECT_EQ(out, "kbot");
+  close(p[0]);
+  close(p[1]);
+}
+
+TEST(Task, DetachedException) {
+  TestManager m;
+  bool started = false, done = false;
+  Spawn(Thrower(m, started));
+  EXPECT_TRUE(started);
+  m.AddTimer(10ms, [&] { done = true; });
+  m.RunUntil(done);
+}
+
+int main() {
+  testing::InitGoogleTest();
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,219 @@
+#include <fmt/format.h>
+#include <gtest/gtest.h>
+#include <unistd.h>
+#include <wasmtime.h>
+
+#include <IRC.hh>
+#include <Manager.hh>
+#include <PluginRegistry.hh>
+#include <Server.hh>
+#include <WasmPlugin.hh>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <memory>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+using namespace kbot;
+
+namespace {
+
+std::vector<uint8_t> Compile(std::string_view wat) {
+  wasm_byte_vec_t wasm;
+  if (auto *error = wasmtime_wat2wasm(wat.data(), wat.size(), &wasm)) {
+    wasm_message_t message;
+    wasmtime_error_message(error, &message);
+    ADD_FAILURE() << std::string_view(message.data, message.size);
+    wasm_byte_vec_delete(&message);
+    wasmtime_error_delete(error);
+    return {};
+  }
+  std::vector<uint8_t> v(wasm.data, wasm.data + wasm.size);
+  wasm_byte_vec_delete(&wasm);
+  return v;
+}
+
+std::unique_ptr<WasmPlugin> Create(std::string_view wat) {
+  return WasmPlugin::CreateNew("test", Compile(wat));
+}
+
+// A Manager without a connection, keeping the lines it sends without CRs and LFs
+struct Bot {
+  Manager m = Manager::CreateNew(Server(-1, "wasm", 0, "kbot"));
+  std::vector<std::string> sent;
+
+  Bot() {
+    m.server.send_sink = [this](std::string_view msg) {
+      auto &line = sent.emplace_back();
+      for (char c : msg) {
+        if (c != '\r' && c != '\n') line.push_back(c);
+      }
+      return static_cast<ssize_t>(msg.size());
+    };
+    m.server.SetState(ServerState::kLoggedIn);
+  }
+};
+
+IRCMessagePrivMsg Command(std::string_view line) {
+  return IRCMessagePrivMsg(IRCMessage(line, IRCMessageType::PRIVMSG));
+}
+
+constexpr std::string_view kHello = R"(
+(module
+  (import "kbot" "reply" (func $reply (param i32 i32)))
+  (memory (export "memory") 1)
+  (data (i32.const 0) "hello")
+  (func (export "kbot_command_hi") (call $reply (i32.const 0) (i32.const 5))))
+)";
+
+TEST(WasmPlugin, Commands) {
+  Bot bot;
+  auto p = Create(kHello);
+  ASSERT_TRUE(p);
+  EXPECT_EQ(p->GetCommands(), std::vector<std::string>{":,hi"});
+  EXPECT_TRUE(p->Invoke(bot.m, Command(":joe!u@h PRIVMSG #a :,hi")));
+  ASSERT_EQ(bot.sent.size(), 1u);
+  EXPECT_EQ(bot.sent[0], "PRIVMSG #a :joe: hello");
+  // Without commands, or without exporting its memory, a module is refused
+  EXPECT_FALSE(Create(R"((module (memory (export "memory") 1)))"));
+  EXPECT_FALSE(Create(R"((module (func (export "kbot_command_hi"))))"));
+}
+
+// Running out of fuel abandons the command, the next one gets a full tank
+TEST(WasmPlugin, Fuel) {
+  Bot bot;
+  auto p = Create(R"(
+(module
+  (import "kbot" "reply" (func $reply (param i32 i32)))
+  (memory (export "memory") 1)
+  (data (i32.const 0) "ok")
+  (func (export "kbot_command_spin") (loop br 0))
+  (func (export "kbot_command_ok") (call $reply (i32.const 0) (i32.const 2))))
+)");
+  ASSERT_TRUE(p);
+  EXPECT_FALSE(p->Invoke(bot.m, Command(":joe!u@h PRIVMSG #a :,spin")));
+  EXPECT_TRUE(bot.sent.empty());
+  EXPECT_TRUE(p->Invoke(bot.m, Command(":joe!u@h PRIVMSG #a :,ok")));
+  EXPECT_EQ(bot.sent.size(), 1u);
+  // The start function is metered too
+  EXPECT_FALSE(Create(R"(
+(module
+  (memory (export "memory") 1)
+  (func $start (loop br 0))
+  (start $start)
+  (func (export "kbot_command_hi")))
+)"));
+}
+
+TEST(WasmPlugin, MemoryCap) {
+  Bot bot;
+  constexpr int kPages = WasmPlugin::kMemoryMax / 65536;
+  // Growing past the cap fails like running out of memory would, the module carries on
+  auto p = Create(fmt::format(R"(
+(module
+  (import "kbot" "reply" (func $reply (param i32 i32)))
+  (memory (export "memory") 1)
+  (data (i32.const 0) "denied")
+  (func (export "kbot_command_grow")
+    (if (i32.ne (memory.grow (i32.const {})) (i32.const -1)) (then unreachable))
+    (call $reply (i32.const 0) (i32.const 6))))
+)",
+                              kPages));
+  ASSERT_TRUE(p);
+  EXPECT_TRUE(p->Invoke(bot.m, Command(":joe!u@h PRIVMSG #a :,grow")));
+  ASSERT_EQ(bot.sent.size(), 1u);
+  EXPECT_EQ(bot.sent[0], "PRIVMSG #a :joe: denied");
+  // Asking for more up front fails to instantiate
+  EXPECT_FALSE(Create(fmt::format(R"(
+(module
+  (memory (export "memory") {})
+  (func (export "kbot_command_hi")))
+)",
+                                  kPages + 1)));
+}
+
+// Replies can't smuggle in lines of their own
+TEST(WasmPlugin, LineBreaks) {
+  Bot bot;
+  auto p = Create(R"(
+(module
+  (import "kbot" "reply" (func $reply (param i32 i32)))
+  (memory (export "memory") 1)
+  (data (i32.const 0) "a\0d\0aQUIT :bye")
+  (data (i32.const 16) "a\0aQUIT :bye")
+  (data (i32.const 32) "a\00b")
+  (func (export "kbot_command_crlf") (call $reply (i32.const 0) (i32.const 12)))
+  (func (export "kbot_command_lf") (call $reply (i32.const 16) (i32.const 11)))
+  (func (export "kbot_command_nul") (call $reply (i32.const 32) (i32.const 3)))
+  (func (export "kbot_command_oob") (call $reply (i32.const 65530) (i32.const 10))))
+)");
+  ASSERT_TRUE(p);
+  for (auto c : {"crlf", "lf", "nul", "oob"}) {
+    EXPECT_FALSE(p->Invoke(bot.m, Command(fmt::format(":joe!u@h PRIVMSG #a :,{}", c)))) << c;
+  }
+  EXPECT_TRUE(bot.sent.empty());
+}
+
+class WasmPluginFiles : public ::testing::Test {
+ protected:
+  std::string dir;
+
+  void SetUp() override {
+    char tmpl[] = "/tmp/kbot-wasm-XXXXXX";
+    ASSERT_TRUE(mkdtemp(tmpl));
+    dir = tmpl;
+    plugin::SetSearchPath(dir);
+  }
+
+  void TearDown() override {
+    unlink((dir + "/hi.wasm").c_str());
+    rmdir(dir.c_str());
+    plugin::SetSearchPath("");
+  }
+
+  void Write(std::span<const uint8_t> data) {
+    std::ofstream f(dir + "/hi.wasm", std::ios::binary | std::ios::trunc);
+    f.write(reinterpret_cast<const char *>(data.data()), data.size());
+  }
+};
+
+TEST_F(WasmPluginFiles, LoadReloadUnload) {
+  Bot bot;
+  Write(Compile(kHello));
+  ASSERT_TRUE(bot.m.LoadWasmPlugin("hi"));
+  ASSERT_TRUE(ProcessMessageLine(bot.m, ":joe!u@h PRIVMSG #a :,hi"));
+  ASSERT_EQ(bot.sent.size(), 1u);
+  EXPECT_EQ(bot.sent.back(), "PRIVMSG #a :joe: hello");
+  // A broken file leaves the loaded module in place
+  const uint8_t garbage[] = {0, 'a', 's', 'm', 0xff};
+  Write(garbage);
+  EXPECT_FALSE(bot.m.ReloadWasmPlugin("hi"));
+  ASSERT_TRUE(ProcessMessageLine(bot.m, ":joe!u@h PRIVMSG #a :,hi"));
+  ASSERT_EQ(bot.sent.size(), 2u);
+  EXPECT_EQ(bot.sent.back(), "PRIVMSG #a :joe: hello");
+  Write(Compile(R"(
+(module
+  (import "kbot" "reply" (func $reply (param i32 i32)))
+  (memory (export "memory") 1)
+  (data (i32.const 0) "hello again")
+  (func (export "kbot_command_hi") (call $reply (i32.const 0) (i32.const 11))))
+)"));
+  EXPECT_TRUE(bot.m.ReloadWasmPlugin("hi"));
+  ASSERT_TRUE(ProcessMessageLine(bot.m, ":joe!u@h PRIVMSG #a :,hi"));
+  ASSERT_EQ(bot.sent.size(), 3u);
+  EXPECT_EQ(bot.sent.back(), "PRIVMSG #a :joe: hello again");
+  EXPECT_TRUE(bot.m.UnloadWasmPlugin("hi"));
+  EXPECT_FALSE(bot.m.UnloadWasmPlugin("hi"));
+  ASSERT_TRUE(ProcessMessageLine(bot.m, ":joe!u@h PRIVMSG #a :,hi"));
+  EXPECT_EQ(bot.sent.size(), 3u);
+}
+
+}  // namespace
+
+int main() {
+  testing::InitGoogleTest();
+  return RUN_ALL_TESTS();
+}
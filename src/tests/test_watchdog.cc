@@ -0,0 +1,105 @@
+#include <gtest/gtest.h>
+
+#include <Watchdog.hh>
+#include <chrono>
+#include <string>
+
+using namespace kbot;
+using namespace std::chrono_literals;
+using Action = LagWatchdog::Action;
+
+namespace {
+
+LagWatchdog::Clock::time_point At(std::chrono::milliseconds t) {
+  return LagWatchdog::Clock::time_point(1000h + t);
+}
+
+LagWatchdog::Config TestConfig() {
+  LagWatchdog::Config c;
+  c.idle = 30s;
+  c.interval = 120s;
+  c.timeout = 90s;
+  return c;
+}
+
+}  // namespace
+
+TEST(LagWatchdog, PingWhenIdle) {
+  LagWatchdog w(TestConfig(), At(0s));
+  EXPECT_EQ(w.Check(At(10s)), Action::kNone);
+  w.OnReceive(At(20s));
+  EXPECT_EQ(w.Check(At(49s)), Action::kNone);
+  EXPECT_EQ(w.Check(At(50s)), Action::kPing);
+  auto token = w.StartPing(At(50s));
+  EXPECT_TRUE(token.starts_with(LagWatchdog::kTokenPrefix));
+  EXPECT_TRUE(w.PingOutstanding());
+  EXPECT_EQ(w.Check(At(60s)), Action::kNone);
+
+  w.OnReceive(At(50250ms));
+  auto lag = w.OnPong(token, At(50250ms));
+  ASSERT_TRUE(lag);
+  EXPECT_EQ(*lag, 250ms);
+  EXPECT_FALSE(w.PingOutstanding());
+}
+
+// Busy connections are still measured every interval
+TEST(LagWatchdog, PingWhileBusy) {
+  LagWatchdog w(TestConfig(), At(0s));
+  for (auto t = 0s; t < 120s; t += 5s) {
+    w.OnReceive(At(t));
+    EXPECT_EQ(w.Check(At(t)), Action::kNone);
+  }
+  w.OnReceive(At(120s));
+  EXPECT_EQ(w.Check(At(120s)), Action::kPing);
+}
+
+TEST(LagWatchdog, Timeout) {
+  LagWatchdog w(TestConfig(), At(0s));
+  w.StartPing(At(30s));
+  EXPECT_EQ(w.Check(At(119s)), Action::kNone);
+  EXPECT_EQ(w.Check(At(120s)), Action::kTimeout);
+  // A new connection starts over
+  w.Reset(At(200s));
+  EXPECT_FALSE(w.PingOutstanding());
+  EXPECT_EQ(w.Check(At(210s)), Action::kNone);
+}
+
+// Traffic without the PONG means it got lost, ask again instead of giving up
+TEST(LagWatchdog, LostPong) {
+  LagWatchdog w(TestConfig(), At(0s));
+  auto first = w.StartPing(At(30s));
+  w.OnReceive(At(60s));
+  EXPECT_EQ(w.Check(At(120s)), Action::kPing);
+  auto second = w.StartPing(At(120s));
+  // The late answer to the first still measures its own round trip
+  auto lag = w.OnPong(first, At(125s));
+  ASSERT_TRUE(lag);
+  EXPECT_EQ(*lag, 95s);
+  EXPECT_FALSE(w.PingOutstanding());
+}
+
+TEST(LagWatchdog, ForeignTokens) {
+  LagWatchdog w(TestConfig(), At(0s));
+  w.StartPing(At(30s));
+  EXPECT_FALSE(w.OnPong("irc.example.org", At(31s)));
+  EXPECT_FALSE(w.OnPong("kbot-", At(31s)));
+  EXPECT_FALSE(w.OnPong("kbot-12x", At(31s)));
+  // From the future
+  EXPECT_FALSE(w.OnPong(w.StartPing(At(40s)), At(31s)));
+  EXPECT_TRUE(w.PingOutstanding());
+}
+
+TEST(LagWatchdog, CheckInterval) {
+  LagWatchdog w(TestConfig(), At(0s));
+  EXPECT_EQ(w.GetCheckInterval(), 7s);
+  LagWatchdog::Config c;
+  c.idle = 2s;
+  EXPECT_EQ(LagWatchdog(c).GetCheckInterval(), 1s);
+  c.idle = c.interval = c.timeout = 600s;
+  EXPECT_EQ(LagWatchdog(c).GetCheckInterval(), 10s);
+}
+
+int main() {
+  testing::InitGoogleTest();
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,549 @@
+#include <arpa/inet.h>
+#include <fmt/format.h>
+#include <glog/logging.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <Capture.hh>
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <optional>
+#include <random>
+#include <set>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// kbot-loadgen
+// Stands in for an IRC server on localhost to put a real kbot under reproducible load: it accepts
+// one connection, registers it, puts it into the channels and then either replays a capture taken
+// with kbot -C (see Capture.hh), or synthesizes chat from a seeded generator. Lines go out on a
+// fixed schedule whatever kbot does (open loop), so a bot falling behind shows up as latency
+// instead of quietly lowering the rate.
+//
+// Commands in the traffic (",hi" when synthesizing, any line starting with the prefix in a
+// capture) are timed from when they were due until the reply kbot addresses to their sender in
+// the same channel, matching replies to commands in order per sender and channel.
+//
+//   kbot-loadgen -p 7000 -c 50 -u 2000 -R 5000 -s 20:400:pareto:1.5 -d 60
+//   kbot -s 127.0.0.1 -p 7000 -n kbot -c ''
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+constexpr std::string_view kServerName = "kbot-loadgen";
+
+struct Config {
+  uint16_t port = 6667;
+  // Replay
+  const char *capture_path = nullptr;
+  double speed = 1.0;
+  // Synthesis
+  unsigned channels = 10;
+  unsigned users = 100;
+  double rate = 1000;
+  unsigned min_size = 10;
+  unsigned max_size = 200;
+  bool pareto = false;
+  // 1.16 is the 80/20 rule: most lines short, a few up to the limit
+  double pareto_shape = 1.16;
+  double command_fraction = 0.01;
+  std::chrono::seconds duration{10};
+  uint64_t seed = 1;
+  // Both
+  std::string prefix = ",";
+  std::chrono::seconds drain{2};
+};
+
+struct Line {
+  // Since the start of the traffic
+  std::chrono::nanoseconds at;
+  std::string text;
+  // "<channel> <nick>" in lower case if this is a command expecting a reply
+  std::string reply_key;
+};
+
+std::string Lower(std::string_view s) {
+  std::string r(s);
+  for (auto &c : r) {
+    if (c >= 'A' && c <= 'Z') c = static_cast<char>(c - 'A' + 'a');
+  }
+  return r;
+}
+
+// Parameters of a line, the source and the command first if present
+std::vector<std::string_view> Split(std::string_view line) {
+  std::vector<std::string_view> v;
+  while (!line.empty()) {
+    if (line.front() == ' ') {
+      line.remove_prefix(1);
+      continue;
+    }
+    if (line.front() == ':' && !v.empty()) {
+      v.push_back(line.substr(1));
+      break;
+    }
+    auto sp = line.find(' ');
+    v.push_back(line.substr(0, sp));
+    line.remove_prefix(sp == line.npos ? line.size() : sp);
+  }
+  return v;
+}
+
+std::string_view SourceNick(std::string_view source) {
+  if (!source.starts_with(':')) return "";
+  source.remove_prefix(1);
+  return source.substr(0, source.find('!'));
+}
+
+// Generation
+// All randomness comes from one mt19937_64, whose output the standard fixes, and is turned into
+// numbers by hand since the standard distributions differ between library implementations
+
+class Generator {
+  const Config &config;
+  std::mt19937_64 rng;
+
+  uint64_t Below(uint64_t n) { return rng() % n; }
+  double Unit() { return static_cast<double>(rng() >> 11) * 0x1.0p-53; }
+
+  size_t Size() {
+    if (!config.pareto) return config.min_size + Below(config.max_size - config.min_size + 1);
+    double x = config.min_size / std::pow(1 - Unit(), 1 / config.pareto_shape);
+    return static_cast<size_t>(std::min<double>(x, config.max_size));
+  }
+
+ public:
+  explicit Generator(const Config &config) : config(config), rng(config.seed) {}
+
+  Line Next(std::chrono::nanoseconds at) {
+    auto user = Below(config.users);
+    auto channel = Below(config.channels);
+    Line l{at, {}, {}};
+    std::string text;
+    if (Unit() < config.command_fraction) {
+      text = config.prefix + "hi";
+      l.reply_key = fmt::format("#load{} u{}", channel, user);
+    } else {
+      auto size = std::max<size_t>(Size(), 1);
+      while (text.size() < size) {
+        if (!text.empty()) text.push_back(' ');
+        auto word = 1 + Below(9);
+        for (uint64_t i = 0; i < word && text.size() < size; i++) {
+          text.push_back(static_cast<char>('a' + Below(26)));
+        }
+      }
+    }
+    l.text = fmt::format(":u{}!u@load.invalid PRIVMSG #load{} :{}\r\n", user, channel, text);
+    return l;
+  }
+};
+
+std::vector<Line> Synthesize(const Config &config, std::set<std::string> &channels) {
+  for (unsigned i = 0; i < config.channels; i++) channels.insert(fmt::format("#load{}", i));
+  Generator g(config);
+  auto count = static_cast<uint64_t>(config.rate * static_cast<double>(config.duration.count()));
+  std::vector<Line> lines;
+  lines.reserve(count);
+  for (uint64_t i = 0; i < count; i++) {
+    lines.push_back(g.Next(std::chrono::nanoseconds(static_cast<int64_t>(i * 1e9 / config.rate))));
+  }
+  return lines;
+}
+
+// Replays all of a capture but the registration, which we do ourselves. Lines from the nickname
+// it was taken with come from the one connecting now instead.
+std::optional<std::vector<Line>> LoadCapture(const Config &config, std::string_view nickname,
+                                             std::set<std::string> &channels) {
+  auto reader = kbot::capture::Reader::Open(config.capture_path);
+  if (!reader) return std::nullopt;
+  std::vector<Line> lines;
+  std::string captured_nick;
+  while (auto e = reader->Next()) {
+    auto v = Split(e->line);
+    if (v.empty()) continue;
+    size_t cmd = v[0].starts_with(':') ? 1 : 0;
+    if (cmd >= v.size()) continue;
+    std::string_view command = v[cmd];
+    if (command == "001" && cmd + 1 < v.size()) captured_nick = v[cmd + 1];
+    if (command == "CAP" || command == "AUTHENTICATE" || command == "001" || command == "002" ||
+        command == "003" || command == "004" || command == "005" ||
+        (command.size() == 3 && command >= "900" && command <= "908")) {
+      continue;
+    }
+    std::string text;
+    if (!captured_nick.empty() && cmd == 1 && SourceNick(v[0]) == captured_nick) {
+      text = fmt::format(":{}{}", nickname, e->line.substr(1 + captured_nick.size()));
+    } else {
+      text = e->line;
+    }
+    Line l{std::chrono::nanoseconds(static_cast<int64_t>(e->at.count() / config.speed)), {}, {}};
+    if (cmd + 2 < v.size() && (command == "PRIVMSG" || command == "NOTICE")) {
+      auto target = v[cmd + 1];
+      if (target.starts_with('#') || target.starts_with('&')) {
+        channels.emplace(target);
+        if (command == "PRIVMSG" && v.back().starts_with(config.prefix)) {
+          l.reply_key = Lower(fmt::format("{} {}", target, SourceNick(v[0])));
+        }
+      }
+    }
+    l.text = std::move(text) + "\r\n";
+    lines.push_back(std::move(l));
+  }
+  if (reader->Torn()) LOG(WARNING) << "Capture ends in a torn record, replaying what came before";
+  if (lines.empty()) {
+    LOG(ERROR) << "Nothing to replay in " << config.capture_path;
+    return std::nullopt;
+  }
+  // The capture starts with the connection, the traffic with its first line after registration
+  auto first = lines.front().at;
+  for (auto &l : lines) l.at -= first;
+  return lines;
+}
+
+// Connection
+
+struct Connection {
+  int fd = -1;
+  std::string in;
+  std::string out;
+  bool closed = false;
+
+  void Send(std::string_view s) { out.append(s); }
+
+  void Flush() {
+    while (!out.empty()) {
+      ssize_t r = send(fd, out.data(), out.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+      if (r < 0) {
+        if (errno == EINTR) continue;
+        if (errno != EAGAIN) {
+          PLOG(ERROR) << "Failed to send";
+          closed = true;
+        }
+        return;
+      }
+      out.erase(0, static_cast<size_t>(r));
+    }
+  }
+
+  // Invokes f for every complete line received
+  template <class F>
+  void Receive(F &&f) {
+    char buf[16384];
+    for (;;) {
+      ssize_t r = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+      if (r < 0 && errno == EINTR) continue;
+      if (r < 0 && errno == EAGAIN) break;
+      if (r <= 0) {
+        closed = true;
+        break;
+      }
+      in.append(buf, static_cast<size_t>(r));
+    }
+    size_t start = 0;
+    for (size_t nl; (nl = in.find('\n', start)) != in.npos; start = nl + 1) {
+      std::string_view line(in.data() + start, nl - start);
+      while (!line.empty() && line.front() == '\r') line.remove_prefix(1);
+      while (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+      if (!line.empty()) f(line);
+    }
+    in.erase(0, start);
+  }
+};
+
+int Listen(uint16_t port) {
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) return -1;
+  int one = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0 || listen(fd, 1) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Statistics
+
+struct Stats {
+  uint64_t lines_sent = 0;
+  uint64_t bytes_sent = 0;
+  uint64_t commands = 0;
+  uint64_t replies = 0;
+  uint64_t unmatched = 0;
+  uint64_t lines_received = 0;
+  std::vector<Clock::duration> latency;
+};
+
+void Report(const Stats &s, Clock::duration elapsed, Clock::duration max_behind) {
+  auto secs = std::chrono::duration<double>(elapsed).count();
+  fmt::print("sent {} lines, {} bytes in {:.3f}s ({:.0f} lines/s), at most {:.3f}ms behind "
+             "schedule\n",
+             s.lines_sent, s.bytes_sent, secs, static_cast<double>(s.lines_sent) / secs,
+             std::chrono::duration<double, std::milli>(max_behind).count());
+  fmt::print("received {} lines, {} replies to {} commands, {} unanswered, {} unmatched\n",
+             s.lines_received, s.replies, s.commands, s.commands - s.replies, s.unmatched);
+  if (s.latency.empty()) return;
+  auto v = s.latency;
+  std::sort(v.begin(), v.end());
+  auto ms = [](Clock::duration d) { return std::chrono::duration<double, std::milli>(d).count(); };
+  // Nearest rank
+  auto at = [&](double p) { return ms(v[static_cast<size_t>(std::ceil(p * v.size())) - 1]); };
+  fmt::print("reply latency ms: p50 {:.3f} p90 {:.3f} p99 {:.3f} p99.9 {:.3f} max {:.3f}\n",
+             at(0.5), at(0.9), at(0.99), at(0.999), ms(v.back()));
+}
+
+[[noreturn]] void usage() {
+  LOG(INFO) << "Usage:   kbot-loadgen [-p <port>] [-P <command prefix>] [-w <drain seconds>]";
+  LOG(INFO) << "           -r <capture> [-x <speed>] (replay a capture taken with kbot -C)";
+  LOG(INFO) << "           [-c <channels>] [-u <users>] [-R <lines/s>] [-d <seconds>]";
+  LOG(INFO) << "           [-s <min>:<max>[:uniform|pareto[:<shape>]]] [-k <command fraction>]";
+  LOG(INFO) << "           [-S <seed>]";
+  LOG(INFO) << "           (synthesize, default 10 channels, 100 users, 1000 lines/s for 10s of "
+               "10 to 200 bytes uniformly, 1% commands, Pareto shape 1.16)";
+  exit(0);
+}
+
+template <class T>
+bool ParseNumber(std::string_view s, T &out) {
+  auto [p, ec] = std::from_chars(s.data(), s.data() + s.size(), out);
+  return ec == std::errc() && p == s.data() + s.size();
+}
+
+std::optional<Config> ParseArgs(int argc, char *argv[]) {
+  Config c;
+  int opt;
+  unsigned secs = 0;
+  while ((opt = getopt(argc, argv, "hp:r:x:c:u:R:d:s:k:S:P:w:")) != -1) {
+    std::string_view v = optarg ? optarg : "";
+    bool ok = true;
+    switch (opt) {
+      case 'p':
+        ok = ParseNumber(v, c.port);
+        break;
+      case 'r':
+        c.capture_path = optarg;
+        break;
+      case 'x':
+        ok = ParseNumber(v, c.speed) && c.speed > 0;
+        break;
+      case 'c':
+        ok = ParseNumber(v, c.channels) && c.channels;
+        break;
+      case 'u':
+        ok = ParseNumber(v, c.users) && c.users;
+        break;
+      case 'R':
+        ok = ParseNumber(v, c.rate) && c.rate > 0;
+        break;
+      case 'd':
+        ok = ParseNumber(v, secs);
+        c.duration = std::chrono::seconds(secs);
+        break;
+      case 's': {
+        auto colon = v.find(':');
+        auto rest = colon == v.npos ? "" : v.substr(colon + 1);
+        auto shape = rest.find(':');
+        ok = ParseNumber(v.substr(0, colon), c.min_size) &&
+             ParseNumber(rest.substr(0, shape), c.max_size) && c.min_size &&
+             c.min_size <= c.max_size;
+        if (shape != rest.npos) {
+          auto s = rest.substr(shape + 1);
+          auto alpha = s.find(':');
+          c.pareto = s.substr(0, alpha) == "pareto";
+          ok = ok && (c.pareto || s == "uniform");
+          if (c.pareto && alpha != s.npos) {
+            ok = ok && ParseNumber(s.substr(alpha + 1), c.pareto_shape) && c.pareto_shape > 0;
+          }
+        }
+        break;
+      }
+      case 'k':
+        ok = ParseNumber(v, c.command_fraction) && c.command_fraction >= 0 &&
+             c.command_fraction <= 1;
+        break;
+      case 'S':
+        ok = ParseNumber(v, c.seed);
+        break;
+      case 'P':
+        c.prefix = v;
+        ok = !c.prefix.empty();
+        break;
+      case 'w':
+        ok = ParseNumber(v, secs);
+        c.drain = std::chrono::seconds(secs);
+        break;
+      default:
+        usage();
+    }
+    if (!ok) {
+      LOG(ERROR) << "Bad value for -" << static_cast<char>(opt) << ": " << v;
+      return std::nullopt;
+    }
+  }
+  return c;
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  google::InitGoogleLogging(argv[0]);
+  auto config = ParseArgs(argc, argv);
+  if (!config) return 1;
+
+  int lfd = Listen(config->port);
+  if (lfd < 0) {
+    PLOG(ERROR) << "Failed to listen on 127.0.0.1:" << config->port;
+    return 1;
+  }
+  LOG(INFO) << "Waiting for kbot on 127.0.0.1:" << config->port;
+  Connection conn;
+  conn.fd = accept4(lfd, nullptr, nullptr, SOCK_CLOEXEC);
+  close(lfd);
+  if (conn.fd < 0) {
+    PLOG(ERROR) << "Failed to accept";
+    return 1;
+  }
+  int one = 1;
+  setsockopt(conn.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  std::string nickname;
+  bool user = false;
+  bool registered = false;
+  std::set<std::string> channels;
+  std::vector<Line> lines;
+  size_t next = 0;
+  Clock::time_point start;
+  Clock::time_point end;
+  Clock::duration max_behind{};
+  Stats stats;
+  std::unordered_map<std::string, std::deque<Clock::time_point>> pending;
+
+  auto on_line = [&](std::string_view line) {
+    stats.lines_received++;
+    auto v = Split(line);
+    if (v.empty()) return;
+    if (v[0].starts_with(':')) v.erase(v.begin());
+    if (v.empty()) return;
+    auto command = v[0];
+    if (command == "CAP" && v.size() > 1 && v[1] == "LS") {
+      conn.Send(fmt::format(":{} CAP * LS :\r\n", kServerName));
+    } else if (command == "NICK" && v.size() > 1) {
+      nickname = v[1];
+    } else if (command == "USER") {
+      user = true;
+    } else if (command == "PING" && v.size() > 1) {
+      conn.Send(fmt::format(":{} PONG {} :{}\r\n", kServerName, kServerName, v.back()));
+    } else if (command == "JOIN" && v.size() > 1) {
+      for (std::string_view list = v[1]; !list.empty();) {
+        auto comma = list.find(',');
+        conn.Send(fmt::format(":{}!kbot@localhost JOIN {}\r\n", nickname, list.substr(0, comma)));
+        list.remove_prefix(comma == list.npos ? list.size() : comma + 1);
+      }
+    } else if (command == "PRIVMSG" && v.size() > 2) {
+      // Replies to the invoker start with "<nick>:"
+      auto word = v[2].substr(0, v[2].find(' '));
+      if (!word.ends_with(':')) return;
+      word.remove_suffix(1);
+      auto now = Clock::now();
+      for (std::string_view list = v[1]; !list.empty();) {
+        auto comma = list.find(',');
+        auto it = pending.find(Lower(fmt::format("{} {}", list.substr(0, comma), word)));
+        if (it == pending.end() || it->second.empty()) {
+          stats.unmatched++;
+        } else {
+          stats.latency.push_back(now - it->second.front());
+          stats.replies++;
+          it->second.pop_front();
+        }
+        list.remove_prefix(comma == list.npos ? list.size() : comma + 1);
+      }
+    }
+    if (!registered && user && !nickname.empty()) {
+      registered = true;
+      conn.Send(fmt::format(":{} 001 {} :Welcome to the load generator\r\n", kServerName,
+                            nickname));
+      conn.Send(fmt::format(":{} 005 {} CASEMAPPING=rfc1459 CHANTYPES=#& PREFIX=(ov)@+ "
+                            "TARGMAX=JOIN:,PRIVMSG:4 :are supported by this server\r\n",
+                            kServerName, nickname));
+      conn.Send(fmt::format(":{} 422 {} :MOTD File is missing\r\n", kServerName, nickname));
+    }
+  };
+
+  // Registration
+  while (!registered && !conn.closed) {
+    conn.Receive(on_line);
+    conn.Flush();
+    struct pollfd pfd = {.fd = conn.fd, .events = POLLIN, .revents = 0};
+    poll(&pfd, 1, 1000);
+  }
+  if (conn.closed) {
+    LOG(ERROR) << "Connection closed during registration";
+    return 1;
+  }
+  if (config->capture_path) {
+    auto l = LoadCapture(*config, nickname, channels);
+    if (!l) return 1;
+    lines = std::move(*l);
+  } else {
+    lines = Synthesize(*config, channels);
+  }
+  if (lines.empty()) {
+    LOG(ERROR) << "No traffic to send";
+    return 1;
+  }
+  LOG(INFO) << nickname << " registered, " << lines.size() << " lines for " << channels.size()
+            << " channels";
+  for (auto &c : channels) conn.Send(fmt::format(":{}!kbot@localhost JOIN {}\r\n", nickname, c));
+
+  start = Clock::now();
+  end = start + lines.back().at + config->drain;
+  while (!conn.closed) {
+    auto now = Clock::now();
+    // Everything due goes out in one write, lines behind schedule are not pushed back
+    for (; next < lines.size() && start + lines[next].at <= now; next++) {
+      auto &l = lines[next];
+      auto due = start + l.at;
+      max_behind = std::max(max_behind, now - due);
+      conn.Send(l.text);
+      stats.lines_sent++;
+      stats.bytes_sent += l.text.size();
+      if (!l.reply_key.empty()) {
+        pending[l.reply_key].push_back(due);
+        stats.commands++;
+      }
+    }
+    conn.Flush();
+    if (next == lines.size() && (stats.replies == stats.commands || now >= end)) break;
+    int timeout = 100;
+    if (next < lines.size()) {
+      auto wait = start + lines[next].at - now;
+      timeout = static_cast<int>(std::chrono::ceil<std::chrono::milliseconds>(wait).count());
+    }
+    struct pollfd pfd = {.fd = conn.fd,
+                         .events = static_cast<short>(POLLIN | (conn.out.empty() ? 0 : POLLOUT)),
+                         .revents = 0};
+    if (poll(&pfd, 1, std::max(timeout, 0)) > 0 && (pfd.revents & (POLLIN | POLLHUP | POLLERR))) {
+      conn.Receive(on_line);
+    }
+  }
+  if (conn.closed) LOG(WARNING) << "Connection closed by kbot";
+  Report(stats, Clock::now() - start, max_behind);
+  close(conn.fd);
+  return 0;
+}